@@ -0,0 +1,422 @@
+#include "gb.h"
+#include "global.h"
+#include "hash.h"
+#include "pool.h"
+#include "ppu.h"
+#include "state.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+
+static const unsigned long _DEFAULT_HASH_INTERVAL = 60;
+
+
+typedef struct InputEventDef {
+  unsigned long frame;
+  uint8_t buttons;
+} InputEvent;
+
+typedef struct JobDef {
+  char* rom;
+  unsigned long frames;
+  // Input script, or NULL to hold nothing.
+  char* input;
+  // Stop once the serial port has sent this text, or NULL.
+  char* exit_serial;
+  // JSON line reported for the job, set once it finished.
+  char* result;
+  int ok;
+} Job;
+
+typedef struct BatchDef {
+  Job* jobs;
+  size_t job_count;
+  // Frames between framebuffer hashes, 0 for the last frame only.
+  unsigned long hash_interval;
+  // Results are printed in manifest order as soon as every job before them
+  // finished.
+  pthread_mutex_t output_lock;
+  size_t next_output;
+  size_t failures;
+} Batch;
+
+// Growable string.
+typedef struct TextDef {
+  char* data;
+  size_t size;
+  size_t capacity;
+} Text;
+
+
+static void PrintUsage(void) {
+  printf("Usage: gbemu-batch [options] <manifest>\n"
+         "  --threads <n>           worker threads, default one per core\n"
+         "  --pin                   bind each worker thread to a core\n"
+         "  --hash-interval <n>     frames between frame hashes, 0 for the\n"
+         "                          last frame only (default 60)\n"
+         "\n"
+         "Each manifest line is one job of tab separated fields:\n"
+         "  <romfile> <frames> [input script|-] [exit serial text|-]\n"
+         "An input script has one '<frame> <buttons>' line per change of\n"
+         "the held buttons, in frame order. Lines starting with # are\n"
+         "ignored. One JSON line is printed per job.\n");
+}
+
+
+static void TextAppend(Text* const text, const char* const format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (length < 0) {
+    return;
+  }
+  if (text->size + length + 1 > text->capacity) {
+    size_t capacity = text->capacity ? text->capacity : 256;
+    while (text->size + length + 1 > capacity) {
+      capacity *= 2;
+    }
+    char* data = (char*)realloc(text->data, capacity);
+    if (data == NULL) {
+      return;
+    }
+    text->data = data;
+    text->capacity = capacity;
+  }
+  va_start(args, format);
+  vsnprintf(text->data + text->size, length + 1, format, args);
+  va_end(args);
+  text->size += length;
+}
+
+
+static void TextAppendJsonString(Text* const text, const char* const str) {
+  TextAppend(text, "\"");
+  for (const char* c = str; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') {
+      TextAppend(text, "\\%c", *c);
+    }
+    else if ((unsigned char)*c < 0x20) {
+      TextAppend(text, "\\u%04x", (unsigned char)*c);
+    }
+    else {
+      TextAppend(text, "%c", *c);
+    }
+  }
+  TextAppend(text, "\"");
+}
+
+
+// Reads an input script. Returns the number of events, or -1 if the file
+// can't be read.
+static long LoadInput(const char* const path, InputEvent** const events) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  size_t count = 0;
+  size_t capacity = 0;
+  *events = NULL;
+  unsigned long frame;
+  int buttons;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%lu %i", &frame, &buttons) != 2) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      InputEvent* grown =
+          (InputEvent*)realloc(*events, capacity * sizeof(InputEvent));
+      if (grown == NULL) {
+        break;
+      }
+      *events = grown;
+    }
+    (*events)[count++] = (InputEvent){
+      .frame = frame, .buttons = (uint8_t)buttons
+    };
+  }
+  fclose(file);
+  return (long)count;
+}
+
+
+static double Seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+static uint64_t FrameHash(const Gameboy* const gb) {
+  return Hash64(gb->renderer->framebuffer,
+                PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT * sizeof(uint32_t), 0);
+}
+
+
+static void RunJob(const Batch* const batch, Job* const job, size_t index,
+                   Text* const out) {
+  double start = Seconds();
+  GlobalCtx global_ctx;
+  Gameboy gb = {
+    .cartridge = NULL,
+    .bus = NULL,
+    .renderer = NULL,
+    .frames = NULL,
+    .options = {
+      .color_profile = COLOR_PROFILE_LCD,
+      .apu_mode = APU_MODE_ELIDED,
+      .render_mode = RENDER_MODE_INLINE
+    },
+    .global_ctx = &global_ctx
+  };
+  InputEvent* events = NULL;
+  long event_count = 0;
+
+  TextAppend(out, "{\"job\":%zu,\"rom\":", index);
+  TextAppendJsonString(out, job->rom);
+
+  if (job->input != NULL) {
+    event_count = LoadInput(job->input, &events);
+    if (event_count < 0) {
+      TextAppend(out, ",\"status\":\"error\",\"error\":\"FAILED TO READ "
+                      "INPUT\"}");
+      return;
+    }
+  }
+  if (GameboyInit(&gb, job->rom) == RESULT_NOTOK) {
+    TextAppend(out, ",\"status\":\"error\",\"error\":");
+    TextAppendJsonString(out, _ERROR_CODE_STRINGS[global_ctx.error]);
+    TextAppend(out, "}");
+    GameboyDestroy(&gb);
+    free(events);
+    return;
+  }
+
+  const char* reason = "frames";
+  unsigned long long cycles = 0;
+  unsigned long frame = 0;
+  long next_event = 0;
+  TextAppend(out, ",\"frame_hashes\":[");
+  while (frame < job->frames) {
+    while (next_event < event_count && events[next_event].frame <= frame) {
+      BusSetButtons(gb.bus, events[next_event++].buttons);
+    }
+    unsigned int clock = global_ctx.clock;
+    Result result = GameboyRunFrame(&gb);
+    cycles += global_ctx.clock - clock;
+    ++frame;
+    if (result == RESULT_NOTOK) {
+      reason = "error";
+      break;
+    }
+    if (global_ctx.status == STATUS_STOP) {
+      reason = "stop";
+      break;
+    }
+    if (job->exit_serial != NULL &&
+        strstr(gb.bus->serial_out, job->exit_serial) != NULL) {
+      reason = "serial";
+      break;
+    }
+    if (batch->hash_interval != 0 && frame % batch->hash_interval == 0 &&
+        frame < job->frames) {
+      TextAppend(out, "\"%016llx\",", (unsigned long long)FrameHash(&gb));
+    }
+  }
+  // The last frame is always hashed.
+  TextAppend(out, "\"%016llx\"]", (unsigned long long)FrameHash(&gb));
+
+  job->ok = global_ctx.error == NO_ERROR;
+  TextAppend(out, ",\"status\":\"%s\",\"error\":", job->ok ? "ok" : "error");
+  if (job->ok) {
+    TextAppend(out, "null");
+  }
+  else {
+    TextAppendJsonString(out, _ERROR_CODE_STRINGS[global_ctx.error]);
+  }
+  TextAppend(out, ",\"exit\":\"%s\",\"frames\":%lu,\"cycles\":%llu,"
+                  "\"state_hash\":\"%016llx\",\"serial\":",
+             reason, frame, cycles, (unsigned long long)StateHash(&gb));
+  TextAppendJsonString(out, gb.bus->serial_out);
+  TextAppend(out, ",\"wall_ms\":%.3f}", (Seconds() - start) * 1000.0);
+
+  GameboyDestroy(&gb);
+  free(events);
+}
+
+
+static void BatchTask(void* const ctx, size_t index, int worker) {
+  (void)worker;
+  Batch* const batch = (Batch*)ctx;
+  Job* const job = &batch->jobs[index];
+  Text out = {.data = NULL, .size = 0, .capacity = 0};
+  RunJob(batch, job, index, &out);
+
+  pthread_mutex_lock(&batch->output_lock);
+  job->result = out.data != NULL ? out.data : strdup("{}");
+  while (batch->next_output < batch->job_count &&
+         batch->jobs[batch->next_output].result != NULL) {
+    Job* done = &batch->jobs[batch->next_output++];
+    printf("%s\n", done->result);
+    if (!done->ok) {
+      ++batch->failures;
+    }
+    free(done->result);
+    done->result = NULL;
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&batch->output_lock);
+}
+
+
+// Splits line at tabs in place. Returns the number of fields.
+static int SplitFields(char* const line, char** const fields, int max) {
+  int count = 0;
+  char* field = line;
+  while (count < max) {
+    fields[count++] = field;
+    char* tab = strchr(field, '\t');
+    if (tab == NULL) {
+      break;
+    }
+    *tab = '\0';
+    field = tab + 1;
+  }
+  return count;
+}
+
+
+static char* OptionalField(const char* const field) {
+  if (field == NULL || field[0] == '\0' || strcmp(field, "-") == 0) {
+    return NULL;
+  }
+  return strdup(field);
+}
+
+
+static Result LoadManifest(const char* const path, Batch* const batch) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open manifest %s\n", path);
+    return RESULT_NOTOK;
+  }
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_capacity = 0;
+  ssize_t length;
+  int line_number = 0;
+  Result result = RESULT_OK;
+  while ((length = getline(&line, &line_capacity, file)) >= 0) {
+    ++line_number;
+    while (length > 0 &&
+           (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    if (length == 0 || line[0] == '#') {
+      continue;
+    }
+    char* fields[4] = {NULL, NULL, NULL, NULL};
+    int count = SplitFields(line, fields, 4);
+    if (count < 2 || strtoul(fields[1], NULL, 10) == 0) {
+      fprintf(stderr, "%s:%d: expected <romfile> <frames>\n", path,
+              line_number);
+      result = RESULT_NOTOK;
+      break;
+    }
+    if (batch->job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      Job* grown = (Job*)realloc(batch->jobs, capacity * sizeof(Job));
+      if (grown == NULL) {
+        result = RESULT_NOTOK;
+        break;
+      }
+      batch->jobs = grown;
+    }
+    batch->jobs[batch->job_count++] = (Job){
+      .rom = strdup(fields[0]),
+      .frames = strtoul(fields[1], NULL, 10),
+      .input = OptionalField(fields[2]),
+      .exit_serial = OptionalField(fields[3]),
+      .result = NULL,
+      .ok = 0
+    };
+  }
+  free(line);
+  fclose(file);
+  return result;
+}
+
+
+static void FreeJobs(Batch* const batch) {
+  for (size_t i = 0; i < batch->job_count; ++i) {
+    free(batch->jobs[i].rom);
+    free(batch->jobs[i].input);
+    free(batch->jobs[i].exit_serial);
+  }
+  free(batch->jobs);
+  batch->jobs = NULL;
+  batch->job_count = 0;
+}
+
+
+int main(int argc, char** argv) {
+  const char* manifest = NULL;
+  int threads = 0;
+  int pin = 0;
+  Batch batch = {
+    .jobs = NULL,
+    .job_count = 0,
+    .hash_interval = _DEFAULT_HASH_INTERVAL,
+    .next_output = 0,
+    .failures = 0
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--pin") == 0) {
+      pin = 1;
+    }
+    else if (strcmp(argv[i], "--hash-interval") == 0 && i + 1 < argc) {
+      batch.hash_interval = strtoul(argv[++i], NULL, 10);
+    }
+    else {
+      manifest = argv[i];
+    }
+  }
+  if (manifest == NULL) {
+    PrintUsage();
+    return 1;
+  }
+  if (LoadManifest(manifest, &batch) == RESULT_NOTOK) {
+    FreeJobs(&batch);
+    return 1;
+  }
+
+  GlobalCtx global_ctx = {.error = NO_ERROR};
+  ThreadPool* pool = ThreadPoolCreate(&global_ctx, threads, pin);
+  if (pool == NULL) {
+    fprintf(stderr, "Fatal Error: %s\n",
+            _ERROR_CODE_STRINGS[global_ctx.error]);
+    FreeJobs(&batch);
+    return 1;
+  }
+  pthread_mutex_init(&batch.output_lock, NULL);
+  ThreadPoolRun(pool, BatchTask, &batch, batch.job_count);
+  ThreadPoolDestroy(pool);
+  pthread_mutex_destroy(&batch.output_lock);
+
+  size_t failures = batch.failures;
+  FreeJobs(&batch);
+  return failures == 0 ? 0 : 1;
+}
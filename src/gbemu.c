@@ -1,43 +1,274 @@
 #include "gb.h"
 #include "global.h"
+#include "headless.h"
+#include "netplay.h"
+#ifdef GB_ENABLE_SDL
+  #include "frontend_sdl.h"
+#endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
-static GlobalCtx global_ctx;
+// Parses <port>:<host>:<port>. The host may hold colons of its own.
+static int ParseNetplay(char* const spec, NetplayOptions* const options) {
+  char* first = strchr(spec, ':');
+  char* last = strrchr(spec, ':');
+  if (first == NULL || first == last) {
+    return 0;
+  }
+  *first = '\0';
+  *last = '\0';
+  options->port = (uint16_t)strtoul(spec, NULL, 10);
+  options->peer_host = first + 1;
+  options->peer_port = (uint16_t)strtoul(last + 1, NULL, 10);
+  return 1;
+}
+
+
+static Result RunNetplay(NetplayOptions* const options, int headless,
+                         unsigned long frames, int scale, int vsync) {
+  GlobalCtx global_ctx = {.error = NO_ERROR};
+  options->render = !headless;
+  Netplay* netplay = NetplayCreate(&global_ctx, options);
+  if (netplay == NULL) {
+    printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[global_ctx.error]);
+    return RESULT_NOTOK;
+  }
+
+  Result result = RESULT_NOTOK;
+  if (headless) {
+    result = NetplayRun(netplay, NULL, frames);
+  }
+#ifdef GB_ENABLE_SDL
+  else {
+    // Audio isn't rolled back, so netplay runs without it.
+    SdlFrontend* sdl = SdlFrontendCreate(&global_ctx, scale, vsync, 0);
+    if (sdl != NULL) {
+      result = NetplayRun(netplay, &sdl->frontend, frames);
+      SdlFrontendDestroy(sdl);
+    }
+  }
+#endif
+  (void)scale;
+  (void)vsync;
+
+  const NetplayStats* stats = &netplay->stats;
+  printf("frames=%lu rollbacks=%lu resimulated=%lu max_resimulated=%u "
+         "max_rollback_ms=%.2f stalls=%lu ",
+         netplay->frame, stats->rollbacks, stats->resimulated,
+         stats->max_resimulated, stats->max_rollback_ms, stats->stalls);
+  if (stats->desync == NETPLAY_NO_DESYNC) {
+    printf("desync=none\n");
+  }
+  else {
+    printf("desync=%lu\n", stats->desync);
+  }
+  if (result == RESULT_NOTOK) {
+    printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[global_ctx.error]);
+  }
+  NetplayDestroy(netplay);
+  return result;
+}
+
+
+static void PrintUsage(void) {
+  printf("Usage: gbemu [options] <romfile>\n"
+         "  --vsync                 present in step with the display\n"
+         "  --scale <n>             initial window scale\n"
+         "  --raw-colors            disable CGB color correction\n"
+         "  --mute                  skip audio synthesis\n"
+         "  --render <mode>         threaded, inline or none\n"
+         "  --run-ahead <n>         show frames n frames ahead of the real one\n"
+         "  --run-ahead-fork        run ahead on a fork instead of reloading\n"
+         "  --headless              run without a window or audio device\n"
+         "  --frames <n>            headless: stop after n frames\n"
+         "  --exit-on-serial <text> headless: stop once serial sent text\n"
+         "  --dump-frame <path>     headless: write the last frame as PPM\n"
+         "  --dump-serial <path>    headless: write serial output\n"
+         "  --play <movie>          headless: replay and check a movie\n"
+         "  --seek <n>              headless: start the movie at frame n\n"
+         "  --netplay <port>:<host>:<port>\n"
+         "                          play linked over UDP from port to a peer\n"
+         "  --player <n>            netplay: play as player 0 or 1\n"
+         "  --link-rom <romfile>    netplay: the other player's ROM\n"
+         "  --input-delay <n>       netplay: frames before buttons count\n"
+         "  --net-delay <ms>        netplay: hold back packets sent\n"
+         "Keys: arrows, X (A), Z (B), Backspace (Select), Return (Start)\n");
+}
 
 
-// gbemu <romfile>
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    printf("Usage: gbemu <romfile>\n");
+  const char* romfile = NULL;
+  int scale = 4;
+  int vsync = 0;
+  int headless = 0;
+  GameboyOptions options = {
+    .color_profile = COLOR_PROFILE_LCD,
+    .apu_mode = APU_MODE_FULL,
+    .render_mode = RENDER_MODE_THREADED,
+    .run_ahead = 0,
+    .run_ahead_mode = RUN_AHEAD_RESTORE
+  };
+  HeadlessOptions headless_options = {
+    .frames = 0,
+    .exit_serial = NULL,
+    .dump_frame = NULL,
+    .dump_serial = NULL,
+    .movie = NULL,
+    .seek = 0
+  };
+  int netplay = 0;
+  const char* link_rom = NULL;
+  NetplayOptions netplay_options = {
+    .player = 0,
+    .input_delay = 2,
+    .send_delay_ms = 0
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--vsync") == 0) {
+      vsync = 1;
+    }
+    else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--raw-colors") == 0) {
+      options.color_profile = COLOR_PROFILE_RAW;
+    }
+    else if (strcmp(argv[i], "--mute") == 0) {
+      options.apu_mode = APU_MODE_ELIDED;
+    }
+    else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "inline") == 0) {
+        options.render_mode = RENDER_MODE_INLINE;
+      }
+      else if (strcmp(argv[i], "none") == 0) {
+        options.render_mode = RENDER_MODE_NONE;
+      }
+      else {
+        options.render_mode = RENDER_MODE_THREADED;
+      }
+    }
+    else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+      options.run_ahead = (unsigned int)strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--run-ahead-fork") == 0) {
+      options.run_ahead_mode = RUN_AHEAD_FORK;
+    }
+    else if (strcmp(argv[i], "--headless") == 0) {
+      headless = 1;
+    }
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      headless_options.frames = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--exit-on-serial") == 0 && i + 1 < argc) {
+      headless_options.exit_serial = argv[++i];
+    }
+    else if (strcmp(argv[i], "--dump-frame") == 0 && i + 1 < argc) {
+      headless_options.dump_frame = argv[++i];
+    }
+    else if (strcmp(argv[i], "--dump-serial") == 0 && i + 1 < argc) {
+      headless_options.dump_serial = argv[++i];
+    }
+    else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+      headless_options.movie = argv[++i];
+      headless = 1;
+    }
+    else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc) {
+      headless_options.seek = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--netplay") == 0 && i + 1 < argc) {
+      netplay = ParseNetplay(argv[++i], &netplay_options);
+      if (!netplay) {
+        PrintUsage();
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc) {
+      netplay_options.player = atoi(argv[++i]) != 0;
+    }
+    else if (strcmp(argv[i], "--link-rom") == 0 && i + 1 < argc) {
+      link_rom = argv[++i];
+    }
+    else if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc) {
+      netplay_options.input_delay = (unsigned int)strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--net-delay") == 0 && i + 1 < argc) {
+      netplay_options.send_delay_ms =
+          (unsigned int)strtoul(argv[++i], NULL, 10);
+    }
+    else {
+      romfile = argv[i];
+    }
+  }
+  if (romfile == NULL) {
+    PrintUsage();
     return 1;
   }
-  const char* romfile = argv[1];
+#ifndef GB_ENABLE_SDL
+  // Built without a frontend.
+  headless = 1;
+#endif
+  if (headless) {
+    // Nobody listens, so don't synthesize samples nobody drains.
+    options.apu_mode = APU_MODE_ELIDED;
+  }
+  if (netplay) {
+    // Both peers run both machines, the other player's from the link ROM.
+    int player = netplay_options.player;
+    netplay_options.roms[player] = romfile;
+    netplay_options.roms[!player] = link_rom != NULL ? link_rom : romfile;
+    Result result = RunNetplay(&netplay_options, headless,
+                               headless_options.frames, scale, vsync);
+    return result == RESULT_OK ? 0 : 1;
+  }
 
+  GlobalCtx global_ctx;
   Gameboy gb = {
     .cpu = {0},
     .cartridge = NULL,
     .bus = NULL,
-    .screen = NULL,
+    .renderer = NULL,
+    .frames = NULL,
+    .options = options,
     .global_ctx = &global_ctx
   };
 
-  printf("Starting up gameboy...\n\n");
-
   Result result = GameboyInit(&gb, romfile);
   if (result == RESULT_NOTOK) {
     printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[gb.global_ctx->error]);
+    GameboyDestroy(&gb);
     return 1;
   }
 
-  printf("Gameboy running!\n\n");
+  if (headless) {
+    result = HeadlessRun(&gb, &headless_options);
+  }
+#ifdef GB_ENABLE_SDL
+  else {
+    printf("Starting up gameboy...\n\n");
+    SdlFrontend* sdl = SdlFrontendCreate(gb.global_ctx, scale, vsync,
+                                         options.apu_mode == APU_MODE_FULL);
+    if (sdl == NULL) {
+      printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[gb.global_ctx->error]);
+      GameboyDestroy(&gb);
+      return 1;
+    }
+    printf("Gameboy running!\n\n");
+    result = GameboyRun(&gb, &sdl->frontend);
+    printf("Gameboy powering off...\n");
+    SdlFrontendDestroy(sdl);
+  }
+#endif
+  (void)scale;
+  (void)vsync;
 
-  if (GameboyRun(&gb) == RESULT_NOTOK) {
+  if (result == RESULT_NOTOK) {
     printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[gb.global_ctx->error]);
   }
-
-  printf("Gameboy powering off...\n");
   GameboyDestroy(&gb);
-  return 0;
+  return result == RESULT_OK ? 0 : 1;
 }
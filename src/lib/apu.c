@@ -0,0 +1,587 @@
+#include "apu.h"
+
+#include "blip.h"
+#include "global.h"
+#include "ring.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sched.h>
+
+
+static const uint16_t _APU_REGISTERS_BEGIN = 0xFF10;
+
+// Offsets into ApuState.regs. Each channel's registers start five apart.
+static const uint8_t _NR10 = 0x00;
+static const uint8_t _NR30 = 0x0A;
+static const uint8_t _NR32 = 0x0C;
+static const uint8_t _NR43 = 0x12;
+static const uint8_t _NR50 = 0x14;
+static const uint8_t _NR51 = 0x15;
+static const uint8_t _NR52 = 0x16;
+static const uint8_t _WAVE_RAM = 0x20;
+static const uint8_t _CHANNEL_REGISTERS_END = 0x14;
+
+static const uint8_t _EVENT_FRAME_STEP = 0xFF;
+// One sound frame matches one video frame.
+static const uint32_t _FRAME_CYCLES = 70224;
+// Scales the mixed 4 bit channel levels, at most 480, to 16 bit samples.
+static const float _VOLUME_SCALE = 48.0f;
+
+// Bits that read back as 1 in 0xFF10 - 0xFF2F.
+static const uint8_t _READ_MASKS[0x20] = {
+  0x80, 0x3F, 0x00, 0xFF, 0xBF,
+  0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+  0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+  0xFF, 0xFF, 0x00, 0x00, 0xBF,
+  0x00, 0x00, 0x70,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// 12.5%, 25%, 50% and 75% duty cycles, one bit per step.
+static const uint8_t _DUTY_PATTERNS[4] = {0x01, 0x81, 0x87, 0x7E};
+static const uint8_t _NOISE_DIVISORS[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+
+static uint8_t ChannelRegister(const ApuState* const state, int channel,
+                               int reg) {
+  return state->regs[channel * 5 + reg];
+}
+
+
+static int Powered(const ApuState* const state) {
+  return state->regs[_NR52] & 0x80;
+}
+
+
+static int DacEnabled(const ApuState* const state, int channel) {
+  if (channel == 2) {
+    return state->regs[_NR30] & 0x80;
+  }
+  return ChannelRegister(state, channel, 2) & 0xF8;
+}
+
+
+static uint16_t Frequency(const ApuState* const state, int channel) {
+  return ((ChannelRegister(state, channel, 4) & 0x07) << 8) |
+         ChannelRegister(state, channel, 3);
+}
+
+
+static uint16_t SweepCalculate(ApuState* const state) {
+  uint16_t delta = state->sweep_shadow >> (state->regs[_NR10] & 0x07);
+  if (state->regs[_NR10] & 0x08) {
+    state->sweep_negated = 1;
+    return state->sweep_shadow - delta;
+  }
+  return state->sweep_shadow + delta;
+}
+
+
+static void ClockLength(ApuState* const state) {
+  for (int channel = 0; channel < 4; ++channel) {
+    if ((ChannelRegister(state, channel, 4) & 0x40) &&
+        state->length[channel] > 0 && --state->length[channel] == 0) {
+      state->enabled &= ~(1 << channel);
+    }
+  }
+}
+
+
+static void ClockSweep(ApuState* const state) {
+  if (state->sweep_timer > 0) {
+    --state->sweep_timer;
+  }
+  if (state->sweep_timer > 0) {
+    return;
+  }
+  uint8_t period = (state->regs[_NR10] >> 4) & 0x07;
+  state->sweep_timer = period ? period : 8;
+  if (!state->sweep_enabled || period == 0) {
+    return;
+  }
+
+  uint16_t frequency = SweepCalculate(state);
+  if (frequency > 0x7FF) {
+    state->enabled &= ~0x01;
+    return;
+  }
+  if (state->regs[_NR10] & 0x07) {
+    state->sweep_shadow = frequency;
+    state->regs[0x03] = frequency & 0xFF;
+    state->regs[0x04] = (state->regs[0x04] & 0xF8) | (frequency >> 8);
+    // The new frequency is checked for overflow again straight away.
+    if (SweepCalculate(state) > 0x7FF) {
+      state->enabled &= ~0x01;
+    }
+  }
+}
+
+
+static void ClockEnvelope(ApuState* const state) {
+  for (int channel = 0; channel < 4; ++channel) {
+    if (channel == 2) {
+      continue;
+    }
+    uint8_t envelope = ChannelRegister(state, channel, 2);
+    uint8_t period = envelope & 0x07;
+    if (period == 0) {
+      continue;
+    }
+    if (state->envelope_timer[channel] > 0) {
+      --state->envelope_timer[channel];
+    }
+    if (state->envelope_timer[channel] > 0) {
+      continue;
+    }
+    state->envelope_timer[channel] = period;
+    if ((envelope & 0x08) && state->volume[channel] < 15) {
+      ++state->volume[channel];
+    }
+    else if (!(envelope & 0x08) && state->volume[channel] > 0) {
+      --state->volume[channel];
+    }
+  }
+}
+
+
+static void StepFrameSequencer(ApuState* const state) {
+  if (!Powered(state)) {
+    return;
+  }
+  switch (state->frame_step) {
+    case 0:
+    case 4:
+      ClockLength(state);
+      break;
+    case 2:
+    case 6:
+      ClockLength(state);
+      ClockSweep(state);
+      break;
+    case 7:
+      ClockEnvelope(state);
+      break;
+  }
+  state->frame_step = (state->frame_step + 1) & 0x07;
+}
+
+
+static void Trigger(ApuState* const state, int channel) {
+  uint16_t max_length = channel == 2 ? 256 : 64;
+  if (state->length[channel] == 0) {
+    state->length[channel] = max_length;
+    // Reloading during the half of the sequencer period that won't clock
+    // length costs one clock straight away.
+    if ((state->frame_step & 0x01) &&
+        (ChannelRegister(state, channel, 4) & 0x40)) {
+      --state->length[channel];
+    }
+  }
+  if (DacEnabled(state, channel)) {
+    state->enabled |= 1 << channel;
+  }
+  if (channel != 2) {
+    uint8_t envelope = ChannelRegister(state, channel, 2);
+    state->volume[channel] = envelope >> 4;
+    state->envelope_timer[channel] = envelope & 0x07;
+  }
+  if (channel == 0) {
+    uint8_t period = (state->regs[_NR10] >> 4) & 0x07;
+    state->sweep_shadow = Frequency(state, 0);
+    state->sweep_timer = period ? period : 8;
+    state->sweep_enabled = period != 0 || (state->regs[_NR10] & 0x07) != 0;
+    state->sweep_negated = 0;
+    if ((state->regs[_NR10] & 0x07) && SweepCalculate(state) > 0x7FF) {
+      state->enabled &= ~0x01;
+    }
+  }
+}
+
+
+static void SetPower(ApuState* const state, uint8_t data) {
+  if (!(data & 0x80)) {
+    // Powering off clears every register except wave RAM. DMG keeps the
+    // length counters.
+    memset(state->regs, 0, _WAVE_RAM);
+    state->enabled = 0;
+    if (!state->dmg) {
+      memset(state->length, 0, sizeof(state->length));
+    }
+    return;
+  }
+  if (!Powered(state)) {
+    state->frame_step = 0;
+  }
+  state->regs[_NR52] = 0x80;
+}
+
+
+static void WriteRegister(ApuState* const state, uint8_t reg, uint8_t data) {
+  if (reg >= _WAVE_RAM) {
+    state->regs[reg] = data;
+    return;
+  }
+  if (reg == _NR52) {
+    SetPower(state, data);
+    return;
+  }
+  int channel = reg / 5;
+  int offset = reg % 5;
+  if (!Powered(state)) {
+    if (state->dmg && reg < _CHANNEL_REGISTERS_END && offset == 1) {
+      state->length[channel] = channel == 2 ? 256 - data : 64 - (data & 0x3F);
+    }
+    return;
+  }
+
+  uint8_t prev = state->regs[reg];
+  state->regs[reg] = data;
+  if (reg >= _CHANNEL_REGISTERS_END) {
+    return;
+  }
+
+  if (reg == _NR10 && state->sweep_negated && (prev & 0x08) &&
+      !(data & 0x08)) {
+    // Leaving subtraction mode after it was used disables the channel.
+    state->enabled &= ~0x01;
+  }
+  if (offset == 1) {
+    state->length[channel] = channel == 2 ? 256 - data : 64 - (data & 0x3F);
+  }
+  if (offset == 4) {
+    // Enabling length during the half of the sequencer period that won't
+    // clock it clocks it once immediately.
+    if ((state->frame_step & 0x01) && !(prev & 0x40) && (data & 0x40) &&
+        state->length[channel] > 0 && --state->length[channel] == 0 &&
+        !(data & 0x80)) {
+      state->enabled &= ~(1 << channel);
+    }
+    if (data & 0x80) {
+      Trigger(state, channel);
+    }
+  }
+  if (!DacEnabled(state, channel)) {
+    state->enabled &= ~(1 << channel);
+  }
+}
+
+
+static uint8_t ReadRegister(const ApuState* const state, uint8_t reg) {
+  if (reg >= _WAVE_RAM) {
+    return state->regs[reg];
+  }
+  if (reg == _NR52) {
+    return state->regs[_NR52] | _READ_MASKS[reg] | state->enabled;
+  }
+  return state->regs[reg] | _READ_MASKS[reg];
+}
+
+
+static int ChannelLevel(const ApuSynth* const synth, int channel) {
+  const ApuState* state = &synth->state;
+  if (!(state->enabled & (1 << channel))) {
+    return 0;
+  }
+  uint8_t position = synth->positions[channel];
+  switch (channel) {
+    case 0:
+    case 1: {
+      uint8_t duty = ChannelRegister(state, channel, 1) >> 6;
+      return (_DUTY_PATTERNS[duty] >> position) & 0x01 ? state->volume[channel]
+                                                       : 0;
+    }
+    case 2: {
+      uint8_t sample = state->regs[_WAVE_RAM + position / 2];
+      sample = position & 0x01 ? sample & 0x0F : sample >> 4;
+      uint8_t shift = (state->regs[_NR32] >> 5) & 0x03;
+      return shift ? sample >> (shift - 1) : 0;
+    }
+    default:
+      return synth->lfsr & 0x01 ? 0 : state->volume[channel];
+  }
+}
+
+
+static void UpdateLevel(ApuSynth* const synth, int channel, uint32_t time) {
+  int level = ChannelLevel(synth, channel);
+  uint8_t volume = synth->state.regs[_NR50];
+  uint8_t panning = synth->state.regs[_NR51];
+  int left = (panning >> (channel + 4)) & 0x01 ?
+             level * (((volume >> 4) & 0x07) + 1) : 0;
+  int right = (panning >> channel) & 0x01 ? level * ((volume & 0x07) + 1) : 0;
+
+  if (left != synth->amps[channel][0]) {
+    BlipAddDelta(&synth->left, time,
+                 (left - synth->amps[channel][0]) * _VOLUME_SCALE);
+    synth->amps[channel][0] = left;
+  }
+  if (right != synth->amps[channel][1]) {
+    BlipAddDelta(&synth->right, time,
+                 (right - synth->amps[channel][1]) * _VOLUME_SCALE);
+    synth->amps[channel][1] = right;
+  }
+}
+
+
+// T-cycles between waveform steps, or 0 if the channel doesn't step.
+static int32_t StepPeriod(const ApuSynth* const synth, int channel) {
+  const ApuState* state = &synth->state;
+  switch (channel) {
+    case 0:
+    case 1:
+      return (2048 - Frequency(state, channel)) * 4;
+    case 2:
+      return (2048 - Frequency(state, channel)) * 2;
+    default: {
+      uint8_t shift = state->regs[_NR43] >> 4;
+      if (shift >= 14) {
+        return 0;
+      }
+      return _NOISE_DIVISORS[state->regs[_NR43] & 0x07] << shift;
+    }
+  }
+}
+
+
+static void StepWaveform(ApuSynth* const synth, int channel) {
+  switch (channel) {
+    case 0:
+    case 1:
+      synth->positions[channel] = (synth->positions[channel] + 1) & 0x07;
+      break;
+    case 2:
+      synth->positions[channel] = (synth->positions[channel] + 1) & 0x1F;
+      break;
+    default: {
+      uint16_t bit = (synth->lfsr ^ (synth->lfsr >> 1)) & 0x01;
+      synth->lfsr = (synth->lfsr >> 1) | (bit << 14);
+      if (synth->state.regs[_NR43] & 0x08) {
+        synth->lfsr = (synth->lfsr & ~0x40) | (bit << 6);
+      }
+      break;
+    }
+  }
+}
+
+
+// Emits every waveform edge of every playing channel up to the given clock.
+static void RunChannels(ApuSynth* const synth, uint32_t time) {
+  for (int channel = 0; channel < 4; ++channel) {
+    int32_t period = StepPeriod(synth, channel);
+    if (!(synth->state.enabled & (1 << channel)) || period == 0) {
+      // Idle channels restart their timer when triggered.
+      synth->next_step[channel] = time;
+      continue;
+    }
+    while (synth->next_step[channel] < (int32_t)time) {
+      StepWaveform(synth, channel);
+      UpdateLevel(synth, channel, synth->next_step[channel]);
+      synth->next_step[channel] += period;
+    }
+  }
+  synth->time = time;
+}
+
+
+static void ApplyEvent(ApuSynth* const synth, const ApuEvent* const event) {
+  RunChannels(synth, event->time);
+  if (event->reg == _EVENT_FRAME_STEP) {
+    StepFrameSequencer(&synth->state);
+  }
+  else {
+    WriteRegister(&synth->state, event->reg, event->value);
+    int channel = event->reg / 5;
+    if (event->reg < _CHANNEL_REGISTERS_END && event->reg % 5 == 4 &&
+        (event->value & 0x80) && Powered(&synth->state)) {
+      synth->next_step[channel] = event->time + StepPeriod(synth, channel);
+      if (channel == 2) {
+        synth->positions[2] = 0;
+      }
+      if (channel == 3) {
+        synth->lfsr = 0x7FFF;
+      }
+    }
+  }
+  for (int channel = 0; channel < 4; ++channel) {
+    UpdateLevel(synth, channel, event->time);
+  }
+}
+
+
+// Synthesizes the logged events. The log is empty afterwards.
+static void FlushEvents(Apu* const apu) {
+  for (size_t i = 0; i < apu->event_count; ++i) {
+    ApplyEvent(apu->synth, &apu->events[i]);
+  }
+  apu->event_count = 0;
+}
+
+
+static void PushSamples(Apu* const apu) {
+  const int16_t* samples = apu->synth->samples;
+  size_t remaining = apu->synth->sample_count;
+  while (remaining > 0) {
+    size_t pushed = RingBufferPush(apu->output, samples, remaining);
+    samples += pushed * 2;
+    remaining -= pushed;
+    if (remaining == 0 ||
+        apu->global_ctx->error != NO_ERROR ||
+        apu->global_ctx->status == STATUS_STOP) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+
+static void EndFrame(Apu* const apu) {
+  ApuSynth* synth = apu->synth;
+  FlushEvents(apu);
+  RunChannels(synth, apu->frame_time);
+
+  synth->sample_count = BlipEndFrame(&synth->left, apu->frame_time,
+                                     synth->samples, 2);
+  BlipEndFrame(&synth->right, apu->frame_time, synth->samples + 1, 2);
+  for (int channel = 0; channel < 4; ++channel) {
+    synth->next_step[channel] -= apu->frame_time;
+  }
+  synth->time = 0;
+  apu->frame_time = 0;
+
+  if (apu->output != NULL) {
+    PushSamples(apu);
+  }
+}
+
+
+static void LogEvent(Apu* const apu, uint8_t reg, uint8_t value) {
+  if (apu->event_count == APU_EVENT_CAPACITY) {
+    // Synthesize what has been logged so far rather than grow the log.
+    FlushEvents(apu);
+  }
+  ApuEvent* event = &apu->events[apu->event_count++];
+  event->time = apu->frame_time;
+  event->reg = reg;
+  event->value = value;
+}
+
+
+Result ApuInit(Apu* const apu, GlobalCtx* const global_ctx, ApuMode mode) {
+  memset(apu, 0, sizeof(Apu));
+  apu->global_ctx = global_ctx;
+  apu->mode = mode;
+  if (mode == APU_MODE_FULL) {
+    apu->events = (ApuEvent*)malloc(APU_EVENT_CAPACITY * sizeof(ApuEvent));
+    apu->synth = (ApuSynth*)malloc(sizeof(ApuSynth));
+    if (apu->events == NULL || apu->synth == NULL) {
+      global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      ApuDestroy(apu);
+      return RESULT_NOTOK;
+    }
+  }
+  ApuReset(apu);
+  return RESULT_OK;
+}
+
+
+void ApuReset(Apu* const apu) {
+  // Post boot ROM state. Channel 1 is still on after the boot sound, with
+  // its envelope run down to zero.
+  ApuState* state = &apu->state;
+  memset(state, 0, sizeof(ApuState));
+  state->dmg = apu->global_ctx->mode == GB_MODE_DMG;
+  state->regs[0x01] = 0x80;
+  state->regs[0x02] = 0xF3;
+  state->regs[_NR50] = 0x77;
+  state->regs[_NR51] = 0xF3;
+  state->regs[_NR52] = 0x80;
+  state->enabled = 0x01;
+  apu->div_bit = 0;
+  apu->frame_time = 0;
+  apu->event_count = 0;
+  if (apu->mode == APU_MODE_ELIDED) {
+    return;
+  }
+
+  memset(apu->synth, 0, sizeof(ApuSynth));
+  apu->synth->state = apu->state;
+  apu->synth->lfsr = 0x7FFF;
+  BlipInit(&apu->synth->left);
+  BlipInit(&apu->synth->right);
+}
+
+
+void ApuDestroy(Apu* const apu) {
+  if (apu == NULL) {
+    return;
+  }
+  free(apu->events);
+  free(apu->synth);
+  apu->events = NULL;
+  apu->synth = NULL;
+  apu->global_ctx = NULL;
+}
+
+
+void ApuTick(Apu* const apu, uint16_t div, int cycles) {
+  apu->frame_time += cycles;
+  // The sequencer runs at 512 Hz off bit 10 of the machine cycle divider,
+  // so resetting DIV can clock it early.
+  uint8_t div_bit = (div >> 10) & 0x01;
+  if (apu->div_bit && !div_bit) {
+    StepFrameSequencer(&apu->state);
+    if (apu->mode == APU_MODE_FULL) {
+      LogEvent(apu, _EVENT_FRAME_STEP, 0);
+    }
+  }
+  apu->div_bit = div_bit;
+
+  if (apu->frame_time < _FRAME_CYCLES) {
+    return;
+  }
+  // Frames end at the same cycles either way, so saved states don't tell
+  // the modes apart.
+  if (apu->mode == APU_MODE_ELIDED) {
+    apu->frame_time = 0;
+    return;
+  }
+  EndFrame(apu);
+}
+
+
+uint8_t ApuReadRegister(const Apu* const apu, uint16_t addr) {
+  return ReadRegister(&apu->state, addr - _APU_REGISTERS_BEGIN);
+}
+
+
+void ApuWriteRegister(Apu* const apu, uint16_t addr, uint8_t data) {
+  uint8_t reg = addr - _APU_REGISTERS_BEGIN;
+  WriteRegister(&apu->state, reg, data);
+  if (apu->mode == APU_MODE_FULL) {
+    LogEvent(apu, reg, data);
+  }
+}
+
+
+void ApuResync(Apu* const apu) {
+  if (apu->mode == APU_MODE_ELIDED) {
+    return;
+  }
+  ApuSynth* synth = apu->synth;
+  apu->event_count = 0;
+  synth->state = apu->state;
+  synth->time = apu->frame_time;
+  for (int channel = 0; channel < 4; ++channel) {
+    synth->next_step[channel] = apu->frame_time + StepPeriod(synth, channel);
+    UpdateLevel(synth, channel, apu->frame_time);
+  }
+}
+
+
+void ApuSetOutput(Apu* const apu, RingBuffer* const output) {
+  apu->output = output;
+}
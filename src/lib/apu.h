@@ -0,0 +1,121 @@
+#ifndef APU_H
+#define APU_H
+
+#include "blip.h"
+#include "global.h"
+#include "ring.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Native output rate, one sample every 64 T-cycles.
+#define APU_SAMPLE_RATE 65536
+#define APU_EVENT_CAPACITY 4096
+
+
+typedef enum ApuModeDef {
+  // Synthesizes samples every frame.
+  APU_MODE_FULL = 0,
+  // Keeps only the state the CPU can observe: registers, channel status,
+  // length expiry and sweep overflow. Nothing is logged or synthesized.
+  APU_MODE_ELIDED = 1,
+} ApuMode;
+
+// Register file and sequencer state of the four channels. Both the CPU side
+// and the synthesizer keep one, driven through the same code by the same
+// writes at the same clocks, so they never disagree.
+typedef struct ApuStateDef {
+  // 0xFF10 - 0xFF3F, wave RAM from offset 0x20.
+  uint8_t regs[0x30];
+  // Bits 0-3 are set while the matching channel is playing.
+  uint8_t enabled;
+  uint16_t length[4];
+  // Envelope volume and timer of the square and noise channels.
+  uint8_t volume[4];
+  uint8_t envelope_timer[4];
+  uint16_t sweep_shadow;
+  uint8_t sweep_timer;
+  uint8_t sweep_enabled;
+  // Set once a sweep calculation has subtracted since the last trigger.
+  uint8_t sweep_negated;
+  // Next step of the 512 Hz frame sequencer.
+  uint8_t frame_step;
+  // Length registers stay writable while powered off on DMG.
+  uint8_t dmg;
+} ApuState;
+
+// A register write, or a frame sequencer step when reg is 0xFF, stamped
+// with the T-cycle in the current frame it happened at.
+typedef struct ApuEventDef {
+  uint32_t time;
+  uint8_t reg;
+  uint8_t value;
+} ApuEvent;
+
+typedef struct ApuSynthDef {
+  ApuState state;
+  // Clock of each channel's next waveform step.
+  int32_t next_step[4];
+  // Duty step of the squares or sample index of the wave channel.
+  uint8_t positions[4];
+  uint16_t lfsr;
+  // Last amplitude each channel sent to the left and right outputs.
+  int amps[4][2];
+  // Clock in the current frame synthesis has reached.
+  uint32_t time;
+  Blip left;
+  Blip right;
+  // Interleaved stereo samples of the last finished frame.
+  int16_t samples[BLIP_MAX_SAMPLES * 2];
+  size_t sample_count;
+} ApuSynth;
+
+// Sound is split in two. The CPU thread only updates the state games can
+// observe and logs what it did. Samples are made in one pass over the log
+// at the end of each frame, band limited, so the cost follows the number of
+// waveform edges rather than the number of clocks.
+typedef struct ApuDef {
+  ApuMode mode;
+  ApuState state;
+  // Level of the DIV bit that clocks the frame sequencer on its falling
+  // edge.
+  uint8_t div_bit;
+  // T-cycles since the start of the current sound frame.
+  uint32_t frame_time;
+  // Unused and NULL when elided.
+  ApuEvent* events;
+  size_t event_count;
+  ApuSynth* synth;
+  // Receives each frame's samples as interleaved int16 stereo frames.
+  RingBuffer* output;
+  GlobalCtx* global_ctx;
+} Apu;
+
+
+// CPU visible behavior is the same in every mode, since both run the same
+// register and sequencer code.
+Result ApuInit(Apu* const apu, GlobalCtx* const global_ctx, ApuMode mode);
+
+void ApuDestroy(Apu* const apu);
+
+// Returns to the post boot state without reallocating.
+void ApuReset(Apu* const apu);
+
+// Advances sound by the given number of T-cycles. div is the timer's
+// divider, whose falling edges clock the frame sequencer.
+void ApuTick(Apu* const apu, uint16_t div, int cycles);
+
+uint8_t ApuReadRegister(const Apu* const apu, uint16_t addr);
+
+void ApuWriteRegister(Apu* const apu, uint16_t addr, uint8_t data);
+
+// Restarts synthesis from the CPU side state, as after loading a state.
+// Waveform phases start over and anything logged but not yet synthesized
+// is dropped.
+void ApuResync(Apu* const apu);
+
+// Pushes finished samples to output. Emulation waits for room when output
+// is full, which paces it to whoever drains the ring.
+void ApuSetOutput(Apu* const apu, RingBuffer* const output);
+
+#endif
@@ -0,0 +1,209 @@
+#include "audio.h"
+
+#include "apu.h"
+#include "global.h"
+#include "ring.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <SDL2/SDL.h>
+
+
+#define _PHASES 256
+#define _TAPS 32
+
+// Ring capacity in stereo frames, about 31 ms at the APU rate. The APU
+// waits for room when it's full, which bounds latency and paces emulation
+// to the audio clock.
+static const size_t _RING_FRAMES = 2048;
+// Device buffer in output frames, about 5 ms.
+static const uint16_t _DEVICE_FRAMES = 256;
+// Passband edge relative to the input rate, 20 kHz at 65536 Hz.
+static const double _CUTOFF = 20000.0 / APU_SAMPLE_RATE;
+// Largest adjustment rate control makes to the resampling ratio.
+static const double _MAX_RATE_ADJUST = 0.005;
+static const double _FILL_SMOOTHING = 0.02;
+
+static float _FILTER[_PHASES][_TAPS];
+static pthread_once_t _FILTER_ONCE = PTHREAD_ONCE_INIT;
+
+
+// Windowed sinc low pass tabulated at _PHASES fractional offsets, so each
+// output frame is one dot product with the nearest phase.
+static void BuildFilter(void) {
+  const double pi = 3.14159265358979323846;
+  const double half = _TAPS / 2;
+  for (int phase = 0; phase < _PHASES; ++phase) {
+    double taps[_TAPS];
+    double sum = 0.0;
+    for (int i = 0; i < _TAPS; ++i) {
+      double x = i - (half - 1) - (double)phase / _PHASES;
+      double sinc = x == 0.0 ? 1.0 : sin(2.0 * pi * _CUTOFF * x) /
+                                     (2.0 * pi * _CUTOFF * x);
+      double window = 0.0;
+      if (fabs(x) < half) {
+        window = 0.42 + 0.5 * cos(pi * x / half) +
+                 0.08 * cos(2.0 * pi * x / half);
+      }
+      taps[i] = sinc * window;
+      sum += taps[i];
+    }
+    for (int i = 0; i < _TAPS; ++i) {
+      _FILTER[phase][i] = (float)(taps[i] / sum);
+    }
+  }
+}
+
+
+// Written as independent lanes over contiguous taps so the compiler can
+// vectorize it.
+static float Convolve(const float* const input, const float* const taps) {
+  float lanes[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < _TAPS; i += 4) {
+    lanes[0] += input[i] * taps[i];
+    lanes[1] += input[i + 1] * taps[i + 1];
+    lanes[2] += input[i + 2] * taps[i + 2];
+    lanes[3] += input[i + 3] * taps[i + 3];
+  }
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+// Drops history the filter no longer reaches and tops it up from the ring.
+// Returns whether there is enough input for the next output frame.
+static int Refill(Audio* const audio) {
+  size_t keep = (size_t)audio->position - (_TAPS / 2 - 1);
+  size_t kept = audio->history_size - keep;
+  for (int channel = 0; channel < 2; ++channel) {
+    memmove(audio->history[channel], audio->history[channel] + keep,
+            kept * sizeof(float));
+  }
+  audio->history_size = kept;
+  audio->position -= keep;
+
+  int16_t frames[256][2];
+  while (audio->history_size < AUDIO_HISTORY_SIZE) {
+    size_t space = AUDIO_HISTORY_SIZE - audio->history_size;
+    size_t count = RingBufferPop(audio->ring, frames,
+                                 space < 256 ? space : 256);
+    if (count == 0) {
+      break;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      audio->history[0][audio->history_size + i] = frames[i][0];
+      audio->history[1][audio->history_size + i] = frames[i][1];
+    }
+    audio->history_size += count;
+  }
+  return (size_t)audio->position + _TAPS / 2 < audio->history_size;
+}
+
+
+static void AudioCallback(void* const userdata, uint8_t* const stream,
+                          int len) {
+  Audio* const audio = (Audio*)userdata;
+  int16_t* out = (int16_t*)stream;
+  size_t frames = len / (2 * sizeof(int16_t));
+
+  // Rate control. Consume slightly faster while the ring is fuller than
+  // half and slightly slower while it's emptier.
+  double target = _RING_FRAMES / 2.0;
+  audio->fill += (RingBufferSize(audio->ring) - audio->fill) * _FILL_SMOOTHING;
+  double error = (audio->fill - target) / target;
+  if (error > 1.0) {
+    error = 1.0;
+  }
+  else if (error < -1.0) {
+    error = -1.0;
+  }
+  double step = audio->step * (1.0 + _MAX_RATE_ADJUST * error);
+
+  size_t i = 0;
+  for (; i < frames; ++i) {
+    if ((size_t)audio->position + _TAPS / 2 >= audio->history_size &&
+        !Refill(audio)) {
+      break;
+    }
+    size_t base = (size_t)audio->position - (_TAPS / 2 - 1);
+    int phase = (int)((audio->position - floor(audio->position)) * _PHASES);
+    const float* taps = _FILTER[phase];
+    for (int channel = 0; channel < 2; ++channel) {
+      float sample = Convolve(audio->history[channel] + base, taps);
+      if (sample > 32767.0f) {
+        sample = 32767.0f;
+      }
+      else if (sample < -32768.0f) {
+        sample = -32768.0f;
+      }
+      out[i * 2 + channel] = (int16_t)sample;
+    }
+    audio->position += step;
+  }
+  // The emulator fell behind. Play silence rather than stale samples.
+  memset(out + i * 2, 0, (frames - i) * 2 * sizeof(int16_t));
+}
+
+
+Audio* AudioCreate(GlobalCtx* const global_ctx) {
+  pthread_once(&_FILTER_ONCE, BuildFilter);
+
+  Audio* audio = (Audio*)malloc(sizeof(Audio));
+  if (audio == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(audio, 0, sizeof(Audio));
+  audio->global_ctx = global_ctx;
+  // Leading silence the filter can look back into.
+  audio->history_size = _TAPS;
+  audio->position = _TAPS / 2 - 1;
+
+  audio->ring = RingBufferCreate(global_ctx, _RING_FRAMES,
+                                 2 * sizeof(int16_t));
+  if (audio->ring == NULL) {
+    AudioDestroy(audio);
+    return NULL;
+  }
+
+  SDL_AudioSpec want = {
+    .freq = AUDIO_OUTPUT_RATE,
+    .format = AUDIO_S16SYS,
+    .channels = 2,
+    .samples = _DEVICE_FRAMES,
+    .callback = AudioCallback,
+    .userdata = audio
+  };
+  SDL_AudioSpec have;
+  audio->device = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                      SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audio->device == 0) {
+    global_ctx->error = SDL_AUDIO_DEVICE_OPEN_FAILED;
+    AudioDestroy(audio);
+    return NULL;
+  }
+  audio->step = (double)APU_SAMPLE_RATE / have.freq;
+  SDL_PauseAudioDevice(audio->device, 0);
+  return audio;
+}
+
+
+void AudioDestroy(Audio* audio) {
+  if (audio == NULL) {
+    return;
+  }
+  // Closing the device waits for a running callback, so the ring can be
+  // freed after.
+  if (audio->device != 0) {
+    SDL_CloseAudioDevice(audio->device);
+  }
+  RingBufferDestroy(audio->ring);
+  audio->ring = NULL;
+  audio->global_ctx = NULL;
+  free(audio);
+  audio = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "global.h"
+#include "ring.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#define AUDIO_OUTPUT_RATE 48000
+// Input frames kept for the resampler, enough for one device callback.
+#define AUDIO_HISTORY_SIZE 4096
+
+
+// Plays the APU's output through an SDL audio device. The APU pushes
+// stereo frames into ring at its native rate and the device callback pops
+// them and resamples to the output rate, so neither side takes a lock.
+// The resampling ratio is nudged by up to half a percent to hold the ring
+// near half full, which absorbs drift between the emulated and the host
+// clocks without dropping or repeating samples.
+typedef struct AudioDef {
+  SDL_AudioDeviceID device;
+  // Interleaved int16 stereo frames at APU_SAMPLE_RATE.
+  RingBuffer* ring;
+  // Planar input history the filter reads from.
+  float history[2][AUDIO_HISTORY_SIZE];
+  size_t history_size;
+  // Read position in history, in input frames.
+  double position;
+  // Input frames per output frame before rate control.
+  double step;
+  // Ring fill level, smoothed over callbacks.
+  double fill;
+  GlobalCtx* global_ctx;
+} Audio;
+
+
+Audio* AudioCreate(GlobalCtx* const global_ctx);
+
+void AudioDestroy(Audio* audio);
+
+#endif
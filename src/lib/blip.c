@@ -0,0 +1,98 @@
+#include "blip.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// Passband as a fraction of the output rate, a little under Nyquist to leave
+// room for the window's transition band.
+static const double _CUTOFF = 0.45;
+static const float _DC_RATE = 1.0f / 4096.0f;
+
+static float _KERNEL[BLIP_PHASES][BLIP_TAPS];
+static pthread_once_t _KERNEL_ONCE = PTHREAD_ONCE_INIT;
+
+
+static void BuildKernel(void) {
+  const double pi = 3.14159265358979323846;
+  const double half = BLIP_TAPS / 2;
+  for (int phase = 0; phase < BLIP_PHASES; ++phase) {
+    double sum = 0.0;
+    double taps[BLIP_TAPS];
+    for (int i = 0; i < BLIP_TAPS; ++i) {
+      // Distance from the impulse, which sits half the kernel plus the
+      // phase into the taps.
+      double x = i - half - (double)phase / BLIP_PHASES;
+      double sinc = x == 0.0 ? 1.0 : sin(2.0 * pi * _CUTOFF * x) /
+                                     (2.0 * pi * _CUTOFF * x);
+      double window = 0.0;
+      if (fabs(x) < half) {
+        window = 0.42 + 0.5 * cos(pi * x / half) +
+                 0.08 * cos(2.0 * pi * x / half);
+      }
+      taps[i] = sinc * window;
+      sum += taps[i];
+    }
+    // Every phase sums to one so a step always settles at exactly its
+    // height.
+    for (int i = 0; i < BLIP_TAPS; ++i) {
+      _KERNEL[phase][i] = (float)(taps[i] / sum);
+    }
+  }
+}
+
+
+void BlipInit(Blip* const blip) {
+  pthread_once(&_KERNEL_ONCE, BuildKernel);
+  memset(blip, 0, sizeof(Blip));
+}
+
+
+void BlipAddDelta(Blip* const blip, uint32_t time, float delta) {
+  uint32_t clock = blip->offset + time;
+  uint32_t sample = clock >> BLIP_CLOCK_SHIFT;
+  if (sample >= BLIP_MAX_SAMPLES) {
+    return;
+  }
+  float* out = &blip->deltas[sample];
+  const float* kernel = _KERNEL[clock & (BLIP_PHASES - 1)];
+  for (int i = 0; i < BLIP_TAPS; ++i) {
+    out[i] += kernel[i] * delta;
+  }
+}
+
+
+size_t BlipEndFrame(Blip* const blip, uint32_t clocks, int16_t* const out,
+                    size_t stride) {
+  uint32_t end = blip->offset + clocks;
+  size_t count = end >> BLIP_CLOCK_SHIFT;
+  if (count > BLIP_MAX_SAMPLES) {
+    count = BLIP_MAX_SAMPLES;
+  }
+  blip->offset = end & (BLIP_PHASES - 1);
+
+  float integrator = blip->integrator;
+  float dc = blip->dc;
+  for (size_t i = 0; i < count; ++i) {
+    integrator += blip->deltas[i];
+    dc += (integrator - dc) * _DC_RATE;
+    float sample = integrator - dc;
+    if (sample > 32767.0f) {
+      sample = 32767.0f;
+    }
+    else if (sample < -32768.0f) {
+      sample = -32768.0f;
+    }
+    out[i * stride] = (int16_t)sample;
+  }
+  blip->integrator = integrator;
+  blip->dc = dc;
+
+  // Kernel tails that reach past the frame carry over into the next one.
+  memmove(blip->deltas, blip->deltas + count, BLIP_TAPS * sizeof(float));
+  memset(blip->deltas + BLIP_TAPS, 0, count * sizeof(float));
+  return count;
+}
@@ -0,0 +1,45 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each output sample spans 1 << BLIP_CLOCK_SHIFT input clocks, which is also
+// the number of sub-sample phases the step kernel is tabulated for.
+#define BLIP_CLOCK_SHIFT 6
+#define BLIP_PHASES (1 << BLIP_CLOCK_SHIFT)
+#define BLIP_TAPS 16
+// Longest frame, in output samples, that can be buffered before reading.
+#define BLIP_MAX_SAMPLES 4096
+
+
+// Band-limited step synthesizer. Instead of sampling a waveform every clock,
+// callers add the amplitude changes of a signal at the clock they happen.
+// Each change is spread over BLIP_TAPS samples with a windowed sinc kernel
+// picked by its sub-sample phase, and the output is the running sum of
+// those impulses. The cost is proportional to the number of edges, not the
+// number of clocks, and the result is free of aliasing.
+typedef struct BlipDef {
+  float deltas[BLIP_MAX_SAMPLES + BLIP_TAPS];
+  // Clocks left over from the previous frame that didn't fill a sample.
+  uint32_t offset;
+  float integrator;
+  // Slow moving average removed from the output, like the capacitor on the
+  // hardware's output stage.
+  float dc;
+} Blip;
+
+
+void BlipInit(Blip* const blip);
+
+// Adds an amplitude change at the given clock, relative to the start of the
+// current frame.
+void BlipAddDelta(Blip* const blip, uint32_t time, float delta);
+
+// Ends a frame that lasted the given number of clocks and writes the
+// finished samples to out, stride elements apart. Returns the number of
+// samples written.
+size_t BlipEndFrame(Blip* const blip, uint32_t clocks, int16_t* const out,
+                    size_t stride);
+
+#endif
@@ -1,10 +1,14 @@
 #include "bus.h"
 
+#include "apu.h"
 #include "cartridge.h"
+#include "cow.h"
 #include "global.h"
+#include "ppu.h"
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 static const uint16_t _ROM_END = 0x8000;
@@ -18,6 +22,7 @@ static const uint16_t _MIRROR_END = 0xFE00;
 static const uint16_t _OAM_BEGIN = _MIRROR_END;
 static const uint16_t _OAM_END = 0xFEA0;
 static const uint16_t _UNUSED_END = 0xFF00;
+static const uint16_t _JOYPAD = 0xFF00;
 static const uint16_t _SERIAL_TRANSFER_DATA = 0xFF01;
 static const uint16_t _SERIAL_TRANSFER_CONTROL = 0xFF02;
 static const uint16_t _DIV_TIMER_REG = 0xFF04;
@@ -25,6 +30,13 @@ static const uint16_t _TIMA_TIMER_REG = 0xFF05;
 static const uint16_t _TMA_TIMER_REG = 0xFF06;
 static const uint16_t _TAC_TIMER_REG = 0xFF07;
 static const uint16_t _INTERRUPTS_FLAG = 0xFF0F;
+static const uint16_t _APU_REGISTERS_BEGIN = 0xFF10;
+static const uint16_t _APU_REGISTERS_END = 0xFF40;
+static const uint16_t _LCD_REGISTERS_BEGIN = 0xFF40;
+static const uint16_t _DMA_TRANSFER = 0xFF46;
+static const uint16_t _LCD_REGISTERS_END = 0xFF4C;
+static const uint16_t _CGB_PALETTES_BEGIN = 0xFF68;
+static const uint16_t _CGB_PALETTES_END = 0xFF6C;
 static const uint16_t _VRAM_BANK_SELECT = 0xFF4F;
 static const uint16_t _WRAM_BANK_SELECT = 0xFF70;
 static const uint16_t _IO_REGISTERS_BEGIN = _UNUSED_END;
@@ -34,9 +46,23 @@ static const uint16_t _HRAM_END = 0xFFFF;
 
 static const uint16_t _VRAM_BANK_SIZE = 0x2000;
 static const uint16_t _WRAM_BANK_SIZE = 0x1000;
+static const uint16_t _OAM_SIZE = 0xA0;
 
+// Cycles per bit shifted on the internal clock, at 8192 Hz or at 262144 Hz
+// with the CGB's fast clock.
+static const int _SERIAL_BIT_CYCLES = 512;
+static const int _SERIAL_FAST_BIT_CYCLES = 16;
 
-Bus* BusCreate(GlobalCtx* const global_ctx, Cartridge* const cartridge) {
+
+// Offset into WRAM of an address relative to 0xC000. Wraps around rather
+// than running off the end when a high bank is selected.
+static uint16_t WramOffset(const Bus* const bus, uint16_t relative) {
+  return (bus->wram_bank * _WRAM_BANK_SIZE + relative) & (BUS_WRAM_SIZE - 1);
+}
+
+
+Bus* BusCreate(GlobalCtx* const global_ctx, Cartridge* const cartridge,
+               ApuMode apu_mode) {
   Bus* bus = (Bus*)malloc(sizeof(Bus));
   if (bus == NULL) {
     global_ctx->error = MEMORY_ALLOCATION_FAILURE;
@@ -44,13 +70,92 @@ Bus* BusCreate(GlobalCtx* const global_ctx, Cartridge* const cartridge) {
   }
   bus->global_ctx = global_ctx;
   bus->cartridge = cartridge;
+  bus->link_next = NULL;
+  bus->link_prev = NULL;
+  CowMemoryInit(&bus->wram, global_ctx, BUS_WRAM_SIZE);
+  CowMemoryInit(&bus->vram, global_ctx, BUS_VRAM_SIZE);
+  if (ApuInit(&bus->apu, global_ctx, apu_mode) == RESULT_NOTOK) {
+    free(bus);
+    return NULL;
+  }
+  if (PpuInit(&bus->ppu, global_ctx) == RESULT_NOTOK) {
+    ApuDestroy(&bus->apu);
+    free(bus);
+    return NULL;
+  }
+  BusReset(bus);
+  return bus;
+}
+
+
+void BusReset(Bus* const bus) {
+  CowMemoryClear(&bus->wram);
+  CowMemoryClear(&bus->vram);
+  memset(bus->oam, 0, sizeof(bus->oam));
+  memset(bus->io_regs, 0, sizeof(bus->io_regs));
+  memset(bus->hram, 0, sizeof(bus->hram));
   bus->interrupts_enable_reg = 0;
   bus->interrupts_flag = 0;
   bus->wram_bank = 0;
   bus->vram_bank = 0;
+  bus->joypad_select = 0x30;
+  bus->buttons = 0;
+  bus->serial_data[0] = 0;
+  bus->serial_data[1] = 0;
+  bus->serial_bits = 0;
+  bus->serial_cycles = 0;
+  bus->serial_out[0] = '\0';
+  bus->serial_out_size = 0;
   TimerInit(&bus->timer);
   bus->timer.div = 0xABCC;
-  return bus;
+  ApuReset(&bus->apu);
+  PpuReset(&bus->ppu);
+}
+
+
+void BusFork(Bus* const bus, Bus* const parent) {
+  CowMemoryShare(&bus->wram, &parent->wram);
+  CowMemoryShare(&bus->vram, &parent->vram);
+  memcpy(bus->oam, parent->oam, sizeof(bus->oam));
+  memcpy(bus->io_regs, parent->io_regs, sizeof(bus->io_regs));
+  memcpy(bus->hram, parent->hram, sizeof(bus->hram));
+  bus->interrupts_enable_reg = parent->interrupts_enable_reg;
+  bus->interrupts_flag = parent->interrupts_flag;
+  bus->wram_bank = parent->wram_bank;
+  bus->vram_bank = parent->vram_bank;
+  bus->timer = parent->timer;
+  bus->apu.state = parent->apu.state;
+  bus->apu.div_bit = parent->apu.div_bit;
+  bus->apu.frame_time = parent->apu.frame_time;
+  ApuResync(&bus->apu);
+  bus->ppu.regs = parent->ppu.regs;
+  bus->ppu.mode = parent->ppu.mode;
+  bus->ppu.dot = parent->ppu.dot;
+  bus->ppu.stat_line = parent->ppu.stat_line;
+  memcpy(bus->ppu.palette_ram, parent->ppu.palette_ram,
+         sizeof(bus->ppu.palette_ram));
+  bus->ppu.frames = parent->ppu.frames;
+  bus->joypad_select = parent->joypad_select;
+  bus->buttons = parent->buttons;
+  memcpy(bus->serial_data, parent->serial_data, sizeof(bus->serial_data));
+  bus->serial_bits = parent->serial_bits;
+  bus->serial_cycles = parent->serial_cycles;
+  memcpy(bus->serial_out, parent->serial_out, parent->serial_out_size + 1);
+  bus->serial_out_size = parent->serial_out_size;
+}
+
+
+void BusConnect(Bus* const from, Bus* const to) {
+  if (from->link_next != NULL) {
+    from->link_next->link_prev = NULL;
+  }
+  if (to != NULL) {
+    if (to->link_prev != NULL) {
+      to->link_prev->link_next = NULL;
+    }
+    to->link_prev = from;
+  }
+  from->link_next = to;
 }
 
 
@@ -58,6 +163,14 @@ void BusDestroy(Bus* bus) {
   if (bus == NULL) {
     return;
   }
+  BusConnect(bus, NULL);
+  if (bus->link_prev != NULL) {
+    BusConnect(bus->link_prev, NULL);
+  }
+  PpuDestroy(&bus->ppu);
+  ApuDestroy(&bus->apu);
+  CowMemoryDestroy(&bus->wram);
+  CowMemoryDestroy(&bus->vram);
   bus->global_ctx = NULL;
   bus->cartridge = NULL;
   free(bus);
@@ -65,6 +178,35 @@ void BusDestroy(Bus* bus) {
 }
 
 
+// Low nibble of 0xFF00. Pressed buttons on the selected lines read as 0.
+static uint8_t JoypadLines(const Bus* const bus) {
+  uint8_t lines = 0x0F;
+  if (!(bus->joypad_select & 0x10)) {
+    lines &= ~bus->buttons & 0x0F;
+  }
+  if (!(bus->joypad_select & 0x20)) {
+    lines &= ~(bus->buttons >> 4) & 0x0F;
+  }
+  return lines;
+}
+
+
+// The joypad interrupt fires when any line falls from 1 to 0, whether a
+// button was pressed or a line holding one was selected.
+static void JoypadUpdate(Bus* const bus, uint8_t lines) {
+  if (lines & ~JoypadLines(bus)) {
+    RequestInterrupt(INTERRUPT_JOYPAD, &bus->interrupts_flag);
+  }
+}
+
+
+void BusSetButtons(Bus* const bus, uint8_t buttons) {
+  uint8_t lines = JoypadLines(bus);
+  bus->buttons = buttons;
+  JoypadUpdate(bus, lines);
+}
+
+
 uint8_t BusRead(const Bus* const bus, uint16_t addr) {
   if (addr < _ROM_END) {
     // Read from cartridge ROM.
@@ -73,7 +215,8 @@ uint8_t BusRead(const Bus* const bus, uint16_t addr) {
   if (addr < _VRAM_END) {
     // Read from VRAM.
     // VRAM consists of two switchable 0x2000 byte banks.
-    return bus->vram [bus->vram_bank * _VRAM_BANK_SIZE + (addr - _VRAM_BEGIN)];
+    return CowRead(&bus->vram,
+                   bus->vram_bank * _VRAM_BANK_SIZE + (addr - _VRAM_BEGIN));
   }
   if (addr < _CRAM_END) {
     // Read from Cartridge RAM.
@@ -82,11 +225,11 @@ uint8_t BusRead(const Bus* const bus, uint16_t addr) {
   if (addr < _WRAM_END) {
     // Read from WRAM.
     // WRAM consists of eight switchable 0x1000 byte banks.
-    return bus->wram [bus->wram_bank * _WRAM_BANK_SIZE + (addr - _WRAM_BEGIN)];
+    return CowRead(&bus->wram, WramOffset(bus, addr - _WRAM_BEGIN));
   }
   if (addr < _MIRROR_END) {
     // Mirror of 0xC000 - 0xDDFF.
-    return bus->wram [bus->wram_bank * _WRAM_BANK_SIZE + (addr - _MIRROR_BEGIN)];
+    return CowRead(&bus->wram, WramOffset(bus, addr - _MIRROR_BEGIN));
   }
   if (addr < _OAM_END) {
     // Read from OAM.
@@ -97,6 +240,9 @@ uint8_t BusRead(const Bus* const bus, uint16_t addr) {
     // data.
     return 0xFF;
   }
+  if (addr == _JOYPAD) {
+    return 0xC0 | bus->joypad_select | JoypadLines(bus);
+  }
   if (addr == _SERIAL_TRANSFER_DATA) {
     return bus->serial_data[0];
   }
@@ -118,6 +264,14 @@ uint8_t BusRead(const Bus* const bus, uint16_t addr) {
   if (addr == _INTERRUPTS_FLAG) {
     return bus->interrupts_flag;
   }
+  if (addr >= _APU_REGISTERS_BEGIN && addr < _APU_REGISTERS_END) {
+    return ApuReadRegister(&bus->apu, addr);
+  }
+  if ((addr >= _LCD_REGISTERS_BEGIN && addr < _LCD_REGISTERS_END &&
+       addr != _DMA_TRANSFER) ||
+      (addr >= _CGB_PALETTES_BEGIN && addr < _CGB_PALETTES_END)) {
+    return PpuReadRegister(&bus->ppu, addr);
+  }
   if (addr < _IO_REGISTERS_END) {
     // Read from IO registers.
     return bus->io_regs [addr - _IO_REGISTERS_BEGIN];
@@ -131,6 +285,80 @@ uint8_t BusRead(const Bus* const bus, uint16_t addr) {
 }
 
 
+// Records a byte sent over the serial port.
+static void SerialOut(Bus* const bus, uint8_t data) {
+  if (bus->serial_out_size == BUS_SERIAL_OUT_SIZE - 1) {
+    size_t half = BUS_SERIAL_OUT_SIZE / 2;
+    memmove(bus->serial_out, bus->serial_out + half,
+            bus->serial_out_size - half);
+    bus->serial_out_size -= half;
+  }
+  bus->serial_out[bus->serial_out_size++] = (char)data;
+  bus->serial_out[bus->serial_out_size] = '\0';
+}
+
+
+// Bit the port drives onto the cable. The line idles high.
+static int SerialOutBit(const Bus* const bus) {
+  return bus->serial_bits > 0 ? bus->serial_data[0] >> 7 : 1;
+}
+
+
+// Shifts in into SB, ending the transfer after the eighth bit.
+static void SerialShift(Bus* const bus, int in) {
+  if (bus->serial_bits == 8) {
+    SerialOut(bus, bus->serial_data[0]);
+  }
+  bus->serial_data[0] = (uint8_t)(bus->serial_data[0] << 1 | in);
+  if (--bus->serial_bits == 0) {
+    bus->serial_data[1] &= 0x7F;
+    RequestInterrupt(INTERRUPT_SERIAL, &bus->interrupts_flag);
+  }
+}
+
+
+// Shifts a bit on every port clock drives: itself and the ports of its
+// chain waiting on the external clock. Each takes the bit the port before
+// it drove as the edge came, and the first of an open chain takes 1.
+static void SerialClock(Bus* const clock) {
+  Bus* first = clock;
+  while (first->link_prev != NULL && first->link_prev != clock) {
+    first = first->link_prev;
+  }
+  int in = first->link_prev != NULL ? SerialOutBit(first->link_prev) : 1;
+  Bus* bus = first;
+  do {
+    int out = SerialOutBit(bus);
+    if (bus == clock ||
+        (bus->serial_bits > 0 && !(bus->serial_data[1] & 0x01))) {
+      SerialShift(bus, in);
+    }
+    in = out;
+    bus = bus->link_next;
+  } while (bus != NULL && bus != first);
+}
+
+
+static int SerialBitCycles(const Bus* const bus) {
+  return bus->global_ctx->mode == GB_MODE_GBC && (bus->serial_data[1] & 0x02)
+             ? _SERIAL_FAST_BIT_CYCLES
+             : _SERIAL_BIT_CYCLES;
+}
+
+
+void BusSerialTick(Bus* const bus, int cycles) {
+  if (bus->serial_bits == 0 || !(bus->serial_data[1] & 0x01)) {
+    return;
+  }
+  int left = bus->serial_cycles - cycles;
+  while (left <= 0 && bus->serial_bits > 0) {
+    SerialClock(bus);
+    left += SerialBitCycles(bus);
+  }
+  bus->serial_cycles = (uint16_t)(left > 0 ? left : 0);
+}
+
+
 Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data) {
   if (addr < _ROM_END) {
     // Write to cartridge ROM.
@@ -139,7 +367,11 @@ Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data) {
   if (addr < _VRAM_END) {
     // Write to VRAM.
     // VRAM consists of two switchable 0x2000 byte banks.
-    bus->vram [bus->vram_bank * _VRAM_BANK_SIZE + (addr - _VRAM_BEGIN)] = data;
+    uint16_t offset = bus->vram_bank * _VRAM_BANK_SIZE + (addr - _VRAM_BEGIN);
+    if (CowWrite(&bus->vram, offset, data) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    PpuLogVramWrite(&bus->ppu, offset, data);
     return RESULT_OK;
   }
   if (addr < _CRAM_END) {
@@ -149,17 +381,16 @@ Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data) {
   if (addr < _WRAM_END) {
     // Write to WRAM.
     // WRAM consists of eight switchable 0x1000 byte banks.
-    bus->wram [bus->wram_bank * _WRAM_BANK_SIZE + (addr - _WRAM_BEGIN)] = data;
-    return RESULT_OK;
+    return CowWrite(&bus->wram, WramOffset(bus, addr - _WRAM_BEGIN), data);
   }
   if (addr < _MIRROR_END) {
     // Mirror of 0xC000 - 0xDDFF.
-    bus->wram [bus->wram_bank * _WRAM_BANK_SIZE + (addr - _MIRROR_BEGIN)] = data;
-    return RESULT_OK;
+    return CowWrite(&bus->wram, WramOffset(bus, addr - _MIRROR_BEGIN), data);
   }
   if (addr < _OAM_END) {
     // Write to OAM.
     bus->oam [addr - _OAM_BEGIN] = data;
+    PpuLogOamWrite(&bus->ppu, addr - _OAM_BEGIN, data);
     return RESULT_OK;
   }
   if (addr < _UNUSED_END) {
@@ -167,12 +398,21 @@ Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data) {
     bus->global_ctx->error = ILLEGAL_WRITE_TO_MEMORY;
     return RESULT_NOTOK;
   }
+  if (addr == _JOYPAD) {
+    uint8_t lines = JoypadLines(bus);
+    bus->joypad_select = data & 0x30;
+    JoypadUpdate(bus, lines);
+    return RESULT_OK;
+  }
   if (addr == _SERIAL_TRANSFER_DATA) {
     bus->serial_data[0] = data;
     return RESULT_OK;
   }
   if (addr == _SERIAL_TRANSFER_CONTROL) {
     bus->serial_data[1] = data;
+    // Starting over drops whatever of a transfer was under way.
+    bus->serial_bits = data & 0x80 ? 8 : 0;
+    bus->serial_cycles = (uint16_t)SerialBitCycles(bus);
     return RESULT_OK;
   }
   if (addr == _DIV_TIMER_REG) {
@@ -194,6 +434,26 @@ Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data) {
   if (addr == _INTERRUPTS_FLAG) {
     bus->interrupts_flag = data;
   }
+  if (addr >= _APU_REGISTERS_BEGIN && addr < _APU_REGISTERS_END) {
+    ApuWriteRegister(&bus->apu, addr, data);
+    return RESULT_OK;
+  }
+  if (addr == _DMA_TRANSFER) {
+    // OAM DMA copies 0xA0 bytes from 0xXX00 into OAM. The transfer is done
+    // all at once rather than over 160 machine cycles.
+    bus->io_regs [addr - _IO_REGISTERS_BEGIN] = data;
+    uint16_t source = (uint16_t)data << 8;
+    for (uint16_t i = 0; i < _OAM_SIZE; ++i) {
+      bus->oam [i] = BusRead(bus, source + i);
+      PpuLogOamWrite(&bus->ppu, i, bus->oam [i]);
+    }
+    return RESULT_OK;
+  }
+  if ((addr >= _LCD_REGISTERS_BEGIN && addr < _LCD_REGISTERS_END) ||
+      (addr >= _CGB_PALETTES_BEGIN && addr < _CGB_PALETTES_END)) {
+    PpuWriteRegister(&bus->ppu, addr, data);
+    return RESULT_OK;
+  }
   if (addr == _VRAM_BANK_SELECT && bus->global_ctx->mode == GB_MODE_GBC) {
     // Selects VRAM memory bank 0-1 in VRAM 0x8000-0x9FFF. GBC Only.
     // Only the least significant bit is used.
@@ -1,24 +1,34 @@
 #ifndef BUS_H
 #define BUS_H
 
+#include "apu.h"
 #include "cartridge.h"
+#include "cow.h"
 #include "global.h"
+#include "ppu.h"
 #include "timer.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define BUS_SERIAL_OUT_SIZE 0x1000
+
+
+#define BUS_WRAM_SIZE 0x8000
+#define BUS_VRAM_SIZE 0x4000
+
 
 typedef struct BusDef {
-  // 0xC000 - 0xDFFF
-  uint8_t wram[0x8000];
-  // 0x8000 - 0x9FFF
-  uint8_t vram[0x4000];
+  // 0xC000 - 0xDFFF, all eight banks. Shared with forks until written.
+  CowMemory wram;
+  // 0x8000 - 0x9FFF, both banks.
+  CowMemory vram;
   // 0xFE00 - 0xFE9F
-  uint8_t oam[0x9F];
-  // 0xFF00 - 0xFF70
-  uint8_t io_regs[0x7F];
+  uint8_t oam[0xA0];
+  // 0xFF00 - 0xFF7F
+  uint8_t io_regs[0x80];
   // 0xFF80 - 0xFFFE
-  uint8_t hram[0x7E];
+  uint8_t hram[0x7F];
   // 0xFFFF
   uint8_t interrupts_enable_reg;
   // 0xFF0F
@@ -30,7 +40,29 @@ typedef struct BusDef {
 
   Timer timer;
 
+  Apu apu;
+
+  Ppu ppu;
+
+  // Lines selected by the game through bits 4-5 of 0xFF00.
+  uint8_t joypad_select;
+  // Held buttons, set bits are pressed. Bits 0-3 are Right, Left, Up and
+  // Down, bits 4-7 are A, B, Select and Start.
+  uint8_t buttons;
+
   uint8_t serial_data[2];
+  // Bits of the transfer under way left to shift, and cycles until the next
+  // one shifts when this end drives the clock.
+  uint8_t serial_bits;
+  uint16_t serial_cycles;
+  // Bytes sent over the serial port, NUL terminated. Once full the oldest
+  // half is dropped.
+  char serial_out[BUS_SERIAL_OUT_SIZE];
+  size_t serial_out_size;
+  // Ports this one's output and input are cabled to, or NULL. Set with
+  // BusConnect.
+  struct BusDef* link_next;
+  struct BusDef* link_prev;
 
   Cartridge* cartridge;
 
@@ -38,10 +70,35 @@ typedef struct BusDef {
 } Bus;
 
 
-Bus* BusCreate(GlobalCtx* const global_ctx, Cartridge* const cartridge);
+Bus* BusCreate(GlobalCtx* const global_ctx, Cartridge* const cartridge,
+               ApuMode apu_mode);
 
 void BusDestroy(Bus* bus);
 
+// Returns memory and every device on the bus to the post boot state,
+// keeping the cartridge and every allocation.
+void BusReset(Bus* const bus);
+
+// Makes bus a copy of parent. Memory is shared page by page until either
+// side writes it, so this copies little more than the registers.
+void BusFork(Bus* const bus, Bus* const parent);
+
+// Cables the serial output of from to the input of to, replacing whatever
+// either was cabled to there. to may be NULL to disconnect from. Cabling
+// two ports both ways makes a plain link cable, and more make a daisy
+// chain. Each bit the port driving the clock shifts moves down the chain
+// through every port waiting on the external clock.
+void BusConnect(Bus* const from, Bus* const to);
+
+// Advances a transfer under way by cycles. Ports on the external clock
+// wait for another one to shift them.
+void BusSerialTick(Bus* const bus, int cycles);
+
+// Changes the held buttons, raising the joypad interrupt for newly
+// pressed buttons on the selected lines. Anything setting buttons while
+// the machine runs goes through here.
+void BusSetButtons(Bus* const bus, uint8_t buttons);
+
 uint8_t BusRead(const Bus* const bus, uint16_t addr);
 
 Result BusWrite(Bus* const bus, uint16_t addr, uint8_t data);
@@ -0,0 +1,36 @@
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include <stdint.h>
+
+// Little endian fields of saved states, movies, stores and packets, read
+// and written a byte at a time so files mean the same on any host.
+
+static inline void Put16(uint8_t* const out, uint16_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+}
+
+static inline void Put32(uint8_t* const out, uint32_t value) {
+  Put16(out, (uint16_t)value);
+  Put16(out + 2, (uint16_t)(value >> 16));
+}
+
+static inline void Put64(uint8_t* const out, uint64_t value) {
+  Put32(out, (uint32_t)value);
+  Put32(out + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint16_t Get16(const uint8_t* const in) {
+  return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static inline uint32_t Get32(const uint8_t* const in) {
+  return Get16(in) | (uint32_t)Get16(in + 2) << 16;
+}
+
+static inline uint64_t Get64(const uint8_t* const in) {
+  return Get32(in) | (uint64_t)Get32(in + 4) << 32;
+}
+
+#endif
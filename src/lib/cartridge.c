@@ -2,17 +2,22 @@
 
 #include "disassemble.h"
 #include "global.h"
+#include "hash.h"
 #include "mbc.h"
 
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 static const uint16_t _ROM_BANK_0_END = 0x4000;
 static const uint16_t _ROM_BANK_N_END = 0x8000;
 static const uint16_t _ROM_BANK_SIZE = 0x4000;
+static const uint16_t _ROM_HEADER_END = 0x0150;
+// Header sizes run from 32 KiB, 0, up to 8 MiB, 8.
+static const uint8_t _ROM_SIZE_CODE_MAX = 0x08;
 
 static const uint16_t _RAM_BEGIN = 0xA000;
 static const uint16_t _RAM_END = 0xC000;
@@ -23,6 +28,7 @@ static const uint16_t _ROM_BANK_SELECT_END = 0x4000;
 static const uint16_t _RAM_ROM_RTC_SELECT_END = 0x6000;
 static const uint16_t _BANKING_MODE_SELECT_LATCH_END = 0x8000;
 
+#ifdef GB_DEBUG_MODE
 static const char* _CARTRIDGE_TYPES[] = {
   "ROM ONLY",
   "MBC_1",
@@ -60,6 +66,7 @@ static const char* _CARTRIDGE_TYPES[] = {
   "0x21 UNKNOWN",
   "MBC7+SENSOR+RUMBLE+RAM+BATTERY"
 };
+#endif
 
 static const uint8_t _RAM_SIZES[] = {
   0,
@@ -82,18 +89,32 @@ static Result ReadRomFile(const char* const filename,
   fseek(fp, 0, SEEK_END);
   uint32_t rom_size = ftell(fp);
   rewind(fp);
-  cartridge->data = (uint8_t*)malloc(rom_size);
-  if (cartridge->data == NULL) {
-    cartridge->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+  cartridge->rom = CowBlockCreate(cartridge->global_ctx, rom_size);
+  if (cartridge->rom == NULL) {
+    fclose(fp);
     return RESULT_NOTOK;
   }
+  cartridge->data = cartridge->rom->data;
+  cartridge->rom_size = rom_size;
 
   size_t rom_read = fread(cartridge->data, rom_size, 1, fp);
+  fclose(fp);
   if (rom_read != 1) {
     cartridge->global_ctx->error = FAILED_TO_READ_ROM;
     return RESULT_NOTOK;
   }
-  fclose(fp);
+  return RESULT_OK;
+}
+
+
+// Validates the header of the loaded ROM and sets up the MBC and RAM it
+// asks for.
+static Result ParseRom(Cartridge* const cartridge) {
+  uint32_t rom_size = cartridge->rom_size;
+  if (rom_size < _ROM_HEADER_END) {
+    cartridge->global_ctx->error = FAILED_TO_READ_ROM;
+    return RESULT_NOTOK;
+  }
 
   uint8_t checksum = 0;
   for (uint16_t i = 0x0134; i < 0x014D; ++i) {
@@ -107,6 +128,20 @@ static Result ReadRomFile(const char* const filename,
     return RESULT_NOTOK;
   }
 
+  // Reads go straight into the image, so it must hold every bank the header
+  // declares, and at least the two that are always mapped.
+  if (header->rom_size > _ROM_SIZE_CODE_MAX ||
+      rom_size < (uint32_t)(_ROM_BANK_N_END << header->rom_size)) {
+    cartridge->global_ctx->error = FAILED_TO_READ_ROM;
+    return RESULT_NOTOK;
+  }
+  cartridge->rom_bank_mask = (2u << header->rom_size) - 1;
+
+  // Cartridges without the CGB flag run in DMG mode, with DMG palettes and
+  // without the CGB-only banks and registers.
+  cartridge->global_ctx->mode = header->gbc_flag & 0x80 ? GB_MODE_GBC
+                                                        : GB_MODE_DMG;
+
   // Done for brevity's sake.
   uint8_t ct = header->cartridge_type;
   if (ct == 0 || ct == 0x08 || ct == 0x09) {
@@ -133,20 +168,15 @@ static Result ReadRomFile(const char* const filename,
 
   // The MBC_2 is marked as having no external RAM, though it does have 512
   // half bytes (4 bit memory slots) built into the chip.
-  if (header->ram_size > 1) {
-    cartridge->ram = (uint8_t*)malloc(_RAM_SIZES[header->ram_size] * 1024);
-    if (cartridge->ram == NULL) {
-      cartridge->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
-      return RESULT_NOTOK;
-    }
+  if (header->ram_size > 1 && header->ram_size < sizeof(_RAM_SIZES)) {
+    cartridge->ram_size = _RAM_SIZES[header->ram_size] * 1024;
   }
   else if (cartridge->mbc.type == MBC_2) {
-    cartridge->ram = (uint8_t*)malloc(512);
-    if (cartridge->ram == NULL) {
-      cartridge->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
-      return RESULT_NOTOK;
-    }
+    cartridge->ram_size = 512;
   }
+  // Cleared so runs from the same ROM always start from the same state.
+  CowMemoryInit(&cartridge->ram, cartridge->global_ctx, cartridge->ram_size);
+  cartridge->rom_hash = Hash64(cartridge->data, cartridge->rom_size, 0);
 
   #ifdef GB_DEBUG_MODE
     printf("Game Title: %s\n", header->title);
@@ -161,7 +191,9 @@ static Result ReadRomFile(const char* const filename,
     printf("Destination Code: %s\n", header->destination_code == 0 ? "Japan" : "Overseas");
     printf("Old Licensee Code: %02x\n", header->old_licensee_code);
     printf("ROM Version: %d\n\n", header->rom_version);
-    Disassemble(filename);
+    if (cartridge->filename != NULL) {
+      Disassemble(cartridge->filename);
+    }
   #endif
   return RESULT_OK;
 }
@@ -177,10 +209,49 @@ Cartridge* CartridgeCreate(GlobalCtx* const global_ctx,
 
   cartridge->global_ctx = global_ctx;
   cartridge->filename = filename;
+  cartridge->rom = NULL;
+  cartridge->data = NULL;
+  cartridge->rom_size = 0;
+  cartridge->rom_bank_mask = 0;
+  CowMemoryInit(&cartridge->ram, global_ctx, 0);
+  cartridge->ram_size = 0;
+  MemBankControllerInit(&cartridge->mbc);
+
+  if (ReadRomFile(cartridge->filename, cartridge) == RESULT_NOTOK ||
+      ParseRom(cartridge) == RESULT_NOTOK) {
+    CartridgeDestroy(cartridge);
+    return NULL;
+  }
+  return cartridge;
+}
+
+
+Cartridge* CartridgeCreateFromBuffer(GlobalCtx* const global_ctx,
+                                     const uint8_t* const rom, size_t size) {
+  Cartridge* cartridge = (Cartridge*)malloc(sizeof(Cartridge));
+  if (cartridge == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+
+  cartridge->global_ctx = global_ctx;
+  cartridge->filename = NULL;
+  cartridge->data = NULL;
+  cartridge->rom_size = size;
+  cartridge->rom_bank_mask = 0;
+  CowMemoryInit(&cartridge->ram, global_ctx, 0);
+  cartridge->ram_size = 0;
   MemBankControllerInit(&cartridge->mbc);
 
-  Result result = ReadRomFile(cartridge->filename, cartridge);
-  if (result == RESULT_NOTOK) {
+  cartridge->rom = CowBlockCreate(global_ctx, size);
+  if (cartridge->rom == NULL) {
+    CartridgeDestroy(cartridge);
+    return NULL;
+  }
+  cartridge->data = cartridge->rom->data;
+  memcpy(cartridge->data, rom, size);
+
+  if (ParseRom(cartridge) == RESULT_NOTOK) {
     CartridgeDestroy(cartridge);
     return NULL;
   }
@@ -188,16 +259,37 @@ Cartridge* CartridgeCreate(GlobalCtx* const global_ctx,
 }
 
 
+Cartridge* CartridgeFork(Cartridge* const parent, GlobalCtx* const global_ctx) {
+  Cartridge* cartridge = (Cartridge*)malloc(sizeof(Cartridge));
+  if (cartridge == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  cartridge->global_ctx = global_ctx;
+  cartridge->filename = parent->filename;
+  cartridge->mbc = parent->mbc;
+  cartridge->rom = CowBlockRetain(parent->rom);
+  cartridge->data = parent->data;
+  cartridge->rom_size = parent->rom_size;
+  cartridge->rom_bank_mask = parent->rom_bank_mask;
+  cartridge->rom_hash = parent->rom_hash;
+  CowMemoryInit(&cartridge->ram, global_ctx, 0);
+  CowMemoryShare(&cartridge->ram, &parent->ram);
+  cartridge->ram_size = parent->ram_size;
+  return cartridge;
+}
+
+
 void CartridgeDestroy(Cartridge* cart) {
   if (cart == NULL) {
     return;
   }
   cart->global_ctx = NULL;
   cart->filename = NULL;
-  free(cart->data);
+  CowBlockRelease(cart->rom);
+  cart->rom = NULL;
   cart->data = NULL;
-  free(cart->ram);
-  cart->ram = NULL;
+  CowMemoryDestroy(&cart->ram);
   free(cart);
   cart = NULL;
 }
@@ -209,8 +301,11 @@ uint8_t CartridgeRead(const Cartridge* const cart, uint16_t addr) {
     return cart->data[addr];
   }
   if (addr < _ROM_BANK_N_END) {
-    // Read from ROM bank <mbc.rom_bank>.
-    return cart->data[cart->mbc.rom_bank * _ROM_BANK_SIZE + addr];
+    // Read from ROM bank <mbc.rom_bank>, wrapped to the banks there are.
+    // The bank is only 0 before the game selects one, when 1 is mapped.
+    size_t bank = cart->mbc.rom_bank > 0 ? cart->mbc.rom_bank : 1;
+    return cart->data[(bank & cart->rom_bank_mask) * _ROM_BANK_SIZE +
+                      (addr - _ROM_BANK_0_END)];
   }
   if (addr < _RAM_END) {
     // Read from RAM, which must be enabled.
@@ -220,25 +315,27 @@ uint8_t CartridgeRead(const Cartridge* const cart, uint16_t addr) {
       case MBC_NONE:
         // Not a valid option, as there are no known cartridges with RAM and
         // no MBC.
-        return cart->ram[addr - _RAM_BEGIN];
+        return CowRead(&cart->ram, addr - _RAM_BEGIN);
 
       case MBC_1:
         // Read from RAM bank <mbc.ram_abnk_>.
-        return cart->ram[cart->mbc.ram_bank * _RAM_BANK_SIZE + (addr - _RAM_BEGIN)];
+        return CowRead(&cart->ram, cart->mbc.ram_bank * _RAM_BANK_SIZE +
+                                   (addr - _RAM_BEGIN));
 
       case MBC_2:
-        return cart->ram[addr - _RAM_BEGIN];
+        return CowRead(&cart->ram, addr - _RAM_BEGIN);
 
       case MBC_3:
         if (cart->mbc.banking_mode == RAM_BANKING) {
-          return cart->ram[cart->mbc.ram_bank * _RAM_BANK_SIZE + (addr - _RAM_BEGIN)];
+          return CowRead(&cart->ram, cart->mbc.ram_bank * _RAM_BANK_SIZE +
+                                   (addr - _RAM_BEGIN));
         }
         else if (cart->mbc.banking_mode == RTC_BANKING) {
           // In RTC Register select mode (RTC_BANKING), reading from this
           // address range takes whatever RTC register value was written.
           // In this implementation, the selected RTC register value will
           // always be written in ram[0].
-          return cart->ram[0];
+          return CowRead(&cart->ram, 0);
         }
         break;
 
@@ -343,20 +440,15 @@ Result CartridgeWrite(Cartridge* const cart, uint16_t addr,
           cart->mbc.banking_mode = RTC_BANKING;
           switch (data) {
             case 0x08:
-              cart->ram[0] = cart->mbc.rtc.seconds;
-              break;
+              return CowWrite(&cart->ram, 0, cart->mbc.rtc.seconds);
             case 0x09:
-              cart->ram[0] = cart->mbc.rtc.minutes;
-              break;
+              return CowWrite(&cart->ram, 0, cart->mbc.rtc.minutes);
             case 0x0A:
-              cart->ram[0] = cart->mbc.rtc.hours;
-              break;
+              return CowWrite(&cart->ram, 0, cart->mbc.rtc.hours);
             case 0x0B:
-              cart->ram[0] = cart->mbc.rtc.l_day_counter;
-              break;
+              return CowWrite(&cart->ram, 0, cart->mbc.rtc.l_day_counter);
             case 0x0C:
-              cart->ram[0] = cart->mbc.rtc.h_day_counter;
-              break;
+              return CowWrite(&cart->ram, 0, cart->mbc.rtc.h_day_counter);
           } // switch
         } // if
         return RESULT_OK;
@@ -409,8 +501,7 @@ Result CartridgeWrite(Cartridge* const cart, uint16_t addr,
         cart->global_ctx->error = ILLEGAL_WRITE_TO_MEMORY;
         return RESULT_NOTOK;
       }
-      cart->ram[addr - _RAM_BEGIN] = data;
-      return RESULT_OK;
+      return CowWrite(&cart->ram, addr - _RAM_BEGIN, data);
     }
 
     // Not entirely sure why you would want to write to these addresses in
@@ -418,12 +509,11 @@ Result CartridgeWrite(Cartridge* const cart, uint16_t addr,
     // the RTC registers, only read from again at this address. However, I
     // didn't find any information saying this area couldn't be written to.
     if (cart->mbc.type == MBC_3 && cart->mbc.banking_mode == RTC_BANKING) {
-      cart->ram[0] = data;
-      return RESULT_OK;
+      return CowWrite(&cart->ram, 0, data);
     }
 
-    cart->ram[cart->mbc.ram_bank * _RAM_BANK_SIZE + (addr - _RAM_BEGIN)] = data;
-    return RESULT_OK;
+    return CowWrite(&cart->ram, cart->mbc.ram_bank * _RAM_BANK_SIZE +
+                                (addr - _RAM_BEGIN), data);
   }
   // Code should never reach this point.
   return RESULT_NOTOK;
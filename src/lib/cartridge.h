@@ -1,9 +1,11 @@
 #ifndef CARTRIDGE_H
 #define CARTRIDGE_H
 
+#include "cow.h"
 #include "global.h"
 #include "mbc.h"
 
+#include "stddef.h"
 #include "stdint.h"
 
 
@@ -27,9 +29,18 @@ typedef struct CartridgeHeaderDef {
 
 typedef struct CartridgeDef {
   MemBankController mbc;
+  // NULL when created from a buffer.
   const char* filename;
+  // Shared by every fork of the cartridge, and never written.
+  CowBlock* rom;
   uint8_t* data;
-  uint8_t* ram;
+  size_t rom_size;
+  // Banks the header declares, less one. Bank numbers wrap around at it.
+  size_t rom_bank_mask;
+  // Hash64 of the ROM, which saved states are checked against.
+  uint64_t rom_hash;
+  CowMemory ram;
+  size_t ram_size;
   GlobalCtx* global_ctx;
 } Cartridge;
 
@@ -37,6 +48,13 @@ typedef struct CartridgeDef {
 Cartridge* CartridgeCreate(GlobalCtx* const global_ctx,
                            const char* const filename);
 
+// Copies the ROM, so the caller keeps ownership of rom.
+Cartridge* CartridgeCreateFromBuffer(GlobalCtx* const global_ctx,
+                                     const uint8_t* const rom, size_t size);
+
+// Copy of parent sharing its ROM, and its RAM until either side writes.
+Cartridge* CartridgeFork(Cartridge* const parent, GlobalCtx* const global_ctx);
+
 void CartridgeDestroy(Cartridge* cart);
 
 uint8_t CartridgeRead(const Cartridge* const cart, uint16_t addr);
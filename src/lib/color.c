@@ -0,0 +1,73 @@
+#include "color.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+
+
+#define _LUT_SIZE 0x8000
+#define _ENCODE_STEPS 1024
+
+static const double _PANEL_GAMMA = 2.2;
+
+// Channel mixing for COLOR_PROFILE_LCD, each row sums to one.
+static const double _LCD_MIX[3][3] = {
+  {13.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
+  {0.0, 12.0 / 16.0, 4.0 / 16.0},
+  {3.0 / 16.0, 2.0 / 16.0, 11.0 / 16.0}
+};
+
+static uint32_t _LUTS[COLOR_PROFILE_COUNT][_LUT_SIZE];
+static pthread_once_t _LUTS_ONCE = PTHREAD_ONCE_INIT;
+
+
+static uint32_t PackColor(uint32_t r, uint32_t g, uint32_t b) {
+  return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+
+static void BuildLuts(void) {
+  // Decoding and encoding curves are tabulated so building the tables
+  // doesn't need a pow() per entry.
+  double linear[32];
+  for (int i = 0; i < 32; ++i) {
+    linear[i] = pow(i / 31.0, _PANEL_GAMMA);
+  }
+  uint8_t encode[_ENCODE_STEPS + 1];
+  for (int i = 0; i <= _ENCODE_STEPS; ++i) {
+    encode[i] = (uint8_t)(pow((double)i / _ENCODE_STEPS, 1.0 / _PANEL_GAMMA) *
+                          255.0 + 0.5);
+  }
+
+  for (uint32_t color = 0; color < _LUT_SIZE; ++color) {
+    uint32_t channels[3] = {
+      color & 0x1F,
+      (color >> 5) & 0x1F,
+      (color >> 10) & 0x1F
+    };
+
+    _LUTS[COLOR_PROFILE_RAW][color] = PackColor(
+      (channels[0] << 3) | (channels[0] >> 2),
+      (channels[1] << 3) | (channels[1] >> 2),
+      (channels[2] << 3) | (channels[2] >> 2));
+
+    uint32_t mixed[3];
+    for (int out = 0; out < 3; ++out) {
+      double value = 0.0;
+      for (int in = 0; in < 3; ++in) {
+        value += _LCD_MIX[out][in] * linear[channels[in]];
+      }
+      mixed[out] = encode[(int)(value * _ENCODE_STEPS + 0.5)];
+    }
+    _LUTS[COLOR_PROFILE_LCD][color] = PackColor(mixed[0], mixed[1], mixed[2]);
+  }
+}
+
+
+const uint32_t* ColorLut(ColorProfile profile) {
+  pthread_once(&_LUTS_ONCE, BuildLuts);
+  if (profile >= COLOR_PROFILE_COUNT) {
+    profile = COLOR_PROFILE_RAW;
+  }
+  return _LUTS[profile];
+}
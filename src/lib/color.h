@@ -0,0 +1,22 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include <stdint.h>
+
+
+typedef enum ColorProfileDef {
+  // Straight expansion of each 5 bit channel to 8 bits.
+  COLOR_PROFILE_RAW = 0,
+  // Approximates the GBC panel: channels are mixed in linear light and
+  // re-encoded with a 2.2 gamma, which softens the oversaturated raw colors.
+  COLOR_PROFILE_LCD = 1,
+  COLOR_PROFILE_COUNT,
+} ColorProfile;
+
+
+// Returns a 32768 entry table mapping CGB RGB555 colors to ARGB8888 for the
+// given profile. Tables are built once per process on first use and are
+// read only afterwards, so they can be shared between threads and machines.
+const uint32_t* ColorLut(ColorProfile profile);
+
+#endif
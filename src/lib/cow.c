@@ -0,0 +1,153 @@
+#include "cow.h"
+
+#include "global.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Read by every page that was never written.
+static uint8_t _ZERO_PAGE[COW_PAGE_SIZE];
+
+
+CowBlock* CowBlockCreate(GlobalCtx* const global_ctx, size_t size) {
+  CowBlock* block = (CowBlock*)malloc(sizeof(CowBlock) + size);
+  if (block == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  atomic_init(&block->refs, 1);
+  block->size = size;
+  return block;
+}
+
+
+CowBlock* CowBlockRetain(CowBlock* const block) {
+  atomic_fetch_add_explicit(&block->refs, 1, memory_order_relaxed);
+  return block;
+}
+
+
+void CowBlockRelease(CowBlock* const block) {
+  if (block == NULL) {
+    return;
+  }
+  // The last owner has to see every other owner's writes before freeing.
+  if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) == 1) {
+    free(block);
+  }
+}
+
+
+static size_t PageSize(const CowMemory* const memory, size_t page) {
+  size_t offset = page << COW_PAGE_SHIFT;
+  return memory->size - offset < COW_PAGE_SIZE ? memory->size - offset
+                                               : COW_PAGE_SIZE;
+}
+
+
+// Drops every page, leaving them all reading zeroes.
+static void ReleasePages(CowMemory* const memory) {
+  for (size_t i = 0; i < COW_MAX_PAGES; ++i) {
+    CowBlockRelease(memory->blocks[i]);
+    memory->blocks[i] = NULL;
+    memory->pages[i] = _ZERO_PAGE;
+  }
+  memory->writable = 0;
+  memory->own = NULL;
+}
+
+
+void CowMemoryInit(CowMemory* const memory, GlobalCtx* const global_ctx,
+                   size_t size) {
+  memset(memory, 0, sizeof(CowMemory));
+  memory->global_ctx = global_ctx;
+  memory->size = size;
+  memory->page_count = (size + COW_PAGE_SIZE - 1) >> COW_PAGE_SHIFT;
+  // Pages past the end read as zeroes too, as banks a cartridge doesn't
+  // have may still be selected.
+  for (size_t i = 0; i < COW_MAX_PAGES; ++i) {
+    memory->pages[i] = _ZERO_PAGE;
+  }
+}
+
+
+void CowMemoryDestroy(CowMemory* const memory) {
+  ReleasePages(memory);
+  memory->global_ctx = NULL;
+}
+
+
+void CowMemoryClear(CowMemory* const memory) {
+  uint32_t all = memory->page_count < 32 ? (1u << memory->page_count) - 1
+                                         : 0xFFFFFFFF;
+  if (memory->page_count > 0 && memory->writable == all) {
+    // Keeps pointers handed out by CowMemoryUnshare valid.
+    memset(memory->own->data, 0, memory->size);
+    return;
+  }
+  ReleasePages(memory);
+}
+
+
+void CowMemoryShare(CowMemory* const memory, CowMemory* const source) {
+  ReleasePages(memory);
+  memory->size = source->size;
+  memory->page_count = source->page_count;
+  for (size_t i = 0; i < source->page_count; ++i) {
+    memory->pages[i] = source->pages[i];
+    memory->blocks[i] = source->blocks[i];
+    if (memory->blocks[i] != NULL) {
+      CowBlockRetain(memory->blocks[i]);
+    }
+  }
+  // own is now referenced from both sides, so neither may write it.
+  source->writable = 0;
+  source->own = NULL;
+}
+
+
+Result CowMemoryUnsharePage(CowMemory* const memory, size_t page) {
+  if (page >= memory->page_count) {
+    memory->global_ctx->error = ILLEGAL_WRITE_TO_MEMORY;
+    return RESULT_NOTOK;
+  }
+  if (memory->own == NULL) {
+    memory->own = CowBlockCreate(memory->global_ctx,
+                                 memory->page_count << COW_PAGE_SHIFT);
+    if (memory->own == NULL) {
+      return RESULT_NOTOK;
+    }
+    // The creating reference is given up, so only pages hold one.
+    atomic_store_explicit(&memory->own->refs, 0, memory_order_relaxed);
+  }
+  uint8_t* copy = memory->own->data + (page << COW_PAGE_SHIFT);
+  memcpy(copy, memory->pages[page], PageSize(memory, page));
+  CowBlockRelease(memory->blocks[page]);
+  memory->blocks[page] = CowBlockRetain(memory->own);
+  memory->pages[page] = copy;
+  memory->writable |= 1u << page;
+  return RESULT_OK;
+}
+
+
+uint8_t* CowMemoryUnshare(CowMemory* const memory) {
+  for (size_t i = 0; i < memory->page_count; ++i) {
+    if (!(memory->writable & (1u << i)) &&
+        CowMemoryUnsharePage(memory, i) == RESULT_NOTOK) {
+      return NULL;
+    }
+  }
+  return memory->page_count > 0 ? memory->own->data : NULL;
+}
+
+
+void CowMemoryCopy(const CowMemory* const memory, uint8_t* const out) {
+  for (size_t i = 0; i < memory->page_count; ++i) {
+    memcpy(out + (i << COW_PAGE_SHIFT), memory->pages[i],
+           PageSize(memory, i));
+  }
+}
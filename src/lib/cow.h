@@ -0,0 +1,92 @@
+#ifndef COW_H
+#define COW_H
+
+#include "global.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COW_PAGE_SHIFT 12
+#define COW_PAGE_SIZE (1 << COW_PAGE_SHIFT)
+// Enough for 128 KiB, the largest cartridge RAM.
+#define COW_MAX_PAGES 32
+
+
+// Reference counted storage, freed with its last reference. Blocks may be
+// read from any thread; only blocks with a single reference are written.
+typedef struct CowBlockDef {
+  atomic_uint refs;
+  size_t size;
+  uint8_t data[];
+} CowBlock;
+
+// Memory split into 4 KiB pages that machines forked from each other
+// share until one of them writes. Every page points into some block, or at
+// a shared page of zeroes before it's first written. Writing a page that
+// isn't this memory's alone copies it into own first, so forking only
+// copies the page table and untouched pages are never copied at all.
+typedef struct CowMemoryDef {
+  // Where each page reads from.
+  uint8_t* pages[COW_MAX_PAGES];
+  // Block holding each page, with a reference per page. NULL for zeroes.
+  CowBlock* blocks[COW_MAX_PAGES];
+  // Set bits are pages in own, which nothing else references.
+  uint32_t writable;
+  // Block written pages are copied into, at their offset, or NULL.
+  CowBlock* own;
+  size_t size;
+  size_t page_count;
+  GlobalCtx* global_ctx;
+} CowMemory;
+
+
+// Returns a block with one reference, or NULL.
+CowBlock* CowBlockCreate(GlobalCtx* const global_ctx, size_t size);
+
+CowBlock* CowBlockRetain(CowBlock* const block);
+
+void CowBlockRelease(CowBlock* const block);
+
+// Starts out all zeroes, without allocating.
+void CowMemoryInit(CowMemory* const memory, GlobalCtx* const global_ctx,
+                   size_t size);
+
+void CowMemoryDestroy(CowMemory* const memory);
+
+// Back to all zeroes. Memory that is entirely its own is cleared in place.
+void CowMemoryClear(CowMemory* const memory);
+
+// Makes memory share every page of source, dropping what it held. Neither
+// writes a shared page in place from then on.
+void CowMemoryShare(CowMemory* const memory, CowMemory* const source);
+
+// Gives the page a private copy. Called by CowWrite. Pages past the end
+// can't be written.
+Result CowMemoryUnsharePage(CowMemory* const memory, size_t page);
+
+// Unshares every page, which leaves all of the memory contiguous in own.
+// Returns a pointer to it, valid until the memory is next shared or
+// cleared, or NULL on failure or if the memory is empty.
+uint8_t* CowMemoryUnshare(CowMemory* const memory);
+
+// Gathers the memory into out, which holds size bytes.
+void CowMemoryCopy(const CowMemory* const memory, uint8_t* const out);
+
+static inline uint8_t CowRead(const CowMemory* const memory, size_t offset) {
+  return memory->pages[offset >> COW_PAGE_SHIFT][offset &
+                                                 (COW_PAGE_SIZE - 1)];
+}
+
+static inline Result CowWrite(CowMemory* const memory, size_t offset,
+                              uint8_t data) {
+  size_t page = offset >> COW_PAGE_SHIFT;
+  if (!(memory->writable & (1u << page)) &&
+      CowMemoryUnsharePage(memory, page) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  memory->pages[page][offset & (COW_PAGE_SIZE - 1)] = data;
+  return RESULT_OK;
+}
+
+#endif
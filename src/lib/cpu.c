@@ -1,6 +1,8 @@
 #include "cpu.h"
 
+#include "apu.h"
 #include "instruction.h"
+#include "ppu.h"
 #include "timer.h"
 
 #include <pthread.h>
@@ -45,6 +47,8 @@ void CpuInit(Cpu* const cpu) {
   cpu->pc = 0x0100;
   cpu->sp = 0xFFFE;
   cpu->interrupt_master_enable = 0;
+  cpu->ime_pending = 0;
+  cpu->cb_prefix = 0;
 }
 
 
@@ -91,41 +95,26 @@ void CpuInit(Cpu* const cpu) {
 
 
   static void PrintSerialDebug(Cpu* const cpu) {
-    static char dbg_msg[1024] = {0};
-    static int msg_size = 0;
-    if (cpu->bus->serial_data[1] == 0x81) {
-      printf("DBG: Byte received\n");
-      char c = (char)cpu->bus->serial_data[0];
-      printf("DBG: %c\n", c);
-      dbg_msg[msg_size++] = c;
-      cpu->bus->serial_data[1] = 0;
-    }
-
-    if (dbg_msg[0]) {
-      printf("DBG: Message size: %d\n", msg_size);
-      printf("DBG: %s\n", dbg_msg);
+    if (cpu->bus->serial_out_size > 0) {
+      printf("DBG: Message size: %zu\n", cpu->bus->serial_out_size);
+      printf("DBG: %s\n", cpu->bus->serial_out);
     }
   }
 #endif
 
 
-void RequestInterrupt(InterruptType it, uint8_t *const interrupts_flag) {
-  switch(it) {
-    case INTERRUPT_VBANK:
-      *interrupts_flag |= 0x01;
-      break;
-    case INTERRUPT_STAT:
-      *interrupts_flag |= 0x02;
-      break;
-    case INTERRUPT_TIMER:
-      *interrupts_flag |= 0x04;
-      break;
-    case INTERRUPT_SERIAL:
-      *interrupts_flag |= 0x08;
-      break;
-    case INTERRUPT_JOYPAD:
-      *interrupts_flag |= 0x10;
-      break;
+// Advances every component clocked alongside the CPU. Callers hold the
+// interrupt mutex.
+static void Tick(Cpu* const cpu, int cycles) {
+  cpu->global_ctx->clock += cycles;
+  int machine_cycles = cycles / 4;
+  for (int i = 0; i < machine_cycles; ++i) {
+    TimerTick(&cpu->bus->timer, &cpu->bus->interrupts_flag);
+  }
+  ApuTick(&cpu->bus->apu, cpu->bus->timer.div, cycles);
+  PpuTick(&cpu->bus->ppu, &cpu->bus->interrupts_flag, cycles);
+  if (cpu->bus->serial_bits > 0) {
+    BusSerialTick(cpu->bus, cycles);
   }
 }
 
@@ -170,10 +159,7 @@ static void HandleInterrupt(Cpu* const cpu) {
   BusWrite(cpu->bus, --cpu->sp, lo);
   cpu->pc = interrupt;
 
-  cpu->global_ctx->clock += 20;
-  for (int i = 0; i < 5; ++i) {
-    TimerTick(&cpu->bus->timer, &cpu->bus->interrupts_flag);
-  }
+  Tick(cpu, 20);
 }
 
 
@@ -267,16 +253,23 @@ static void UpdateFlagsRegister(Cpu* const cpu) {
 }
 
 
-static void Halt(Cpu* const cpu) {
+// Steps a halted CPU. The timer and PPU are clocked from this thread, so
+// they have to keep ticking while halted or no interrupt would ever arrive,
+// and each step ticks 4 cycles so whoever runs the machine can stop it in
+// between. Returns 0 once an interrupt is pending and the CPU wakes, to
+// go on with the step and service it if IME is set.
+static int Halted(Cpu* const cpu) {
   pthread_mutex_lock(&cpu->global_ctx->interrupt_mtx);
-  while (!(cpu->interrupt_master_enable &&
-          (cpu->bus->interrupts_enable_reg &
-           cpu->bus->interrupts_flag) != 0)) {
-    pthread_cond_wait(&cpu->global_ctx->interrupt_write,
-                      &cpu->global_ctx->interrupt_mtx);
+  int pending = (cpu->bus->interrupts_enable_reg &
+                 cpu->bus->interrupts_flag & 0x1F) != 0;
+  if (pending) {
+    cpu->global_ctx->status = STATUS_RUNNING;
+  }
+  else {
+    Tick(cpu, 4);
   }
-  HandleInterrupt(cpu);
   pthread_mutex_unlock(&cpu->global_ctx->interrupt_mtx);
+  return !pending;
 }
 
 
@@ -1096,14 +1089,16 @@ static void Reset(Cpu* const cpu, const Instruction* const instr) {
 
 
 void CpuStep(Cpu* const cpu) {
-  static uint8_t cb_prefix = 0;
-  static uint8_t cpu_ime_enable = 0;
   uint8_t tmp = 0;
 
+  if (cpu->global_ctx->status == STATUS_HALT && Halted(cpu)) {
+    return;
+  }
+
   // Check Interrupts.
-  if (cpu_ime_enable) {
+  if (cpu->ime_pending) {
     cpu->interrupt_master_enable = 1;
-    cpu_ime_enable = 0;
+    cpu->ime_pending = 0;
   }
   pthread_mutex_lock(&cpu->global_ctx->interrupt_mtx);
   if (cpu->interrupt_master_enable &&
@@ -1117,12 +1112,12 @@ void CpuStep(Cpu* const cpu) {
 
   // Decode.
   Instruction instr;
-  if (!cb_prefix) {
+  if (!cpu->cb_prefix) {
     instr = _INSTRUCTION_MAP[opcode];
   }
   else {
     instr = _CB_INSTRUCTION_MAP[opcode];
-    cb_prefix = 0;
+    cpu->cb_prefix = 0;
   }
 
   #ifdef GB_DEBUG_MODE
@@ -1141,8 +1136,6 @@ void CpuStep(Cpu* const cpu) {
       break;
     case OP_HALT:
       cpu->global_ctx->status = STATUS_HALT;
-      Halt(cpu);
-      cpu->global_ctx->status = STATUS_RUNNING;
       break;
     case OP_LD:
       Load(cpu, &instr);
@@ -1175,18 +1168,18 @@ void CpuStep(Cpu* const cpu) {
       Return(cpu, &instr);
       break;
     case OP_RETI:
-      cpu_ime_enable = 1;
+      cpu->ime_pending = 1;
       Return(cpu, &instr);
       break;
     case OP_RST:
       Restart(cpu, &instr);
       break;
     case OP_DI:
-      cpu_ime_enable = 0;
+      cpu->ime_pending = 0;
       cpu->interrupt_master_enable = 0;
       break;
     case OP_EI:
-      cpu_ime_enable = 1;
+      cpu->ime_pending = 1;
       break;
     case OP_ADD:
       Add(cpu, &instr, /*carry=*/0);
@@ -1245,7 +1238,7 @@ void CpuStep(Cpu* const cpu) {
       Rotate(cpu, &instr, RIGHT, /*carry=*/1);
       break;
     case OP_CB:
-      cb_prefix = 1;
+      cpu->cb_prefix = 1;
       break;
     case OP_RLC:
       Rotate(cpu, &instr, LEFT, /*carry=*/0);
@@ -1286,11 +1279,7 @@ void CpuStep(Cpu* const cpu) {
     default:
       __builtin_unreachable();
   }
-  cpu->global_ctx->clock += instr.cycles;
-  int machine_cycles = instr.cycles / 4;
   pthread_mutex_lock(&cpu->global_ctx->interrupt_mtx);
-  for (int i = 0; i < machine_cycles; ++i) {
-    TimerTick(&cpu->bus->timer, &cpu->bus->interrupts_flag);
-  }
+  Tick(cpu, instr.cycles);
   pthread_mutex_unlock(&cpu->global_ctx->interrupt_mtx);
 }
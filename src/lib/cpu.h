@@ -34,6 +34,10 @@ typedef struct CpuDef {
   uint16_t pc;
   uint16_t sp;
   int interrupt_master_enable;
+  // EI takes effect after the following instruction.
+  uint8_t ime_pending;
+  // The previous opcode was 0xCB.
+  uint8_t cb_prefix;
 } Cpu;
 
 
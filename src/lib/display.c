@@ -0,0 +1,131 @@
+#include "display.h"
+
+#include "global.h"
+#include "ppu.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+
+Display* DisplayCreate(GlobalCtx* const global_ctx, int scale, int vsync) {
+  Display* display = (Display*)malloc(sizeof(Display));
+  if (display == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  display->global_ctx = global_ctx;
+  display->renderer = NULL;
+  display->texture = NULL;
+
+  display->window = SDL_CreateWindow(
+    /*title=*/"gbemu",
+    /*x=*/0,
+    /*y=*/0,
+    /*width=*/PPU_SCREEN_WIDTH * scale,
+    /*height=*/PPU_SCREEN_HEIGHT * scale,
+    /*flags=*/SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE
+  );
+  if (display->window == NULL) {
+    global_ctx->error = SDL_WINDOW_CREATION_FAILED;
+    DisplayDestroy(display);
+    return NULL;
+  }
+
+  uint32_t flags = SDL_RENDERER_ACCELERATED;
+  if (vsync) {
+    flags |= SDL_RENDERER_PRESENTVSYNC;
+  }
+  display->renderer = SDL_CreateRenderer(display->window, -1, flags);
+  if (display->renderer == NULL) {
+    global_ctx->error = SDL_RENDERER_CREATION_FAILED;
+    DisplayDestroy(display);
+    return NULL;
+  }
+
+  // ARGB8888 matches the framebuffer layout, so rows upload with a memcpy.
+  display->texture = SDL_CreateTexture(
+    display->renderer,
+    SDL_PIXELFORMAT_ARGB8888,
+    SDL_TEXTUREACCESS_STREAMING,
+    PPU_SCREEN_WIDTH,
+    PPU_SCREEN_HEIGHT
+  );
+  if (display->texture == NULL) {
+    global_ctx->error = SDL_TEXTURE_CREATION_FAILED;
+    DisplayDestroy(display);
+    return NULL;
+  }
+  SDL_SetRenderDrawColor(display->renderer, 0, 0, 0, 0xFF);
+  return display;
+}
+
+
+void DisplayDestroy(Display* display) {
+  if (display == NULL) {
+    return;
+  }
+  if (display->texture != NULL) {
+    SDL_DestroyTexture(display->texture);
+  }
+  if (display->renderer != NULL) {
+    SDL_DestroyRenderer(display->renderer);
+  }
+  if (display->window != NULL) {
+    SDL_DestroyWindow(display->window);
+  }
+  display->global_ctx = NULL;
+  free(display);
+  display = NULL;
+}
+
+
+static SDL_Rect LetterboxRect(Display* const display) {
+  int width = 0;
+  int height = 0;
+  SDL_GetRendererOutputSize(display->renderer, &width, &height);
+
+  int scale = width / PPU_SCREEN_WIDTH;
+  if (height / PPU_SCREEN_HEIGHT < scale) {
+    scale = height / PPU_SCREEN_HEIGHT;
+  }
+  if (scale < 1) {
+    scale = 1;
+  }
+
+  SDL_Rect rect = {
+    .x = (width - PPU_SCREEN_WIDTH * scale) / 2,
+    .y = (height - PPU_SCREEN_HEIGHT * scale) / 2,
+    .w = PPU_SCREEN_WIDTH * scale,
+    .h = PPU_SCREEN_HEIGHT * scale
+  };
+  return rect;
+}
+
+
+void DisplayPresent(Display* const display, const uint32_t* const frame) {
+  if (frame != NULL) {
+    void* pixels = NULL;
+    int pitch = 0;
+    if (SDL_LockTexture(display->texture, NULL, &pixels, &pitch) == 0) {
+      size_t row_size = PPU_SCREEN_WIDTH * sizeof(uint32_t);
+      if ((size_t)pitch == row_size) {
+        memcpy(pixels, frame, row_size * PPU_SCREEN_HEIGHT);
+      }
+      else {
+        for (int y = 0; y < PPU_SCREEN_HEIGHT; ++y) {
+          memcpy((uint8_t*)pixels + y * pitch, frame + y * PPU_SCREEN_WIDTH,
+                 row_size);
+        }
+      }
+      SDL_UnlockTexture(display->texture);
+    }
+  }
+
+  SDL_Rect rect = LetterboxRect(display);
+  SDL_RenderClear(display->renderer);
+  SDL_RenderCopy(display->renderer, display->texture, NULL, &rect);
+  SDL_RenderPresent(display->renderer);
+}
@@ -0,0 +1,30 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+
+// Presents frames through a streaming texture. Frames are written straight
+// into the locked texture and scaled by the largest integer factor that
+// fits the window, with the remainder letterboxed.
+typedef struct DisplayDef {
+  SDL_Window* window;
+  SDL_Renderer* renderer;
+  SDL_Texture* texture;
+  GlobalCtx* global_ctx;
+} Display;
+
+
+Display* DisplayCreate(GlobalCtx* const global_ctx, int scale, int vsync);
+
+void DisplayDestroy(Display* display);
+
+// Uploads frame, when not NULL, and presents the texture. Blocks until the
+// next refresh when created with vsync.
+void DisplayPresent(Display* const display, const uint32_t* const frame);
+
+#endif
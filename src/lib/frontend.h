@@ -0,0 +1,26 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include "ring.h"
+
+#include <stdint.h>
+
+
+// Connects a running Gameboy to the host. The core never touches a window
+// or an audio device itself, so it builds and runs without SDL and can be
+// driven by any presenter.
+typedef struct FrontendDef {
+  void* data;
+  // Handles host events on the main thread. Returns 0 once the user asked
+  // to quit.
+  int (*poll)(void* const data);
+  // Shows a finished frame of PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT pixels.
+  void (*present)(void* const data, const uint32_t* const frame);
+  // Buttons the host holds, laid out as Bus buttons. Read after every
+  // poll. NULL when the host has no input.
+  uint8_t (*buttons)(void* const data);
+  // Ring the APU pushes samples into, or NULL to discard them.
+  RingBuffer* audio;
+} Frontend;
+
+#endif
@@ -0,0 +1,121 @@
+#include "frontend_sdl.h"
+
+#include "audio.h"
+#include "display.h"
+#include "frontend.h"
+#include "global.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <SDL2/SDL.h>
+
+
+// Indexed by button bit: Right, Left, Up, Down, A, B, Select, Start.
+static const SDL_Keycode _BUTTON_KEYS[8] = {
+  SDLK_RIGHT, SDLK_LEFT, SDLK_UP, SDLK_DOWN,
+  SDLK_x, SDLK_z, SDLK_BACKSPACE, SDLK_RETURN
+};
+
+
+static int SdlFrontendPoll(void* const data) {
+  SdlFrontend* const sdl = (SdlFrontend*)data;
+  SDL_Event event;
+  int open = 1;
+  // Sleep until there is input or it's time to look for a new frame,
+  // rather than spinning on the event queue.
+  if (SDL_WaitEventTimeout(&event, 1)) {
+    do {
+      if (event.type == SDL_QUIT) {
+        open = 0;
+      }
+      if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) &&
+          !event.key.repeat) {
+        for (int i = 0; i < 8; ++i) {
+          if (event.key.keysym.sym != _BUTTON_KEYS[i]) {
+            continue;
+          }
+          if (event.type == SDL_KEYDOWN) {
+            sdl->buttons |= 1 << i;
+          }
+          else {
+            sdl->buttons &= ~(1 << i);
+          }
+        }
+      }
+    } while (SDL_PollEvent(&event));
+  }
+  return open;
+}
+
+
+static uint8_t SdlFrontendButtons(void* const data) {
+  return ((SdlFrontend*)data)->buttons;
+}
+
+
+static void SdlFrontendPresent(void* const data, const uint32_t* const frame) {
+  SdlFrontend* const sdl = (SdlFrontend*)data;
+  DisplayPresent(sdl->display, frame);
+}
+
+
+SdlFrontend* SdlFrontendCreate(GlobalCtx* const global_ctx, int scale,
+                               int vsync, int audio) {
+  SdlFrontend* sdl = (SdlFrontend*)malloc(sizeof(SdlFrontend));
+  if (sdl == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  sdl->display = NULL;
+  sdl->audio = NULL;
+  sdl->buttons = 0;
+  sdl->global_ctx = global_ctx;
+  sdl->frontend = (Frontend){
+    .data = sdl,
+    .poll = SdlFrontendPoll,
+    .present = SdlFrontendPresent,
+    .buttons = SdlFrontendButtons,
+    .audio = NULL
+  };
+
+  uint32_t subsystems = SDL_INIT_VIDEO;
+  if (audio) {
+    subsystems |= SDL_INIT_AUDIO;
+  }
+  if (SDL_Init(subsystems) < 0) {
+    global_ctx->error = SDL_INIT_ERROR;
+    free(sdl);
+    return NULL;
+  }
+
+  sdl->display = DisplayCreate(global_ctx, scale > 0 ? scale : 4, vsync);
+  if (sdl->display == NULL) {
+    SdlFrontendDestroy(sdl);
+    return NULL;
+  }
+  if (audio) {
+    sdl->audio = AudioCreate(global_ctx);
+    if (sdl->audio == NULL) {
+      SdlFrontendDestroy(sdl);
+      return NULL;
+    }
+    sdl->frontend.audio = sdl->audio->ring;
+  }
+  return sdl;
+}
+
+
+void SdlFrontendDestroy(SdlFrontend* sdl) {
+  if (sdl == NULL) {
+    return;
+  }
+  AudioDestroy(sdl->audio);
+  DisplayDestroy(sdl->display);
+  SDL_Quit();
+  sdl->audio = NULL;
+  sdl->display = NULL;
+  sdl->global_ctx = NULL;
+  free(sdl);
+  sdl = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef FRONTEND_SDL_H
+#define FRONTEND_SDL_H
+
+#include "audio.h"
+#include "display.h"
+#include "frontend.h"
+#include "global.h"
+
+
+// Window and speakers through SDL.
+typedef struct SdlFrontendDef {
+  Frontend frontend;
+  Display* display;
+  // NULL when created without audio.
+  Audio* audio;
+  // Held buttons, from the arrows, X (A), Z (B), Backspace (Select) and
+  // Enter (Start).
+  uint8_t buttons;
+  GlobalCtx* global_ctx;
+} SdlFrontend;
+
+
+SdlFrontend* SdlFrontendCreate(GlobalCtx* const global_ctx, int scale,
+                               int vsync, int audio);
+
+void SdlFrontendDestroy(SdlFrontend* sdl);
+
+#endif
@@ -1,17 +1,35 @@
 #include "gb.h"
 
+#include "apu.h"
 #include "bus.h"
 #include "cartridge.h"
+#include "cow.h"
 #include "cpu.h"
+#include "frontend.h"
 #include "global.h"
+#include "ppu.h"
+#include "ring.h"
+#include "state.h"
+#include "triple_buffer.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <pthread.h>
-#include <SDL2/SDL.h>
+#include <sched.h>
 
 
-Result GameboyInit(Gameboy* const gb, const char* const romfile) {
+#define _LOG_BATCH 256
+
+// Cycles in one frame of the LCD.
+static const unsigned int _FRAME_CYCLES = 70224;
+// Inline rendering drains the log well before the CPU would wait on it.
+static const size_t _INLINE_DRAIN_THRESHOLD = 1 << 12;
+
+
+static void InitContext(Gameboy* const gb) {
   *gb->global_ctx = (GlobalCtx){
     .mode = GB_MODE_GBC,
     .error = NO_ERROR,
@@ -19,40 +37,90 @@ Result GameboyInit(Gameboy* const gb, const char* const romfile) {
     .clock = 0
   };
   pthread_mutex_init(&gb->global_ctx->interrupt_mtx, NULL);
-  pthread_cond_init(&gb->global_ctx->interrupt_write, NULL);
+  gb->cartridge = NULL;
+  gb->bus = NULL;
+  gb->renderer = NULL;
+  gb->frames = NULL;
+  gb->power_on = NULL;
+}
 
-  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-    gb->global_ctx->error = SDL_VIDEO_INIT_ERROR;
-    return RESULT_NOTOK;
-  }
 
-  gb->screen = SDL_CreateWindow(
-    /*title=*/"gbemu",
-    /*x=*/0,
-    /*y=*/0,
-    /*width=*/640,
-    /*height=*/480,
-    /*flags=*/SDL_WINDOW_SHOWN
-  );
-  if (gb->screen == NULL) {
-    gb->global_ctx->error = SDL_WINDOW_CREATION_FAILED;
-    return RESULT_NOTOK;
-  }
+// Records the state GameboyReset returns to.
+static void CapturePowerOn(Gameboy* const gb) {
+  memcpy(gb->power_on, gb->bus, sizeof(Bus));
+  gb->power_on_mbc = gb->cartridge->mbc;
+  gb->power_on_mode = gb->global_ctx->mode;
+}
 
-  gb->cartridge = CartridgeCreate(gb->global_ctx, romfile);
+
+// Builds the rest of the machine around gb->cartridge.
+static Result InitMachine(Gameboy* const gb) {
   if (gb->cartridge == NULL) {
     return RESULT_NOTOK;
   }
 
-  gb->bus = BusCreate(gb->global_ctx, gb->cartridge);
+  gb->bus = BusCreate(gb->global_ctx, gb->cartridge, gb->options.apu_mode);
   if (gb->bus == NULL) {
     return RESULT_NOTOK;
   }
+  gb->bus->ppu.logging = gb->options.render_mode != RENDER_MODE_NONE;
+
+  gb->renderer = PpuRendererCreate(gb->global_ctx);
+  if (gb->renderer == NULL) {
+    return RESULT_NOTOK;
+  }
+  PpuRendererSetColorProfile(gb->renderer, gb->options.color_profile);
 
   CpuInit(&gb->cpu);
   gb->cpu.global_ctx = gb->global_ctx;
   gb->cpu.bus = gb->bus;
   // TODO: Run boot ROM...
+
+  gb->power_on = (Bus*)malloc(sizeof(Bus));
+  if (gb->power_on == NULL) {
+    gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  CapturePowerOn(gb);
+  return RESULT_OK;
+}
+
+
+Result GameboyInit(Gameboy* const gb, const char* const romfile) {
+  InitContext(gb);
+  gb->cartridge = CartridgeCreate(gb->global_ctx, romfile);
+  return InitMachine(gb);
+}
+
+
+Result GameboyInitFromBuffer(Gameboy* const gb, const uint8_t* const rom,
+                             size_t size) {
+  InitContext(gb);
+  gb->cartridge = CartridgeCreateFromBuffer(gb->global_ctx, rom, size);
+  return InitMachine(gb);
+}
+
+
+Result GameboyFork(Gameboy* const gb, Gameboy* const parent) {
+  InitContext(gb);
+  // The child's power on image is the parent's, so build it in the mode the
+  // parent powered on in.
+  gb->global_ctx->mode = parent->power_on_mode;
+  gb->cartridge = CartridgeFork(parent->cartridge, gb->global_ctx);
+  if (InitMachine(gb) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  gb->power_on_mbc = parent->power_on_mbc;
+
+  BusFork(gb->bus, parent->bus);
+  gb->cpu = parent->cpu;
+  gb->cpu.bus = gb->bus;
+  gb->cpu.global_ctx = gb->global_ctx;
+  gb->global_ctx->mode = parent->global_ctx->mode;
+  gb->global_ctx->status = parent->global_ctx->status;
+  gb->global_ctx->clock = parent->global_ctx->clock;
+  PpuRendererSync(gb->renderer, &gb->bus->vram, gb->bus->oam,
+                  gb->bus->ppu.palette_ram);
   return RESULT_OK;
 }
 
@@ -61,23 +129,233 @@ void GameboyDestroy(Gameboy* const gb) {
   if (gb == NULL) {
     return;
   }
-  SDL_DestroyWindow(gb->screen);
-  SDL_Quit();
+  free(gb->power_on);
+  gb->power_on = NULL;
+  PpuRendererDestroy(gb->renderer);
+  TripleBufferDestroy(gb->frames);
   BusDestroy(gb->bus);
   CartridgeDestroy(gb->cartridge);
   pthread_mutex_destroy(&gb->global_ctx->interrupt_mtx);
-  pthread_cond_destroy(&gb->global_ctx->interrupt_write);
   gb->global_ctx = NULL;
 }
 
 
+void GameboyReset(Gameboy* const gb) {
+  PpuClearLog(&gb->bus->ppu);
+  // The image was taken of this same bus, so its pointers are still valid.
+  // Only where samples go and the link cable may have changed since. Memory
+  // isn't part of the image, as it holds nothing but zeroes at power on.
+  RingBuffer* output = gb->bus->apu.output;
+  CowMemory wram = gb->bus->wram;
+  CowMemory vram = gb->bus->vram;
+  Bus* link_next = gb->bus->link_next;
+  Bus* link_prev = gb->bus->link_prev;
+  memcpy(gb->bus, gb->power_on, sizeof(Bus));
+  gb->bus->apu.output = output;
+  gb->bus->link_next = link_next;
+  gb->bus->link_prev = link_prev;
+  gb->bus->wram = wram;
+  gb->bus->vram = vram;
+  CowMemoryClear(&gb->bus->wram);
+  CowMemoryClear(&gb->bus->vram);
+  ApuResync(&gb->bus->apu);
+
+  gb->cartridge->mbc = gb->power_on_mbc;
+  gb->global_ctx->mode = gb->power_on_mode;
+  gb->global_ctx->error = NO_ERROR;
+  gb->global_ctx->status = STATUS_RUNNING;
+  gb->global_ctx->clock = 0;
+  CpuInit(&gb->cpu);
+  PpuRendererSync(gb->renderer, &gb->bus->vram, gb->bus->oam,
+                  gb->bus->ppu.palette_ram);
+}
+
+
+// Puts cartridge in the machine in place of the current one.
+static Result SwapCartridge(Gameboy* const gb, Cartridge* const cartridge,
+                            GBMode mode) {
+  if (cartridge == NULL) {
+    // Parsing the header may have switched modes before it failed.
+    gb->global_ctx->mode = mode;
+    return RESULT_NOTOK;
+  }
+  CartridgeDestroy(gb->cartridge);
+  gb->cartridge = cartridge;
+  gb->bus->cartridge = cartridge;
+  // The post boot state depends on the cartridge's mode.
+  PpuClearLog(&gb->bus->ppu);
+  BusReset(gb->bus);
+  CapturePowerOn(gb);
+  GameboyReset(gb);
+  return RESULT_OK;
+}
+
+
+Result GameboyLoadRom(Gameboy* const gb, const char* const romfile) {
+  GBMode mode = gb->global_ctx->mode;
+  return SwapCartridge(gb, CartridgeCreate(gb->global_ctx, romfile), mode);
+}
+
+
+Result GameboyLoadRomFromBuffer(Gameboy* const gb, const uint8_t* const rom,
+                                size_t size) {
+  GBMode mode = gb->global_ctx->mode;
+  return SwapCartridge(
+      gb, CartridgeCreateFromBuffer(gb->global_ctx, rom, size), mode);
+}
+
+
+// Applies everything the CPU has logged so far. Returns the number of
+// entries applied.
+static size_t DrainRenderLog(Gameboy* const gb) {
+  PpuLogEntry entries[_LOG_BATCH];
+  size_t total = 0;
+  size_t count = 0;
+  do {
+    count = RingBufferPop(gb->bus->ppu.log, entries, _LOG_BATCH);
+    for (size_t i = 0; i < count; ++i) {
+      PpuRendererApply(gb->renderer, &entries[i]);
+    }
+    total += count;
+  } while (count == _LOG_BATCH);
+  return total;
+}
+
+
 static void* GameboyRunCpu(void* const gb_arg) {
   Gameboy* const gb = (Gameboy* const)gb_arg;
+  int inline_render = gb->options.render_mode == RENDER_MODE_INLINE;
+  unsigned int frames = gb->bus->ppu.frames;
 
   while(gb->global_ctx->error == NO_ERROR &&
         gb->global_ctx->status != STATUS_STOP) {
+    uint8_t held = (uint8_t)atomic_load_explicit(&gb->input,
+                                                 memory_order_relaxed);
+    if (held != gb->bus->buttons) {
+      BusSetButtons(gb->bus, held);
+    }
     CpuStep(&gb->cpu);
+    if (inline_render &&
+        (gb->bus->ppu.frames != frames ||
+         RingBufferSize(gb->bus->ppu.log) > _INLINE_DRAIN_THRESHOLD)) {
+      frames = gb->bus->ppu.frames;
+      DrainRenderLog(gb);
+    }
+  }
+  pthread_exit(NULL);
+}
+
+
+// Runs the frames past the real one on ahead, which starts where the real
+// machine is, and renders the last of them.
+static Result RunAheadFrames(Gameboy* const ahead, int render) {
+  RingBuffer* output = ahead->bus->apu.output;
+  ApuSetOutput(&ahead->bus->apu, NULL);
+  Result result = RESULT_OK;
+  for (unsigned int i = 0;
+       result == RESULT_OK && i < ahead->options.run_ahead; ++i) {
+    if (render && i + 1 == ahead->options.run_ahead) {
+      // Nothing was logged since the real frame started, so the renderer
+      // has to catch up before it draws.
+      PpuRendererSync(ahead->renderer, &ahead->bus->vram, ahead->bus->oam,
+                      ahead->bus->ppu.palette_ram);
+      ahead->bus->ppu.logging = 1;
+    }
+    result = GameboyRunFrame(ahead);
+  }
+  ahead->bus->ppu.logging = 0;
+  ApuSetOutput(&ahead->bus->apu, output);
+  return result;
+}
+
+
+// Forks the instance frames are run ahead on. It lives as long as the frame
+// loop, so forking happens once rather than every frame.
+static Result RunAheadCreate(Gameboy* const gb, Gameboy* const ahead) {
+  if (GameboyFork(ahead, gb) == RESULT_NOTOK) {
+    gb->global_ctx->error = ahead->global_ctx->error;
+    GameboyDestroy(ahead);
+    return RESULT_NOTOK;
+  }
+  PpuRendererSetOutput(ahead->renderer, gb->frames);
+  return RESULT_OK;
+}
+
+
+// Brings ahead to where the real machine is and runs ahead on it. Loading
+// copies into ahead's own memory, so the real machine keeps its pages.
+static void RunAheadSecondary(Gameboy* const gb, Gameboy* const ahead,
+                              uint8_t* const saved, size_t size, int render) {
+  if (StateSave(gb, saved, size) == RESULT_NOTOK) {
+    return;
+  }
+  ahead->global_ctx->error = NO_ERROR;
+  if (StateLoad(ahead, saved, size) == RESULT_NOTOK) {
+    return;
+  }
+  ahead->bus->ppu.logging = 0;
+  // Errors ahead stay with the secondary instance. The real machine meets
+  // them itself once it gets there.
+  RunAheadFrames(ahead, render);
+}
+
+
+// Frame loop of GameboyRun with run-ahead. Each pass runs a real frame,
+// which is heard but not seen, then the frames ahead of it, of which only
+// the last is seen, and goes back to where the real frame ended.
+static void* GameboyRunAhead(void* const gb_arg) {
+  Gameboy* const gb = (Gameboy* const)gb_arg;
+  GlobalCtx* const global_ctx = gb->global_ctx;
+  int render = gb->options.render_mode != RENDER_MODE_NONE;
+  int fork = gb->options.run_ahead_mode == RUN_AHEAD_FORK;
+  size_t size = StateSize(gb);
+  uint8_t* saved = (uint8_t*)malloc(size);
+  if (saved == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    pthread_exit(NULL);
+  }
+  GlobalCtx ahead_ctx;
+  Gameboy ahead = {.options = gb->options, .global_ctx = &ahead_ctx};
+  if (fork && RunAheadCreate(gb, &ahead) == RESULT_NOTOK) {
+    free(saved);
+    pthread_exit(NULL);
+  }
+
+  gb->bus->ppu.logging = 0;
+  while (global_ctx->error == NO_ERROR &&
+         global_ctx->status != STATUS_STOP && !atomic_load(&gb->quit)) {
+    uint8_t held = (uint8_t)atomic_load_explicit(&gb->input,
+                                                 memory_order_relaxed);
+    if (held != gb->bus->buttons) {
+      BusSetButtons(gb->bus, held);
+    }
+    if (GameboyRunFrame(gb) == RESULT_NOTOK) {
+      break;
+    }
+    if (fork) {
+      RunAheadSecondary(gb, &ahead, saved, size, render);
+    }
+    else if (StateSave(gb, saved, size) == RESULT_OK) {
+      RunAheadFrames(gb, render);
+      // As with the secondary instance, errors ahead are left for the real
+      // frames to meet.
+      global_ctx->error = NO_ERROR;
+      StateLoad(gb, saved, size);
+      // The load may have put back a status GameboyRun set to stop since,
+      // which nothing would wait on otherwise. GameboyRun sets quit first.
+      if (atomic_load(&gb->quit)) {
+        global_ctx->status = STATUS_STOP;
+      }
+    }
+  }
+  // Leave the renderer showing the real machine.
+  gb->bus->ppu.logging = render;
+  PpuRendererSync(gb->renderer, &gb->bus->vram, gb->bus->oam,
+                  gb->bus->ppu.palette_ram);
+  if (fork) {
+    GameboyDestroy(&ahead);
   }
+  free(saved);
   pthread_exit(NULL);
 }
 
@@ -85,32 +363,63 @@ static void* GameboyRunCpu(void* const gb_arg) {
 static void* GameboyRunPpu(void* const gb_arg) {
   Gameboy* const gb = (Gameboy* const)gb_arg;
 
+  // Rasterizes scanlines from the log the CPU thread records, so all pixel
+  // work happens off the emulation thread.
+  while(gb->global_ctx->error == NO_ERROR &&
+        gb->global_ctx->status != STATUS_STOP) {
+    if (DrainRenderLog(gb) == 0) {
+      sched_yield();
+    }
+  }
   pthread_exit(NULL);
 }
 
 
-Result GameboyRun(Gameboy* const gb) {
+Result GameboyRun(Gameboy* const gb, const Frontend* const frontend) {
   pthread_t cpu;
   pthread_t ppu;
   Result result = RESULT_OK;
-  int window_open = 1;
+  int run_ahead = gb->options.run_ahead > 0;
+  int threaded = gb->options.render_mode == RENDER_MODE_THREADED &&
+                 !run_ahead;
+
+  // Only needed to hand frames to a presenter, so machines that are only
+  // stepped never allocate it.
+  if (gb->frames == NULL) {
+    gb->frames = TripleBufferCreate(gb->global_ctx);
+    if (gb->frames == NULL) {
+      return RESULT_NOTOK;
+    }
+  }
+  PpuRendererSetOutput(gb->renderer, gb->frames);
+  if (frontend->audio != NULL && gb->options.apu_mode == APU_MODE_FULL) {
+    ApuSetOutput(&gb->bus->apu, frontend->audio);
+  }
 
-  if (pthread_create(&cpu, NULL, GameboyRunCpu, gb) != 0) {
+  atomic_store_explicit(&gb->input, gb->bus->buttons, memory_order_relaxed);
+  atomic_store(&gb->quit, 0);
+  if (pthread_create(&cpu, NULL,
+                     run_ahead ? GameboyRunAhead : GameboyRunCpu, gb) != 0) {
     gb->global_ctx->error = CPU_THREAD_CREATION_FAILED;
     return RESULT_NOTOK;
   }
-  if (pthread_create(&ppu, NULL, GameboyRunPpu, gb) != 0) {
+  if (threaded && pthread_create(&ppu, NULL, GameboyRunPpu, gb) != 0) {
     gb->global_ctx->error = PPU_THREAD_CREATION_FAILED;
+    atomic_store(&gb->quit, 1);
+    gb->global_ctx->status = STATUS_STOP;
+    pthread_join(cpu, NULL);
     return RESULT_NOTOK;
   }
 
-  SDL_Event event;
-  while (window_open) {
-    while (SDL_PollEvent(&event)) {
-      if (event.type == SDL_QUIT) {
-        window_open = 0;
-        gb->global_ctx->status = STATUS_STOP;
-      }
+  while (frontend->poll(frontend->data)) {
+    if (frontend->buttons != NULL) {
+      atomic_store_explicit(&gb->input, frontend->buttons(frontend->data),
+                            memory_order_relaxed);
+    }
+    // Only frames the renderer finished since the last pass are presented.
+    const uint32_t* frame = TripleBufferAcquire(gb->frames);
+    if (frame != NULL) {
+      frontend->present(frontend->data, frame);
     }
 
     if (gb->global_ctx->error != NO_ERROR) {
@@ -118,14 +427,74 @@ Result GameboyRun(Gameboy* const gb) {
       break;
     }
   }
+  atomic_store(&gb->quit, 1);
+  gb->global_ctx->status = STATUS_STOP;
 
   if (pthread_join(cpu, NULL) != 0) {
     gb->global_ctx->error = CPU_THREAD_JOIN_FAILED;
     return RESULT_NOTOK;
   }
-  if (pthread_join(ppu, NULL) != 0) {
+  if (threaded && pthread_join(ppu, NULL) != 0) {
     gb->global_ctx->error = PPU_THREAD_JOIN_FAILED;
     return RESULT_NOTOK;
   }
+  ApuSetOutput(&gb->bus->apu, NULL);
   return result;
 }
+
+
+Result GameboyRunFrame(Gameboy* const gb) {
+  return GameboyRunFrameInputs(gb, NULL, 0);
+}
+
+
+Result GameboyRunFrameInputs(Gameboy* const gb,
+                             const GameboyInput* const inputs,
+                             size_t count) {
+  GlobalCtx* const global_ctx = gb->global_ctx;
+  unsigned int frames = gb->bus->ppu.frames;
+  unsigned int start = global_ctx->clock;
+  size_t next = 0;
+
+  while (gb->bus->ppu.frames == frames &&
+         global_ctx->clock - start < _FRAME_CYCLES &&
+         global_ctx->error == NO_ERROR &&
+         global_ctx->status != STATUS_STOP) {
+    // Buttons change between instructions, once the clock reaches them.
+    while (next < count && global_ctx->clock - start >= inputs[next].cycle) {
+      BusSetButtons(gb->bus, inputs[next++].buttons);
+    }
+    CpuStep(&gb->cpu);
+    if (gb->options.render_mode != RENDER_MODE_NONE &&
+        RingBufferSize(gb->bus->ppu.log) > _INLINE_DRAIN_THRESHOLD) {
+      DrainRenderLog(gb);
+    }
+  }
+  while (next < count) {
+    BusSetButtons(gb->bus, inputs[next++].buttons);
+  }
+  if (gb->options.render_mode != RENDER_MODE_NONE) {
+    DrainRenderLog(gb);
+  }
+  return global_ctx->error == NO_ERROR ? RESULT_OK : RESULT_NOTOK;
+}
+
+
+Result GameboyRunCycles(Gameboy* const gb, unsigned int cycles) {
+  GlobalCtx* const global_ctx = gb->global_ctx;
+  unsigned int start = global_ctx->clock;
+
+  while (global_ctx->clock - start < cycles &&
+         global_ctx->error == NO_ERROR &&
+         global_ctx->status != STATUS_STOP) {
+    CpuStep(&gb->cpu);
+    if (gb->options.render_mode != RENDER_MODE_NONE &&
+        RingBufferSize(gb->bus->ppu.log) > _INLINE_DRAIN_THRESHOLD) {
+      DrainRenderLog(gb);
+    }
+  }
+  if (gb->options.render_mode != RENDER_MODE_NONE) {
+    DrainRenderLog(gb);
+  }
+  return global_ctx->error == NO_ERROR ? RESULT_OK : RESULT_NOTOK;
+}
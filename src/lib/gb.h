@@ -1,27 +1,132 @@
 #ifndef GAMEBOY_H
 #define GAMEBOY_H
 
+#include "apu.h"
 #include "bus.h"
 #include "cartridge.h"
+#include "color.h"
 #include "cpu.h"
+#include "frontend.h"
 #include "global.h"
+#include "mbc.h"
+#include "ppu.h"
+#include "triple_buffer.h"
 
-#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
+typedef enum RenderModeDef {
+  // Scanlines are rasterized on their own thread while GameboyRun is
+  // presenting. Frames run with GameboyRunFrame render inline.
+  RENDER_MODE_THREADED = 0,
+  // Scanlines are rasterized on the emulation thread.
+  RENDER_MODE_INLINE = 1,
+  // Nothing is rasterized. LCD timing and interrupts still run.
+  RENDER_MODE_NONE = 2,
+} RenderMode;
+
+typedef enum RunAheadModeDef {
+  // The real frame is saved before running ahead and loaded back after.
+  RUN_AHEAD_RESTORE = 0,
+  // Frames run ahead on a secondary instance, forked once and brought to the
+  // real machine's state every frame, so the real one is never reloaded.
+  RUN_AHEAD_FORK = 1,
+} RunAheadMode;
+
+typedef struct GameboyOptionsDef {
+  // CGB color correction.
+  ColorProfile color_profile;
+  // Elided audio skips synthesis entirely.
+  ApuMode apu_mode;
+  RenderMode render_mode;
+  // Frames GameboyRun emulates past the real one with the same buttons,
+  // showing only the last, which hides that many frames of the game's own
+  // input lag. Only the real frames are heard. 0 shows frames as they are
+  // emulated. Run-ahead renders inline, whatever the render mode.
+  unsigned int run_ahead;
+  RunAheadMode run_ahead_mode;
+} GameboyOptions;
+
+// The held buttons change to buttons cycle T-cycles into a frame.
+typedef struct GameboyInputDef {
+  uint32_t cycle;
+  uint8_t buttons;
+} GameboyInput;
+
 typedef struct GameboyDef {
   Cpu cpu;
   Cartridge* cartridge;
   Bus* bus;
-  SDL_Window* screen;
+  PpuRenderer* renderer;
+  // Created by GameboyRun, NULL until then.
+  TripleBuffer* frames;
+  // Copy of the bus right after power on, and what else GameboyReset
+  // restores.
+  Bus* power_on;
+  MemBankController power_on_mbc;
+  GBMode power_on_mode;
+  GameboyOptions options;
+  // Buttons the frontend holds, handed by GameboyRun to the emulation
+  // thread.
+  atomic_uint input;
+  // Set by GameboyRun as it stops. Unlike global_ctx->status, loading a
+  // state doesn't undo it.
+  atomic_int quit;
   GlobalCtx* global_ctx;
 } Gameboy;
 
 
+// gb->global_ctx and gb->options are set by the caller. Call
+// GameboyDestroy even when this fails.
 Result GameboyInit(Gameboy* const gb, const char* const romfile);
 
+// Same as GameboyInit with a ROM image already in memory. The image is
+// copied.
+Result GameboyInitFromBuffer(Gameboy* const gb, const uint8_t* const rom,
+                             size_t size);
+
+// Makes gb a copy of parent that runs on its own from here on. The ROM is
+// shared, and memory is shared page by page until either machine writes
+// it, so forking costs little more than copying the registers. parent
+// can't be running meanwhile; afterwards each may run on its own thread.
+// gb->global_ctx and gb->options are set by the caller. Call
+// GameboyDestroy even when this fails.
+Result GameboyFork(Gameboy* const gb, Gameboy* const parent);
+
 void GameboyDestroy(Gameboy* const gb);
 
-Result GameboyRun(Gameboy* const gb);
+// Returns to the power on state in place. Cartridge RAM is kept, as it is
+// on hardware. Not to be called while GameboyRun is running.
+void GameboyReset(Gameboy* const gb);
+
+// Swaps in another cartridge without rebuilding the machine, then resets.
+// On failure the current cartridge stays in and nothing changes.
+Result GameboyLoadRom(Gameboy* const gb, const char* const romfile);
+
+Result GameboyLoadRomFromBuffer(Gameboy* const gb, const uint8_t* const rom,
+                                size_t size);
+
+// Runs until the frontend is closed or an error occurs. Emulation runs on
+// its own thread and finished frames are handed to the frontend on the
+// calling thread.
+Result GameboyRun(Gameboy* const gb, const Frontend* const frontend);
+
+// Runs on the calling thread until the LCD finishes a frame, or for one
+// frame's worth of cycles while it's off. Unless rendering is disabled the
+// frame is in renderer->framebuffer on return.
+Result GameboyRunFrame(Gameboy* const gb);
+
+// Runs a frame like GameboyRunFrame, changing the held buttons as the
+// clock reaches each input. inputs are in cycle order. Those the frame
+// ends before are applied once it ends.
+Result GameboyRunFrameInputs(Gameboy* const gb,
+                             const GameboyInput* const inputs,
+                             size_t count);
+
+// Runs on the calling thread for at least the given number of T-cycles.
+// The last instruction may overshoot.
+Result GameboyRunCycles(Gameboy* const gb, unsigned int cycles);
 
 #endif
@@ -0,0 +1,359 @@
+#include "gbcore.h"
+
+#include "apu.h"
+#include "color.h"
+#include "gb.h"
+#include "global.h"
+#include "movie.h"
+#include "ppu.h"
+#include "rewind.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+_Static_assert(GB_SCREEN_WIDTH == PPU_SCREEN_WIDTH &&
+               GB_SCREEN_HEIGHT == PPU_SCREEN_HEIGHT,
+               "framebuffer size mismatch");
+_Static_assert(GB_NO_DESYNC == MOVIE_NO_DESYNC, "desync marker mismatch");
+
+
+struct gb_instance {
+  Gameboy gb;
+  GlobalCtx global_ctx;
+  // NULL while rewind is off.
+  Rewind* rewind;
+  // Last movie recorded, NULL before the first. Frames are added while
+  // recording is set.
+  Movie* movie;
+  int recording;
+};
+
+
+// Anything but running frames breaks the recorded path. Rewind is turned
+// off if the history can't be rebuilt.
+static void RestartRewind(gb_instance* const gb) {
+  if (gb->rewind == NULL) {
+    return;
+  }
+  ErrorCode error = gb->global_ctx.error;
+  if (RewindClear(gb->rewind) == RESULT_NOTOK) {
+    RewindDestroy(gb->rewind);
+    gb->rewind = NULL;
+    gb->global_ctx.error = error;
+  }
+}
+
+
+// A movie only holds frames, so anything else ends the recording.
+static void StopRecording(gb_instance* const gb) {
+  gb->recording = 0;
+}
+
+
+static gb_instance* Allocate(const gb_options* const options) {
+  gb_instance* instance = (gb_instance*)malloc(sizeof(gb_instance));
+  if (instance == NULL) {
+    return NULL;
+  }
+  memset(instance, 0, sizeof(gb_instance));
+  gb_options settings = {.render = 1, .audio = 0, .raw_colors = 0};
+  if (options != NULL) {
+    settings = *options;
+  }
+  instance->gb.global_ctx = &instance->global_ctx;
+  instance->gb.options = (GameboyOptions){
+    .color_profile = settings.raw_colors ? COLOR_PROFILE_RAW
+                                         : COLOR_PROFILE_LCD,
+    .apu_mode = settings.audio ? APU_MODE_FULL : APU_MODE_ELIDED,
+    .render_mode = settings.render ? RENDER_MODE_INLINE : RENDER_MODE_NONE
+  };
+  return instance;
+}
+
+
+gb_instance* gb_create_from_file(const char* path,
+                                 const gb_options* options) {
+  gb_instance* instance = Allocate(options);
+  if (instance == NULL) {
+    return NULL;
+  }
+  if (GameboyInit(&instance->gb, path) == RESULT_NOTOK) {
+    gb_destroy(instance);
+    return NULL;
+  }
+  return instance;
+}
+
+
+gb_instance* gb_create_from_buffer(const uint8_t* rom, size_t size,
+                                   const gb_options* options) {
+  gb_instance* instance = Allocate(options);
+  if (instance == NULL) {
+    return NULL;
+  }
+  if (GameboyInitFromBuffer(&instance->gb, rom, size) == RESULT_NOTOK) {
+    gb_destroy(instance);
+    return NULL;
+  }
+  return instance;
+}
+
+
+gb_instance* gb_fork(gb_instance* parent) {
+  gb_instance* instance = (gb_instance*)malloc(sizeof(gb_instance));
+  if (instance == NULL) {
+    return NULL;
+  }
+  memset(instance, 0, sizeof(gb_instance));
+  instance->gb.global_ctx = &instance->global_ctx;
+  instance->gb.options = parent->gb.options;
+  if (GameboyFork(&instance->gb, &parent->gb) == RESULT_NOTOK) {
+    gb_destroy(instance);
+    return NULL;
+  }
+  return instance;
+}
+
+
+void gb_destroy(gb_instance* gb) {
+  if (gb == NULL) {
+    return;
+  }
+  RewindDestroy(gb->rewind);
+  MovieDestroy(gb->movie);
+  gb->rewind = NULL;
+  gb->movie = NULL;
+  GameboyDestroy(&gb->gb);
+  free(gb);
+  gb = NULL;
+}
+
+
+int gb_run_frames(gb_instance* gb, unsigned int frames) {
+  for (unsigned int i = 0; i < frames; ++i) {
+    Result result = gb->recording
+        ? MovieRecordFrame(gb->movie, &gb->gb, gb->gb.bus->buttons, NULL, 0)
+        : GameboyRunFrame(&gb->gb);
+    if (result == RESULT_NOTOK) {
+      return -1;
+    }
+    if (gb->rewind != NULL) {
+      RewindFrame(gb->rewind);
+    }
+  }
+  return 0;
+}
+
+
+int gb_run_cycles(gb_instance* gb, unsigned int cycles) {
+  Result result = GameboyRunCycles(&gb->gb, cycles);
+  RestartRewind(gb);
+  StopRecording(gb);
+  return result == RESULT_OK ? 0 : -1;
+}
+
+
+void gb_reset(gb_instance* gb) {
+  GameboyReset(&gb->gb);
+  RestartRewind(gb);
+  StopRecording(gb);
+}
+
+
+int gb_load_rom(gb_instance* gb, const uint8_t* rom, size_t size) {
+  ErrorCode error = gb->global_ctx.error;
+  if (GameboyLoadRomFromBuffer(&gb->gb, rom, size) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  RestartRewind(gb);
+  StopRecording(gb);
+  return 0;
+}
+
+
+void gb_set_input(gb_instance* gb, uint8_t buttons) {
+  BusSetButtons(gb->gb.bus, buttons);
+}
+
+
+const uint32_t* gb_get_framebuffer(const gb_instance* gb) {
+  return gb->gb.renderer->framebuffer;
+}
+
+
+size_t gb_state_size(gb_instance* gb) {
+  return StateSize(&gb->gb);
+}
+
+
+// A state that is rejected changes nothing, so the instance keeps running
+// rather than stopping on the error.
+int gb_save_state(gb_instance* gb, void* out, size_t size) {
+  ErrorCode error = gb->global_ctx.error;
+  if (StateSave(&gb->gb, (uint8_t*)out, size) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  return 0;
+}
+
+
+size_t gb_state_bound(gb_instance* gb) {
+  return StateBound(&gb->gb);
+}
+
+
+size_t gb_save_state_compressed(gb_instance* gb, void* out, size_t capacity) {
+  ErrorCode error = gb->global_ctx.error;
+  size_t size = StateSaveCompressed(&gb->gb, (uint8_t*)out, capacity);
+  if (size == 0) {
+    gb->global_ctx.error = error;
+  }
+  return size;
+}
+
+
+int gb_load_state(gb_instance* gb, const void* in, size_t size) {
+  ErrorCode error = gb->global_ctx.error;
+  if (StateLoad(&gb->gb, (const uint8_t*)in, size) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  RestartRewind(gb);
+  StopRecording(gb);
+  return 0;
+}
+
+
+int gb_rewind_enable(gb_instance* gb, unsigned int interval, size_t capacity) {
+  RewindDestroy(gb->rewind);
+  gb->rewind = NULL;
+  if (capacity == 0) {
+    return 0;
+  }
+  RewindOptions options = {.interval = interval, .capacity = capacity};
+  ErrorCode error = gb->global_ctx.error;
+  gb->rewind = RewindCreate(&gb->gb, &options);
+  if (gb->rewind == NULL) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  return 0;
+}
+
+
+unsigned long gb_rewind_frame(const gb_instance* gb) {
+  return gb->rewind != NULL ? gb->rewind->frame : 0;
+}
+
+
+unsigned long gb_rewind_oldest(const gb_instance* gb) {
+  return gb->rewind != NULL ? RewindOldest(gb->rewind) : 0;
+}
+
+
+unsigned long gb_rewind_seek(gb_instance* gb, unsigned long frame) {
+  if (gb->rewind == NULL) {
+    return 0;
+  }
+  StopRecording(gb);
+  return RewindSeek(gb->rewind, frame);
+}
+
+
+unsigned long gb_rewind_step_back(gb_instance* gb) {
+  if (gb->rewind == NULL) {
+    return 0;
+  }
+  StopRecording(gb);
+  return RewindStepBack(gb->rewind);
+}
+
+
+int gb_movie_record(gb_instance* gb, unsigned int digest_interval,
+                    unsigned int keyframe_interval) {
+  ErrorCode error = gb->global_ctx.error;
+  StopRecording(gb);
+  if (gb->movie == NULL) {
+    gb->movie = MovieCreate(&gb->global_ctx);
+  }
+  if (gb->movie == NULL ||
+      MovieRecord(gb->movie, &gb->gb, digest_interval,
+                  keyframe_interval) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  gb->recording = 1;
+  return 0;
+}
+
+
+int gb_movie_write(gb_instance* gb, const char* path) {
+  ErrorCode error = gb->global_ctx.error;
+  if (gb->movie == NULL || MovieWrite(gb->movie, path) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  return 0;
+}
+
+
+int gb_movie_open(gb_instance* gb, const char* path) {
+  ErrorCode error = gb->global_ctx.error;
+  StopRecording(gb);
+  if (gb->movie == NULL) {
+    gb->movie = MovieCreate(&gb->global_ctx);
+  }
+  if (gb->movie == NULL || MovieRead(gb->movie, path) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  return 0;
+}
+
+
+int gb_movie_seek(gb_instance* gb, unsigned long frame) {
+  ErrorCode error = gb->global_ctx.error;
+  // Frames past the end and movies of another ROM change nothing.
+  if (gb->movie == NULL || frame > gb->movie->frame_count ||
+      MovieStart(gb->movie, &gb->gb) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    return -1;
+  }
+  StopRecording(gb);
+  Result result = MovieSeek(gb->movie, &gb->gb, frame);
+  RestartRewind(gb);
+  return result == RESULT_OK ? 0 : -1;
+}
+
+
+int gb_movie_play(gb_instance* gb, const char* path, unsigned long* desync) {
+  ErrorCode error = gb->global_ctx.error;
+  *desync = GB_NO_DESYNC;
+  Movie* movie = MovieCreate(&gb->global_ctx);
+  // Movies that can't be read or are of another ROM change nothing.
+  if (movie == NULL || MovieRead(movie, path) == RESULT_NOTOK ||
+      MovieStart(movie, &gb->gb) == RESULT_NOTOK) {
+    gb->global_ctx.error = error;
+    MovieDestroy(movie);
+    return -1;
+  }
+  StopRecording(gb);
+  Result result = MoviePlay(movie, &gb->gb, 0, desync);
+  MovieDestroy(movie);
+  RestartRewind(gb);
+  return result == RESULT_OK ? 0 : -1;
+}
+
+
+const char* gb_get_error(const gb_instance* gb) {
+  if (gb->global_ctx.error == NO_ERROR) {
+    return NULL;
+  }
+  return _ERROR_CODE_STRINGS[gb->global_ctx.error];
+}
@@ -0,0 +1,143 @@
+#ifndef GBCORE_H
+#define GBCORE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Embedding API. Every instance owns all of its state, so any number of
+// them can run in one process, each on whichever thread drives it. A single
+// instance is not thread safe.
+
+#define GB_SCREEN_WIDTH 160
+#define GB_SCREEN_HEIGHT 144
+
+// Bits of gb_set_input.
+#define GB_BUTTON_RIGHT 0x01
+#define GB_BUTTON_LEFT 0x02
+#define GB_BUTTON_UP 0x04
+#define GB_BUTTON_DOWN 0x08
+#define GB_BUTTON_A 0x10
+#define GB_BUTTON_B 0x20
+#define GB_BUTTON_SELECT 0x40
+#define GB_BUTTON_START 0x80
+
+// Set by gb_movie_play when the whole movie replayed as recorded.
+#define GB_NO_DESYNC ULONG_MAX
+
+
+typedef struct gb_instance gb_instance;
+
+typedef struct gb_options {
+  // Nonzero to rasterize frames. Timing and interrupts run either way.
+  int render;
+  // Nonzero to synthesize audio. Registers behave the same either way.
+  int audio;
+  // Nonzero to skip CGB color correction.
+  int raw_colors;
+} gb_options;
+
+
+// Options passed as NULL render, skip audio and correct colors. Returns
+// NULL on failure.
+gb_instance* gb_create_from_file(const char* path, const gb_options* options);
+
+// The ROM is copied.
+gb_instance* gb_create_from_buffer(const uint8_t* rom, size_t size,
+                                   const gb_options* options);
+
+// Copies a running machine with its options, but without rewind history.
+// Memory is shared with the parent until either writes it, so forks are
+// cheap. parent can't be running meanwhile; afterwards the two may run on
+// different threads. Returns NULL on failure.
+gb_instance* gb_fork(gb_instance* parent);
+
+void gb_destroy(gb_instance* gb);
+
+// Runs until the LCD has finished the given number of frames. Returns 0 on
+// success.
+int gb_run_frames(gb_instance* gb, unsigned int frames);
+
+// Runs for at least the given number of T-cycles. Returns 0 on success.
+int gb_run_cycles(gb_instance* gb, unsigned int cycles);
+
+// Returns to the power on state, keeping cartridge RAM.
+void gb_reset(gb_instance* gb);
+
+// Swaps in another ROM and resets. The instance is unchanged on failure.
+// Returns 0 on success.
+int gb_load_rom(gb_instance* gb, const uint8_t* rom, size_t size);
+
+// Held buttons as GB_BUTTON_* bits, until the next call.
+void gb_set_input(gb_instance* gb, uint8_t buttons);
+
+// Last finished frame, GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT ARGB8888 pixels
+// valid until the instance next runs.
+const uint32_t* gb_get_framebuffer(const gb_instance* gb);
+
+// Size of a saved state, fixed for the lifetime of the instance.
+size_t gb_state_size(gb_instance* gb);
+
+// Returns 0 on success.
+int gb_save_state(gb_instance* gb, void* out, size_t size);
+
+// Upper bound on the size of a compressed state.
+size_t gb_state_bound(gb_instance* gb);
+
+// Saves a compressed state, typically a fraction of the size for a few
+// times the cost. Returns the number of bytes written, or 0 on failure.
+size_t gb_save_state_compressed(gb_instance* gb, void* out, size_t capacity);
+
+// Accepts compressed and uncompressed states. Only states saved by an
+// instance of the same ROM load. Returns 0 on success.
+int gb_load_state(gb_instance* gb, const void* in, size_t size);
+
+// Keeps a snapshot every interval frames in capacity bytes of compressed
+// history, so frames run with gb_run_frames can be stepped back through.
+// A capacity of 0 turns rewind off. Resets, loaded states, swapped ROMs
+// and gb_run_cycles start the history over. Returns 0 on success.
+int gb_rewind_enable(gb_instance* gb, unsigned int interval, size_t capacity);
+
+// Frames run since the history started, and the oldest one still kept.
+// Both are 0 while rewind is off.
+unsigned long gb_rewind_frame(const gb_instance* gb);
+unsigned long gb_rewind_oldest(const gb_instance* gb);
+
+// Moves to the given frame, clamped to the history, and returns the frame
+// reached. Seeks can go back and forth until the next frame is run, which
+// drops the history past it.
+unsigned long gb_rewind_seek(gb_instance* gb, unsigned long frame);
+
+// Seeks one frame back.
+unsigned long gb_rewind_step_back(gb_instance* gb);
+
+// Starts recording a movie of the frames run with gb_run_frames from the
+// current state, replacing the last one. The state is hashed after every
+// digest_interval frames, or never if 0, so replays can be checked, and
+// saved after every keyframe_interval frames, or never if 0, so seeking
+// replays at most that many. Anything but running frames stops the
+// recording. Returns 0 on success.
+int gb_movie_record(gb_instance* gb, unsigned int digest_interval,
+                    unsigned int keyframe_interval);
+
+// Writes the last movie recorded or opened, as far as it got. Returns 0 on
+// success.
+int gb_movie_write(gb_instance* gb, const char* path);
+
+// Reads a movie to seek in, replacing the last one. Returns 0 on success.
+int gb_movie_open(gb_instance* gb, const char* path);
+
+// Puts the instance where it was as frame frame of the last movie recorded
+// or opened started, from the nearest keyframe. Returns 0 on success.
+int gb_movie_seek(gb_instance* gb, unsigned long frame);
+
+// Replays a movie from its start state as fast as it runs, stopping at
+// the first frame whose state doesn't match its digest. desync is set to
+// that frame, or GB_NO_DESYNC. Movies of another ROM are refused. Returns
+// 0 on success.
+int gb_movie_play(gb_instance* gb, const char* path, unsigned long* desync);
+
+// Description of the error that stopped the instance, or NULL.
+const char* gb_get_error(const gb_instance* gb);
+
+#endif
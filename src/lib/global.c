@@ -0,0 +1,31 @@
+#include "global.h"
+
+
+const char* const _ERROR_CODE_STRINGS[] = {
+  "ILLEGAL WRITE TO MEMORY",
+  "MEMORY ALLOCATION FAILURE",
+  "FILE NOT FOUND",
+  "FAILED TO READ ROM",
+  "HEADER CHECKSUM FAILED",
+  "MBC TYPE NOT SUPPORTED",
+  "ILLEGAL INSTRUCTION",
+  "ILLEGAL INSTRUCTION PARAMETER",
+  "UNKNOWN INTERRUPT REQUESTED",
+  "SDL INIT ERROR",
+  "SDL WINDOW CREATION FAIL",
+  "CPU THREAD CREATION FAILED",
+  "PPU THREAD CREATION FAILED",
+  "CPU THREAD JOIN FAILED",
+  "PPU THREAD JOIN FAILED",
+  "SDL RENDERER CREATION FAILED",
+  "SDL TEXTURE CREATION FAILED",
+  "SDL AUDIO DEVICE OPEN FAILED",
+  "FAILED TO WRITE FILE",
+  "INVALID STATE",
+  "STORE FULL",
+  "MOVIE DESYNC",
+  "NETWORK FAILURE",
+  "NETPLAY DESYNC",
+  "INVALID ADDRESS",
+  "NO ERROR"
+};
@@ -4,7 +4,10 @@
 #include <pthread.h>
 #include <stdint.h>
 
-#define GB_DEBUG_MODE
+
+// Matches the project version in CMakeLists.txt.
+#define GB_VERSION_MAJOR 1
+#define GB_VERSION_MINOR 0
 
 
 typedef enum ResultDef {
@@ -22,32 +25,27 @@ typedef enum ErrorCodeDef {
   ILLEGAL_INSTRUCTION = 6,
   ILLEGAL_INSTRUCTION_PARAMETER = 7,
   UNKNOWN_INTERRUPT_REQUESTED = 8,
-  SDL_VIDEO_INIT_ERROR = 9,
+  SDL_INIT_ERROR = 9,
   SDL_WINDOW_CREATION_FAILED = 10,
   CPU_THREAD_CREATION_FAILED = 11,
   PPU_THREAD_CREATION_FAILED = 12,
   CPU_THREAD_JOIN_FAILED = 13,
   PPU_THREAD_JOIN_FAILED = 14,
+  SDL_RENDERER_CREATION_FAILED = 15,
+  SDL_TEXTURE_CREATION_FAILED = 16,
+  SDL_AUDIO_DEVICE_OPEN_FAILED = 17,
+  FAILED_TO_WRITE_FILE = 18,
+  INVALID_STATE = 19,
+  STORE_FULL = 20,
+  MOVIE_DESYNC = 21,
+  NETWORK_FAILURE = 22,
+  NETPLAY_DESYNC = 23,
+  INVALID_ADDRESS = 24,
   NO_ERROR,
 } ErrorCode;
 
-static const char* _ERROR_CODE_STRINGS[] = {
-  "ILLEGAL WRITE TO MEMORY",
-  "MEMORY ALLOCATION FAILURE",
-  "FILE NOT FOUND",
-  "FAILED TO READ ROM",
-  "HEADER CHECKSUM FAILED",
-  "MBC TYPE NOT SUPPORTED",
-  "ILLEGAL INSTRUCTION",
-  "ILLEGAL INSTRUCTION PARAMETER",
-  "UNKNOWN INTERRUPT REQUESTED",
-  "SDL VIDEO INIT ERROR",
-  "SDL WINDOW CREATION FAIL",
-  "CPU THREAD CREATION FAILED",
-  "PPU THREAD CREATION FAILED",
-  "CPU THREAD JOIN FAILED",
-  "PPU THREAD JOIN FAILED"
-};
+// Indexed by ErrorCode.
+extern const char* const _ERROR_CODE_STRINGS[];
 
 typedef enum GBModeDef {
   GB_MODE_GBC = 0,
@@ -75,10 +73,12 @@ typedef struct GlobalCtxDef {
   GBStatus status;
   unsigned int clock;
   pthread_mutex_t interrupt_mtx;
-  pthread_cond_t interrupt_write;
 } GlobalCtx;
 
 
-extern void RequestInterrupt(InterruptType it, uint8_t* const interrupts_flag);
+static inline void RequestInterrupt(InterruptType it,
+                                    uint8_t* const interrupts_flag) {
+  *interrupts_flag |= 1 << it;
+}
 
 #endif
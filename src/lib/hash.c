@@ -0,0 +1,52 @@
+#include "hash.h"
+
+#include "byteorder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+static const uint64_t _PRIME_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t _PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+
+
+static uint64_t Rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+
+// Final avalanche, so every input bit affects every output bit.
+static uint64_t Finalize(uint64_t h) {
+  h ^= h >> 33;
+  h *= _PRIME_2;
+  h ^= h >> 29;
+  h *= _PRIME_1;
+  h ^= h >> 32;
+  return h;
+}
+
+
+uint64_t Hash64(const void* const data, size_t size, uint64_t seed) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  // Four independent lanes keep the multiplies pipelined.
+  uint64_t lanes[4] = {
+    seed + _PRIME_1, seed ^ _PRIME_2, seed - _PRIME_1, Rotate(seed, 32)
+  };
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    for (int lane = 0; lane < 4; ++lane) {
+      uint64_t word = Get64(bytes + i + lane * 8);
+      lanes[lane] = Rotate(lanes[lane] + word * _PRIME_2, 31) * _PRIME_1;
+    }
+  }
+  uint64_t h = Rotate(lanes[0], 1) + Rotate(lanes[1], 7) +
+               Rotate(lanes[2], 12) + Rotate(lanes[3], 18) + size;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word = Get64(bytes + i);
+    h = Rotate(h ^ (word * _PRIME_2), 27) * _PRIME_1;
+  }
+  for (; i < size; ++i) {
+    h = Rotate(h ^ (bytes[i] * _PRIME_1), 11) * _PRIME_2;
+  }
+  return Finalize(h);
+}
@@ -0,0 +1,13 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Fast non-cryptographic 64 bit hash for comparing frames and states.
+// Hashing a buffer in pieces, each seeded with the previous result, gives
+// a stable hash of the whole. The same bytes hash the same on any host.
+uint64_t Hash64(const void* const data, size_t size, uint64_t seed);
+
+#endif
@@ -0,0 +1,108 @@
+#include "headless.h"
+
+#include "gb.h"
+#include "global.h"
+#include "movie.h"
+#include "ppu.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static Result DumpFrame(const Gameboy* const gb, const char* const path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    gb->global_ctx->error = FAILED_TO_WRITE_FILE;
+    return RESULT_NOTOK;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", PPU_SCREEN_WIDTH, PPU_SCREEN_HEIGHT);
+  const uint32_t* pixels = gb->renderer->framebuffer;
+  for (int i = 0; i < PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT; ++i) {
+    uint8_t rgb[3] = {
+      (uint8_t)(pixels[i] >> 16),
+      (uint8_t)(pixels[i] >> 8),
+      (uint8_t)pixels[i]
+    };
+    fwrite(rgb, 1, sizeof(rgb), file);
+  }
+  fclose(file);
+  return RESULT_OK;
+}
+
+
+static Result DumpSerial(const Gameboy* const gb, const char* const path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    gb->global_ctx->error = FAILED_TO_WRITE_FILE;
+    return RESULT_NOTOK;
+  }
+  fwrite(gb->bus->serial_out, 1, gb->bus->serial_out_size, file);
+  fclose(file);
+  return RESULT_OK;
+}
+
+
+static Result PlayMovie(Gameboy* const gb, const char* const path,
+                        unsigned long from, unsigned long* const frames) {
+  Movie* movie = MovieCreate(gb->global_ctx);
+  if (movie == NULL) {
+    return RESULT_NOTOK;
+  }
+  unsigned long desync = MOVIE_NO_DESYNC;
+  Result result = MovieRead(movie, path);
+  if (result == RESULT_OK) {
+    result = MoviePlay(movie, gb, from, &desync);
+  }
+  if (result == RESULT_OK) {
+    *frames = (desync == MOVIE_NO_DESYNC ? movie->frame_count : desync + 1) -
+              from;
+  }
+  MovieDestroy(movie);
+  if (result == RESULT_OK && desync != MOVIE_NO_DESYNC) {
+    printf("desync after frame %lu\n", desync);
+    gb->global_ctx->error = MOVIE_DESYNC;
+    return RESULT_NOTOK;
+  }
+  return result;
+}
+
+
+Result HeadlessRun(Gameboy* const gb, const HeadlessOptions* const options) {
+  unsigned long frames = 0;
+  Result result = RESULT_OK;
+
+  if (options->movie != NULL) {
+    result = PlayMovie(gb, options->movie, options->seek, &frames);
+  }
+  while (options->movie == NULL &&
+         (options->frames == 0 || frames < options->frames)) {
+    result = GameboyRunFrame(gb);
+    ++frames;
+    if (result == RESULT_NOTOK ||
+        gb->global_ctx->status == STATUS_STOP) {
+      break;
+    }
+    if (options->exit_serial != NULL &&
+        strstr(gb->bus->serial_out, options->exit_serial) != NULL) {
+      break;
+    }
+  }
+
+  const Cpu* cpu = &gb->cpu;
+  printf("frames=%lu cycles=%u pc=%04x sp=%04x "
+         "a=%02x b=%02x c=%02x d=%02x e=%02x h=%02x l=%02x\n",
+         frames, gb->global_ctx->clock, cpu->pc, cpu->sp, cpu->regs.a,
+         cpu->regs.b, cpu->regs.c, cpu->regs.d, cpu->regs.e, cpu->regs.h,
+         cpu->regs.l);
+
+  if (options->dump_frame != NULL &&
+      DumpFrame(gb, options->dump_frame) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  if (options->dump_serial != NULL &&
+      DumpSerial(gb, options->dump_serial) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  return result;
+}
@@ -0,0 +1,30 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "gb.h"
+#include "global.h"
+
+
+typedef struct HeadlessOptionsDef {
+  // Frames to run, 0 to run until another exit condition is met.
+  unsigned long frames;
+  // Stop once the serial port has sent this text, or NULL. Test ROMs report
+  // their results this way.
+  const char* exit_serial;
+  // Written on exit when not NULL. The framebuffer is a binary PPM.
+  const char* dump_frame;
+  const char* dump_serial;
+  // Replays this movie instead, checking it against its digests, when not
+  // NULL. Fails with MOVIE_DESYNC if a digest doesn't match.
+  const char* movie;
+  // Frame of the movie to start from, reached from its nearest keyframe.
+  unsigned long seek;
+} HeadlessOptions;
+
+
+// Runs the Gameboy unthrottled on the calling thread, with no window or
+// audio device, until an exit condition is met. Prints a summary of the
+// final machine state to stdout.
+Result HeadlessRun(Gameboy* const gb, const HeadlessOptions* const options);
+
+#endif
@@ -0,0 +1,69 @@
+#include "link.h"
+
+#include "bus.h"
+#include "gb.h"
+#include "global.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+
+Link* LinkCreate(GlobalCtx* const global_ctx, Gameboy* const machines,
+                 size_t count) {
+  Link* link = (Link*)malloc(sizeof(Link));
+  if (link == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  link->starts = (unsigned int*)malloc(count * sizeof(unsigned int));
+  if (link->starts == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    free(link);
+    return NULL;
+  }
+  link->machines = machines;
+  link->count = count;
+  link->global_ctx = global_ctx;
+  for (size_t i = 0; i < count; ++i) {
+    BusConnect(machines[i].bus, count > 1 ? machines[(i + 1) % count].bus
+                                          : NULL);
+  }
+  return link;
+}
+
+
+void LinkDestroy(Link* link) {
+  if (link == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < link->count; ++i) {
+    BusConnect(link->machines[i].bus, NULL);
+  }
+  free(link->starts);
+  link->starts = NULL;
+  link->machines = NULL;
+  link->global_ctx = NULL;
+  free(link);
+  link = NULL;
+}
+
+
+Result LinkRunCycles(Link* const link, unsigned int cycles) {
+  for (size_t i = 0; i < link->count; ++i) {
+    link->starts[i] = link->machines[i].global_ctx->clock;
+  }
+  // Each turn runs a machine up to the end of the quantum rather than for
+  // a quantum, so what an instruction runs over doesn't add up.
+  for (unsigned int end = 0; end < cycles;) {
+    end = cycles - end > LINK_QUANTUM ? end + LINK_QUANTUM : cycles;
+    for (size_t i = 0; i < link->count; ++i) {
+      Gameboy* gb = &link->machines[i];
+      unsigned int ran = gb->global_ctx->clock - link->starts[i];
+      if (ran < end && GameboyRunCycles(gb, end - ran) == RESULT_NOTOK) {
+        link->global_ctx->error = gb->global_ctx->error;
+        return RESULT_NOTOK;
+      }
+    }
+  }
+  return RESULT_OK;
+}
@@ -0,0 +1,42 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "gb.h"
+#include "global.h"
+
+#include <stddef.h>
+
+// Cycles each machine runs before the next takes its turn. A port waiting
+// on the external clock is never more than this, plus an instruction, out
+// of step with the port driving it. Small enough to keep up with the CGB's
+// fast clock within a few bits.
+#define LINK_QUANTUM 64
+
+
+// Machines run in lockstep in one thread, with their serial ports cabled
+// in a ring, each one's output into the next one's input. Two make a plain
+// link cable.
+typedef struct LinkDef {
+  Gameboy* machines;
+  size_t count;
+  // Clock of each machine as the run under way started.
+  unsigned int* starts;
+  GlobalCtx* global_ctx;
+} Link;
+
+
+// Cables count machines, replacing whatever their ports were cabled to.
+// Returns NULL on failure.
+Link* LinkCreate(GlobalCtx* const global_ctx, Gameboy* const machines,
+                 size_t count);
+
+// Unplugs the cables. The machines are left to the caller, to destroy
+// after the link.
+void LinkDestroy(Link* link);
+
+// Runs every machine for cycles cycles, taking turns LINK_QUANTUM cycles at
+// a time. Stops at the first machine to fail, leaving its error in the
+// link's context.
+Result LinkRunCycles(Link* const link, unsigned int cycles);
+
+#endif
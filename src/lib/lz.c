@@ -0,0 +1,175 @@
+#include "lz.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+#define _HASH_BITS 12
+
+static const size_t _MIN_MATCH = 4;
+static const size_t _MAX_OFFSET = 0xFFFF;
+// The last bytes are always literals, so matching never reads past the
+// end.
+static const size_t _END_LITERALS = 5;
+
+
+static uint32_t Read32(const uint8_t* const p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+static uint32_t HashOf(uint32_t value) {
+  return (value * 2654435761U) >> (32 - _HASH_BITS);
+}
+
+
+// Lengths of 15 and more continue in bytes of 255 and a remainder.
+static uint8_t* WriteLength(uint8_t* out, size_t length) {
+  for (length -= 15; length >= 255; length -= 255) {
+    *out++ = 255;
+  }
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+
+static uint8_t* WriteSequence(uint8_t* out, const uint8_t* const literals,
+                              size_t literal_count, size_t match_length,
+                              size_t offset) {
+  uint8_t* token = out++;
+  *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+  if (literal_count >= 15) {
+    out = WriteLength(out, literal_count);
+  }
+  memcpy(out, literals, literal_count);
+  out += literal_count;
+  if (match_length == 0) {
+    return out;
+  }
+  *out++ = (uint8_t)offset;
+  *out++ = (uint8_t)(offset >> 8);
+  size_t code = match_length - _MIN_MATCH;
+  *token |= (uint8_t)(code < 15 ? code : 15);
+  if (code >= 15) {
+    out = WriteLength(out, code);
+  }
+  return out;
+}
+
+
+size_t LzCompress(const uint8_t* const in, size_t size, uint8_t* const out,
+                  size_t capacity) {
+  if (capacity < LzBound(size)) {
+    return 0;
+  }
+  // Positions plus one, so zero means empty.
+  uint32_t table[1 << _HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  uint8_t* pos = out;
+  size_t anchor = 0;
+  size_t i = 0;
+  size_t limit = size > _END_LITERALS + _MIN_MATCH
+                     ? size - _END_LITERALS - _MIN_MATCH : 0;
+  while (i < limit) {
+    uint32_t value = Read32(in + i);
+    uint32_t hash = HashOf(value);
+    size_t candidate = table[hash];
+    table[hash] = (uint32_t)i + 1;
+    if (candidate == 0 || i - (candidate - 1) > _MAX_OFFSET ||
+        Read32(in + candidate - 1) != value) {
+      ++i;
+      continue;
+    }
+    size_t match = candidate - 1;
+    size_t length = _MIN_MATCH;
+    size_t longest = size - _END_LITERALS - i;
+    // A word at a time through the long runs of zeroes states are full of.
+    while (length + 8 <= longest &&
+           memcmp(in + match + length, in + i + length, 8) == 0) {
+      length += 8;
+    }
+    while (length < longest && in[match + length] == in[i + length]) {
+      ++length;
+    }
+    pos = WriteSequence(pos, in + anchor, i - anchor, length, i - match);
+    i += length;
+    anchor = i;
+  }
+  pos = WriteSequence(pos, in + anchor, size - anchor, 0, 0);
+  return (size_t)(pos - out);
+}
+
+
+// Reads a length continued past its 4 bit field. Returns 0 if the input
+// ends first.
+static int ReadLength(const uint8_t** const pos, const uint8_t* const end,
+                      size_t* const length) {
+  uint8_t byte;
+  do {
+    if (*pos >= end) {
+      return 0;
+    }
+    byte = *(*pos)++;
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+
+size_t LzDecompress(const uint8_t* const in, size_t size, uint8_t* const out,
+                    size_t capacity) {
+  const uint8_t* pos = in;
+  const uint8_t* const end = in + size;
+  size_t written = 0;
+  while (pos < end) {
+    uint8_t token = *pos++;
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && !ReadLength(&pos, end, &literal_count)) {
+      return 0;
+    }
+    if (literal_count > (size_t)(end - pos) ||
+        literal_count > capacity - written) {
+      return 0;
+    }
+    memcpy(out + written, pos, literal_count);
+    pos += literal_count;
+    written += literal_count;
+    if (pos == end) {
+      // The last sequence has no match.
+      break;
+    }
+
+    if (end - pos < 2) {
+      return 0;
+    }
+    size_t offset = pos[0] | (pos[1] << 8);
+    pos += 2;
+    size_t length = token & 0x0F;
+    if (length == 15 && !ReadLength(&pos, end, &length)) {
+      return 0;
+    }
+    length += _MIN_MATCH;
+    if (offset == 0 || offset > written || length > capacity - written) {
+      return 0;
+    }
+    const uint8_t* from = out + written - offset;
+    if (offset == 1) {
+      memset(out + written, *from, length);
+    }
+    else if (offset >= length) {
+      memcpy(out + written, from, length);
+    }
+    else {
+      // Byte by byte, since the copy overlaps its own output.
+      for (size_t i = 0; i < length; ++i) {
+        out[written + i] = from[i];
+      }
+    }
+    written += length;
+  }
+  return written;
+}
@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Largest output LzCompress can produce for size bytes of input.
+static inline size_t LzBound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+// Byte oriented LZ77 in the style of LZ4: runs of literals alternate with
+// copies of up to 64 KiB back. Built for speed over ratio, and machine
+// state is mostly zeroes and repeated tiles, so it still shrinks well.
+// Returns the compressed size, or 0 if it doesn't fit in capacity.
+size_t LzCompress(const uint8_t* const in, size_t size, uint8_t* const out,
+                  size_t capacity);
+
+// Returns the decompressed size, or 0 if the input is malformed or would
+// overflow capacity.
+size_t LzDecompress(const uint8_t* const in, size_t size, uint8_t* const out,
+                    size_t capacity);
+
+#endif
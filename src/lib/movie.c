@@ -0,0 +1,519 @@
+#include "movie.h"
+
+#include "bus.h"
+#include "byteorder.h"
+#include "gb.h"
+#include "global.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static uint64_t RomHash(const Gameboy* const gb) {
+  return gb->cartridge->rom_hash;
+}
+
+
+// Makes room for one more item in a growable array.
+static Result Grow(void** const data, size_t* const capacity, size_t count,
+                   size_t item_size, GlobalCtx* const global_ctx) {
+  if (count < *capacity) {
+    return RESULT_OK;
+  }
+  size_t grown = *capacity > 0 ? *capacity * 2 : 1024;
+  void* resized = realloc(*data, grown * item_size);
+  if (resized == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  *data = resized;
+  *capacity = grown;
+  return RESULT_OK;
+}
+
+
+static void Clear(Movie* const movie) {
+  free(movie->start);
+  free(movie->buttons);
+  free(movie->events);
+  free(movie->event_frames);
+  free(movie->digests);
+  free(movie->keyframes);
+  free(movie->keyframe_offsets);
+  movie->start = NULL;
+  movie->buttons = NULL;
+  movie->events = NULL;
+  movie->event_frames = NULL;
+  movie->digests = NULL;
+  movie->keyframes = NULL;
+  movie->keyframe_offsets = NULL;
+  movie->start_size = 0;
+  movie->frame_count = 0;
+  movie->frame_capacity = 0;
+  movie->event_count = 0;
+  movie->event_capacity = 0;
+  movie->digest_count = 0;
+  movie->digest_capacity = 0;
+  movie->keyframes_size = 0;
+  movie->keyframes_capacity = 0;
+  movie->keyframe_count = 0;
+  movie->keyframe_capacity = 0;
+}
+
+
+Movie* MovieCreate(GlobalCtx* const global_ctx) {
+  Movie* movie = (Movie*)malloc(sizeof(Movie));
+  if (movie == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(movie, 0, sizeof(Movie));
+  movie->global_ctx = global_ctx;
+  return movie;
+}
+
+
+void MovieDestroy(Movie* movie) {
+  if (movie == NULL) {
+    return;
+  }
+  Clear(movie);
+  movie->global_ctx = NULL;
+  free(movie);
+  movie = NULL;
+}
+
+
+Result MovieRecord(Movie* const movie, Gameboy* const gb,
+                   unsigned int digest_interval,
+                   unsigned int keyframe_interval) {
+  Clear(movie);
+  size_t capacity = StateBound(gb);
+  movie->start = (uint8_t*)malloc(capacity);
+  if (movie->start == NULL) {
+    movie->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  movie->start_size = StateSaveCompressed(gb, movie->start, capacity);
+  if (movie->start_size == 0) {
+    Clear(movie);
+    return RESULT_NOTOK;
+  }
+  movie->rom_hash = RomHash(gb);
+  movie->version_major = GB_VERSION_MAJOR;
+  movie->version_minor = GB_VERSION_MINOR;
+  movie->digest_interval = digest_interval;
+  movie->keyframe_interval = keyframe_interval;
+  return RESULT_OK;
+}
+
+
+static Result AddKeyframe(Movie* const movie, Gameboy* const gb) {
+  GlobalCtx* const global_ctx = movie->global_ctx;
+  size_t bound = StateBound(gb);
+  if (movie->keyframes_size + bound > movie->keyframes_capacity) {
+    size_t grown = movie->keyframes_capacity * 2;
+    if (grown < movie->keyframes_size + bound) {
+      grown = movie->keyframes_size + bound;
+    }
+    uint8_t* resized = (uint8_t*)realloc(movie->keyframes, grown);
+    if (resized == NULL) {
+      global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      return RESULT_NOTOK;
+    }
+    movie->keyframes = resized;
+    movie->keyframes_capacity = grown;
+  }
+  if (Grow((void**)&movie->keyframe_offsets, &movie->keyframe_capacity,
+           movie->keyframe_count, sizeof(uint64_t),
+           global_ctx) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  size_t size = StateSaveCompressed(
+      gb, movie->keyframes + movie->keyframes_size, bound);
+  if (size == 0) {
+    return RESULT_NOTOK;
+  }
+  movie->keyframe_offsets[movie->keyframe_count++] = movie->keyframes_size;
+  movie->keyframes_size += size;
+  return RESULT_OK;
+}
+
+
+Result MovieRecordFrame(Movie* const movie, Gameboy* const gb,
+                        uint8_t buttons, const GameboyInput* const inputs,
+                        size_t count) {
+  GlobalCtx* const global_ctx = movie->global_ctx;
+  // Movies with inputs out of cycle order don't read back.
+  for (size_t i = 1; i < count; ++i) {
+    if (inputs[i].cycle < inputs[i - 1].cycle) {
+      global_ctx->error = INVALID_STATE;
+      return RESULT_NOTOK;
+    }
+  }
+  if (Grow((void**)&movie->buttons, &movie->frame_capacity,
+           movie->frame_count, sizeof(uint8_t), global_ctx) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    // Both arrays share event_capacity, which only grows once both have.
+    size_t capacity = movie->event_capacity;
+    if (Grow((void**)&movie->event_frames, &capacity, movie->event_count,
+             sizeof(uint32_t), global_ctx) == RESULT_NOTOK ||
+        Grow((void**)&movie->events, &movie->event_capacity,
+             movie->event_count, sizeof(GameboyInput),
+             global_ctx) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    movie->events[movie->event_count] = inputs[i];
+    movie->event_frames[movie->event_count++] = (uint32_t)movie->frame_count;
+  }
+  movie->buttons[movie->frame_count] = buttons;
+  if (MoviePlayFrame(movie, gb, movie->frame_count++) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+
+  if (movie->digest_interval > 0 &&
+      movie->frame_count % movie->digest_interval == 0) {
+    if (Grow((void**)&movie->digests, &movie->digest_capacity,
+             movie->digest_count, sizeof(uint64_t),
+             global_ctx) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    movie->digests[movie->digest_count++] = StateHash(gb);
+  }
+  if (movie->keyframe_interval > 0 &&
+      movie->frame_count % movie->keyframe_interval == 0) {
+    return AddKeyframe(movie, gb);
+  }
+  return RESULT_OK;
+}
+
+
+Result MovieWrite(const Movie* const movie, const char* const path) {
+  uint8_t header[MOVIE_HEADER_SIZE] = {0};
+  Put32(header, MOVIE_MAGIC);
+  Put16(header + 4, MOVIE_VERSION);
+  Put16(header + 8, movie->version_major);
+  Put16(header + 10, movie->version_minor);
+  Put32(header + 12, movie->digest_interval);
+  Put64(header + 16, movie->rom_hash);
+  Put32(header + 24, (uint32_t)movie->frame_count);
+  Put32(header + 28, (uint32_t)movie->event_count);
+  Put32(header + 32, (uint32_t)movie->digest_count);
+  Put32(header + 36, (uint32_t)movie->start_size);
+  Put32(header + 40, movie->keyframe_interval);
+  Put32(header + 44, (uint32_t)movie->keyframe_count);
+
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    movie->global_ctx->error = FAILED_TO_WRITE_FILE;
+    return RESULT_NOTOK;
+  }
+  int ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+           fwrite(movie->start, 1, movie->start_size, file) ==
+               movie->start_size &&
+           fwrite(movie->buttons, 1, movie->frame_count, file) ==
+               movie->frame_count;
+  for (size_t i = 0; ok && i < movie->event_count; ++i) {
+    uint8_t event[MOVIE_EVENT_SIZE];
+    Put32(event, movie->event_frames[i]);
+    Put32(event + 4, movie->events[i].cycle);
+    event[8] = movie->events[i].buttons;
+    ok = fwrite(event, sizeof(event), 1, file) == 1;
+  }
+  for (size_t i = 0; ok && i < movie->digest_count; ++i) {
+    uint8_t digest[8];
+    Put64(digest, movie->digests[i]);
+    ok = fwrite(digest, sizeof(digest), 1, file) == 1;
+  }
+  for (size_t i = 0; ok && i < movie->keyframe_count; ++i) {
+    uint8_t offset[8];
+    Put64(offset, movie->keyframe_offsets[i]);
+    ok = fwrite(offset, sizeof(offset), 1, file) == 1;
+  }
+  if (ok && movie->keyframes_size > 0) {
+    ok = fwrite(movie->keyframes, 1, movie->keyframes_size, file) ==
+         movie->keyframes_size;
+  }
+  if (fclose(file) != 0 || !ok) {
+    movie->global_ctx->error = FAILED_TO_WRITE_FILE;
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
+
+
+// Fills movie from a whole file held in memory.
+static Result Parse(Movie* const movie, const uint8_t* const in,
+                    size_t size) {
+  if (size < MOVIE_HEADER_SIZE || Get32(in) != MOVIE_MAGIC ||
+      Get16(in + 4) != MOVIE_VERSION) {
+    return RESULT_NOTOK;
+  }
+  movie->version_major = Get16(in + 8);
+  movie->version_minor = Get16(in + 10);
+  movie->digest_interval = Get32(in + 12);
+  movie->rom_hash = Get64(in + 16);
+  size_t frame_count = Get32(in + 24);
+  size_t event_count = Get32(in + 28);
+  size_t digest_count = Get32(in + 32);
+  size_t start_size = Get32(in + 36);
+  movie->keyframe_interval = Get32(in + 40);
+  size_t keyframe_count = Get32(in + 44);
+  // Everything but the keyframes, whose size is what's left.
+  size_t expected = (uint64_t)start_size + frame_count +
+                    (uint64_t)event_count * MOVIE_EVENT_SIZE +
+                    (uint64_t)digest_count * 8 + (uint64_t)keyframe_count * 8;
+  if (size - MOVIE_HEADER_SIZE < expected ||
+      digest_count != (movie->digest_interval > 0
+                           ? frame_count / movie->digest_interval
+                           : 0) ||
+      keyframe_count != (movie->keyframe_interval > 0
+                             ? frame_count / movie->keyframe_interval
+                             : 0)) {
+    return RESULT_NOTOK;
+  }
+  size_t keyframes_size = size - MOVIE_HEADER_SIZE - expected;
+  if ((keyframe_count == 0) != (keyframes_size == 0)) {
+    return RESULT_NOTOK;
+  }
+
+  movie->start = (uint8_t*)malloc(start_size > 0 ? start_size : 1);
+  movie->buttons = (uint8_t*)malloc(frame_count > 0 ? frame_count : 1);
+  movie->events = (GameboyInput*)malloc(
+      (event_count > 0 ? event_count : 1) * sizeof(GameboyInput));
+  movie->event_frames = (uint32_t*)malloc(
+      (event_count > 0 ? event_count : 1) * sizeof(uint32_t));
+  movie->digests = (uint64_t*)malloc((digest_count > 0 ? digest_count : 1) *
+                                     sizeof(uint64_t));
+  movie->keyframes = (uint8_t*)malloc(keyframes_size > 0 ? keyframes_size
+                                                         : 1);
+  movie->keyframe_offsets = (uint64_t*)malloc(
+      (keyframe_count > 0 ? keyframe_count : 1) * sizeof(uint64_t));
+  if (movie->start == NULL || movie->buttons == NULL ||
+      movie->events == NULL || movie->event_frames == NULL ||
+      movie->digests == NULL || movie->keyframes == NULL ||
+      movie->keyframe_offsets == NULL) {
+    movie->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  const uint8_t* pos = in + MOVIE_HEADER_SIZE;
+  memcpy(movie->start, pos, start_size);
+  movie->start_size = start_size;
+  pos += start_size;
+  memcpy(movie->buttons, pos, frame_count);
+  movie->frame_count = frame_count;
+  movie->frame_capacity = frame_count;
+  pos += frame_count;
+  for (size_t i = 0; i < event_count; ++i, pos += MOVIE_EVENT_SIZE) {
+    uint32_t frame = Get32(pos);
+    movie->event_frames[i] = frame;
+    movie->events[i] = (GameboyInput){
+      .cycle = Get32(pos + 4), .buttons = pos[8]
+    };
+    // Replay looks events up by frame, so they have to be in order.
+    if (frame >= frame_count ||
+        (i > 0 && (frame < movie->event_frames[i - 1] ||
+                   (frame == movie->event_frames[i - 1] &&
+                    movie->events[i].cycle < movie->events[i - 1].cycle)))) {
+      return RESULT_NOTOK;
+    }
+  }
+  movie->event_count = event_count;
+  movie->event_capacity = event_count;
+  for (size_t i = 0; i < digest_count; ++i, pos += 8) {
+    movie->digests[i] = Get64(pos);
+  }
+  movie->digest_count = digest_count;
+  movie->digest_capacity = digest_count;
+  for (size_t i = 0; i < keyframe_count; ++i, pos += 8) {
+    uint64_t offset = Get64(pos);
+    movie->keyframe_offsets[i] = offset;
+    // Keyframes are back to back and none is empty.
+    if (offset >= keyframes_size ||
+        (i == 0 ? offset != 0 : offset <= movie->keyframe_offsets[i - 1])) {
+      return RESULT_NOTOK;
+    }
+  }
+  movie->keyframe_count = keyframe_count;
+  movie->keyframe_capacity = keyframe_count;
+  memcpy(movie->keyframes, pos, keyframes_size);
+  movie->keyframes_size = keyframes_size;
+  movie->keyframes_capacity = keyframes_size;
+  return RESULT_OK;
+}
+
+
+Result MovieRead(Movie* const movie, const char* const path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    movie->global_ctx->error = FILE_NOT_FOUND;
+    return RESULT_NOTOK;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  uint8_t* data = (uint8_t*)malloc(size > 0 ? (size_t)size : 1);
+  if (data == NULL) {
+    fclose(file);
+    movie->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  size_t read = size > 0 ? fread(data, (size_t)size, 1, file) : 0;
+  fclose(file);
+
+  Clear(movie);
+  ErrorCode error = movie->global_ctx->error;
+  Result result = RESULT_NOTOK;
+  if (read == 1) {
+    result = Parse(movie, data, (size_t)size);
+  }
+  free(data);
+  if (result == RESULT_NOTOK) {
+    if (movie->global_ctx->error == error) {
+      movie->global_ctx->error = INVALID_STATE;
+    }
+    Clear(movie);
+  }
+  return result;
+}
+
+
+// Loads a state of the movie, refused if the machine has another ROM in.
+static Result Load(const Movie* const movie, Gameboy* const gb,
+                   const uint8_t* const state, size_t size) {
+  if (state == NULL || RomHash(gb) != movie->rom_hash) {
+    gb->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  return StateLoad(gb, state, size);
+}
+
+
+Result MovieStart(const Movie* const movie, Gameboy* const gb) {
+  return Load(movie, gb, movie->start, movie->start_size);
+}
+
+
+// Index of the first event of the frame, or event_count.
+static size_t FirstEvent(const Movie* const movie, unsigned long frame) {
+  size_t low = 0;
+  size_t high = movie->event_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (movie->event_frames[middle] < frame) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+
+Result MovieSeek(const Movie* const movie, Gameboy* const gb,
+                 unsigned long frame) {
+  if (frame > movie->frame_count) {
+    gb->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  size_t keyframe = movie->keyframe_interval > 0
+                        ? frame / movie->keyframe_interval
+                        : 0;
+  if (keyframe > movie->keyframe_count) {
+    keyframe = movie->keyframe_count;
+  }
+  Result result;
+  if (keyframe == 0) {
+    result = MovieStart(movie, gb);
+  }
+  else {
+    size_t offset = movie->keyframe_offsets[keyframe - 1];
+    size_t end = keyframe < movie->keyframe_count
+                     ? movie->keyframe_offsets[keyframe]
+                     : movie->keyframes_size;
+    result = Load(movie, gb, movie->keyframes + offset, end - offset);
+  }
+  for (unsigned long i = keyframe * movie->keyframe_interval;
+       result == RESULT_OK && i < frame; ++i) {
+    result = MoviePlayFrame(movie, gb, i);
+  }
+  return result;
+}
+
+
+Result MoviePlayFrame(const Movie* const movie, Gameboy* const gb,
+                      unsigned long frame) {
+  size_t first = FirstEvent(movie, frame);
+  size_t count = 0;
+  while (first + count < movie->event_count &&
+         movie->event_frames[first + count] == frame) {
+    ++count;
+  }
+  BusSetButtons(gb->bus, movie->buttons[frame]);
+  return GameboyRunFrameInputs(gb, movie->events + first, count);
+}
+
+
+int MovieDigestMatches(const Movie* const movie, Gameboy* const gb,
+                       unsigned long frame) {
+  if (movie->digest_interval == 0 ||
+      (frame + 1) % movie->digest_interval != 0) {
+    return 1;
+  }
+  size_t index = (frame + 1) / movie->digest_interval - 1;
+  return index >= movie->digest_count ||
+         StateHash(gb) == movie->digests[index];
+}
+
+
+int MovieKeyframeMatches(const Movie* const movie, Gameboy* const gb,
+                         unsigned long frame) {
+  if (movie->keyframe_interval == 0 ||
+      (frame + 1) % movie->keyframe_interval != 0 ||
+      (frame + 1) / movie->keyframe_interval > movie->keyframe_count) {
+    return 1;
+  }
+  size_t index = (frame + 1) / movie->keyframe_interval - 1;
+  size_t offset = movie->keyframe_offsets[index];
+  size_t end = index + 1 < movie->keyframe_count
+                   ? movie->keyframe_offsets[index + 1]
+                   : movie->keyframes_size;
+  // Compression is deterministic, so equal states compress the same.
+  size_t bound = StateBound(gb);
+  uint8_t* state = (uint8_t*)malloc(bound);
+  if (state == NULL) {
+    gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return 0;
+  }
+  size_t size = StateSaveCompressed(gb, state, bound);
+  int matches = size == end - offset &&
+                memcmp(state, movie->keyframes + offset, size) == 0;
+  free(state);
+  return matches;
+}
+
+
+Result MoviePlay(const Movie* const movie, Gameboy* const gb,
+                 unsigned long from, unsigned long* const desync) {
+  *desync = MOVIE_NO_DESYNC;
+  if (MovieSeek(movie, gb, from) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  for (unsigned long frame = from; frame < movie->frame_count; ++frame) {
+    if (MoviePlayFrame(movie, gb, frame) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    if (!MovieDigestMatches(movie, gb, frame)) {
+      *desync = frame;
+      break;
+    }
+  }
+  return RESULT_OK;
+}
@@ -0,0 +1,119 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "gb.h"
+#include "global.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Movie files start with a 48 byte header, little endian: magic, version,
+// flags, the emulator version that recorded it, digest interval, ROM hash,
+// the frame, event and digest counts, the size of the start state, then
+// the keyframe interval and count. The start state, the buttons of every
+// frame, the events, the digests, the offset of each keyframe and the
+// keyframes follow in that order.
+#define MOVIE_MAGIC 0x564D4247
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 48
+#define MOVIE_EVENT_SIZE 9
+// Reported by MoviePlay when every digest matched.
+#define MOVIE_NO_DESYNC ULONG_MAX
+
+
+// Recorded session: a starting state and the buttons of every frame,
+// which replay it exactly since emulation is deterministic. Digests of the
+// state taken while recording show where a replay first goes elsewhere.
+typedef struct MovieDef {
+  // Hash64 of the ROM it was recorded with.
+  uint64_t rom_hash;
+  // Emulator that recorded it.
+  uint16_t version_major;
+  uint16_t version_minor;
+  // Compressed saved state the movie starts from.
+  uint8_t* start;
+  size_t start_size;
+  // Buttons held as each frame starts.
+  uint8_t* buttons;
+  size_t frame_count;
+  size_t frame_capacity;
+  // Changes within frames, in frame and cycle order, and the frame of
+  // each. A frame's changes are contiguous, ready to run.
+  GameboyInput* events;
+  uint32_t* event_frames;
+  size_t event_count;
+  size_t event_capacity;
+  // StateHash after every digest_interval frames, none when 0.
+  unsigned int digest_interval;
+  uint64_t* digests;
+  size_t digest_count;
+  size_t digest_capacity;
+  // Compressed saved state after every keyframe_interval frames, none when
+  // 0, so seeking replays at most that many frames. Keyframe i starts at
+  // keyframe_offsets[i] and ends where the next one starts.
+  unsigned int keyframe_interval;
+  uint8_t* keyframes;
+  size_t keyframes_size;
+  size_t keyframes_capacity;
+  uint64_t* keyframe_offsets;
+  size_t keyframe_count;
+  size_t keyframe_capacity;
+  GlobalCtx* global_ctx;
+} Movie;
+
+
+// An empty movie, to be recorded or read.
+Movie* MovieCreate(GlobalCtx* const global_ctx);
+
+void MovieDestroy(Movie* movie);
+
+// Drops what the movie held and starts recording from the machine's
+// current state.
+Result MovieRecord(Movie* const movie, Gameboy* const gb,
+                   unsigned int digest_interval,
+                   unsigned int keyframe_interval);
+
+// Runs and records one frame, holding buttons as it starts and changing
+// them at each input's cycle. Recording runs frames exactly the way they
+// are replayed. inputs must be in cycle order, or nothing is recorded and
+// this fails with INVALID_STATE.
+Result MovieRecordFrame(Movie* const movie, Gameboy* const gb,
+                        uint8_t buttons, const GameboyInput* const inputs,
+                        size_t count);
+
+Result MovieWrite(const Movie* const movie, const char* const path);
+
+// Replaces what the movie held. Malformed files are rejected whole.
+Result MovieRead(Movie* const movie, const char* const path);
+
+// Loads the start state. Fails if the machine has another ROM in.
+Result MovieStart(const Movie* const movie, Gameboy* const gb);
+
+// Puts the machine where it was as frame frame started, from the last
+// keyframe before it. Seeking to frame_count gets to the end.
+Result MovieSeek(const Movie* const movie, Gameboy* const gb,
+                 unsigned long frame);
+
+// Replays frame frame, counted from 0, on a machine that played the ones
+// before it.
+Result MoviePlayFrame(const Movie* const movie, Gameboy* const gb,
+                      unsigned long frame);
+
+// Whether the machine matches the digest taken after frame frame. Frames
+// without one always match.
+int MovieDigestMatches(const Movie* const movie, Gameboy* const gb,
+                       unsigned long frame);
+
+// Whether the machine matches the keyframe saved after frame frame, taken
+// as a mismatch if it can't be saved. Frames without one always match.
+int MovieKeyframeMatches(const Movie* const movie, Gameboy* const gb,
+                         unsigned long frame);
+
+// Replays the movie from frame from to the end as fast as it runs. desync
+// is set to the first frame whose digest didn't match, after which replay
+// stops, or to MOVIE_NO_DESYNC.
+Result MoviePlay(const Movie* const movie, Gameboy* const gb,
+                 unsigned long from, unsigned long* const desync);
+
+#endif
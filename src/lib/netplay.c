@@ -0,0 +1,544 @@
+#include "netplay.h"
+
+#include "bus.h"
+#include "byteorder.h"
+#include "frontend.h"
+#include "gb.h"
+#include "global.h"
+#include "hash.h"
+#include "link.h"
+#include "state.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define _STATE_SLOTS (NETPLAY_MAX_ROLLBACK + 1)
+
+// One frame of the LCD, 70224 cycles at 4194304 Hz.
+static const unsigned int _FRAME_CYCLES = 70224;
+static const long _FRAME_NANOSECONDS = 16742706;
+static const uint32_t _NO_HASH = 0xFFFFFFFF;
+// Longest NetplayRun waits for the peer to take the last buttons, past the
+// send delay.
+static const double _LINGER_SECONDS = 1.0;
+
+
+static double Seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+static Result OpenSocket(Netplay* const netplay,
+                         const NetplayOptions* const options) {
+  char port[8];
+  snprintf(port, sizeof(port), "%u", options->peer_port);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+  struct addrinfo* peer = NULL;
+  if (getaddrinfo(options->peer_host, port, &hints, &peer) != 0) {
+    netplay->global_ctx->error = NETWORK_FAILURE;
+    return RESULT_NOTOK;
+  }
+  memcpy(&netplay->peer, peer->ai_addr, peer->ai_addrlen);
+  netplay->peer_size = peer->ai_addrlen;
+  int family = peer->ai_family;
+  freeaddrinfo(peer);
+
+  struct sockaddr_storage local;
+  memset(&local, 0, sizeof(local));
+  socklen_t local_size;
+  if (family == AF_INET6) {
+    struct sockaddr_in6* address = (struct sockaddr_in6*)&local;
+    address->sin6_family = AF_INET6;
+    address->sin6_addr = in6addr_any;
+    address->sin6_port = htons(options->port);
+    local_size = sizeof(*address);
+  }
+  else {
+    struct sockaddr_in* address = (struct sockaddr_in*)&local;
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_ANY);
+    address->sin_port = htons(options->port);
+    local_size = sizeof(*address);
+  }
+  netplay->socket = socket(family, SOCK_DGRAM, 0);
+  if (netplay->socket < 0 ||
+      bind(netplay->socket, (struct sockaddr*)&local, local_size) != 0 ||
+      fcntl(netplay->socket, F_SETFL,
+            fcntl(netplay->socket, F_GETFL) | O_NONBLOCK) != 0) {
+    netplay->global_ctx->error = NETWORK_FAILURE;
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
+
+
+Netplay* NetplayCreate(GlobalCtx* const global_ctx,
+                       const NetplayOptions* const options) {
+  Netplay* netplay = (Netplay*)calloc(1, sizeof(Netplay));
+  if (netplay == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  netplay->global_ctx = global_ctx;
+  netplay->socket = -1;
+  netplay->player = options->player != 0;
+  netplay->send_delay_ms = options->send_delay_ms;
+  netplay->render = options->render;
+  netplay->rollback = ULONG_MAX;
+  netplay->peer_hash_frame = ULONG_MAX;
+  netplay->stats.desync = NETPLAY_NO_DESYNC;
+
+  size_t slot_size = 0;
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    Gameboy* gb = &netplay->machines[i];
+    int shown = i == netplay->player && options->render;
+    gb->options = (GameboyOptions){
+      .color_profile = COLOR_PROFILE_LCD,
+      .apu_mode = APU_MODE_ELIDED,
+      .render_mode = shown ? RENDER_MODE_INLINE : RENDER_MODE_NONE
+    };
+    gb->global_ctx = &netplay->contexts[i];
+    if (GameboyInit(gb, options->roms[i]) == RESULT_NOTOK) {
+      global_ctx->error = gb->global_ctx->error;
+      GameboyDestroy(gb);
+      NetplayDestroy(netplay);
+      return NULL;
+    }
+    netplay->state_size[i] = StateSize(gb);
+    slot_size += netplay->state_size[i];
+  }
+  netplay->link = LinkCreate(global_ctx, netplay->machines, NETPLAY_PLAYERS);
+  if (netplay->link == NULL) {
+    NetplayDestroy(netplay);
+    return NULL;
+  }
+
+  netplay->states = (uint8_t*)malloc(slot_size * _STATE_SLOTS);
+  netplay->outbox =
+      (NetplayPacket*)malloc(NETPLAY_OUTBOX_SIZE * sizeof(NetplayPacket));
+  if (netplay->states == NULL || netplay->outbox == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    NetplayDestroy(netplay);
+    return NULL;
+  }
+  if (OpenSocket(netplay, options) == RESULT_NOTOK) {
+    NetplayDestroy(netplay);
+    return NULL;
+  }
+  netplay->heard_at = Seconds();
+  // Buttons start out released for as long as the input delay.
+  netplay->local_count = options->input_delay < NETPLAY_INPUT_WINDOW / 2
+                             ? options->input_delay
+                             : NETPLAY_INPUT_WINDOW / 2;
+  return netplay;
+}
+
+
+void NetplayDestroy(Netplay* netplay) {
+  if (netplay == NULL) {
+    return;
+  }
+  if (netplay->socket >= 0) {
+    close(netplay->socket);
+  }
+  LinkDestroy(netplay->link);
+  netplay->link = NULL;
+  // Machines that were never loaded have no context.
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    if (netplay->machines[i].global_ctx != NULL) {
+      GameboyDestroy(&netplay->machines[i]);
+    }
+  }
+  free(netplay->states);
+  free(netplay->outbox);
+  netplay->states = NULL;
+  netplay->outbox = NULL;
+  netplay->global_ctx = NULL;
+  free(netplay);
+  netplay = NULL;
+}
+
+
+Gameboy* NetplayLocal(Netplay* const netplay) {
+  return &netplay->machines[netplay->player];
+}
+
+
+static uint8_t* Slot(Netplay* const netplay, unsigned long frame) {
+  size_t slot_size = netplay->state_size[0] + netplay->state_size[1];
+  return netplay->states + (frame % _STATE_SLOTS) * slot_size;
+}
+
+
+static Result SaveFrame(Netplay* const netplay) {
+  uint8_t* slot = Slot(netplay, netplay->frame);
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    if (StateSave(&netplay->machines[i], slot,
+                  netplay->state_size[i]) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    slot += netplay->state_size[i];
+  }
+  return RESULT_OK;
+}
+
+
+static Result LoadFrame(Netplay* const netplay, unsigned long frame) {
+  const uint8_t* slot = Slot(netplay, frame);
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    if (StateLoad(&netplay->machines[i], slot,
+                  netplay->state_size[i]) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    slot += netplay->state_size[i];
+  }
+  netplay->frame = frame;
+  return RESULT_OK;
+}
+
+
+// Saves the state the frame starts from, then runs both machines through
+// it in lockstep. A frame is a frame's worth of cycles on each machine
+// rather than up to its next vertical blank, so the two keep in step.
+static Result RunFrame(Netplay* const netplay) {
+  if (SaveFrame(netplay) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  size_t index = netplay->frame % NETPLAY_INPUT_WINDOW;
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    BusSetButtons(netplay->machines[i].bus, netplay->inputs[i][index]);
+  }
+  if (LinkRunCycles(netplay->link, _FRAME_CYCLES) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  ++netplay->frame;
+  return RESULT_OK;
+}
+
+
+static void CheckHash(Netplay* const netplay) {
+  unsigned long frame = netplay->peer_hash_frame;
+  if (frame == ULONG_MAX || frame >= netplay->hashed ||
+      netplay->hashed - frame > NETPLAY_INPUT_WINDOW) {
+    return;
+  }
+  if (netplay->hashes[frame % NETPLAY_INPUT_WINDOW] != netplay->peer_hash &&
+      frame < netplay->stats.desync) {
+    netplay->stats.desync = frame;
+  }
+  netplay->peer_hash_frame = ULONG_MAX;
+}
+
+
+// Hashes the saved states no prediction led to that weren't yet. They are
+// all still saved, as the session never predicts further back than that.
+static void HashFinalFrames(Netplay* const netplay) {
+  unsigned long final = netplay->remote_count < netplay->frame - 1
+                            ? netplay->remote_count
+                            : netplay->frame - 1;
+  size_t slot_size = netplay->state_size[0] + netplay->state_size[1];
+  for (; netplay->hashed <= final &&
+         netplay->frame - netplay->hashed < _STATE_SLOTS;
+       ++netplay->hashed) {
+    netplay->hashes[netplay->hashed % NETPLAY_INPUT_WINDOW] =
+        Hash64(Slot(netplay, netplay->hashed), slot_size, 0);
+  }
+  CheckHash(netplay);
+}
+
+
+// Whether a packet came from the peer's address and port.
+static int FromPeer(const Netplay* const netplay,
+                    const struct sockaddr_storage* const from) {
+  if (from->ss_family != netplay->peer.ss_family) {
+    return 0;
+  }
+  if (from->ss_family == AF_INET6) {
+    const struct sockaddr_in6* a = (const struct sockaddr_in6*)from;
+    const struct sockaddr_in6* b = (const struct sockaddr_in6*)&netplay->peer;
+    return a->sin6_port == b->sin6_port &&
+           memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+  }
+  const struct sockaddr_in* a = (const struct sockaddr_in*)from;
+  const struct sockaddr_in* b = (const struct sockaddr_in*)&netplay->peer;
+  return a->sin_port == b->sin_port &&
+         a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+
+static void Receive(Netplay* const netplay) {
+  int remote = !netplay->player;
+  uint8_t packet[NETPLAY_MAX_PACKET];
+  struct sockaddr_storage from;
+  socklen_t from_size = sizeof(from);
+  ssize_t size;
+  while ((size = recvfrom(netplay->socket, packet, sizeof(packet), 0,
+                          (struct sockaddr*)&from, &from_size)) >= 0) {
+    from_size = sizeof(from);
+    if (!FromPeer(netplay, &from) || (size_t)size < NETPLAY_HEADER_SIZE ||
+        Get32(packet) != NETPLAY_MAGIC ||
+        Get16(packet + 12) != (size_t)size - NETPLAY_HEADER_SIZE) {
+      continue;
+    }
+    netplay->heard_at = Seconds();
+    unsigned long start = Get32(packet + 4);
+    unsigned long ack = Get32(packet + 8);
+    size_t count = Get16(packet + 12);
+    if (ack > netplay->peer_ack && ack <= netplay->local_count) {
+      netplay->peer_ack = ack;
+    }
+    // Only the next frame expected is taken, so a packet that overtook an
+    // earlier one adds nothing. Every packet repeats whatever wasn't acked.
+    for (size_t i = 0; i < count; ++i) {
+      unsigned long frame = start + i;
+      if (frame != netplay->remote_count ||
+          frame >= netplay->frame + NETPLAY_INPUT_WINDOW / 2) {
+        continue;
+      }
+      uint8_t buttons = packet[NETPLAY_HEADER_SIZE + i];
+      uint8_t* input = &netplay->inputs[remote][frame % NETPLAY_INPUT_WINDOW];
+      if (frame < netplay->frame && *input != buttons &&
+          frame < netplay->rollback) {
+        netplay->rollback = frame;
+      }
+      *input = buttons;
+      ++netplay->remote_count;
+    }
+    if (Get32(packet + 16) != _NO_HASH) {
+      netplay->peer_hash_frame = Get32(packet + 16);
+      netplay->peer_hash = Get64(packet + 24);
+      CheckHash(netplay);
+    }
+  }
+  // Buttons not yet received are predicted to stay as they last were,
+  // including on frames already run, so a rollback runs them again on the
+  // latest prediction. Whichever of those it changed ran after a frame
+  // whose buttons just turned out wrong, so they are run again anyway.
+  uint8_t held = netplay->remote_count > 0
+                     ? netplay->inputs[remote][(netplay->remote_count - 1) %
+                                               NETPLAY_INPUT_WINDOW]
+                     : 0;
+  for (unsigned long frame = netplay->remote_count;
+       frame <= netplay->frame + NETPLAY_MAX_ROLLBACK; ++frame) {
+    netplay->inputs[remote][frame % NETPLAY_INPUT_WINDOW] = held;
+  }
+}
+
+
+// Sends whatever is due in the outbox.
+static void Flush(Netplay* const netplay) {
+  double now = Seconds();
+  while (netplay->outbox_count > 0 &&
+         netplay->outbox[netplay->outbox_head].send_at <= now) {
+    const NetplayPacket* packet = &netplay->outbox[netplay->outbox_head];
+    // UDP may drop it anyway, and the next packet repeats it.
+    sendto(netplay->socket, packet->data, packet->size, 0,
+           (const struct sockaddr*)&netplay->peer, netplay->peer_size);
+    netplay->outbox_head = (netplay->outbox_head + 1) % NETPLAY_OUTBOX_SIZE;
+    --netplay->outbox_count;
+  }
+}
+
+
+// Queues the local buttons the peer hasn't acknowledged.
+static void Send(Netplay* const netplay) {
+  if (netplay->outbox_count == NETPLAY_OUTBOX_SIZE) {
+    // Lost like any other packet.
+    netplay->outbox_head = (netplay->outbox_head + 1) % NETPLAY_OUTBOX_SIZE;
+    --netplay->outbox_count;
+  }
+  NetplayPacket* packet =
+      &netplay->outbox[(netplay->outbox_head + netplay->outbox_count++) %
+                       NETPLAY_OUTBOX_SIZE];
+  packet->send_at = Seconds() + netplay->send_delay_ms / 1000.0;
+
+  unsigned long start = netplay->peer_ack;
+  size_t count = netplay->local_count - start;
+  uint8_t* data = packet->data;
+  memset(data, 0, NETPLAY_HEADER_SIZE);
+  Put32(data, NETPLAY_MAGIC);
+  Put32(data + 4, (uint32_t)start);
+  Put32(data + 8, (uint32_t)netplay->remote_count);
+  Put16(data + 12, (uint16_t)count);
+  if (netplay->hashed > 0) {
+    unsigned long frame = netplay->hashed - 1;
+    Put32(data + 16, (uint32_t)frame);
+    Put64(data + 24, netplay->hashes[frame % NETPLAY_INPUT_WINDOW]);
+  }
+  else {
+    Put32(data + 16, _NO_HASH);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    data[NETPLAY_HEADER_SIZE + i] =
+        netplay->inputs[netplay->player][(start + i) % NETPLAY_INPUT_WINDOW];
+  }
+  packet->size = NETPLAY_HEADER_SIZE + count;
+  Flush(netplay);
+}
+
+
+// Goes back to the first frame that ran on a wrong prediction and runs
+// forward again to where the session was. Only the last frame is drawn.
+static Result Rollback(Netplay* const netplay) {
+  unsigned long frame = netplay->frame;
+  unsigned long from = netplay->rollback;
+  netplay->rollback = ULONG_MAX;
+  if (from >= frame) {
+    return RESULT_OK;
+  }
+  double start = Seconds();
+  Gameboy* local = NetplayLocal(netplay);
+  if (LoadFrame(netplay, from) == RESULT_NOTOK) {
+    netplay->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  local->bus->ppu.logging = 0;
+  while (netplay->frame < frame) {
+    if (RunFrame(netplay) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+  }
+  if (netplay->render) {
+    // The frame about to run is drawn from what the machine holds now.
+    PpuRendererSync(local->renderer, &local->bus->vram, local->bus->oam,
+                    local->bus->ppu.palette_ram);
+    local->bus->ppu.logging = 1;
+  }
+
+  unsigned int count = (unsigned int)(frame - from);
+  double milliseconds = (Seconds() - start) * 1000.0;
+  ++netplay->stats.rollbacks;
+  netplay->stats.resimulated += count;
+  if (count > netplay->stats.max_resimulated) {
+    netplay->stats.max_resimulated = count;
+  }
+  if (milliseconds > netplay->stats.max_rollback_ms) {
+    netplay->stats.max_rollback_ms = milliseconds;
+  }
+  return RESULT_OK;
+}
+
+
+Result NetplayAdvance(Netplay* const netplay, uint8_t buttons,
+                      int* const advanced) {
+  *advanced = 0;
+  Receive(netplay);
+  if (netplay->stats.desync != NETPLAY_NO_DESYNC) {
+    netplay->global_ctx->error = NETPLAY_DESYNC;
+    return RESULT_NOTOK;
+  }
+  // Wait rather than predict further than a rollback can take back, or
+  // hold more buttons than the peer could be sent.
+  if (netplay->frame >= netplay->remote_count + NETPLAY_MAX_ROLLBACK ||
+      netplay->local_count - netplay->peer_ack >= NETPLAY_INPUT_WINDOW / 2) {
+    ++netplay->stats.stalls;
+    if (Seconds() - netplay->heard_at > NETPLAY_TIMEOUT_SECONDS) {
+      netplay->global_ctx->error = NETWORK_FAILURE;
+      return RESULT_NOTOK;
+    }
+    Send(netplay);
+    return RESULT_OK;
+  }
+
+  netplay->inputs[netplay->player][netplay->local_count %
+                                   NETPLAY_INPUT_WINDOW] = buttons;
+  ++netplay->local_count;
+  Send(netplay);
+  if (Rollback(netplay) == RESULT_NOTOK || RunFrame(netplay) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  HashFinalFrames(netplay);
+  *advanced = 1;
+  return RESULT_OK;
+}
+
+
+// Keeps sending until the peer has every button given and the outbox is
+// empty, or for a moment past the send delay at most. Whatever the peer
+// sends is acked, as it may be lingering too.
+static void Linger(Netplay* const netplay) {
+  double until = Seconds() + netplay->send_delay_ms / 1000.0 +
+                 _LINGER_SECONDS;
+  while ((netplay->peer_ack < netplay->local_count ||
+          netplay->outbox_count > 0) &&
+         Seconds() < until) {
+    double heard_at = netplay->heard_at;
+    Receive(netplay);
+    if (netplay->peer_ack < netplay->local_count ||
+        netplay->heard_at != heard_at) {
+      Send(netplay);
+    }
+    else {
+      Flush(netplay);
+    }
+    struct timespec sleep = {.tv_sec = 0, .tv_nsec = 1000000};
+    nanosleep(&sleep, NULL);
+  }
+}
+
+
+Result NetplayRun(Netplay* const netplay, const Frontend* const frontend,
+                  unsigned long frames) {
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  Result result = RESULT_OK;
+  while (frames == 0 || netplay->frame < frames) {
+    if (frontend != NULL && !frontend->poll(frontend->data)) {
+      break;
+    }
+    uint8_t buttons = frontend != NULL && frontend->buttons != NULL
+                          ? frontend->buttons(frontend->data)
+                          : 0;
+    int advanced;
+    result = NetplayAdvance(netplay, buttons, &advanced);
+    if (result == RESULT_NOTOK) {
+      break;
+    }
+    if (advanced && frontend != NULL && netplay->render) {
+      frontend->present(frontend->data,
+                        NetplayLocal(netplay)->renderer->framebuffer);
+    }
+
+    // One frame per refresh of the real LCD. A session that fell behind
+    // starts counting again rather than rushing to catch up.
+    next.tv_nsec += _FRAME_NANOSECONDS;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long wait = (long long)(next.tv_sec - now.tv_sec) * 1000000000LL +
+                     (next.tv_nsec - now.tv_nsec);
+    if (wait > 0) {
+      struct timespec sleep = {
+        .tv_sec = (time_t)(wait / 1000000000LL),
+        .tv_nsec = (long)(wait % 1000000000LL)
+      };
+      while (nanosleep(&sleep, &sleep) != 0 && errno == EINTR) {
+      }
+    }
+    else if (wait < -_FRAME_NANOSECONDS) {
+      next = now;
+    }
+  }
+  if (result == RESULT_OK) {
+    Linger(netplay);
+  }
+  return result;
+}
@@ -0,0 +1,151 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include "frontend.h"
+#include "gb.h"
+#include "global.h"
+#include "link.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+#define NETPLAY_PLAYERS 2
+// Frames the remote buttons may be predicted for before the session waits
+// on the peer, and so the most one rollback runs again.
+#define NETPLAY_MAX_ROLLBACK 8
+// Frames of buttons kept for each player.
+#define NETPLAY_INPUT_WINDOW 128
+// Packets are a 32 byte header, little endian: magic, first frame, frames
+// of the receiver's buttons the sender has, button count, flags, the frame
+// of the sender's last final state and its hash. One byte of buttons per
+// frame follows.
+#define NETPLAY_MAGIC 0x504E4247
+#define NETPLAY_HEADER_SIZE 32
+#define NETPLAY_MAX_PACKET (NETPLAY_HEADER_SIZE + NETPLAY_INPUT_WINDOW)
+// Packets held back for the send delay.
+#define NETPLAY_OUTBOX_SIZE 256
+#define NETPLAY_NO_DESYNC ULONG_MAX
+// Seconds the session waits on a silent peer before failing.
+#define NETPLAY_TIMEOUT_SECONDS 10
+
+
+typedef struct NetplayOptionsDef {
+  // ROM of each player's machine, the same on both peers.
+  const char* roms[NETPLAY_PLAYERS];
+  // Player whose buttons this side gives.
+  int player;
+  // UDP port to listen on, and where the peer listens.
+  uint16_t port;
+  const char* peer_host;
+  uint16_t peer_port;
+  // Frames local buttons wait before they take effect. Each one hides a
+  // frame of network latency from rollbacks at the cost of input lag.
+  unsigned int input_delay;
+  // Held back from every packet sent, to try out latency on loopback.
+  unsigned int send_delay_ms;
+  // Whether the local player's machine rasterizes its frames.
+  int render;
+} NetplayOptions;
+
+typedef struct NetplayStatsDef {
+  unsigned long rollbacks;
+  // Frames run again by rollbacks, and the most by any one.
+  unsigned long resimulated;
+  unsigned int max_resimulated;
+  // Longest a rollback took, in milliseconds.
+  double max_rollback_ms;
+  // Calls to NetplayAdvance that waited on the peer.
+  unsigned long stalls;
+  // First frame whose final state differed from the peer's, or
+  // NETPLAY_NO_DESYNC.
+  unsigned long desync;
+} NetplayStats;
+
+// Packet waiting out the send delay.
+typedef struct NetplayPacketDef {
+  double send_at;
+  size_t size;
+  uint8_t data[NETPLAY_MAX_PACKET];
+} NetplayPacket;
+
+// Two player link play between two peers over UDP. Both peers run both
+// players' machines, linked by cable, so only buttons cross the network.
+// The remote player's buttons are predicted to stay held until they
+// arrive, and when they turn out otherwise both machines go back to the
+// first frame that was wrong and run forward again at once. States are
+// saved every frame for this, and hashed once final so the peers can tell
+// when they went apart.
+typedef struct NetplayDef {
+  Gameboy machines[NETPLAY_PLAYERS];
+  GlobalCtx contexts[NETPLAY_PLAYERS];
+  // Cable between the machines, which run each frame in lockstep.
+  Link* link;
+  int player;
+  unsigned int send_delay_ms;
+  int render;
+  int socket;
+  struct sockaddr_storage peer;
+  socklen_t peer_size;
+  // When the peer was last heard from.
+  double heard_at;
+  // Next frame to run, counted from 0.
+  unsigned long frame;
+  // Buttons of each player for frame f, at f % NETPLAY_INPUT_WINDOW. The
+  // remote player's are predicted from remote_count on.
+  uint8_t inputs[NETPLAY_PLAYERS][NETPLAY_INPUT_WINDOW];
+  // Frames of local buttons given and of remote buttons received.
+  unsigned long local_count;
+  unsigned long remote_count;
+  // Frames of local buttons the peer has.
+  unsigned long peer_ack;
+  // First frame run with a wrong prediction, ULONG_MAX if none.
+  unsigned long rollback;
+  // Both machines' states as frame f started, at f % (NETPLAY_MAX_ROLLBACK
+  // + 1), each machine's state_size bytes after the other's.
+  uint8_t* states;
+  size_t state_size[NETPLAY_PLAYERS];
+  // Hash of the state as frame f started, at f % NETPLAY_INPUT_WINDOW, for
+  // frames below hashed. States are final once no prediction led to them.
+  uint64_t hashes[NETPLAY_INPUT_WINDOW];
+  unsigned long hashed;
+  // Latest final state the peer reported.
+  unsigned long peer_hash_frame;
+  uint64_t peer_hash;
+  NetplayPacket* outbox;
+  size_t outbox_head;
+  size_t outbox_count;
+  NetplayStats stats;
+  GlobalCtx* global_ctx;
+} Netplay;
+
+
+// Loads both machines, links them and opens the socket. Returns NULL on
+// failure.
+Netplay* NetplayCreate(GlobalCtx* const global_ctx,
+                       const NetplayOptions* const options);
+
+void NetplayDestroy(Netplay* netplay);
+
+// Runs the next frame with buttons as the local player's, rolling back
+// first if the peer's buttons proved a prediction wrong. advanced is set
+// to 0 when the peer is too far behind to run a frame, and the frame waits.
+// Fails with NETPLAY_DESYNC once the peers' states differ, and with
+// NETWORK_FAILURE once the peer has been silent for
+// NETPLAY_TIMEOUT_SECONDS while the frame waits.
+Result NetplayAdvance(Netplay* const netplay, uint8_t buttons,
+                      int* const advanced);
+
+// Machine of the local player, with the frame to show.
+Gameboy* NetplayLocal(Netplay* const netplay);
+
+// Runs a frame per display refresh until the frontend is closed, or for
+// frames frames when not 0. frontend may be NULL to run without one,
+// holding no buttons. Before returning it lingers a moment to get the last
+// buttons to the peer, which may still need them to finish.
+Result NetplayRun(Netplay* const netplay, const Frontend* const frontend,
+                  unsigned long frames);
+
+#endif
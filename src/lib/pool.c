@@ -0,0 +1,215 @@
+#ifdef __linux__
+  // pthread_setaffinity_np and the CPU_SET macros.
+  #define _GNU_SOURCE
+#endif
+
+#include "pool.h"
+
+#include "global.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+
+typedef struct WorkerArgsDef {
+  ThreadPool* pool;
+  int worker;
+  int pin;
+} WorkerArgs;
+
+
+int ThreadPoolCores(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+}
+
+
+static void Pin(int worker) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(worker % ThreadPoolCores(), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)worker;
+#endif
+}
+
+
+// Takes the next index from the worker's own queue, or steals the oldest
+// one from another worker. Returns 0 once every queue is empty.
+static int NextIndex(ThreadPool* const pool, int worker, size_t* const index) {
+  WorkQueue* own = &pool->queues[worker];
+  pthread_mutex_lock(&own->lock);
+  if (own->top < own->bottom) {
+    *index = --own->bottom;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (int i = 1; i < pool->size; ++i) {
+    WorkQueue* victim = &pool->queues[(worker + i) % pool->size];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom) {
+      *index = victim->top++;
+      pthread_mutex_unlock(&victim->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return 0;
+}
+
+
+static void Work(ThreadPool* const pool, int worker) {
+  size_t index;
+  while (NextIndex(pool, worker, &index)) {
+    pool->task(pool->ctx, index, worker);
+  }
+}
+
+
+static void* WorkerMain(void* const args_arg) {
+  WorkerArgs* args = (WorkerArgs*)args_arg;
+  ThreadPool* const pool = args->pool;
+  const int worker = args->worker;
+  if (args->pin) {
+    Pin(worker);
+  }
+  free(args);
+  unsigned long generation = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == generation && !pool->stop) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    Work(pool, worker);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+
+ThreadPool* ThreadPoolCreate(GlobalCtx* const global_ctx, int size, int pin) {
+  ThreadPool* pool = (ThreadPool*)malloc(sizeof(ThreadPool));
+  if (pool == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(pool, 0, sizeof(ThreadPool));
+  pool->global_ctx = global_ctx;
+  pool->size = size > 0 ? size : ThreadPoolCores();
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  pool->queues = (WorkQueue*)aligned_alloc(
+      _Alignof(WorkQueue), pool->size * sizeof(WorkQueue));
+  pool->threads = (pthread_t*)malloc(pool->size * sizeof(pthread_t));
+  if (pool->queues == NULL || pool->threads == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i < pool->size; ++i) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pool->queues[i].top = 0;
+    pool->queues[i].bottom = 0;
+  }
+
+  // Threads that fail to start shrink the pool rather than fail it.
+  int started = 1;
+  for (int i = 1; i < pool->size; ++i) {
+    WorkerArgs* args = (WorkerArgs*)malloc(sizeof(WorkerArgs));
+    if (args == NULL) {
+      break;
+    }
+    args->pool = pool;
+    args->worker = started;
+    args->pin = pin;
+    if (pthread_create(&pool->threads[started - 1], NULL, WorkerMain,
+                       args) != 0) {
+      free(args);
+      break;
+    }
+    ++started;
+  }
+  pool->size = started;
+  return pool;
+}
+
+
+void ThreadPoolDestroy(ThreadPool* pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->size - 1; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->size; ++i) {
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->queues);
+  free(pool->threads);
+  pool->queues = NULL;
+  pool->threads = NULL;
+  pool->global_ctx = NULL;
+  free(pool);
+  pool = NULL;
+}
+
+
+void ThreadPoolRun(ThreadPool* const pool, ThreadPoolTask task,
+                   void* const ctx, size_t count) {
+  // Contiguous shares, so neighbouring indices start on the same worker.
+  for (int i = 0; i < pool->size; ++i) {
+    WorkQueue* queue = &pool->queues[i];
+    pthread_mutex_lock(&queue->lock);
+    queue->top = count * i / pool->size;
+    queue->bottom = count * (i + 1) / pool->size;
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->ctx = ctx;
+  pool->busy = pool->size - 1;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  Work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "global.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+
+// Runs task(ctx, index, worker) for one index of a batch. worker is the
+// index of the thread running it, below the pool's size.
+typedef void (*ThreadPoolTask)(void* const ctx, size_t index, int worker);
+
+// Indices of the current batch owned by one worker. The owner takes from
+// the bottom and idle workers steal from the top, so the owner keeps its
+// cache warm on neighbouring indices while stealing balances the load.
+typedef struct WorkQueueDef {
+  _Alignas(64) pthread_mutex_t lock;
+  size_t top;
+  size_t bottom;
+} WorkQueue;
+
+// Fixed set of workers that run batches of independent tasks. Threads are
+// created once and sleep between batches, so running a batch costs a wake
+// up rather than a thread start. The thread calling ThreadPoolRun works as
+// worker 0.
+typedef struct ThreadPoolDef {
+  // size - 1 threads, one per worker after the first.
+  pthread_t* threads;
+  WorkQueue* queues;
+  int size;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  // Bumped for every batch.
+  unsigned long generation;
+  // Threads still working on the current batch.
+  int busy;
+  int stop;
+  ThreadPoolTask task;
+  void* ctx;
+  GlobalCtx* global_ctx;
+} ThreadPool;
+
+
+// Number of cores online.
+int ThreadPoolCores(void);
+
+// size workers, or one per core if size is 0. With pin set, the thread of
+// worker i is bound to core i modulo the core count where the host
+// supports it. The calling thread is left alone.
+ThreadPool* ThreadPoolCreate(GlobalCtx* const global_ctx, int size, int pin);
+
+void ThreadPoolDestroy(ThreadPool* pool);
+
+// Runs task for every index below count and returns once all are done.
+void ThreadPoolRun(ThreadPool* const pool, ThreadPoolTask task,
+                   void* const ctx, size_t count);
+
+#endif
@@ -0,0 +1,732 @@
+#include "ppu.h"
+
+#include "color.h"
+#include "cow.h"
+#include "global.h"
+#include "ring.h"
+#include "triple_buffer.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const uint16_t _LCDC_REG = 0xFF40;
+static const uint16_t _STAT_REG = 0xFF41;
+static const uint16_t _SCY_REG = 0xFF42;
+static const uint16_t _SCX_REG = 0xFF43;
+static const uint16_t _LY_REG = 0xFF44;
+static const uint16_t _LYC_REG = 0xFF45;
+static const uint16_t _BGP_REG = 0xFF47;
+static const uint16_t _OBP0_REG = 0xFF48;
+static const uint16_t _OBP1_REG = 0xFF49;
+static const uint16_t _WY_REG = 0xFF4A;
+static const uint16_t _WX_REG = 0xFF4B;
+static const uint16_t _BCPS_REG = 0xFF68;
+static const uint16_t _BCPD_REG = 0xFF69;
+static const uint16_t _OCPS_REG = 0xFF6A;
+static const uint16_t _OCPD_REG = 0xFF6B;
+
+static const uint16_t _OAM_SCAN_END = 80;
+static const uint16_t _DRAWING_END = 252;
+static const uint16_t _DOTS_PER_LINE = 456;
+static const uint8_t _VBLANK_BEGIN = 144;
+static const uint8_t _LINES_PER_FRAME = 154;
+
+// Enough for several frames worth of scanlines plus heavy VRAM traffic.
+static const size_t _LOG_CAPACITY = 1 << 15;
+
+// Offset of the sprite palettes in palette RAM.
+static const uint8_t _OBJ_PALETTES = 0x40;
+
+static const uint16_t _TILE_MAP_0 = 0x1800;
+static const uint16_t _TILE_MAP_1 = 0x1C00;
+static const uint16_t _TILE_DATA_END = 0x1800;
+static const uint16_t _VRAM_BANK_SIZE = 0x2000;
+static const uint16_t _TILES_PER_BANK = 384;
+static const int _SPRITE_COUNT = 40;
+
+static const uint32_t _DMG_SHADES[4] = {
+  0xFFFFFFFF,
+  0xFFAAAAAA,
+  0xFF555555,
+  0xFF000000
+};
+
+
+Result PpuInit(Ppu* const ppu, GlobalCtx* const global_ctx) {
+  memset(ppu, 0, sizeof(Ppu));
+  ppu->global_ctx = global_ctx;
+  ppu->logging = 1;
+  PpuReset(ppu);
+  ppu->log = RingBufferCreate(global_ctx, _LOG_CAPACITY, sizeof(PpuLogEntry));
+  if (ppu->log == NULL) {
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
+
+
+void PpuReset(Ppu* const ppu) {
+  // Post boot ROM state, LCD and background on.
+  memset(&ppu->regs, 0, sizeof(ppu->regs));
+  ppu->regs.lcdc = 0x91;
+  ppu->regs.bgp = 0xFC;
+  ppu->mode = PPU_MODE_OAM_SCAN;
+  ppu->dot = 0;
+  ppu->stat_line = 0;
+  // The CGB boot ROM leaves every background palette white.
+  memset(ppu->palette_ram, 0xFF, sizeof(ppu->palette_ram));
+  ppu->frames = 0;
+}
+
+
+void PpuDestroy(Ppu* const ppu) {
+  if (ppu == NULL) {
+    return;
+  }
+  RingBufferDestroy(ppu->log);
+  ppu->log = NULL;
+  ppu->global_ctx = NULL;
+}
+
+
+static void PushLog(Ppu* const ppu, const PpuLogEntry* const entry) {
+  if (!ppu->logging) {
+    return;
+  }
+  // The renderer has fallen a full log behind. Wait for it rather than drop
+  // writes, unless the machine is shutting down and nobody is consuming.
+  while (RingBufferPush(ppu->log, entry, 1) == 0) {
+    if (ppu->global_ctx->error != NO_ERROR ||
+        ppu->global_ctx->status == STATUS_STOP) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+
+static void LogScanline(Ppu* const ppu) {
+  PpuLogEntry entry = {
+    .type = PPU_LOG_SCANLINE,
+    .addr = ppu->regs.ly,
+    .lcdc = ppu->regs.lcdc,
+    .scy = ppu->regs.scy,
+    .scx = ppu->regs.scx,
+    .wy = ppu->regs.wy,
+    .wx = ppu->regs.wx,
+    .bgp = ppu->regs.bgp,
+    .obp0 = ppu->regs.obp0,
+    .obp1 = ppu->regs.obp1
+  };
+  PushLog(ppu, &entry);
+}
+
+
+void PpuClearLog(Ppu* const ppu) {
+  PpuLogEntry entries[256];
+  while (RingBufferPop(ppu->log, entries, 256) > 0) {
+  }
+}
+
+
+void PpuLogVramWrite(Ppu* const ppu, uint16_t offset, uint8_t data) {
+  PpuLogEntry entry = {
+    .type = PPU_LOG_VRAM_WRITE,
+    .value = data,
+    .addr = offset
+  };
+  PushLog(ppu, &entry);
+}
+
+
+static void WritePaletteData(Ppu* const ppu, uint8_t* const spec,
+                             uint8_t base, uint8_t data) {
+  uint8_t index = base + (*spec & 0x3F);
+  ppu->palette_ram[index] = data;
+  PpuLogEntry entry = {
+    .type = PPU_LOG_PALETTE_WRITE,
+    .value = data,
+    .addr = index
+  };
+  PushLog(ppu, &entry);
+  // Bit 7 of the spec register auto increments the index after each write.
+  if (*spec & 0x80) {
+    *spec = 0x80 | ((*spec + 1) & 0x3F);
+  }
+}
+
+
+void PpuLogOamWrite(Ppu* const ppu, uint16_t offset, uint8_t data) {
+  PpuLogEntry entry = {
+    .type = PPU_LOG_OAM_WRITE,
+    .value = data,
+    .addr = offset
+  };
+  PushLog(ppu, &entry);
+}
+
+
+static void UpdateStatLine(Ppu* const ppu, uint8_t* const interrupts_flag) {
+  uint8_t stat = ppu->regs.stat;
+  int coincidence = ppu->regs.ly == ppu->regs.lyc;
+  uint8_t line = ((stat & 0x40) && coincidence) ||
+                 ((stat & 0x08) && ppu->mode == PPU_MODE_HBLANK) ||
+                 ((stat & 0x10) && ppu->mode == PPU_MODE_VBLANK) ||
+                 ((stat & 0x20) && ppu->mode == PPU_MODE_OAM_SCAN);
+  if (line && !ppu->stat_line) {
+    RequestInterrupt(INTERRUPT_STAT, interrupts_flag);
+  }
+  ppu->stat_line = line;
+}
+
+
+static uint16_t NextModeChange(const Ppu* const ppu) {
+  switch (ppu->mode) {
+    case PPU_MODE_OAM_SCAN:
+      return _OAM_SCAN_END;
+    case PPU_MODE_DRAWING:
+      return _DRAWING_END;
+    default:
+      return _DOTS_PER_LINE;
+  }
+}
+
+
+static void ChangeMode(Ppu* const ppu, uint8_t* const interrupts_flag) {
+  if (ppu->dot == _DOTS_PER_LINE) {
+    ppu->dot = 0;
+    ppu->regs.ly++;
+    if (ppu->regs.ly == _VBLANK_BEGIN) {
+      ppu->mode = PPU_MODE_VBLANK;
+      RequestInterrupt(INTERRUPT_VBANK, interrupts_flag);
+      ++ppu->frames;
+      PpuLogEntry entry = {.type = PPU_LOG_FRAME_END};
+      PushLog(ppu, &entry);
+    }
+    else if (ppu->regs.ly == _LINES_PER_FRAME) {
+      ppu->regs.ly = 0;
+      ppu->mode = PPU_MODE_OAM_SCAN;
+    }
+    else if (ppu->regs.ly < _VBLANK_BEGIN) {
+      ppu->mode = PPU_MODE_OAM_SCAN;
+    }
+    return;
+  }
+  if (ppu->mode == PPU_MODE_OAM_SCAN) {
+    // Registers are latched for the whole line as drawing begins.
+    ppu->mode = PPU_MODE_DRAWING;
+    LogScanline(ppu);
+    return;
+  }
+  if (ppu->mode == PPU_MODE_DRAWING) {
+    ppu->mode = PPU_MODE_HBLANK;
+  }
+}
+
+
+void PpuTick(Ppu* const ppu, uint8_t* const interrupts_flag, int cycles) {
+  if (!(ppu->regs.lcdc & 0x80)) {
+    return;
+  }
+
+  while (cycles > 0) {
+    int until = NextModeChange(ppu) - ppu->dot;
+    int step = cycles < until ? cycles : until;
+    ppu->dot += step;
+    cycles -= step;
+    if (step == until) {
+      ChangeMode(ppu, interrupts_flag);
+    }
+  }
+  UpdateStatLine(ppu, interrupts_flag);
+}
+
+
+uint8_t PpuReadRegister(const Ppu* const ppu, uint16_t addr) {
+  if (addr == _LCDC_REG) {
+    return ppu->regs.lcdc;
+  }
+  if (addr == _STAT_REG) {
+    // Bit 7 is unused and always reads high. Bits 0-2 reflect the current
+    // state of the LCD.
+    uint8_t coincidence = ppu->regs.ly == ppu->regs.lyc;
+    return 0x80 | (ppu->regs.stat & 0x78) | (coincidence << 2) | ppu->mode;
+  }
+  if (addr == _SCY_REG) {
+    return ppu->regs.scy;
+  }
+  if (addr == _SCX_REG) {
+    return ppu->regs.scx;
+  }
+  if (addr == _LY_REG) {
+    return ppu->regs.ly;
+  }
+  if (addr == _LYC_REG) {
+    return ppu->regs.lyc;
+  }
+  if (addr == _BGP_REG) {
+    return ppu->regs.bgp;
+  }
+  if (addr == _OBP0_REG) {
+    return ppu->regs.obp0;
+  }
+  if (addr == _OBP1_REG) {
+    return ppu->regs.obp1;
+  }
+  if (addr == _WY_REG) {
+    return ppu->regs.wy;
+  }
+  if (addr == _WX_REG) {
+    return ppu->regs.wx;
+  }
+  if (ppu->global_ctx->mode != GB_MODE_GBC) {
+    // The palette registers below only exist on CGB.
+    return 0xFF;
+  }
+  if (addr == _BCPS_REG) {
+    return ppu->regs.bcps | 0x40;
+  }
+  if (addr == _BCPD_REG) {
+    return ppu->palette_ram[ppu->regs.bcps & 0x3F];
+  }
+  if (addr == _OCPS_REG) {
+    return ppu->regs.ocps | 0x40;
+  }
+  if (addr == _OCPD_REG) {
+    return ppu->palette_ram[_OBJ_PALETTES + (ppu->regs.ocps & 0x3F)];
+  }
+  return 0xFF;
+}
+
+
+void PpuWriteRegister(Ppu* const ppu, uint16_t addr, uint8_t data) {
+  if (addr == _LCDC_REG) {
+    uint8_t prev = ppu->regs.lcdc;
+    ppu->regs.lcdc = data;
+    if ((prev & 0x80) && !(data & 0x80)) {
+      // Turning the LCD off resets LY and parks the PPU in HBlank.
+      ppu->regs.ly = 0;
+      ppu->dot = 0;
+      ppu->mode = PPU_MODE_HBLANK;
+    }
+    else if (!(prev & 0x80) && (data & 0x80)) {
+      ppu->mode = PPU_MODE_OAM_SCAN;
+    }
+    return;
+  }
+  if (addr == _STAT_REG) {
+    // Only the interrupt select bits are writable.
+    ppu->regs.stat = data & 0x78;
+    return;
+  }
+  if (addr == _SCY_REG) {
+    ppu->regs.scy = data;
+    return;
+  }
+  if (addr == _SCX_REG) {
+    ppu->regs.scx = data;
+    return;
+  }
+  if (addr == _LYC_REG) {
+    ppu->regs.lyc = data;
+    return;
+  }
+  if (addr == _BGP_REG) {
+    ppu->regs.bgp = data;
+    return;
+  }
+  if (addr == _OBP0_REG) {
+    ppu->regs.obp0 = data;
+    return;
+  }
+  if (addr == _OBP1_REG) {
+    ppu->regs.obp1 = data;
+    return;
+  }
+  if (addr == _WY_REG) {
+    ppu->regs.wy = data;
+    return;
+  }
+  if (addr == _WX_REG) {
+    ppu->regs.wx = data;
+    return;
+  }
+  if (ppu->global_ctx->mode != GB_MODE_GBC) {
+    return;
+  }
+  if (addr == _BCPS_REG) {
+    ppu->regs.bcps = data & 0xBF;
+    return;
+  }
+  if (addr == _BCPD_REG) {
+    WritePaletteData(ppu, &ppu->regs.bcps, 0, data);
+    return;
+  }
+  if (addr == _OCPS_REG) {
+    ppu->regs.ocps = data & 0xBF;
+    return;
+  }
+  if (addr == _OCPD_REG) {
+    WritePaletteData(ppu, &ppu->regs.ocps, _OBJ_PALETTES, data);
+  }
+  // LY is read only.
+}
+
+
+PpuRenderer* PpuRendererCreate(GlobalCtx* const global_ctx) {
+  PpuRenderer* renderer = (PpuRenderer*)malloc(sizeof(PpuRenderer));
+  if (renderer == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(renderer, 0, sizeof(PpuRenderer));
+  // Start every tile one generation ahead of the layers so the first use of
+  // each map entry draws it.
+  for (int i = 0; i < PPU_TILE_SLOTS; ++i) {
+    renderer->tile_gens[i] = 1;
+  }
+  renderer->framebuffer = renderer->screen;
+  renderer->output = NULL;
+  memset(renderer->palette_ram, 0xFF, sizeof(renderer->palette_ram));
+  PpuRendererSetColorProfile(renderer, COLOR_PROFILE_LCD);
+  atomic_init(&renderer->frames, 0);
+  renderer->global_ctx = global_ctx;
+  return renderer;
+}
+
+
+void PpuRendererDestroy(PpuRenderer* renderer) {
+  if (renderer == NULL) {
+    return;
+  }
+  renderer->framebuffer = NULL;
+  renderer->output = NULL;
+  renderer->color_lut = NULL;
+  renderer->global_ctx = NULL;
+  free(renderer);
+  renderer = NULL;
+}
+
+
+// Converts one RGB555 palette entry through the color table. Palette RAM
+// holds the background palettes followed by the sprite palettes.
+static void UpdatePaletteColor(PpuRenderer* const renderer, int color) {
+  uint16_t raw = renderer->palette_ram[color * 2] |
+                 (renderer->palette_ram[color * 2 + 1] << 8);
+  uint32_t argb = renderer->color_lut[raw & 0x7FFF];
+  if (color < 32) {
+    renderer->bg_colors[color / 4][color % 4] = argb;
+  }
+  else {
+    renderer->obj_colors[(color - 32) / 4][color % 4] = argb;
+  }
+}
+
+
+void PpuRendererSetColorProfile(PpuRenderer* const renderer,
+                                ColorProfile profile) {
+  renderer->color_lut = ColorLut(profile);
+  for (int color = 0; color < 64; ++color) {
+    UpdatePaletteColor(renderer, color);
+  }
+}
+
+
+void PpuRendererSetOutput(PpuRenderer* const renderer,
+                          TripleBuffer* const output) {
+  renderer->output = output;
+  renderer->framebuffer = output != NULL ? TripleBufferBack(output)
+                                         : renderer->screen;
+}
+
+
+void PpuRendererSync(PpuRenderer* const renderer,
+                     const CowMemory* const vram, const uint8_t* const oam,
+                     const uint8_t* const palette_ram) {
+  CowMemoryCopy(vram, renderer->vram);
+  memcpy(renderer->oam, oam, sizeof(renderer->oam));
+  memcpy(renderer->palette_ram, palette_ram, sizeof(renderer->palette_ram));
+  // Moving every tile a generation on makes each layer entry stale.
+  for (int i = 0; i < PPU_TILE_SLOTS; ++i) {
+    renderer->tile_gens[i]++;
+  }
+  renderer->sprites_dirty = 1;
+  renderer->window_line = 0;
+  for (int color = 0; color < 64; ++color) {
+    UpdatePaletteColor(renderer, color);
+  }
+}
+
+
+// Index of a tile's data among the 384 tiles of each VRAM bank.
+static uint16_t TileSlot(uint8_t lcdc, uint8_t tile, uint8_t attrs) {
+  uint16_t slot = tile;
+  if (!(lcdc & 0x10)) {
+    // 0x8800 addressing, tile indices are signed relative to 0x9000.
+    slot = (uint16_t)(256 + (int8_t)tile);
+  }
+  if (attrs & 0x08) {
+    slot += _TILES_PER_BANK;
+  }
+  return slot;
+}
+
+
+// Draws one map entry into its 8x8 block of the layer. Each layer byte holds
+// the color index in bits 0-1, the CGB palette in bits 2-4 and the BG
+// priority flag in bit 7.
+static void RenderLayerTile(PpuRenderer* const renderer, int map, int entry,
+                            uint16_t slot, uint8_t attrs) {
+  const uint8_t* data = renderer->vram + (slot / _TILES_PER_BANK) *
+                        _VRAM_BANK_SIZE + (slot % _TILES_PER_BANK) * 16;
+  uint8_t* dst = renderer->layers[map] + (entry / 32) * 8 * PPU_LAYER_SIZE +
+                 (entry % 32) * 8;
+  uint8_t extra = ((attrs & 0x07) << 2) | (attrs & 0x80);
+
+  for (int y = 0; y < 8; ++y) {
+    int row = attrs & 0x40 ? 7 - y : y;
+    uint8_t lo = data[row * 2];
+    uint8_t hi = data[row * 2 + 1];
+    for (int x = 0; x < 8; ++x) {
+      uint8_t bit = attrs & 0x20 ? x : 7 - x;
+      dst[y * PPU_LAYER_SIZE + x] = (((hi >> bit) & 0x01) << 1) |
+                                 ((lo >> bit) & 0x01) | extra;
+    }
+  }
+
+  renderer->layer_slots[map][entry] = slot;
+  renderer->layer_attrs[map][entry] = attrs;
+  renderer->layer_gens[map][entry] = renderer->tile_gens[slot];
+}
+
+
+// Brings one row of 32 map entries up to date. Entries are only redrawn
+// when the tile index, attributes, addressing mode or tile data changed
+// since they were last drawn.
+static void RefreshLayerRow(PpuRenderer* const renderer, int map,
+                            uint8_t lcdc, int row) {
+  int cgb = renderer->global_ctx->mode == GB_MODE_GBC;
+  uint16_t base = map ? _TILE_MAP_1 : _TILE_MAP_0;
+
+  for (int entry = row * 32; entry < row * 32 + 32; ++entry) {
+    uint8_t tile = renderer->vram[base + entry];
+    // CGB attributes live at the same offset in VRAM bank 1.
+    uint8_t attrs = cgb ? renderer->vram[_VRAM_BANK_SIZE + base + entry] : 0;
+    uint16_t slot = TileSlot(lcdc, tile, attrs);
+    if (renderer->layer_slots[map][entry] != slot ||
+        renderer->layer_attrs[map][entry] != attrs ||
+        renderer->layer_gens[map][entry] != renderer->tile_gens[slot]) {
+      RenderLayerTile(renderer, map, entry, slot, attrs);
+    }
+  }
+}
+
+
+static void RenderBackground(PpuRenderer* const renderer,
+                             const PpuLogEntry* const line,
+                             uint8_t* const pixels) {
+  uint8_t ly = (uint8_t)line->addr;
+  int map = line->lcdc & 0x08 ? 1 : 0;
+  uint8_t y = ly + line->scy;
+  RefreshLayerRow(renderer, map, line->lcdc, y / 8);
+
+  // The layer wraps horizontally, so the line is at most two copies.
+  const uint8_t* src = renderer->layers[map] + y * PPU_LAYER_SIZE;
+  int first = PPU_LAYER_SIZE - line->scx;
+  if (first > PPU_SCREEN_WIDTH) {
+    first = PPU_SCREEN_WIDTH;
+  }
+  memcpy(pixels, src + line->scx, first);
+  memcpy(pixels + first, src, PPU_SCREEN_WIDTH - first);
+}
+
+
+static void RenderWindow(PpuRenderer* const renderer,
+                         const PpuLogEntry* const line,
+                         uint8_t* const pixels) {
+  uint8_t ly = (uint8_t)line->addr;
+  if (!(line->lcdc & 0x20) || ly < line->wy || line->wx > 166) {
+    return;
+  }
+
+  int map = line->lcdc & 0x40 ? 1 : 0;
+  uint8_t y = renderer->window_line++;
+  RefreshLayerRow(renderer, map, line->lcdc, y / 8);
+
+  // WX values below 7 shift the window's left edge off screen.
+  int start = line->wx - 7;
+  int skip = start < 0 ? -start : 0;
+  if (start < 0) {
+    start = 0;
+  }
+  memcpy(pixels + start, renderer->layers[map] + y * PPU_LAYER_SIZE + skip,
+         PPU_SCREEN_WIDTH - start);
+}
+
+
+// Rebuilds the per-line sprite table. Each line gets the first ten sprites
+// in OAM order that overlap it, which is what mode 2 selects, already sorted
+// into drawing priority. On DMG lower X wins and ties go to the lower OAM
+// index, on CGB OAM order alone decides.
+static void BuildSpriteBuckets(PpuRenderer* const renderer, int height) {
+  int by_x = renderer->global_ctx->mode == GB_MODE_DMG;
+  memset(renderer->line_sprite_counts, 0,
+         sizeof(renderer->line_sprite_counts));
+
+  for (int i = 0; i < _SPRITE_COUNT; ++i) {
+    int top = renderer->oam[i * 4] - 16;
+    for (int ly = top < 0 ? 0 : top;
+         ly < top + height && ly < PPU_SCREEN_HEIGHT; ++ly) {
+      uint8_t* bucket = renderer->line_sprites[ly];
+      int count = renderer->line_sprite_counts[ly];
+      if (count == PPU_MAX_SPRITES_PER_LINE) {
+        continue;
+      }
+      // Sprites arrive in OAM order, so inserting after every entry with an
+      // equal X keeps ties in OAM order.
+      int j = count;
+      while (by_x && j > 0 && renderer->oam[bucket[j - 1] * 4 + 1] >
+                              renderer->oam[i * 4 + 1]) {
+        bucket[j] = bucket[j - 1];
+        --j;
+      }
+      bucket[j] = (uint8_t)i;
+      renderer->line_sprite_counts[ly] = count + 1;
+    }
+  }
+
+  renderer->sprite_height = height;
+  renderer->sprites_dirty = 0;
+}
+
+
+static void RenderSprites(PpuRenderer* const renderer,
+                          const PpuLogEntry* const line,
+                          const uint8_t* const bg_pixels,
+                          uint32_t* const out) {
+  uint8_t ly = (uint8_t)line->addr;
+  int height = line->lcdc & 0x04 ? 16 : 8;
+  if (renderer->sprites_dirty || renderer->sprite_height != height) {
+    BuildSpriteBuckets(renderer, height);
+  }
+  const uint8_t* selected = renderer->line_sprites[ly];
+  int count = renderer->line_sprite_counts[ly];
+
+  uint8_t drawn[PPU_SCREEN_WIDTH] = {0};
+  int cgb = renderer->global_ctx->mode == GB_MODE_GBC;
+  // On CGB clearing LCDC bit 0 puts sprites above the background regardless
+  // of either priority flag.
+  int bg_can_win = !cgb || (line->lcdc & 0x01);
+
+  for (int i = 0; i < count; ++i) {
+    const uint8_t* sprite = &renderer->oam[selected[i] * 4];
+    uint8_t attrs = sprite[3];
+    uint8_t palette = attrs & 0x10 ? line->obp1 : line->obp0;
+    const uint32_t* colors = renderer->obj_colors[attrs & 0x07];
+    uint8_t tile = height == 16 ? sprite[2] & 0xFE : sprite[2];
+    int row = ly - (sprite[0] - 16);
+    if (attrs & 0x40) {
+      row = height - 1 - row;
+    }
+    uint16_t addr = tile * 16 + row * 2;
+    if (cgb && (attrs & 0x08)) {
+      addr += _VRAM_BANK_SIZE;
+    }
+    uint8_t lo = renderer->vram[addr];
+    uint8_t hi = renderer->vram[addr + 1];
+
+    for (int col = 0; col < 8; ++col) {
+      int x = sprite[1] - 8 + col;
+      if (x < 0 || x >= PPU_SCREEN_WIDTH || drawn[x]) {
+        continue;
+      }
+      uint8_t bit = attrs & 0x20 ? col : 7 - col;
+      uint8_t color = (((hi >> bit) & 0x01) << 1) | ((lo >> bit) & 0x01);
+      if (color == 0) {
+        continue;
+      }
+      // The highest priority opaque sprite pixel owns the dot, even when
+      // it ends up hidden behind the background.
+      drawn[x] = 1;
+      if (bg_can_win && ((attrs & 0x80) || (bg_pixels[x] & 0x80)) &&
+          (bg_pixels[x] & 0x03) != 0) {
+        continue;
+      }
+      if (cgb) {
+        out[x] = colors[color];
+      }
+      else {
+        out[x] = _DMG_SHADES[(palette >> (color * 2)) & 0x03];
+      }
+    }
+  }
+}
+
+
+static void RenderScanline(PpuRenderer* const renderer,
+                           const PpuLogEntry* const line) {
+  uint8_t ly = (uint8_t)line->addr;
+  if (ly >= PPU_SCREEN_HEIGHT) {
+    return;
+  }
+  uint32_t* out = renderer->framebuffer + ly * PPU_SCREEN_WIDTH;
+  uint8_t pixels[PPU_SCREEN_WIDTH] = {0};
+  int cgb = renderer->global_ctx->mode == GB_MODE_GBC;
+
+  // With bit 0 clear the background and window are blank on DMG. On CGB
+  // the bit only affects sprite priority.
+  if (cgb || (line->lcdc & 0x01)) {
+    RenderBackground(renderer, line, pixels);
+    RenderWindow(renderer, line, pixels);
+  }
+  if (cgb) {
+    for (int x = 0; x < PPU_SCREEN_WIDTH; ++x) {
+      out[x] = renderer->bg_colors[(pixels[x] >> 2) & 0x07][pixels[x] & 0x03];
+    }
+  }
+  else {
+    for (int x = 0; x < PPU_SCREEN_WIDTH; ++x) {
+      out[x] = _DMG_SHADES[(line->bgp >> ((pixels[x] & 0x03) * 2)) & 0x03];
+    }
+  }
+  if (line->lcdc & 0x02) {
+    RenderSprites(renderer, line, pixels, out);
+  }
+}
+
+
+void PpuRendererApply(PpuRenderer* const renderer,
+                      const PpuLogEntry* const entry) {
+  switch (entry->type) {
+    case PPU_LOG_VRAM_WRITE:
+      renderer->vram[entry->addr] = entry->value;
+      if (entry->addr % _VRAM_BANK_SIZE < _TILE_DATA_END) {
+        // Invalidates every layer entry drawn from this tile.
+        renderer->tile_gens[(entry->addr / _VRAM_BANK_SIZE) * _TILES_PER_BANK +
+                            (entry->addr % _VRAM_BANK_SIZE) / 16]++;
+      }
+      break;
+    case PPU_LOG_OAM_WRITE:
+      renderer->oam[entry->addr] = entry->value;
+      renderer->sprites_dirty = 1;
+      break;
+    case PPU_LOG_PALETTE_WRITE:
+      renderer->palette_ram[entry->addr] = entry->value;
+      UpdatePaletteColor(renderer, entry->addr / 2);
+      break;
+    case PPU_LOG_SCANLINE:
+      RenderScanline(renderer, entry);
+      break;
+    case PPU_LOG_FRAME_END:
+      renderer->window_line = 0;
+      if (renderer->output != NULL) {
+        renderer->framebuffer = TripleBufferPublish(renderer->output);
+      }
+      atomic_fetch_add_explicit(&renderer->frames, 1, memory_order_release);
+      break;
+  }
+}
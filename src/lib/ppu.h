@@ -1,10 +1,192 @@
 #ifndef PPU_H
 #define PPU_H
 
+#include "color.h"
+#include "cow.h"
 #include "global.h"
+#include "ring.h"
 
-typedef struct PpuDef {
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define PPU_SCREEN_WIDTH 160
+#define PPU_SCREEN_HEIGHT 144
+#define PPU_LAYER_SIZE 256
+// Tile data slots, 384 tiles in each of the two VRAM banks.
+#define PPU_TILE_SLOTS 768
+#define PPU_MAX_SPRITES_PER_LINE 10
+
+struct TripleBufferDef;
+
+
+typedef enum PpuModeDef {
+  PPU_MODE_HBLANK = 0,
+  PPU_MODE_VBLANK = 1,
+  PPU_MODE_OAM_SCAN = 2,
+  PPU_MODE_DRAWING = 3,
+} PpuMode;
+
+typedef struct PpuRegistersDef {
+  // 0xFF40
+  uint8_t lcdc;
+  // 0xFF41
+  uint8_t stat;
+  // 0xFF42
+  uint8_t scy;
+  // 0xFF43
+  uint8_t scx;
+  // 0xFF44
+  uint8_t ly;
+  // 0xFF45
+  uint8_t lyc;
+  // 0xFF47
+  uint8_t bgp;
+  // 0xFF48
+  uint8_t obp0;
+  // 0xFF49
+  uint8_t obp1;
+  // 0xFF4A
+  uint8_t wy;
+  // 0xFF4B
+  uint8_t wx;
+  // 0xFF68, CGB background palette index.
+  uint8_t bcps;
+  // 0xFF6A, CGB sprite palette index.
+  uint8_t ocps;
+} PpuRegisters;
+
+typedef enum PpuLogTypeDef {
+  PPU_LOG_VRAM_WRITE = 0,
+  PPU_LOG_OAM_WRITE = 1,
+  PPU_LOG_SCANLINE = 2,
+  PPU_LOG_FRAME_END = 3,
+  PPU_LOG_PALETTE_WRITE = 4,
+} PpuLogType;
 
+// One entry in the log the CPU thread hands to the PPU thread. Memory writes
+// use addr and value. Scanlines carry a snapshot of every register that
+// affects rasterization, taken as the line enters mode 3, so raster effects
+// that change registers between lines render correctly.
+typedef struct PpuLogEntryDef {
+  uint8_t type;
+  uint8_t value;
+  // VRAM offset including bank, OAM or palette RAM offset, or LY for
+  // scanlines.
+  uint16_t addr;
+  uint8_t lcdc;
+  uint8_t scy;
+  uint8_t scx;
+  uint8_t wy;
+  uint8_t wx;
+  uint8_t bgp;
+  uint8_t obp0;
+  uint8_t obp1;
+} PpuLogEntry;
+
+// CPU side of the PPU. Owns the LCD registers and mode timing, and records
+// everything the renderer needs into the log.
+typedef struct PpuDef {
+  PpuRegisters regs;
+  PpuMode mode;
+  // Dots elapsed in the current scanline, 0 - 455.
+  uint16_t dot;
+  // Level of the STAT interrupt line, interrupts fire on its rising edge.
+  uint8_t stat_line;
+  // CGB palette RAM, eight background palettes followed by eight sprite
+  // palettes of four RGB555 colors each.
+  uint8_t palette_ram[0x80];
+  // Number of times the LCD has entered VBlank.
+  unsigned int frames;
+  RingBuffer* log;
+  // Cleared when nothing consumes the log, so nothing is recorded.
+  uint8_t logging;
+  GlobalCtx* global_ctx;
 } Ppu;
 
+// PPU thread side. Keeps its own copy of VRAM and OAM, updated in log order,
+// so it never reads memory the CPU thread is writing.
+typedef struct PpuRendererDef {
+  uint8_t vram[0x4000];
+  uint8_t oam[0xA0];
+  uint8_t palette_ram[0x80];
+  // ARGB colors of each CGB palette, converted through color_lut whenever
+  // palette RAM is written so drawing never does color math.
+  uint32_t bg_colors[8][4];
+  uint32_t obj_colors[8][4];
+  const uint32_t* color_lut;
+  // Internal window line counter, only advances on lines showing the window.
+  uint8_t window_line;
+  // Pre-rendered 256x256 layers for the tile maps at 0x9800 and 0x9C00.
+  // Background and window lines are copied out of these at SCX/SCY, and a
+  // map entry is only redrawn once something it depends on was written.
+  uint8_t layers[2][PPU_LAYER_SIZE * PPU_LAYER_SIZE];
+  // Bumped on every write to a tile's data.
+  uint32_t tile_gens[PPU_TILE_SLOTS];
+  // What each map entry was last drawn from.
+  uint16_t layer_slots[2][1024];
+  uint8_t layer_attrs[2][1024];
+  uint32_t layer_gens[2][1024];
+  // Sprites selected for each line, in drawing priority order. Rebuilt
+  // lazily after OAM changes so per-line selection is a lookup.
+  uint8_t line_sprites[PPU_SCREEN_HEIGHT][PPU_MAX_SPRITES_PER_LINE];
+  uint8_t line_sprite_counts[PPU_SCREEN_HEIGHT];
+  uint8_t sprites_dirty;
+  // Sprite height the table was built for, 8 or 16.
+  uint8_t sprite_height;
+  // Frame being drawn. Points at screen, or into output when frames are
+  // handed to a presenter.
+  uint32_t* framebuffer;
+  uint32_t screen[PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT];
+  struct TripleBufferDef* output;
+  // Number of frames fully rasterized.
+  atomic_uint frames;
+  GlobalCtx* global_ctx;
+} PpuRenderer;
+
+
+Result PpuInit(Ppu* const ppu, GlobalCtx* const global_ctx);
+
+void PpuDestroy(Ppu* const ppu);
+
+// Returns the LCD to the post boot state. The log is kept as it is.
+void PpuReset(Ppu* const ppu);
+
+// Advances the LCD by the given number of dots (T-cycles).
+void PpuTick(Ppu* const ppu, uint8_t* const interrupts_flag, int cycles);
+
+uint8_t PpuReadRegister(const Ppu* const ppu, uint16_t addr);
+
+void PpuWriteRegister(Ppu* const ppu, uint16_t addr, uint8_t data);
+
+// Drops everything logged and not yet applied. Only safe while nothing
+// consumes the log.
+void PpuClearLog(Ppu* const ppu);
+
+void PpuLogVramWrite(Ppu* const ppu, uint16_t offset, uint8_t data);
+
+void PpuLogOamWrite(Ppu* const ppu, uint16_t offset, uint8_t data);
+
+PpuRenderer* PpuRendererCreate(GlobalCtx* const global_ctx);
+
+void PpuRendererDestroy(PpuRenderer* renderer);
+
+// Switches the CGB color correction table. Cached palette colors are
+// converted again, so drawing costs the same for every profile.
+void PpuRendererSetColorProfile(PpuRenderer* const renderer,
+                                ColorProfile profile);
+
+// Publishes finished frames to output instead of drawing into screen.
+void PpuRendererSetOutput(PpuRenderer* const renderer,
+                          struct TripleBufferDef* const output);
+
+// Replaces the renderer's copy of memory wholesale, as after loading a
+// state, and drops everything cached from the old contents.
+void PpuRendererSync(PpuRenderer* const renderer,
+                     const CowMemory* const vram, const uint8_t* const oam,
+                     const uint8_t* const palette_ram);
+
+// Applies one log entry. Scanline entries rasterize the line.
+void PpuRendererApply(PpuRenderer* const renderer,
+                      const PpuLogEntry* const entry);
+
 #endif
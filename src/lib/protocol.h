@@ -0,0 +1,93 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Wire format of gbemu-server. Clients send a ProtocolRequest, followed by
+// size bytes of payload, and get one ProtocolResponse back. Fields are in
+// host byte order, since both ends share a machine. Frames and memory are
+// never sent over the socket. They are published into a shared memory
+// ProtocolShared, whose file descriptor comes with the response to
+// PROTOCOL_OP_CREATE as SCM_RIGHTS ancillary data.
+
+#define PROTOCOL_VERSION 2
+#define PROTOCOL_MAGIC 0x47424D53
+// Largest payload a request may carry.
+#define PROTOCOL_MAX_PAYLOAD 4096
+#define PROTOCOL_SLOTS 4
+
+
+typedef enum ProtocolOpDef {
+  // Payload is a ROM path. Responds with the new instance and its shared
+  // memory.
+  PROTOCOL_OP_CREATE = 1,
+  // Payload is a ROM path. Replaces the instance's cartridge.
+  PROTOCOL_OP_LOAD_ROM = 2,
+  // Runs arg frames holding buttons, then publishes a slot.
+  PROTOCOL_OP_STEP = 3,
+  // Saves the state on the server. Responds with its id in value.
+  PROTOCOL_OP_SNAPSHOT = 4,
+  // Loads the snapshot with id arg.
+  PROTOCOL_OP_RESTORE = 5,
+  // Frees the snapshot with id arg.
+  PROTOCOL_OP_RELEASE_SNAPSHOT = 6,
+  PROTOCOL_OP_DESTROY = 7,
+} ProtocolOp;
+
+typedef enum ProtocolStatusDef {
+  PROTOCOL_STATUS_OK = 0,
+  PROTOCOL_STATUS_BAD_REQUEST = 1,
+  PROTOCOL_STATUS_NO_INSTANCE = 2,
+  PROTOCOL_STATUS_NO_SNAPSHOT = 3,
+  // The machine failed, error holds its ErrorCode.
+  PROTOCOL_STATUS_MACHINE_ERROR = 4,
+} ProtocolStatus;
+
+typedef struct ProtocolRequestDef {
+  uint32_t op;
+  uint32_t instance;
+  uint32_t arg;
+  uint32_t buttons;
+  // Payload bytes following the request.
+  uint32_t size;
+  uint32_t reserved;
+} ProtocolRequest;
+
+typedef struct ProtocolResponseDef {
+  uint32_t status;
+  uint32_t error;
+  uint32_t instance;
+  // Snapshot id, or the slot STEP published.
+  uint32_t value;
+  // Frames the LCD has finished.
+  uint64_t frames;
+} ProtocolResponse;
+
+// Guarded by a sequence lock: sequence is odd while the server writes the
+// slot and goes up by 2 with every write. A client loads it with acquire
+// order, copies what it needs if it is even, then fences with acquire
+// order and loads it again. The copy is whole if both loads match.
+typedef struct ProtocolSlotDef {
+  _Atomic uint32_t sequence;
+  uint32_t reserved;
+  // Value of ProtocolResponse.frames when the slot was written.
+  uint64_t frames;
+  // 0xAARRGGBB.
+  uint32_t pixels[160 * 144];
+  uint8_t wram[0x8000];
+  uint8_t hram[0x80];
+} ProtocolSlot;
+
+// Slots are written in turn. latest is only stored once its slot is
+// complete, so a client reading slot latest sees a whole frame as long as
+// it finishes before PROTOCOL_SLOTS - 1 more steps. The slot's sequence
+// tells when it didn't.
+typedef struct ProtocolSharedDef {
+  uint32_t magic;
+  uint32_t version;
+  _Atomic uint32_t latest;
+  uint32_t slot_count;
+  ProtocolSlot slots[PROTOCOL_SLOTS];
+} ProtocolShared;
+
+#endif
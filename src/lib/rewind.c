@@ -0,0 +1,357 @@
+#include "rewind.h"
+
+#include "apu.h"
+#include "gb.h"
+#include "global.h"
+#include "lz.h"
+#include "ring.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+
+// Smallest a difference compresses to is about one byte per 255 unchanged,
+// which bounds how many entries the arena can hold.
+static const size_t _MIN_ENTRY_RATIO = 255;
+static const size_t _ENTRY_OVERHEAD = 16;
+
+
+// dst = a ^ b. dst may alias either input.
+static void XorBlocks(uint8_t* const dst, const uint8_t* const a,
+                      const uint8_t* const b, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 64 <= size; i += 64) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(a + i + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(a + i + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(a + i + 48));
+    x0 = _mm_xor_si128(x0, _mm_loadu_si128((const __m128i*)(b + i)));
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)(b + i + 16)));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(b + i + 32)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(b + i + 48)));
+    _mm_storeu_si128((__m128i*)(dst + i), x0);
+    _mm_storeu_si128((__m128i*)(dst + i + 16), x1);
+    _mm_storeu_si128((__m128i*)(dst + i + 32), x2);
+    _mm_storeu_si128((__m128i*)(dst + i + 48), x3);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 64 <= size; i += 64) {
+    uint8x16_t x0 = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    uint8x16_t x1 = veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+    uint8x16_t x2 = veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+    uint8x16_t x3 = veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+    vst1q_u8(dst + i, x0);
+    vst1q_u8(dst + i + 16, x1);
+    vst1q_u8(dst + i + 32, x2);
+    vst1q_u8(dst + i + 48, x3);
+  }
+#endif
+  for (; i + 8 <= size; i += 8) {
+    uint64_t x;
+    uint64_t y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    x ^= y;
+    memcpy(dst + i, &x, sizeof(x));
+  }
+  for (; i < size; ++i) {
+    dst[i] = a[i] ^ b[i];
+  }
+}
+
+
+static RewindEntry* Entry(const Rewind* const rewind, size_t index) {
+  return &rewind->entries[(rewind->first + index) % rewind->entry_capacity];
+}
+
+
+static void DropOldest(Rewind* const rewind) {
+  rewind->first = (rewind->first + 1) % rewind->entry_capacity;
+  --rewind->count;
+}
+
+
+// Drops every snapshot after the given frame and makes the cursor, which
+// sits on it, the newest.
+static void Truncate(Rewind* const rewind) {
+  while (rewind->count > 0 &&
+         Entry(rewind, rewind->count - 1)->frame > rewind->cursor_frame) {
+    --rewind->count;
+  }
+  if (rewind->count > 0) {
+    RewindEntry* newest = Entry(rewind, rewind->count - 1);
+    rewind->head = newest->offset + newest->size;
+  }
+  else {
+    rewind->head = 0;
+  }
+  uint8_t* latest = rewind->latest;
+  rewind->latest = rewind->cursor;
+  rewind->cursor = latest;
+  rewind->latest_frame = rewind->cursor_frame;
+  rewind->cursor_valid = 0;
+}
+
+
+// Makes room for size bytes at the head, dropping the oldest entries in
+// the way.
+static size_t Reserve(Rewind* const rewind, size_t size) {
+  size_t offset = rewind->head;
+  if (offset + size > rewind->capacity) {
+    // Entries past the head are older than those at the start.
+    while (rewind->count > 0 && Entry(rewind, 0)->offset >= offset) {
+      DropOldest(rewind);
+    }
+    offset = 0;
+  }
+  while (rewind->count > 0 && Entry(rewind, 0)->offset >= offset &&
+         Entry(rewind, 0)->offset < offset + size) {
+    DropOldest(rewind);
+  }
+  if (rewind->count == rewind->entry_capacity) {
+    DropOldest(rewind);
+  }
+  rewind->head = offset + size;
+  return offset;
+}
+
+
+static void Capture(Rewind* const rewind) {
+  StateSave(rewind->gb, rewind->scratch, rewind->state_size);
+  // The cursor doubles as room for the difference.
+  XorBlocks(rewind->cursor, rewind->latest, rewind->scratch,
+            rewind->state_size);
+  rewind->cursor_valid = 0;
+  size_t size = LzCompress(rewind->cursor, rewind->state_size,
+                           rewind->packed, rewind->packed_capacity);
+  if (size > rewind->capacity) {
+    // Too big to keep at all, so nothing older is reachable.
+    rewind->count = 0;
+    rewind->head = 0;
+  }
+  else {
+    size_t offset = Reserve(rewind, size);
+    memcpy(rewind->arena + offset, rewind->packed, size);
+    *Entry(rewind, rewind->count) = (RewindEntry){
+      .frame = rewind->frame,
+      .offset = offset,
+      .size = size
+    };
+    ++rewind->count;
+  }
+
+  uint8_t* latest = rewind->latest;
+  rewind->latest = rewind->scratch;
+  rewind->scratch = latest;
+  rewind->latest_frame = rewind->frame;
+}
+
+
+// Applies the difference between the snapshot of entry index and the one
+// before it to the cursor.
+static void ApplyEntry(Rewind* const rewind, size_t index) {
+  const RewindEntry* entry = Entry(rewind, index);
+  LzDecompress(rewind->arena + entry->offset, entry->size, rewind->scratch,
+               rewind->state_size);
+  XorBlocks(rewind->cursor, rewind->cursor, rewind->scratch,
+            rewind->state_size);
+}
+
+
+// Rebuilds the snapshot of the given frame in the cursor.
+static void MoveCursor(Rewind* const rewind, unsigned long frame) {
+  if (!rewind->cursor_valid) {
+    memcpy(rewind->cursor, rewind->latest, rewind->state_size);
+    rewind->cursor_frame = rewind->latest_frame;
+    rewind->cursor_valid = 1;
+  }
+  if (rewind->count == 0) {
+    return;
+  }
+  unsigned long first_frame = Entry(rewind, 0)->frame;
+  while (rewind->cursor_frame > frame) {
+    ApplyEntry(rewind, (rewind->cursor_frame - first_frame) /
+                       rewind->interval);
+    rewind->cursor_frame -= rewind->interval;
+  }
+  while (rewind->cursor_frame < frame) {
+    rewind->cursor_frame += rewind->interval;
+    ApplyEntry(rewind, (rewind->cursor_frame - first_frame) /
+                       rewind->interval);
+  }
+}
+
+
+static void FreeBuffers(Rewind* const rewind) {
+  free(rewind->latest);
+  free(rewind->cursor);
+  free(rewind->scratch);
+  free(rewind->packed);
+  free(rewind->entries);
+  free(rewind->inputs);
+  rewind->latest = NULL;
+  rewind->cursor = NULL;
+  rewind->scratch = NULL;
+  rewind->packed = NULL;
+  rewind->entries = NULL;
+  rewind->inputs = NULL;
+}
+
+
+// Sizes everything that depends on the cartridge through its state size.
+static Result AllocateBuffers(Rewind* const rewind) {
+  size_t state_size = StateSize(rewind->gb);
+  if (state_size == rewind->state_size && rewind->latest != NULL) {
+    return RESULT_OK;
+  }
+  FreeBuffers(rewind);
+  rewind->state_size = state_size;
+  rewind->packed_capacity = LzBound(state_size);
+  rewind->entry_capacity = rewind->capacity /
+      (state_size / _MIN_ENTRY_RATIO + _ENTRY_OVERHEAD) + 1;
+  // Replaying needs the buttons from the oldest snapshot on.
+  rewind->input_capacity = (rewind->entry_capacity + 2) * rewind->interval;
+
+  rewind->latest = (uint8_t*)malloc(state_size);
+  rewind->cursor = (uint8_t*)malloc(state_size);
+  rewind->scratch = (uint8_t*)malloc(state_size);
+  rewind->packed = (uint8_t*)malloc(rewind->packed_capacity);
+  rewind->entries = (RewindEntry*)malloc(rewind->entry_capacity *
+                                         sizeof(RewindEntry));
+  rewind->inputs = (uint8_t*)calloc(rewind->input_capacity, 1);
+  if (rewind->latest == NULL || rewind->cursor == NULL ||
+      rewind->scratch == NULL || rewind->packed == NULL ||
+      rewind->entries == NULL || rewind->inputs == NULL) {
+    rewind->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    FreeBuffers(rewind);
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
+
+
+Rewind* RewindCreate(Gameboy* const gb, const RewindOptions* const options) {
+  Rewind* rewind = (Rewind*)malloc(sizeof(Rewind));
+  if (rewind == NULL) {
+    gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(rewind, 0, sizeof(Rewind));
+  rewind->gb = gb;
+  rewind->global_ctx = gb->global_ctx;
+  rewind->interval = options->interval > 0 ? options->interval : 1;
+  rewind->capacity = options->capacity;
+
+  rewind->arena = (uint8_t*)malloc(rewind->capacity > 0 ? rewind->capacity
+                                                        : 1);
+  if (rewind->arena == NULL) {
+    gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    RewindDestroy(rewind);
+    return NULL;
+  }
+  if (RewindClear(rewind) == RESULT_NOTOK) {
+    RewindDestroy(rewind);
+    return NULL;
+  }
+  return rewind;
+}
+
+
+void RewindDestroy(Rewind* rewind) {
+  if (rewind == NULL) {
+    return;
+  }
+  FreeBuffers(rewind);
+  free(rewind->arena);
+  rewind->arena = NULL;
+  rewind->gb = NULL;
+  rewind->global_ctx = NULL;
+  free(rewind);
+  rewind = NULL;
+}
+
+
+Result RewindClear(Rewind* const rewind) {
+  if (AllocateBuffers(rewind) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  rewind->head = 0;
+  rewind->first = 0;
+  rewind->count = 0;
+  rewind->frame = 0;
+  rewind->end = 0;
+  rewind->latest_frame = 0;
+  rewind->cursor_valid = 0;
+  StateSave(rewind->gb, rewind->latest, rewind->state_size);
+  return RESULT_OK;
+}
+
+
+void RewindFrame(Rewind* const rewind) {
+  if (rewind->frame < rewind->end) {
+    // The machine left the recorded path, so what followed never happens.
+    MoveCursor(rewind, rewind->latest_frame < rewind->frame
+                       ? rewind->latest_frame
+                       : rewind->frame - rewind->frame % rewind->interval);
+    Truncate(rewind);
+  }
+  rewind->inputs[rewind->frame % rewind->input_capacity] =
+      rewind->gb->bus->buttons;
+  ++rewind->frame;
+  rewind->end = rewind->frame;
+  if (rewind->frame - rewind->latest_frame >= rewind->interval) {
+    Capture(rewind);
+  }
+}
+
+
+unsigned long RewindOldest(const Rewind* const rewind) {
+  if (rewind->count == 0) {
+    return rewind->latest_frame;
+  }
+  return Entry(rewind, 0)->frame - rewind->interval;
+}
+
+
+unsigned long RewindSeek(Rewind* const rewind, unsigned long frame) {
+  unsigned long oldest = RewindOldest(rewind);
+  if (frame < oldest) {
+    frame = oldest;
+  }
+  if (frame > rewind->end) {
+    frame = rewind->end;
+  }
+  unsigned long snapshot = frame - (frame - oldest) % rewind->interval;
+  if (snapshot > rewind->latest_frame) {
+    snapshot = rewind->latest_frame;
+  }
+  MoveCursor(rewind, snapshot);
+
+  Gameboy* const gb = rewind->gb;
+  StateLoad(gb, rewind->cursor, rewind->state_size);
+  // Replayed frames were already heard.
+  RingBuffer* output = gb->bus->apu.output;
+  ApuSetOutput(&gb->bus->apu, NULL);
+  for (unsigned long i = snapshot; i < frame; ++i) {
+    BusSetButtons(gb->bus, rewind->inputs[i % rewind->input_capacity]);
+    GameboyRunFrame(gb);
+  }
+  ApuSetOutput(&gb->bus->apu, output);
+  rewind->frame = frame;
+  return frame;
+}
+
+
+unsigned long RewindStepBack(Rewind* const rewind) {
+  return RewindSeek(rewind, rewind->frame > 0 ? rewind->frame - 1 : 0);
+}
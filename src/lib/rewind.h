@@ -0,0 +1,98 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "gb.h"
+#include "global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct RewindOptionsDef {
+  // Frames between snapshots. Seeking replays up to interval - 1 frames
+  // from the nearest one.
+  unsigned int interval;
+  // Bytes of compressed history kept. The oldest snapshots are dropped to
+  // make room.
+  size_t capacity;
+} RewindOptions;
+
+// One snapshot in the history, stored as the compressed XOR of it and the
+// snapshot before it.
+typedef struct RewindEntryDef {
+  unsigned long frame;
+  size_t offset;
+  size_t size;
+} RewindEntry;
+
+// Always on history of a machine driven one frame at a time. Every
+// interval frames the state is saved and XORed with the previous snapshot,
+// which leaves zeroes wherever nothing changed, and the difference is
+// compressed into a fixed size ring. Only the newest snapshot is kept
+// whole; older ones are rebuilt by walking the differences back from it.
+// The buttons of every frame are kept too, so any frame in the history
+// can be reached by loading the snapshot before it and replaying.
+typedef struct RewindDef {
+  Gameboy* gb;
+  unsigned int interval;
+  size_t state_size;
+  // Newest snapshot, uncompressed, and its frame.
+  uint8_t* latest;
+  unsigned long latest_frame;
+  // Snapshot rebuilt by the last seek. Further seeks walk from it, so
+  // stepping through history costs one difference per snapshot crossed.
+  uint8_t* cursor;
+  unsigned long cursor_frame;
+  int cursor_valid;
+  // A state being captured, and a compressed difference.
+  uint8_t* scratch;
+  uint8_t* packed;
+  size_t packed_capacity;
+  // Compressed differences, written around in order. head is where the
+  // next one goes.
+  uint8_t* arena;
+  size_t capacity;
+  size_t head;
+  // Ring of entries, oldest first.
+  RewindEntry* entries;
+  size_t entry_capacity;
+  size_t first;
+  size_t count;
+  // Buttons held during each frame, indexed by frame modulo
+  // input_capacity.
+  uint8_t* inputs;
+  size_t input_capacity;
+  // Frame the machine is at, and the furthest frame reached since the
+  // history last diverged.
+  unsigned long frame;
+  unsigned long end;
+  GlobalCtx* global_ctx;
+} Rewind;
+
+
+// Starts recording at frame 0 from the machine's current state.
+Rewind* RewindCreate(Gameboy* const gb, const RewindOptions* const options);
+
+void RewindDestroy(Rewind* rewind);
+
+// Drops the history and starts over at frame 0. Needed whenever the
+// machine changes other than by running frames: resets, loaded states and
+// swapped cartridges.
+Result RewindClear(Rewind* const rewind);
+
+// Records the frame just run. Called after every frame. Running a frame
+// after seeking back drops the history past it.
+void RewindFrame(Rewind* const rewind);
+
+// Oldest frame still reachable.
+unsigned long RewindOldest(const Rewind* const rewind);
+
+// Moves the machine to the given frame, clamped to the history, and
+// returns the frame reached. The history is kept until a new frame is
+// run, so seeks can go back and forth.
+unsigned long RewindSeek(Rewind* const rewind, unsigned long frame);
+
+// Seeks one frame back.
+unsigned long RewindStepBack(Rewind* const rewind);
+
+#endif
@@ -0,0 +1,110 @@
+#include "ring.h"
+
+#include "global.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+RingBuffer* RingBufferCreate(GlobalCtx* const global_ctx, size_t capacity,
+                             size_t elem_size) {
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+
+  // head and tail sit on cache lines of their own, which malloc doesn't
+  // align to. sizeof is a multiple of the alignment, as aligned_alloc needs.
+  RingBuffer* ring = (RingBuffer*)aligned_alloc(_Alignof(RingBuffer),
+                                                sizeof(RingBuffer));
+  if (ring == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  ring->data = (uint8_t*)malloc(rounded * elem_size);
+  if (ring->data == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    free(ring);
+    return NULL;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = rounded;
+  ring->elem_size = elem_size;
+  return ring;
+}
+
+
+void RingBufferDestroy(RingBuffer* ring) {
+  if (ring == NULL) {
+    return;
+  }
+  free(ring->data);
+  ring->data = NULL;
+  free(ring);
+  ring = NULL;
+}
+
+
+size_t RingBufferPush(RingBuffer* const ring, const void* const elems,
+                      size_t count) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t space = ring->capacity - (head - tail);
+  if (count > space) {
+    count = space;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  // The free region may wrap around the end of the buffer, in which case it
+  // is copied in two pieces.
+  size_t begin = head & (ring->capacity - 1);
+  size_t first = ring->capacity - begin;
+  if (first > count) {
+    first = count;
+  }
+  memcpy(ring->data + begin * ring->elem_size, elems,
+         first * ring->elem_size);
+  memcpy(ring->data, (const uint8_t*)elems + first * ring->elem_size,
+         (count - first) * ring->elem_size);
+
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+  return count;
+}
+
+
+size_t RingBufferPop(RingBuffer* const ring, void* const elems, size_t count) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t available = head - tail;
+  if (count > available) {
+    count = available;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  size_t begin = tail & (ring->capacity - 1);
+  size_t first = ring->capacity - begin;
+  if (first > count) {
+    first = count;
+  }
+  memcpy(elems, ring->data + begin * ring->elem_size,
+         first * ring->elem_size);
+  memcpy((uint8_t*)elems + first * ring->elem_size, ring->data,
+         (count - first) * ring->elem_size);
+
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+  return count;
+}
+
+
+size_t RingBufferSize(RingBuffer* const ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return head - tail;
+}
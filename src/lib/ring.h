@@ -0,0 +1,41 @@
+#ifndef RING_H
+#define RING_H
+
+#include "global.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Lock-free single producer, single consumer ring buffer of fixed size
+// elements. The producer only ever writes head and the consumer only ever
+// writes tail, so neither side needs a lock. Capacity is rounded up to a
+// power of two so indices can be masked instead of wrapped.
+typedef struct RingBufferDef {
+  // Kept on separate cache lines so the two threads don't false share.
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  _Alignas(64) size_t capacity;
+  size_t elem_size;
+  uint8_t* data;
+} RingBuffer;
+
+
+RingBuffer* RingBufferCreate(GlobalCtx* const global_ctx, size_t capacity,
+                             size_t elem_size);
+
+void RingBufferDestroy(RingBuffer* ring);
+
+// Producer side. Pushes up to count elements and returns how many fit.
+size_t RingBufferPush(RingBuffer* const ring, const void* const elems,
+                      size_t count);
+
+// Consumer side. Pops up to count elements and returns how many were read.
+size_t RingBufferPop(RingBuffer* const ring, void* const elems, size_t count);
+
+// Number of elements currently queued. Exact only when called from one of
+// the two owning threads.
+size_t RingBufferSize(RingBuffer* const ring);
+
+#endif
@@ -0,0 +1,503 @@
+#include "state.h"
+
+#include "apu.h"
+#include "bus.h"
+#include "byteorder.h"
+#include "cartridge.h"
+#include "cow.h"
+#include "cpu.h"
+#include "gb.h"
+#include "global.h"
+#include "hash.h"
+#include "lz.h"
+#include "mbc.h"
+#include "ppu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define _CHUNK_TAG(a, b, c, d) \
+  ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | \
+   (uint32_t)(d) << 24)
+#define _MAX_CHUNKS 16
+
+static const uint32_t _CHUNK_CPU = _CHUNK_TAG('C', 'P', 'U', ' ');
+static const uint32_t _CHUNK_BUS = _CHUNK_TAG('B', 'U', 'S', ' ');
+static const uint32_t _CHUNK_TIMER = _CHUNK_TAG('T', 'I', 'M', 'R');
+static const uint32_t _CHUNK_APU = _CHUNK_TAG('A', 'P', 'U', ' ');
+static const uint32_t _CHUNK_PPU = _CHUNK_TAG('P', 'P', 'U', ' ');
+static const uint32_t _CHUNK_MBC = _CHUNK_TAG('M', 'B', 'C', ' ');
+static const uint32_t _CHUNK_CART_RAM = _CHUNK_TAG('C', 'R', 'A', 'M');
+static const uint32_t _CHUNK_CONTEXT = _CHUNK_TAG('C', 'T', 'X', ' ');
+// Added after the first states were saved, so states without it still
+// load and leave the held buttons alone.
+static const uint32_t _CHUNK_JOYPAD = _CHUNK_TAG('J', 'O', 'Y', 'P');
+// Added along with timed serial transfers. States without it were saved
+// when transfers completed at once, so none is left under way.
+static const uint32_t _CHUNK_SERIAL = _CHUNK_TAG('S', 'I', 'O', ' ');
+
+// Enums and ints are saved as 4 byte integers, and the structs copied
+// whole must be plain bytes.
+_Static_assert(sizeof(int) == 4, "int must be 4 bytes");
+_Static_assert(sizeof(PpuMode) == 4, "enums must be 4 bytes");
+_Static_assert(sizeof(MBCType) == 4, "enums must be 4 bytes");
+_Static_assert(sizeof(GBMode) == 4, "enums must be 4 bytes");
+_Static_assert(sizeof(CpuRegisters) == 8, "CpuRegisters must be bytes");
+_Static_assert(sizeof(PpuRegisters) == 13, "PpuRegisters must be bytes");
+_Static_assert(sizeof(RealTimeClock) == 6, "RealTimeClock must be bytes");
+
+
+// Consecutive regions sharing a tag, and where the chunk sits in a state
+// being loaded.
+typedef struct ChunkDef {
+  uint32_t tag;
+  size_t first;
+  size_t count;
+  size_t size;
+  const uint8_t* data;
+} Chunk;
+
+
+static void AddRegion(StateRegion* const regions, size_t* const count,
+                      uint32_t chunk, void* const data, size_t size,
+                      size_t width) {
+  regions[*count] = (StateRegion){
+    .data = data,
+    .size = size,
+    .width = width,
+    .chunk = chunk
+  };
+  ++*count;
+}
+
+
+// Pages are listed one by one, since a forked machine's may be anywhere.
+static void AddMemory(StateRegion* const regions, size_t* const count,
+                      uint32_t chunk, CowMemory* const memory) {
+  if (memory->page_count == 0) {
+    AddRegion(regions, count, chunk, NULL, 0, 1);
+    return;
+  }
+  for (size_t i = 0; i < memory->page_count; ++i) {
+    size_t offset = i << COW_PAGE_SHIFT;
+    size_t size = memory->size - offset < COW_PAGE_SIZE ? memory->size - offset
+                                                        : COW_PAGE_SIZE;
+    AddRegion(regions, count, chunk, memory->pages[i], size, 1);
+  }
+}
+
+
+// Loading writes every page, so none may be shared with a fork.
+static Result Unshare(Gameboy* const gb) {
+  CowMemory* memories[] = {
+    &gb->bus->wram, &gb->bus->vram, &gb->cartridge->ram
+  };
+  for (size_t i = 0; i < sizeof(memories) / sizeof(memories[0]); ++i) {
+    if (memories[i]->size > 0 && CowMemoryUnshare(memories[i]) == NULL) {
+      return RESULT_NOTOK;
+    }
+  }
+  return RESULT_OK;
+}
+
+
+// Copies between host order and little endian. Swapping is its own
+// inverse, so this goes both ways.
+static void CopyRegion(void* const dst, const void* const src, size_t size,
+                       size_t width) {
+  if (size == 0) {
+    return;
+  }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  if (width > 1) {
+    uint8_t* out = (uint8_t*)dst;
+    const uint8_t* in = (const uint8_t*)src;
+    for (size_t i = 0; i < size; i += width) {
+      for (size_t j = 0; j < width; ++j) {
+        out[i + j] = in[i + width - 1 - j];
+      }
+    }
+    return;
+  }
+#else
+  (void)width;
+#endif
+  memcpy(dst, src, size);
+}
+
+
+// Groups regions into chunks. Returns the number of chunks.
+static size_t Chunks(const StateRegion* const regions, size_t count,
+                     Chunk* const chunks) {
+  size_t chunk_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (chunk_count == 0 || chunks[chunk_count - 1].tag != regions[i].chunk) {
+      chunks[chunk_count++] = (Chunk){.tag = regions[i].chunk, .first = i};
+    }
+    chunks[chunk_count - 1].count++;
+    chunks[chunk_count - 1].size += regions[i].size;
+  }
+  return chunk_count;
+}
+
+
+static size_t BodySize(const Chunk* const chunks, size_t chunk_count) {
+  size_t size = 0;
+  for (size_t i = 0; i < chunk_count; ++i) {
+    size += STATE_CHUNK_HEADER_SIZE + chunks[i].size;
+  }
+  return size;
+}
+
+
+static void WriteHeader(uint8_t* const out, uint16_t flags, size_t body_size,
+                        size_t stored_size) {
+  Put32(out, STATE_MAGIC);
+  Put16(out + 4, STATE_VERSION);
+  Put16(out + 6, flags);
+  Put32(out + 8, (uint32_t)body_size);
+  Put32(out + 12, (uint32_t)stored_size);
+}
+
+
+static void WriteBody(const StateRegion* const regions,
+                      const Chunk* const chunks, size_t chunk_count,
+                      uint8_t* const out) {
+  uint8_t* pos = out;
+  for (size_t i = 0; i < chunk_count; ++i) {
+    Put32(pos, chunks[i].tag);
+    Put32(pos + 4, (uint32_t)chunks[i].size);
+    pos += STATE_CHUNK_HEADER_SIZE;
+    for (size_t j = chunks[i].first; j < chunks[i].first + chunks[i].count;
+         ++j) {
+      CopyRegion(pos, regions[j].data, regions[j].size, regions[j].width);
+      pos += regions[j].size;
+    }
+  }
+}
+
+
+// Where the state being loaded holds field, one of chunk's regions.
+static const uint8_t* SavedField(const StateRegion* const regions,
+                                 const Chunk* const chunk,
+                                 const void* const field) {
+  const uint8_t* data = chunk->data;
+  for (size_t j = chunk->first; regions[j].data != field; ++j) {
+    data += regions[j].size;
+  }
+  return data;
+}
+
+
+// Finds every chunk the machine needs in body and checks its size, then
+// scatters them into place. Nothing is written unless all of them check
+// out.
+static Result ReadBody(Gameboy* const gb, const uint8_t* const body,
+                       size_t size) {
+  StateRegion regions[STATE_MAX_REGIONS];
+  size_t count = StateRegions(gb, regions);
+  Chunk chunks[_MAX_CHUNKS];
+  size_t chunk_count = Chunks(regions, count, chunks);
+
+  const uint8_t* pos = body;
+  const uint8_t* const end = body + size;
+  while (pos < end) {
+    if ((size_t)(end - pos) < STATE_CHUNK_HEADER_SIZE) {
+      return RESULT_NOTOK;
+    }
+    uint32_t tag = Get32(pos);
+    size_t chunk_size = Get32(pos + 4);
+    pos += STATE_CHUNK_HEADER_SIZE;
+    if (chunk_size > (size_t)(end - pos)) {
+      return RESULT_NOTOK;
+    }
+    for (size_t i = 0; i < chunk_count; ++i) {
+      if (chunks[i].tag != tag) {
+        continue;
+      }
+      if (chunks[i].data != NULL || chunks[i].size != chunk_size) {
+        return RESULT_NOTOK;
+      }
+      chunks[i].data = pos;
+    }
+    pos += chunk_size;
+  }
+  for (size_t i = 0; i < chunk_count; ++i) {
+    if (chunks[i].data == NULL && chunks[i].tag != _CHUNK_JOYPAD &&
+        chunks[i].tag != _CHUNK_SERIAL) {
+      return RESULT_NOTOK;
+    }
+  }
+
+  // States of another ROM would run code that isn't there, and those of
+  // another kind of cartridge would bank nonsense.
+  Cartridge* const cart = gb->cartridge;
+  for (size_t i = 0; i < chunk_count; ++i) {
+    if ((chunks[i].tag == _CHUNK_CONTEXT &&
+         Get64(SavedField(regions, &chunks[i], &cart->rom_hash)) !=
+             cart->rom_hash) ||
+        (chunks[i].tag == _CHUNK_MBC &&
+         Get32(SavedField(regions, &chunks[i], &cart->mbc.type)) !=
+             (uint32_t)cart->mbc.type)) {
+      return RESULT_NOTOK;
+    }
+  }
+
+  if (Unshare(gb) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  // Unsharing moved pages, so the regions are listed again.
+  StateRegions(gb, regions);
+  for (size_t i = 0; i < chunk_count; ++i) {
+    const uint8_t* data = chunks[i].data;
+    if (data == NULL && chunks[i].tag == _CHUNK_SERIAL) {
+      gb->bus->serial_bits = 0;
+      gb->bus->serial_cycles = 0;
+    }
+    if (data == NULL) {
+      continue;
+    }
+    for (size_t j = chunks[i].first; j < chunks[i].first + chunks[i].count;
+         ++j) {
+      CopyRegion(regions[j].data, data, regions[j].size, regions[j].width);
+      data += regions[j].size;
+    }
+  }
+  return RESULT_OK;
+}
+
+
+size_t StateRegions(Gameboy* const gb, StateRegion* const regions) {
+  Cpu* const cpu = &gb->cpu;
+  Bus* const bus = gb->bus;
+  Apu* const apu = &bus->apu;
+  Ppu* const ppu = &bus->ppu;
+  MemBankController* const mbc = &gb->cartridge->mbc;
+  GlobalCtx* const global_ctx = gb->global_ctx;
+  size_t count = 0;
+
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->regs, sizeof(cpu->regs), 1);
+  AddRegion(regions, &count, _CHUNK_CPU, cpu->flags, sizeof(cpu->flags), 1);
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->pc, sizeof(cpu->pc), 2);
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->sp, sizeof(cpu->sp), 2);
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->interrupt_master_enable,
+            sizeof(cpu->interrupt_master_enable), 4);
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->ime_pending,
+            sizeof(cpu->ime_pending), 1);
+  AddRegion(regions, &count, _CHUNK_CPU, &cpu->cb_prefix,
+            sizeof(cpu->cb_prefix), 1);
+
+  AddMemory(regions, &count, _CHUNK_BUS, &bus->wram);
+  AddMemory(regions, &count, _CHUNK_BUS, &bus->vram);
+  AddRegion(regions, &count, _CHUNK_BUS, bus->oam, sizeof(bus->oam), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, bus->io_regs, sizeof(bus->io_regs),
+            1);
+  AddRegion(regions, &count, _CHUNK_BUS, bus->hram, sizeof(bus->hram), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, &bus->interrupts_enable_reg,
+            sizeof(bus->interrupts_enable_reg), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, &bus->interrupts_flag,
+            sizeof(bus->interrupts_flag), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, &bus->wram_bank,
+            sizeof(bus->wram_bank), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, &bus->vram_bank,
+            sizeof(bus->vram_bank), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, &bus->joypad_select,
+            sizeof(bus->joypad_select), 1);
+  AddRegion(regions, &count, _CHUNK_BUS, bus->serial_data,
+            sizeof(bus->serial_data), 1);
+
+  AddRegion(regions, &count, _CHUNK_TIMER, &bus->timer.div,
+            sizeof(bus->timer.div), 2);
+  AddRegion(regions, &count, _CHUNK_TIMER, &bus->timer.tima,
+            sizeof(bus->timer.tima), 1);
+  AddRegion(regions, &count, _CHUNK_TIMER, &bus->timer.tma,
+            sizeof(bus->timer.tma), 1);
+  AddRegion(regions, &count, _CHUNK_TIMER, &bus->timer.tac,
+            sizeof(bus->timer.tac), 1);
+
+  ApuState* const sound = &apu->state;
+  AddRegion(regions, &count, _CHUNK_APU, sound->regs, sizeof(sound->regs), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->enabled,
+            sizeof(sound->enabled), 1);
+  AddRegion(regions, &count, _CHUNK_APU, sound->length, sizeof(sound->length),
+            2);
+  AddRegion(regions, &count, _CHUNK_APU, sound->volume, sizeof(sound->volume),
+            1);
+  AddRegion(regions, &count, _CHUNK_APU, sound->envelope_timer,
+            sizeof(sound->envelope_timer), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->sweep_shadow,
+            sizeof(sound->sweep_shadow), 2);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->sweep_timer,
+            sizeof(sound->sweep_timer), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->sweep_enabled,
+            sizeof(sound->sweep_enabled), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->sweep_negated,
+            sizeof(sound->sweep_negated), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->frame_step,
+            sizeof(sound->frame_step), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &sound->dmg, sizeof(sound->dmg), 1);
+  AddRegion(regions, &count, _CHUNK_APU, &apu->div_bit, sizeof(apu->div_bit),
+            1);
+  AddRegion(regions, &count, _CHUNK_APU, &apu->frame_time,
+            sizeof(apu->frame_time), 4);
+
+  AddRegion(regions, &count, _CHUNK_PPU, &ppu->regs, sizeof(ppu->regs), 1);
+  AddRegion(regions, &count, _CHUNK_PPU, &ppu->mode, sizeof(ppu->mode), 4);
+  AddRegion(regions, &count, _CHUNK_PPU, &ppu->dot, sizeof(ppu->dot), 2);
+  AddRegion(regions, &count, _CHUNK_PPU, &ppu->stat_line,
+            sizeof(ppu->stat_line), 1);
+  AddRegion(regions, &count, _CHUNK_PPU, ppu->palette_ram,
+            sizeof(ppu->palette_ram), 1);
+  AddRegion(regions, &count, _CHUNK_PPU, &ppu->frames, sizeof(ppu->frames),
+            4);
+
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->rtc, sizeof(mbc->rtc), 1);
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->rom_bank,
+            sizeof(mbc->rom_bank), 1);
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->ram_bank,
+            sizeof(mbc->ram_bank), 1);
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->type, sizeof(mbc->type), 4);
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->ram_enable,
+            sizeof(mbc->ram_enable), 4);
+  AddRegion(regions, &count, _CHUNK_MBC, &mbc->banking_mode,
+            sizeof(mbc->banking_mode), 4);
+  // Listed even when empty, so a state only loads into a cartridge with
+  // as much RAM.
+  AddMemory(regions, &count, _CHUNK_CART_RAM, &gb->cartridge->ram);
+
+  AddRegion(regions, &count, _CHUNK_CONTEXT, &global_ctx->mode,
+            sizeof(global_ctx->mode), 4);
+  AddRegion(regions, &count, _CHUNK_CONTEXT, &global_ctx->status,
+            sizeof(global_ctx->status), 4);
+  AddRegion(regions, &count, _CHUNK_CONTEXT, &global_ctx->clock,
+            sizeof(global_ctx->clock), 4);
+  // Only checked on load, since it never changes.
+  AddRegion(regions, &count, _CHUNK_CONTEXT, &gb->cartridge->rom_hash,
+            sizeof(gb->cartridge->rom_hash), 8);
+
+  // Part of the state since the joypad interrupt depends on what was held
+  // before.
+  AddRegion(regions, &count, _CHUNK_JOYPAD, &bus->buttons,
+            sizeof(bus->buttons), 1);
+  AddRegion(regions, &count, _CHUNK_SERIAL, &bus->serial_bits,
+            sizeof(bus->serial_bits), 1);
+  AddRegion(regions, &count, _CHUNK_SERIAL, &bus->serial_cycles,
+            sizeof(bus->serial_cycles), 2);
+  return count;
+}
+
+
+size_t StateSize(Gameboy* const gb) {
+  StateRegion regions[STATE_MAX_REGIONS];
+  size_t count = StateRegions(gb, regions);
+  Chunk chunks[_MAX_CHUNKS];
+  size_t chunk_count = Chunks(regions, count, chunks);
+  return STATE_HEADER_SIZE + BodySize(chunks, chunk_count);
+}
+
+
+size_t StateBound(Gameboy* const gb) {
+  return STATE_HEADER_SIZE + LzBound(StateSize(gb) - STATE_HEADER_SIZE);
+}
+
+
+Result StateSave(Gameboy* const gb, uint8_t* const out, size_t size) {
+  StateRegion regions[STATE_MAX_REGIONS];
+  size_t count = StateRegions(gb, regions);
+  Chunk chunks[_MAX_CHUNKS];
+  size_t chunk_count = Chunks(regions, count, chunks);
+  size_t body_size = BodySize(chunks, chunk_count);
+  if (size < STATE_HEADER_SIZE + body_size) {
+    gb->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  WriteHeader(out, 0, body_size, body_size);
+  WriteBody(regions, chunks, chunk_count, out + STATE_HEADER_SIZE);
+  return RESULT_OK;
+}
+
+
+size_t StateSaveCompressed(Gameboy* const gb, uint8_t* const out,
+                           size_t capacity) {
+  StateRegion regions[STATE_MAX_REGIONS];
+  size_t count = StateRegions(gb, regions);
+  Chunk chunks[_MAX_CHUNKS];
+  size_t chunk_count = Chunks(regions, count, chunks);
+  size_t body_size = BodySize(chunks, chunk_count);
+  if (capacity < STATE_HEADER_SIZE + LzBound(body_size)) {
+    gb->global_ctx->error = INVALID_STATE;
+    return 0;
+  }
+  uint8_t* body = (uint8_t*)malloc(body_size);
+  if (body == NULL) {
+    gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return 0;
+  }
+  WriteBody(regions, chunks, chunk_count, body);
+  size_t stored_size = LzCompress(body, body_size, out + STATE_HEADER_SIZE,
+                                  capacity - STATE_HEADER_SIZE);
+  free(body);
+  WriteHeader(out, STATE_FLAG_COMPRESSED, body_size, stored_size);
+  return STATE_HEADER_SIZE + stored_size;
+}
+
+
+Result StateLoad(Gameboy* const gb, const uint8_t* const in, size_t size) {
+  if (size < STATE_HEADER_SIZE || Get32(in) != STATE_MAGIC ||
+      Get16(in + 4) != STATE_VERSION ||
+      Get32(in + 12) != size - STATE_HEADER_SIZE) {
+    gb->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  uint16_t flags = Get16(in + 6);
+  size_t body_size = Get32(in + 8);
+  const uint8_t* stored = in + STATE_HEADER_SIZE;
+  size_t stored_size = size - STATE_HEADER_SIZE;
+
+  Result result;
+  if (flags & STATE_FLAG_COMPRESSED) {
+    uint8_t* body = (uint8_t*)malloc(body_size > 0 ? body_size : 1);
+    if (body == NULL) {
+      gb->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      return RESULT_NOTOK;
+    }
+    if (LzDecompress(stored, stored_size, body, body_size) != body_size) {
+      result = RESULT_NOTOK;
+    }
+    else {
+      result = ReadBody(gb, body, body_size);
+    }
+    free(body);
+  }
+  else if (body_size == stored_size) {
+    result = ReadBody(gb, stored, stored_size);
+  }
+  else {
+    result = RESULT_NOTOK;
+  }
+  if (result == RESULT_NOTOK) {
+    gb->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+
+  // Whatever the renderer has not applied yet belongs to the old state.
+  PpuClearLog(&gb->bus->ppu);
+  PpuRendererSync(gb->renderer, &gb->bus->vram, gb->bus->oam,
+                  gb->bus->ppu.palette_ram);
+  ApuResync(&gb->bus->apu);
+  return RESULT_OK;
+}
+
+
+uint64_t StateHash(Gameboy* const gb) {
+  StateRegion regions[STATE_MAX_REGIONS];
+  size_t count = StateRegions(gb, regions);
+  uint64_t hash = 0;
+  for (size_t i = 0; i < count; ++i) {
+    hash = Hash64(regions[i].data, regions[i].size, hash);
+  }
+  return hash;
+}
@@ -0,0 +1,64 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "gb.h"
+#include "global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper bound on the number of regions StateRegions returns.
+#define STATE_MAX_REGIONS 128
+
+// Saved states start with a 16 byte header: magic, version, flags, the
+// size of the body once decompressed and the number of bytes stored after
+// the header, all little endian. The body is a list of chunks, each a tag
+// and a size followed by its fields in order. Loading skips chunks it
+// doesn't know and rejects states missing one it needs, so fields can be
+// added in new chunks without breaking old states.
+#define STATE_MAGIC 0x54534247
+#define STATE_VERSION 1
+#define STATE_HEADER_SIZE 16
+#define STATE_CHUNK_HEADER_SIZE 8
+// The body is compressed with LzCompress.
+#define STATE_FLAG_COMPRESSED 0x0001
+
+
+// One contiguous piece of machine state, an array of width byte integers
+// in host order. Saved states hold them little endian.
+typedef struct StateRegionDef {
+  void* data;
+  size_t size;
+  size_t width;
+  // Tag of the chunk the region is saved in.
+  uint32_t chunk;
+} StateRegion;
+
+
+// Lists everything a state holds, in the order it is saved. Pointers,
+// host resources and the renderer's caches are left out; the renderer and
+// synthesizer are rebuilt from the listed state on load. Regions of a
+// chunk are listed together. Returns the number of regions written.
+size_t StateRegions(Gameboy* const gb, StateRegion* const regions);
+
+// Bytes StateSave writes. Fixed for a given cartridge.
+size_t StateSize(Gameboy* const gb);
+
+// Upper bound on the bytes StateSaveCompressed writes.
+size_t StateBound(Gameboy* const gb);
+
+// Saves uncompressed, which is a header and a copy of every region.
+Result StateSave(Gameboy* const gb, uint8_t* const out, size_t size);
+
+// Returns the number of bytes written, or 0 on failure.
+size_t StateSaveCompressed(Gameboy* const gb, uint8_t* const out,
+                           size_t capacity);
+
+// Accepts compressed and uncompressed states. The whole state is checked
+// before anything is written, so the machine is untouched on failure.
+Result StateLoad(Gameboy* const gb, const uint8_t* const in, size_t size);
+
+// Hash of the machine state, taken region by region without saving it.
+uint64_t StateHash(Gameboy* const gb);
+
+#endif
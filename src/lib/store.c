@@ -0,0 +1,502 @@
+#include "store.h"
+
+#include "byteorder.h"
+#include "gb.h"
+#include "global.h"
+#include "hash.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define _RECORD_TAG(a, b, c, d) \
+  ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | \
+   (uint32_t)(d) << 24)
+
+// A piece's hash followed by its bytes.
+static const uint32_t _RECORD_PIECE = _RECORD_TAG('P', 'I', 'E', 'C');
+// A state's size and piece count followed by the offset of each piece.
+static const uint32_t _RECORD_STATE = _RECORD_TAG('S', 'T', 'A', 'T');
+static const size_t _PIECE_HASH_SIZE = 16;
+static const size_t _STATE_LIST_OFFSET = 8;
+// Seeds of the two halves of a piece's hash.
+static const uint64_t _SEEDS[2] = {0, 0x5851F42D4C957F2DULL};
+static const size_t _MIN_PIECE_CAPACITY = 1024;
+static const size_t _MIN_STATE_CAPACITY = 256;
+
+
+static size_t Align8(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+
+// Ends of the pieces a state splits into, written to ends unless NULL.
+// Chunks of a page or more are cut into pages from the start of their
+// data, so each memory bank lands in a piece of its own. Everything in
+// between, small chunks and chunk headers, is kept together.
+static size_t Split(const uint8_t* const state, size_t size,
+                    uint64_t* const ends) {
+  size_t count = 0;
+  size_t last = 0;
+  size_t offset = STATE_HEADER_SIZE;
+  while (offset + STATE_CHUNK_HEADER_SIZE <= size) {
+    size_t data = offset + STATE_CHUNK_HEADER_SIZE;
+    size_t length = Get32(state + offset + 4);
+    if (length > size - data) {
+      break;
+    }
+    if (length >= STORE_PIECE_SIZE) {
+      for (size_t end = data; end <= data + length;
+           end += STORE_PIECE_SIZE) {
+        if (ends != NULL) {
+          ends[count] = end;
+        }
+        ++count;
+        last = end;
+      }
+    }
+    offset = data + length;
+  }
+  if (size > last) {
+    if (ends != NULL) {
+      ends[count] = size;
+    }
+    ++count;
+  }
+  return count;
+}
+
+
+static void HashPiece(const uint8_t* const data, size_t size,
+                      uint64_t* const hash) {
+  hash[0] = Hash64(data, size, _SEEDS[0]);
+  hash[1] = Hash64(data, size, _SEEDS[1]);
+}
+
+
+// Slot holding the piece, or the empty slot it would go in.
+static StorePiece* FindPiece(const Store* const store,
+                             const uint64_t* const hash) {
+  size_t mask = store->piece_capacity - 1;
+  size_t slot = (size_t)hash[0] & mask;
+  while (store->pieces[slot].offset != 0 &&
+         (store->pieces[slot].hash[0] != hash[0] ||
+          store->pieces[slot].hash[1] != hash[1])) {
+    slot = (slot + 1) & mask;
+  }
+  return &store->pieces[slot];
+}
+
+
+// Makes room for one more piece.
+static Result ReservePiece(Store* const store) {
+  if ((store->piece_count + 1) * 2 <= store->piece_capacity) {
+    return RESULT_OK;
+  }
+  size_t capacity = store->piece_capacity > 0 ? store->piece_capacity * 2
+                                              : _MIN_PIECE_CAPACITY;
+  StorePiece* pieces = (StorePiece*)calloc(capacity, sizeof(StorePiece));
+  if (pieces == NULL) {
+    store->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  StorePiece* old = store->pieces;
+  size_t old_capacity = store->piece_capacity;
+  store->pieces = pieces;
+  store->piece_capacity = capacity;
+  for (size_t i = 0; i < old_capacity; ++i) {
+    if (old[i].offset != 0) {
+      *FindPiece(store, old[i].hash) = old[i];
+    }
+  }
+  free(old);
+  return RESULT_OK;
+}
+
+
+static Result AddStateRecord(Store* const store, uint64_t offset) {
+  if (store->state_count == store->state_capacity) {
+    size_t capacity = store->state_capacity > 0 ? store->state_capacity * 2
+                                                : _MIN_STATE_CAPACITY;
+    uint64_t* states = (uint64_t*)realloc(store->states,
+                                          capacity * sizeof(uint64_t));
+    if (states == NULL) {
+      store->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      return RESULT_NOTOK;
+    }
+    store->states = states;
+    store->state_capacity = capacity;
+  }
+  store->states[store->state_count++] = offset;
+  return RESULT_OK;
+}
+
+
+// Offset the next record's payload goes at, or 0 if it doesn't fit.
+static size_t Reserve(Store* const store, size_t size) {
+  if (size > UINT32_MAX ||
+      store->capacity - store->end < STORE_RECORD_HEADER_SIZE + Align8(size)) {
+    store->global_ctx->error = STORE_FULL;
+    return 0;
+  }
+  return store->end + STORE_RECORD_HEADER_SIZE;
+}
+
+
+// Writes the record's header once its payload is in place, so a record
+// cut short by a crash reads as the end of the store.
+static uint64_t Commit(Store* const store, uint32_t type, size_t size) {
+  uint64_t offset = store->end;
+  Put32(store->arena + offset + 4, (uint32_t)size);
+  Put32(store->arena + offset, type);
+  store->end += STORE_RECORD_HEADER_SIZE + Align8(size);
+  return offset;
+}
+
+
+// Rebuilds the tables from the records of a reopened file. Records of
+// unknown types are skipped.
+static Result Scan(Store* const store) {
+  const uint8_t* arena = store->arena;
+  if (Get32(arena) != STORE_MAGIC || Get32(arena + 4) != STORE_VERSION) {
+    store->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  size_t offset = STORE_HEADER_SIZE;
+  while (store->capacity - offset >= STORE_RECORD_HEADER_SIZE) {
+    uint32_t type = Get32(arena + offset);
+    size_t size = Get32(arena + offset + 4);
+    if (type == 0) {
+      break;
+    }
+    if (store->capacity - offset - STORE_RECORD_HEADER_SIZE < Align8(size)) {
+      store->global_ctx->error = INVALID_STATE;
+      return RESULT_NOTOK;
+    }
+    const uint8_t* payload = arena + offset + STORE_RECORD_HEADER_SIZE;
+    if (type == _RECORD_PIECE) {
+      if (size < _PIECE_HASH_SIZE) {
+        store->global_ctx->error = INVALID_STATE;
+        return RESULT_NOTOK;
+      }
+      if (ReservePiece(store) == RESULT_NOTOK) {
+        return RESULT_NOTOK;
+      }
+      uint64_t hash[2] = {Get64(payload), Get64(payload + 8)};
+      StorePiece* piece = FindPiece(store, hash);
+      if (piece->offset == 0) {
+        *piece = (StorePiece){{hash[0], hash[1]}, offset};
+        ++store->piece_count;
+      }
+    }
+    else if (type == _RECORD_STATE) {
+      if (size < _STATE_LIST_OFFSET ||
+          size != _STATE_LIST_OFFSET + (size_t)Get32(payload + 4) * 8) {
+        store->global_ctx->error = INVALID_STATE;
+        return RESULT_NOTOK;
+      }
+      if (AddStateRecord(store, offset) == RESULT_NOTOK) {
+        return RESULT_NOTOK;
+      }
+    }
+    offset += STORE_RECORD_HEADER_SIZE + Align8(size);
+  }
+  store->end = offset;
+  return RESULT_OK;
+}
+
+
+static Result Map(Store* const store, const StoreOptions* const options) {
+  store->capacity = Align8(options->capacity);
+  if (store->capacity < STORE_HEADER_SIZE) {
+    store->capacity = STORE_HEADER_SIZE;
+  }
+  void* map;
+  if (options->path != NULL) {
+    store->fd = open(options->path, O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0) {
+      store->global_ctx->error = FILE_NOT_FOUND;
+      return RESULT_NOTOK;
+    }
+    struct stat info;
+    if (fstat(store->fd, &info) != 0) {
+      store->global_ctx->error = FILE_NOT_FOUND;
+      return RESULT_NOTOK;
+    }
+    // Other files are left as they are.
+    uint8_t header[8];
+    if (info.st_size > 0 &&
+        (pread(store->fd, header, sizeof(header), 0) != sizeof(header) ||
+         Get32(header) != STORE_MAGIC ||
+         Get32(header + 4) != STORE_VERSION)) {
+      store->global_ctx->error = INVALID_STATE;
+      return RESULT_NOTOK;
+    }
+    // Never shrinks a store written with a larger capacity. Growing leaves
+    // a sparse file.
+    if ((size_t)info.st_size > store->capacity) {
+      store->capacity = (size_t)info.st_size;
+    }
+    else if ((size_t)info.st_size < store->capacity &&
+             ftruncate(store->fd, (off_t)store->capacity) != 0) {
+      store->global_ctx->error = FAILED_TO_WRITE_FILE;
+      return RESULT_NOTOK;
+    }
+    map = mmap(NULL, store->capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+               store->fd, 0);
+  }
+  else {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    map = mmap(NULL, store->capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+  }
+  if (map == MAP_FAILED) {
+    store->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  store->arena = (uint8_t*)map;
+  return RESULT_OK;
+}
+
+
+Store* StoreCreate(GlobalCtx* const global_ctx,
+                   const StoreOptions* const options) {
+  Store* store = (Store*)malloc(sizeof(Store));
+  if (store == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(store, 0, sizeof(Store));
+  store->fd = -1;
+  store->global_ctx = global_ctx;
+  if (Map(store, options) == RESULT_NOTOK ||
+      ReservePiece(store) == RESULT_NOTOK) {
+    StoreDestroy(store);
+    return NULL;
+  }
+  // New files are all zeroes.
+  if (Get32(store->arena) == 0) {
+    Put32(store->arena, STORE_MAGIC);
+    Put32(store->arena + 4, STORE_VERSION);
+    store->end = STORE_HEADER_SIZE;
+  }
+  else if (Scan(store) == RESULT_NOTOK) {
+    StoreDestroy(store);
+    return NULL;
+  }
+  return store;
+}
+
+
+void StoreDestroy(Store* store) {
+  if (store == NULL) {
+    return;
+  }
+  if (store->arena != NULL) {
+    if (store->fd >= 0) {
+      msync(store->arena, store->end, MS_SYNC);
+    }
+    munmap(store->arena, store->capacity);
+    store->arena = NULL;
+  }
+  if (store->fd >= 0) {
+    close(store->fd);
+    store->fd = -1;
+  }
+  free(store->pieces);
+  free(store->states);
+  free(store->links);
+  free(store->scratch);
+  store->pieces = NULL;
+  store->states = NULL;
+  store->links = NULL;
+  store->scratch = NULL;
+  store->global_ctx = NULL;
+  free(store);
+  store = NULL;
+}
+
+
+// Returns the offset of the piece's record, adding it if it's new, or 0
+// on failure.
+static uint64_t AddPiece(Store* const store, const uint8_t* const data,
+                         size_t size) {
+  uint64_t hash[2];
+  HashPiece(data, size, hash);
+  if (ReservePiece(store) == RESULT_NOTOK) {
+    return 0;
+  }
+  StorePiece* piece = FindPiece(store, hash);
+  if (piece->offset != 0) {
+    return piece->offset;
+  }
+  size_t payload = Reserve(store, _PIECE_HASH_SIZE + size);
+  if (payload == 0) {
+    return 0;
+  }
+  Put64(store->arena + payload, hash[0]);
+  Put64(store->arena + payload + 8, hash[1]);
+  memcpy(store->arena + payload + _PIECE_HASH_SIZE, data, size);
+  *piece = (StorePiece){{hash[0], hash[1]},
+                        Commit(store, _RECORD_PIECE, _PIECE_HASH_SIZE + size)};
+  ++store->piece_count;
+  return piece->offset;
+}
+
+
+Result StoreAdd(Store* const store, const uint8_t* const state, size_t size,
+                uint64_t* const id) {
+  // Compressed states have no chunks to split along. Flags are the high
+  // half of the second word.
+  if (size < STATE_HEADER_SIZE || size > UINT32_MAX ||
+      Get32(state) != STATE_MAGIC ||
+      (Get32(state + 4) >> 16) & STATE_FLAG_COMPRESSED) {
+    store->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  size_t count = Split(state, size, NULL);
+  if (count > store->link_capacity) {
+    uint64_t* links = (uint64_t*)realloc(store->links,
+                                         count * sizeof(uint64_t));
+    if (links == NULL) {
+      store->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      return RESULT_NOTOK;
+    }
+    store->links = links;
+    store->link_capacity = count;
+  }
+  Split(state, size, store->links);
+  // Each end is replaced by the piece that ends there.
+  size_t start = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t end = store->links[i];
+    store->links[i] = AddPiece(store, state + start, end - start);
+    if (store->links[i] == 0) {
+      return RESULT_NOTOK;
+    }
+    start = end;
+  }
+
+  size_t record_size = _STATE_LIST_OFFSET + count * 8;
+  size_t payload = Reserve(store, record_size);
+  if (payload == 0) {
+    return RESULT_NOTOK;
+  }
+  Put32(store->arena + payload, (uint32_t)size);
+  Put32(store->arena + payload + 4, (uint32_t)count);
+  for (size_t i = 0; i < count; ++i) {
+    Put64(store->arena + payload + _STATE_LIST_OFFSET + i * 8,
+          store->links[i]);
+  }
+  if (AddStateRecord(store, store->end) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  Commit(store, _RECORD_STATE, record_size);
+  *id = store->state_count - 1;
+  return RESULT_OK;
+}
+
+
+size_t StoreStateSize(const Store* const store, uint64_t id) {
+  if (id >= store->state_count) {
+    return 0;
+  }
+  return Get32(store->arena + store->states[id] + STORE_RECORD_HEADER_SIZE);
+}
+
+
+Result StoreGet(const Store* const store, uint64_t id, uint8_t* const out,
+                size_t size) {
+  if (StoreStateSize(store, id) != size || size == 0) {
+    store->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  const uint8_t* record = store->arena + store->states[id] +
+                          STORE_RECORD_HEADER_SIZE;
+  size_t count = Get32(record + 4);
+  size_t pos = 0;
+  // Links are checked, since they may come from a damaged file.
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t link = Get64(record + _STATE_LIST_OFFSET + i * 8);
+    if (link < STORE_HEADER_SIZE ||
+        link > store->end - STORE_RECORD_HEADER_SIZE ||
+        Get32(store->arena + link) != _RECORD_PIECE) {
+      store->global_ctx->error = INVALID_STATE;
+      return RESULT_NOTOK;
+    }
+    size_t piece_size = Get32(store->arena + link + 4);
+    if (piece_size < _PIECE_HASH_SIZE ||
+        piece_size > store->end - link - STORE_RECORD_HEADER_SIZE ||
+        piece_size - _PIECE_HASH_SIZE > size - pos) {
+      store->global_ctx->error = INVALID_STATE;
+      return RESULT_NOTOK;
+    }
+    piece_size -= _PIECE_HASH_SIZE;
+    memcpy(out + pos, store->arena + link + STORE_RECORD_HEADER_SIZE +
+                      _PIECE_HASH_SIZE, piece_size);
+    pos += piece_size;
+  }
+  if (pos != size) {
+    store->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
+
+
+static Result ReserveScratch(Store* const store, size_t size) {
+  if (size <= store->scratch_size) {
+    return RESULT_OK;
+  }
+  uint8_t* scratch = (uint8_t*)realloc(store->scratch, size);
+  if (scratch == NULL) {
+    store->global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return RESULT_NOTOK;
+  }
+  store->scratch = scratch;
+  store->scratch_size = size;
+  return RESULT_OK;
+}
+
+
+Result StoreSave(Store* const store, Gameboy* const gb, uint64_t* const id) {
+  size_t size = StateSize(gb);
+  if (ReserveScratch(store, size) == RESULT_NOTOK ||
+      StateSave(gb, store->scratch, size) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  return StoreAdd(store, store->scratch, size, id);
+}
+
+
+Result StoreLoad(Store* const store, Gameboy* const gb, uint64_t id) {
+  size_t size = StoreStateSize(store, id);
+  if (size == 0) {
+    store->global_ctx->error = INVALID_STATE;
+    return RESULT_NOTOK;
+  }
+  if (ReserveScratch(store, size) == RESULT_NOTOK ||
+      StoreGet(store, id, store->scratch, size) == RESULT_NOTOK) {
+    return RESULT_NOTOK;
+  }
+  return StateLoad(gb, store->scratch, size);
+}
+
+
+Result StoreSync(Store* const store) {
+  if (store->fd >= 0 && msync(store->arena, store->end, MS_SYNC) != 0) {
+    store->global_ctx->error = FAILED_TO_WRITE_FILE;
+    return RESULT_NOTOK;
+  }
+  return RESULT_OK;
+}
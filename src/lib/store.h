@@ -0,0 +1,98 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "gb.h"
+#include "global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Files start with a 16 byte header: magic, version and padding, little
+// endian. Records follow, each a type and a payload size followed by the
+// payload padded to 8 bytes. A zero type marks the end.
+#define STORE_MAGIC 0x53534247
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 16
+#define STORE_RECORD_HEADER_SIZE 8
+// Pieces are at most one page of memory, so every bank is its own piece.
+#define STORE_PIECE_SIZE 4096
+
+
+typedef struct StoreOptionsDef {
+  // File holding the store, reopened if it exists. NULL keeps the store in
+  // anonymous memory, gone once destroyed.
+  const char* path;
+  // Largest the store may grow to. The address space, and the file, are
+  // reserved up front, but only what is written takes memory or disk.
+  size_t capacity;
+} StoreOptions;
+
+// Slot of the piece table. offset is where the piece's record starts, or
+// 0 for an empty slot.
+typedef struct StorePieceDef {
+  uint64_t hash[2];
+  uint64_t offset;
+} StorePiece;
+
+// Archive of saved states that keeps each distinct piece once. States are
+// split along their chunks into pieces of at most a page, so every memory
+// bank is a piece of its own, and pieces are keyed by a 128 bit hash of
+// their contents. A state is then only a list of pieces, and states that
+// differ in a few banks share all the others. Everything is appended to
+// one memory mapped log, so the store can outgrow memory and be reopened.
+// Not safe to use from several threads at once.
+typedef struct StoreDef {
+  uint8_t* arena;
+  size_t capacity;
+  // Bytes of the arena in use.
+  size_t end;
+  // -1 without a file.
+  int fd;
+  // Open addressed, at most half full.
+  StorePiece* pieces;
+  size_t piece_capacity;
+  size_t piece_count;
+  // Offset of each state's record, indexed by id.
+  uint64_t* states;
+  size_t state_capacity;
+  size_t state_count;
+  // Pieces of the state being added.
+  uint64_t* links;
+  size_t link_capacity;
+  // Holds a state for StoreSave and StoreLoad.
+  uint8_t* scratch;
+  size_t scratch_size;
+  GlobalCtx* global_ctx;
+} Store;
+
+
+// Returns NULL on failure, including for files that aren't stores.
+Store* StoreCreate(GlobalCtx* const global_ctx,
+                   const StoreOptions* const options);
+
+// Flushes the file, if any.
+void StoreDestroy(Store* store);
+
+// Adds an uncompressed saved state and sets id to the number it is loaded
+// by. Ids count up from 0.
+Result StoreAdd(Store* const store, const uint8_t* const state, size_t size,
+                uint64_t* const id);
+
+// Size of the saved state, or 0 for ids not in the store.
+size_t StoreStateSize(const Store* const store, uint64_t id);
+
+// Reassembles a saved state into out, which holds StoreStateSize bytes.
+Result StoreGet(const Store* const store, uint64_t id, uint8_t* const out,
+                size_t size);
+
+// Saves the machine's state into the store.
+Result StoreSave(Store* const store, Gameboy* const gb, uint64_t* const id);
+
+// Loads a state from the store into the machine, untouched on failure.
+Result StoreLoad(Store* const store, Gameboy* const gb, uint64_t id);
+
+// Writes what was added to the file. Done anyway by the system over time
+// and on destroy.
+Result StoreSync(Store* const store);
+
+#endif
@@ -0,0 +1,60 @@
+#include "triple_buffer.h"
+
+#include "global.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const int _FRESH_FRAME = 0x04;
+static const int _INDEX_MASK = 0x03;
+
+
+TripleBuffer* TripleBufferCreate(GlobalCtx* const global_ctx) {
+  TripleBuffer* tb = (TripleBuffer*)malloc(sizeof(TripleBuffer));
+  if (tb == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(tb->buffers, 0xFF, sizeof(tb->buffers));
+  tb->back = 0;
+  tb->front = 1;
+  atomic_init(&tb->middle, 2);
+  return tb;
+}
+
+
+void TripleBufferDestroy(TripleBuffer* tb) {
+  if (tb == NULL) {
+    return;
+  }
+  free(tb);
+  tb = NULL;
+}
+
+
+uint32_t* TripleBufferBack(TripleBuffer* const tb) {
+  return tb->buffers[tb->back];
+}
+
+
+uint32_t* TripleBufferPublish(TripleBuffer* const tb) {
+  int prev = atomic_exchange_explicit(&tb->middle, tb->back | _FRESH_FRAME,
+                                      memory_order_acq_rel);
+  tb->back = prev & _INDEX_MASK;
+  return tb->buffers[tb->back];
+}
+
+
+const uint32_t* TripleBufferAcquire(TripleBuffer* const tb) {
+  if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) &
+        _FRESH_FRAME)) {
+    return NULL;
+  }
+  int prev = atomic_exchange_explicit(&tb->middle, tb->front,
+                                      memory_order_acq_rel);
+  tb->front = prev & _INDEX_MASK;
+  return tb->buffers[tb->front];
+}
@@ -0,0 +1,44 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include "global.h"
+#include "ppu.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+
+// Lock-free handoff of finished frames from the PPU thread to the thread
+// presenting them. The producer always owns one buffer to draw into, the
+// consumer owns the one on screen, and the third is swapped between them
+// atomically. Neither side ever waits, and a frame is never copied on its
+// way through.
+typedef struct TripleBufferDef {
+  uint32_t buffers[3][PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT];
+  // Buffer the producer is drawing into. Producer only.
+  int back;
+  // Buffer being presented. Consumer only.
+  int front;
+  // Spare buffer index, with _FRESH_FRAME set while it holds a frame the
+  // consumer hasn't picked up yet.
+  atomic_int middle;
+} TripleBuffer;
+
+
+TripleBuffer* TripleBufferCreate(GlobalCtx* const global_ctx);
+
+void TripleBufferDestroy(TripleBuffer* tb);
+
+// Producer side. Buffer to draw the next frame into.
+uint32_t* TripleBufferBack(TripleBuffer* const tb);
+
+// Producer side. Hands the finished back buffer over and returns the buffer
+// to draw the following frame into. Frames the consumer never picked up are
+// overwritten.
+uint32_t* TripleBufferPublish(TripleBuffer* const tb);
+
+// Consumer side. Returns the newest finished frame, or NULL when nothing
+// was published since the last call.
+const uint32_t* TripleBufferAcquire(TripleBuffer* const tb);
+
+#endif
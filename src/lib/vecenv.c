@@ -0,0 +1,220 @@
+#include "vecenv.h"
+
+#include "bus.h"
+#include "color.h"
+#include "gb.h"
+#include "global.h"
+#include "pool.h"
+#include "ppu.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const uint16_t _CART_RAM_BEGIN = 0xA000;
+static const uint16_t _CART_RAM_END = 0xC000;
+
+
+static Result InitEnv(VecEnv* const vec, size_t index,
+                      const char* const romfile) {
+  Gameboy* gb = &vec->envs[index];
+  gb->global_ctx = &vec->contexts[index];
+  gb->options = (GameboyOptions){
+    .color_profile = COLOR_PROFILE_LCD,
+    .apu_mode = APU_MODE_ELIDED,
+    .render_mode = vec->options.render ? RENDER_MODE_INLINE
+                                       : RENDER_MODE_NONE
+  };
+  if (index == 0) {
+    return GameboyInit(gb, romfile);
+  }
+  // Every other machine copies the ROM the first one read.
+  const Cartridge* first = vec->envs[0].cartridge;
+  return GameboyInitFromBuffer(gb, first->data, first->rom_size);
+}
+
+
+void VecEnvReset(VecEnv* const vec, size_t index) {
+  Gameboy* gb = &vec->envs[index];
+  if (vec->start != NULL) {
+    StateLoad(gb, vec->start, vec->state_size);
+  }
+  else {
+    GameboyReset(gb);
+  }
+  gb->global_ctx->error = NO_ERROR;
+  BusSetButtons(gb->bus, 0);
+  vec->episode_frames[index] = 0;
+}
+
+
+VecEnv* VecEnvCreate(GlobalCtx* const global_ctx, const char* const romfile,
+                     const VecEnvOptions* const options) {
+  for (size_t i = 0; i < options->ram_addr_count; ++i) {
+    if (options->ram_addrs[i] >= _CART_RAM_BEGIN &&
+        options->ram_addrs[i] < _CART_RAM_END) {
+      global_ctx->error = INVALID_ADDRESS;
+      return NULL;
+    }
+  }
+  VecEnv* vec = (VecEnv*)malloc(sizeof(VecEnv));
+  if (vec == NULL) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+  memset(vec, 0, sizeof(VecEnv));
+  vec->global_ctx = global_ctx;
+  vec->options = *options;
+  vec->options.ram_addrs = NULL;
+
+  // Zeroed so VecEnvDestroy can tell which machines were initialized.
+  vec->envs = (Gameboy*)calloc(options->count, sizeof(Gameboy));
+  vec->contexts = (GlobalCtx*)calloc(options->count, sizeof(GlobalCtx));
+  vec->episode_frames =
+      (unsigned long*)calloc(options->count, sizeof(unsigned long));
+  if (options->ram_addr_count > 0) {
+    vec->ram_addrs =
+        (uint16_t*)malloc(options->ram_addr_count * sizeof(uint16_t));
+  }
+  if (vec->envs == NULL || vec->contexts == NULL ||
+      vec->episode_frames == NULL ||
+      (options->ram_addr_count > 0 && vec->ram_addrs == NULL)) {
+    global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+    VecEnvDestroy(vec);
+    return NULL;
+  }
+  if (options->ram_addr_count > 0) {
+    memcpy(vec->ram_addrs, options->ram_addrs,
+           options->ram_addr_count * sizeof(uint16_t));
+  }
+
+  for (size_t i = 0; i < options->count; ++i) {
+    if (InitEnv(vec, i, romfile) == RESULT_NOTOK) {
+      global_ctx->error = vec->contexts[i].error;
+      VecEnvDestroy(vec);
+      return NULL;
+    }
+  }
+
+  // Episodes from a given state restart by loading it. Those from power on
+  // use the machine's own reset.
+  if (options->start_state != NULL && options->count > 0) {
+    // Loading it once checks it and leaves it uncompressed, so resets are
+    // a plain copy.
+    Gameboy* const first = &vec->envs[0];
+    if (StateLoad(first, options->start_state,
+                  options->start_state_size) == RESULT_NOTOK) {
+      global_ctx->error = INVALID_STATE;
+      VecEnvDestroy(vec);
+      return NULL;
+    }
+    vec->state_size = StateSize(first);
+    vec->start = (uint8_t*)malloc(vec->state_size);
+    if (vec->start == NULL) {
+      global_ctx->error = MEMORY_ALLOCATION_FAILURE;
+      VecEnvDestroy(vec);
+      return NULL;
+    }
+    StateSave(first, vec->start, vec->state_size);
+    for (size_t i = 0; i < options->count; ++i) {
+      VecEnvReset(vec, i);
+    }
+  }
+
+  vec->pool = ThreadPoolCreate(global_ctx, options->threads, options->pin);
+  if (vec->pool == NULL) {
+    VecEnvDestroy(vec);
+    return NULL;
+  }
+  return vec;
+}
+
+
+void VecEnvDestroy(VecEnv* vec) {
+  if (vec == NULL) {
+    return;
+  }
+  ThreadPoolDestroy(vec->pool);
+  if (vec->envs != NULL) {
+    for (size_t i = 0; i < vec->options.count; ++i) {
+      if (vec->envs[i].global_ctx != NULL) {
+        GameboyDestroy(&vec->envs[i]);
+      }
+    }
+  }
+  free(vec->envs);
+  free(vec->contexts);
+  free(vec->episode_frames);
+  free(vec->ram_addrs);
+  free(vec->start);
+  vec->envs = NULL;
+  vec->contexts = NULL;
+  vec->episode_frames = NULL;
+  vec->ram_addrs = NULL;
+  vec->start = NULL;
+  vec->pool = NULL;
+  vec->global_ctx = NULL;
+  free(vec);
+  vec = NULL;
+}
+
+
+static void StepEnv(void* const ctx, size_t index, int worker) {
+  (void)worker;
+  VecEnv* const vec = (VecEnv*)ctx;
+  const VecEnvStep* const step = &vec->step;
+  Gameboy* const gb = &vec->envs[index];
+
+  if (step->actions != NULL) {
+    BusSetButtons(gb->bus, step->actions[index]);
+  }
+  unsigned int frame = 0;
+  for (; frame < step->frames; ++frame) {
+    if (GameboyRunFrame(gb) == RESULT_NOTOK ||
+        gb->global_ctx->status == STATUS_STOP) {
+      ++frame;
+      break;
+    }
+  }
+  vec->episode_frames[index] += frame;
+
+  if (step->observations != NULL && vec->options.render) {
+    memcpy(step->observations +
+               index * PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT,
+           gb->renderer->framebuffer,
+           PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT * sizeof(uint32_t));
+  }
+  if (step->ram != NULL) {
+    uint8_t* out = step->ram + index * vec->options.ram_addr_count;
+    for (size_t i = 0; i < vec->options.ram_addr_count; ++i) {
+      out[i] = BusRead(gb->bus, vec->ram_addrs[i]);
+    }
+  }
+  uint8_t done = gb->global_ctx->error != NO_ERROR ||
+                 gb->global_ctx->status == STATUS_STOP ||
+                 (vec->options.max_frames != 0 &&
+                  vec->episode_frames[index] >= vec->options.max_frames);
+  if (step->dones != NULL) {
+    step->dones[index] = done;
+  }
+  if (done) {
+    VecEnvReset(vec, index);
+  }
+}
+
+
+void VecEnvStepAll(VecEnv* const vec, const uint8_t* const actions,
+                   unsigned int frames, uint32_t* const observations,
+                   uint8_t* const ram, uint8_t* const dones) {
+  vec->step = (VecEnvStep){
+    .actions = actions,
+    .frames = frames,
+    .observations = observations,
+    .ram = ram,
+    .dones = dones
+  };
+  ThreadPoolRun(vec->pool, StepEnv, vec, vec->options.count);
+}
@@ -0,0 +1,83 @@
+#ifndef VECENV_H
+#define VECENV_H
+
+#include "gb.h"
+#include "global.h"
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct VecEnvOptionsDef {
+  // Number of environments.
+  size_t count;
+  // Pool size, 0 for one worker per core, and whether to pin workers.
+  int threads;
+  int pin;
+  // Frames after which an episode ends, 0 for no limit.
+  unsigned long max_frames;
+  // Addresses read into the RAM features after every step, or NULL.
+  // Cartridge RAM, 0xA000 to 0xBFFF, can't be read while the game has it
+  // disabled, so those addresses are rejected with INVALID_ADDRESS.
+  const uint16_t* ram_addrs;
+  size_t ram_addr_count;
+  // Zero skips rasterization. Observations are then left untouched.
+  int render;
+  // State episodes start from, compressed or not, or NULL to start from
+  // power on. Must have been saved from the same ROM.
+  const uint8_t* start_state;
+  size_t start_state_size;
+} VecEnvOptions;
+
+// Arguments of the step in progress, read by the workers.
+typedef struct VecEnvStepDef {
+  const uint8_t* actions;
+  unsigned int frames;
+  uint32_t* observations;
+  uint8_t* ram;
+  uint8_t* dones;
+} VecEnvStep;
+
+// Many independent machines on one ROM, stepped together. Every machine
+// runs on the pool's threads and writes straight into the caller's
+// buffers, so a step allocates nothing.
+typedef struct VecEnvDef {
+  Gameboy* envs;
+  GlobalCtx* contexts;
+  // Frames into the current episode of each environment.
+  unsigned long* episode_frames;
+  // Saved state every episode starts from, or NULL to start from power on.
+  uint8_t* start;
+  size_t state_size;
+  VecEnvOptions options;
+  // Private copy of options.ram_addrs.
+  uint16_t* ram_addrs;
+  VecEnvStep step;
+  ThreadPool* pool;
+  GlobalCtx* global_ctx;
+} VecEnv;
+
+
+VecEnv* VecEnvCreate(GlobalCtx* const global_ctx, const char* const romfile,
+                     const VecEnvOptions* const options);
+
+void VecEnvDestroy(VecEnv* vec);
+
+// Holds actions[i], laid out like Bus.buttons, on environment i for frames
+// frames. Then, for every environment i, writes:
+// - its framebuffer to observations + i * PPU_SCREEN_WIDTH *
+//   PPU_SCREEN_HEIGHT, when rendering,
+// - the bytes at ram_addrs to ram + i * ram_addr_count,
+// - whether the episode ended to dones[i].
+// Any output may be NULL. Environments whose episode ended, by reaching
+// max_frames or stopping on an error, are reset after their outputs are
+// written, so the next step starts a new episode.
+void VecEnvStepAll(VecEnv* const vec, const uint8_t* const actions,
+                   unsigned int frames, uint32_t* const observations,
+                   uint8_t* const ram, uint8_t* const dones);
+
+// Starts a new episode on one environment.
+void VecEnvReset(VecEnv* const vec, size_t index);
+
+#endif
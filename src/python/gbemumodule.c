@@ -0,0 +1,498 @@
+// CPython bindings. Memory is exported through the buffer protocol, so
+// memoryview and NumPy see the emulator's own arrays without copying.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "cow.h"
+#include "gb.h"
+#include "global.h"
+#include "ppu.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+typedef struct InstanceDef {
+  PyObject_HEAD
+  Gameboy gb;
+  GlobalCtx global_ctx;
+  int initialized;
+  // Set while frames run with the GIL released. Anything touching the
+  // machine refuses to run meanwhile.
+  int running;
+} Instance;
+
+// A piece of an instance's memory. Keeps the instance alive for as long as
+// anything views it.
+typedef struct RegionDef {
+  PyObject_HEAD
+  PyObject* owner;
+  void* data;
+  Py_ssize_t size;
+  Py_ssize_t itemsize;
+  const char* format;
+  int ndim;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+  int readonly;
+} Region;
+
+
+static PyTypeObject _REGION_TYPE;
+
+
+static int RegionGetBuffer(PyObject* const self, Py_buffer* const view,
+                           int flags) {
+  Region* region = (Region*)self;
+  if ((flags & PyBUF_WRITABLE) && region->readonly) {
+    PyErr_SetString(PyExc_BufferError, "region is read only");
+    view->obj = NULL;
+    return -1;
+  }
+  view->obj = Py_NewRef(self);
+  view->buf = region->data;
+  view->len = region->size;
+  view->readonly = region->readonly;
+  view->itemsize = region->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? (char*)region->format : NULL;
+  view->ndim = region->ndim;
+  view->shape = (flags & PyBUF_ND) ? region->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? region->strides
+                                                             : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+
+static void RegionDealloc(PyObject* const self) {
+  Region* region = (Region*)self;
+  Py_XDECREF(region->owner);
+  Py_TYPE(self)->tp_free(self);
+}
+
+
+static PyBufferProcs _REGION_BUFFER = {
+  .bf_getbuffer = RegionGetBuffer,
+  .bf_releasebuffer = NULL
+};
+
+static PyTypeObject _REGION_TYPE = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "gbemu.Region",
+  .tp_basicsize = sizeof(Region),
+  .tp_dealloc = RegionDealloc,
+  .tp_as_buffer = &_REGION_BUFFER,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Memory of a Gameboy instance, viewed in place."
+};
+
+
+// Returns a memoryview over data, rows of width items when rows is above
+// zero, or one dimensional otherwise.
+static PyObject* View(Instance* const owner, void* const data,
+                      Py_ssize_t count, Py_ssize_t itemsize,
+                      const char* const format, Py_ssize_t rows,
+                      int readonly) {
+  Region* region = PyObject_New(Region, &_REGION_TYPE);
+  if (region == NULL) {
+    return NULL;
+  }
+  region->owner = Py_NewRef((PyObject*)owner);
+  region->data = data;
+  region->size = count * itemsize;
+  region->itemsize = itemsize;
+  region->format = format;
+  region->readonly = readonly;
+  if (rows > 0) {
+    region->ndim = 2;
+    region->shape[0] = rows;
+    region->shape[1] = count / rows;
+    region->strides[0] = region->shape[1] * itemsize;
+    region->strides[1] = itemsize;
+  }
+  else {
+    region->ndim = 1;
+    region->shape[0] = count;
+    region->strides[0] = itemsize;
+  }
+  PyObject* view = PyMemoryView_FromObject((PyObject*)region);
+  Py_DECREF(region);
+  return view;
+}
+
+
+static int CheckReady(const Instance* const self) {
+  if (!self->initialized) {
+    PyErr_SetString(PyExc_RuntimeError, "instance is not initialized");
+    return 0;
+  }
+  if (self->running) {
+    PyErr_SetString(PyExc_RuntimeError, "instance is running on another "
+                                        "thread");
+    return 0;
+  }
+  return 1;
+}
+
+
+static PyObject* RaiseError(const Instance* const self) {
+  PyErr_SetString(PyExc_RuntimeError,
+                  _ERROR_CODE_STRINGS[self->global_ctx.error]);
+  return NULL;
+}
+
+
+static int InstanceInit(PyObject* const py_self, PyObject* const args,
+                        PyObject* const kwargs) {
+  Instance* self = (Instance*)py_self;
+  static char* keywords[] = {"rom", "render", "raw_colors", NULL};
+  PyObject* rom = NULL;
+  int render = 1;
+  int raw_colors = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pp", keywords, &rom,
+                                   &render, &raw_colors)) {
+    return -1;
+  }
+  if (self->initialized) {
+    PyErr_SetString(PyExc_RuntimeError, "instance is already initialized");
+    return -1;
+  }
+
+  self->gb.global_ctx = &self->global_ctx;
+  self->gb.options = (GameboyOptions){
+    .color_profile = raw_colors ? COLOR_PROFILE_RAW : COLOR_PROFILE_LCD,
+    .apu_mode = APU_MODE_ELIDED,
+    .render_mode = render ? RENDER_MODE_INLINE : RENDER_MODE_NONE
+  };
+
+  // Anything bytes-like is the image itself, anything else a path.
+  Result result;
+  if (PyObject_CheckBuffer(rom)) {
+    Py_buffer buffer;
+    if (PyObject_GetBuffer(rom, &buffer, PyBUF_SIMPLE) < 0) {
+      return -1;
+    }
+    result = GameboyInitFromBuffer(&self->gb, (const uint8_t*)buffer.buf,
+                                   (size_t)buffer.len);
+    PyBuffer_Release(&buffer);
+  }
+  else {
+    PyObject* path = NULL;
+    if (!PyUnicode_FSConverter(rom, &path)) {
+      return -1;
+    }
+    result = GameboyInit(&self->gb, PyBytes_AS_STRING(path));
+    Py_DECREF(path);
+  }
+  if (result == RESULT_NOTOK) {
+    ErrorCode error = self->global_ctx.error;
+    GameboyDestroy(&self->gb);
+    PyErr_SetString(PyExc_RuntimeError, _ERROR_CODE_STRINGS[error]);
+    return -1;
+  }
+  self->initialized = 1;
+  return 0;
+}
+
+
+static void InstanceDealloc(PyObject* const py_self) {
+  Instance* self = (Instance*)py_self;
+  if (self->initialized) {
+    GameboyDestroy(&self->gb);
+    self->initialized = 0;
+  }
+  Py_TYPE(py_self)->tp_free(py_self);
+}
+
+
+static PyObject* InstanceStep(PyObject* const py_self, PyObject* const args,
+                              PyObject* const kwargs) {
+  Instance* self = (Instance*)py_self;
+  static char* keywords[] = {"frames", "buttons", NULL};
+  unsigned int frames = 1;
+  PyObject* buttons = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|IO", keywords, &frames,
+                                   &buttons)) {
+    return NULL;
+  }
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  if (buttons != Py_None) {
+    long value = PyLong_AsLong(buttons);
+    if (value == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+    BusSetButtons(self->gb.bus, (uint8_t)value);
+  }
+
+  Result result = RESULT_OK;
+  self->running = 1;
+  Py_BEGIN_ALLOW_THREADS
+  for (unsigned int i = 0; i < frames && result == RESULT_OK; ++i) {
+    result = GameboyRunFrame(&self->gb);
+  }
+  Py_END_ALLOW_THREADS
+  self->running = 0;
+  if (result == RESULT_NOTOK) {
+    return RaiseError(self);
+  }
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* InstanceSaveState(PyObject* const py_self,
+                                   PyObject* const args,
+                                   PyObject* const kwargs) {
+  Instance* self = (Instance*)py_self;
+  static char* keywords[] = {"compress", NULL};
+  int compress = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", keywords,
+                                   &compress)) {
+    return NULL;
+  }
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  if (!compress) {
+    size_t size = StateSize(&self->gb);
+    PyObject* state = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+    if (state == NULL) {
+      return NULL;
+    }
+    StateSave(&self->gb, (uint8_t*)PyBytes_AS_STRING(state), size);
+    return state;
+  }
+
+  size_t capacity = StateBound(&self->gb);
+  uint8_t* buffer = (uint8_t*)PyMem_Malloc(capacity);
+  if (buffer == NULL) {
+    return PyErr_NoMemory();
+  }
+  ErrorCode error = self->global_ctx.error;
+  size_t size = StateSaveCompressed(&self->gb, buffer, capacity);
+  PyObject* state = NULL;
+  if (size == 0) {
+    self->global_ctx.error = error;
+    PyErr_NoMemory();
+  }
+  else {
+    state = PyBytes_FromStringAndSize((const char*)buffer, (Py_ssize_t)size);
+  }
+  PyMem_Free(buffer);
+  return state;
+}
+
+
+static PyObject* InstanceLoadState(PyObject* const py_self,
+                                   PyObject* const arg) {
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  Py_buffer buffer;
+  if (PyObject_GetBuffer(arg, &buffer, PyBUF_SIMPLE) < 0) {
+    return NULL;
+  }
+  ErrorCode error = self->global_ctx.error;
+  Result result = StateLoad(&self->gb, (const uint8_t*)buffer.buf,
+                            (size_t)buffer.len);
+  PyBuffer_Release(&buffer);
+  if (result == RESULT_NOTOK) {
+    // A rejected state leaves the machine as it was.
+    self->global_ctx.error = error;
+    PyErr_SetString(PyExc_ValueError, "state does not match this ROM");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* InstanceGetButtons(PyObject* const py_self,
+                                    void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!self->initialized) {
+    return PyLong_FromLong(0);
+  }
+  return PyLong_FromLong(self->gb.bus->buttons);
+}
+
+
+static int InstanceSetButtons(PyObject* const py_self, PyObject* const value,
+                              void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (value == NULL) {
+    PyErr_SetString(PyExc_AttributeError, "buttons can't be deleted");
+    return -1;
+  }
+  long buttons = PyLong_AsLong(value);
+  if (buttons == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (!CheckReady(self)) {
+    return -1;
+  }
+  BusSetButtons(self->gb.bus, (uint8_t)buttons);
+  return 0;
+}
+
+
+static PyObject* InstanceGetFrames(PyObject* const py_self,
+                                   void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  return PyLong_FromUnsignedLong(self->gb.bus->ppu.frames);
+}
+
+
+static PyObject* InstanceGetFramebuffer(PyObject* const py_self,
+                                        void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  // 0xAARRGGBB words, so a little endian host sees BGRA bytes.
+  return View(self, self->gb.renderer->framebuffer,
+              PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT, sizeof(uint32_t), "I",
+              PPU_SCREEN_HEIGHT, 1);
+}
+
+
+static PyObject* InstanceGetWram(PyObject* const py_self,
+                                 void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  // Views need the memory in one piece.
+  uint8_t* wram = CowMemoryUnshare(&self->gb.bus->wram);
+  if (wram == NULL) {
+    return PyErr_NoMemory();
+  }
+  return View(self, wram, BUS_WRAM_SIZE, 1, "B", 0, 0);
+}
+
+
+static PyObject* InstanceGetHram(PyObject* const py_self,
+                                 void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  return View(self, self->gb.bus->hram, sizeof(self->gb.bus->hram), 1, "B",
+              0, 0);
+}
+
+
+static PyObject* InstanceGetCartRam(PyObject* const py_self,
+                                    void* const closure) {
+  (void)closure;
+  Instance* self = (Instance*)py_self;
+  if (!CheckReady(self)) {
+    return NULL;
+  }
+  if (self->gb.cartridge->ram_size == 0) {
+    Py_RETURN_NONE;
+  }
+  uint8_t* ram = CowMemoryUnshare(&self->gb.cartridge->ram);
+  if (ram == NULL) {
+    return PyErr_NoMemory();
+  }
+  return View(self, ram, (Py_ssize_t)self->gb.cartridge->ram_size, 1, "B", 0,
+              0);
+}
+
+
+static PyMethodDef _INSTANCE_METHODS[] = {
+  {"step", (PyCFunction)(void(*)(void))InstanceStep,
+   METH_VARARGS | METH_KEYWORDS,
+   "step(frames=1, buttons=None)\n\nRuns frames frames, holding buttons "
+   "if given. Other Python threads run meanwhile."},
+  {"save_state", (PyCFunction)(void(*)(void))InstanceSaveState,
+   METH_VARARGS | METH_KEYWORDS,
+   "save_state(compress=False) -> bytes\n\nCompressed states are a "
+   "fraction of the size and take a few times longer to save."},
+  {"load_state", InstanceLoadState, METH_O,
+   "load_state(state)\n\nRestores a state saved from the same ROM, "
+   "compressed or not."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef _INSTANCE_GETSET[] = {
+  {"buttons", InstanceGetButtons, InstanceSetButtons,
+   "Held buttons as BUTTON_* bits.", NULL},
+  {"frames", InstanceGetFrames, NULL,
+   "Frames the LCD has finished.", NULL},
+  {"framebuffer", InstanceGetFramebuffer, NULL,
+   "Read only 144x160 view of ARGB pixels.", NULL},
+  {"wram", InstanceGetWram, NULL, "Writable view of work RAM.", NULL},
+  {"hram", InstanceGetHram, NULL, "Writable view of high RAM.", NULL},
+  {"cart_ram", InstanceGetCartRam, NULL,
+   "Writable view of cartridge RAM, or None.", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject _INSTANCE_TYPE = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "gbemu.Gameboy",
+  .tp_basicsize = sizeof(Instance),
+  .tp_dealloc = InstanceDealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Gameboy(rom, render=True, raw_colors=False)\n\n"
+            "rom is a path or a bytes-like ROM image.",
+  .tp_methods = _INSTANCE_METHODS,
+  .tp_getset = _INSTANCE_GETSET,
+  .tp_init = InstanceInit,
+  .tp_new = PyType_GenericNew
+};
+
+static PyModuleDef _MODULE = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "gbemu",
+  .m_doc = "Gameboy emulator instances with zero-copy memory views.",
+  .m_size = -1
+};
+
+
+PyMODINIT_FUNC PyInit_gbemu(void) {
+  if (PyType_Ready(&_REGION_TYPE) < 0 || PyType_Ready(&_INSTANCE_TYPE) < 0) {
+    return NULL;
+  }
+  PyObject* module = PyModule_Create(&_MODULE);
+  if (module == NULL) {
+    return NULL;
+  }
+  if (PyModule_AddObjectRef(module, "Gameboy",
+                            (PyObject*)&_INSTANCE_TYPE) < 0) {
+    Py_DECREF(module);
+    return NULL;
+  }
+  static const struct {
+    const char* name;
+    long value;
+  } buttons[] = {
+    {"BUTTON_RIGHT", 0x01}, {"BUTTON_LEFT", 0x02}, {"BUTTON_UP", 0x04},
+    {"BUTTON_DOWN", 0x08}, {"BUTTON_A", 0x10}, {"BUTTON_B", 0x20},
+    {"BUTTON_SELECT", 0x40}, {"BUTTON_START", 0x80}
+  };
+  for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); ++i) {
+    if (PyModule_AddIntConstant(module, buttons[i].name,
+                                buttons[i].value) < 0) {
+      Py_DECREF(module);
+      return NULL;
+    }
+  }
+  return module;
+}
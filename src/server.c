@@ -0,0 +1,538 @@
+#ifdef __linux__
+  // memfd_create.
+  #define _GNU_SOURCE
+#endif
+
+#include "cow.h"
+#include "gb.h"
+#include "global.h"
+#include "ppu.h"
+#include "protocol.h"
+#include "state.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// Instance ids hold a table index in the low bits and the generation of
+// the index above them.
+#define _INDEX_BITS 12
+#define _MAX_INSTANCES (1 << _INDEX_BITS)
+#define _MAX_SNAPSHOTS 64
+
+_Static_assert(sizeof(((ProtocolSlot*)0)->wram) == BUS_WRAM_SIZE,
+               "slots must hold all of WRAM");
+_Static_assert(sizeof(((ProtocolSlot*)0)->pixels) ==
+                   PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT * sizeof(uint32_t),
+               "slots must hold a whole frame");
+
+
+typedef struct InstanceDef {
+  // Held while the machine runs or changes.
+  pthread_mutex_t lock;
+  // Guarded by the table lock. The instance is freed once it is dead and
+  // nobody refers to it.
+  int refs;
+  int dead;
+  Gameboy gb;
+  GlobalCtx global_ctx;
+  int initialized;
+  int shared_fd;
+  ProtocolShared* shared;
+  uint32_t next_slot;
+  uint8_t* snapshots[_MAX_SNAPSHOTS];
+  // Loaded ROMs may change the state size, so each snapshot keeps its own.
+  size_t snapshot_sizes[_MAX_SNAPSHOTS];
+} Instance;
+
+typedef struct TableDef {
+  pthread_mutex_t lock;
+  Instance* instances[_MAX_INSTANCES];
+  // Bumped whenever an index is freed, so a stale id can't reach the
+  // instance that takes the index next.
+  uint32_t generations[_MAX_INSTANCES];
+  // Indices freed by destroyed instances, taken before any never used.
+  uint32_t free_indices[_MAX_INSTANCES];
+  uint32_t free_count;
+  uint32_t used_count;
+} Table;
+
+
+static void PrintUsage(void) {
+  printf("Usage: gbemu-server <socket path>\n"
+         "Hosts emulator instances driven over a Unix domain socket. See\n"
+         "src/lib/protocol.h for the protocol.\n");
+}
+
+
+static int CreateSharedMemory(size_t size) {
+#ifdef __linux__
+  int fd = memfd_create("gbemu-instance", MFD_CLOEXEC);
+#else
+  char name[64];
+  snprintf(name, sizeof(name), "/gbemu-%ld-%p", (long)getpid(),
+           (void*)&name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    // Only reachable through the descriptor from here on.
+    shm_unlink(name);
+  }
+#endif
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t)size) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+static void FreeSnapshots(Instance* const instance) {
+  for (int i = 0; i < _MAX_SNAPSHOTS; ++i) {
+    free(instance->snapshots[i]);
+    instance->snapshots[i] = NULL;
+  }
+}
+
+
+static void FreeInstance(Instance* const instance) {
+  FreeSnapshots(instance);
+  if (instance->initialized) {
+    GameboyDestroy(&instance->gb);
+  }
+  if (instance->shared != NULL) {
+    munmap(instance->shared, sizeof(ProtocolShared));
+  }
+  if (instance->shared_fd >= 0) {
+    close(instance->shared_fd);
+  }
+  pthread_mutex_destroy(&instance->lock);
+  free(instance);
+}
+
+
+// Entry of the instance with id, or NULL if it is gone. The table lock is
+// held.
+static Instance** Lookup(Table* const table, uint32_t id) {
+  uint32_t index = id & (_MAX_INSTANCES - 1);
+  if (table->instances[index] == NULL ||
+      table->generations[index] != id >> _INDEX_BITS) {
+    return NULL;
+  }
+  return &table->instances[index];
+}
+
+
+static Instance* Acquire(Table* const table, uint32_t id) {
+  Instance* instance = NULL;
+  pthread_mutex_lock(&table->lock);
+  Instance** entry = Lookup(table, id);
+  if (entry != NULL) {
+    instance = *entry;
+    ++instance->refs;
+  }
+  pthread_mutex_unlock(&table->lock);
+  return instance;
+}
+
+
+static void Release(Table* const table, Instance* const instance) {
+  pthread_mutex_lock(&table->lock);
+  int unused = --instance->refs == 0 && instance->dead;
+  pthread_mutex_unlock(&table->lock);
+  if (unused) {
+    FreeInstance(instance);
+  }
+}
+
+
+// Builds the machine for the ROM at path. The instance lock is held or the
+// instance is not shared yet.
+static Result LoadRom(Instance* const instance, const char* const path) {
+  if (instance->initialized) {
+    // The machine stays, only the cartridge changes. Snapshots of the old
+    // ROM can't be loaded any more.
+    if (GameboyLoadRom(&instance->gb, path) == RESULT_NOTOK) {
+      return RESULT_NOTOK;
+    }
+    FreeSnapshots(instance);
+    return RESULT_OK;
+  }
+  instance->gb = (Gameboy){
+    .cartridge = NULL,
+    .bus = NULL,
+    .renderer = NULL,
+    .frames = NULL,
+    .options = {
+      .color_profile = COLOR_PROFILE_LCD,
+      .apu_mode = APU_MODE_ELIDED,
+      .render_mode = RENDER_MODE_INLINE
+    },
+    .global_ctx = &instance->global_ctx
+  };
+  Result result = GameboyInit(&instance->gb, path);
+  if (result == RESULT_NOTOK) {
+    ErrorCode error = instance->global_ctx.error;
+    GameboyDestroy(&instance->gb);
+    instance->global_ctx.error = error;
+    return RESULT_NOTOK;
+  }
+  instance->initialized = 1;
+  return RESULT_OK;
+}
+
+
+static void Publish(Instance* const instance) {
+  ProtocolShared* shared = instance->shared;
+  uint32_t slot = instance->next_slot;
+  instance->next_slot = (slot + 1) % PROTOCOL_SLOTS;
+  ProtocolSlot* out = &shared->slots[slot];
+  // Odd while the slot is written. See ProtocolSlot.
+  uint32_t sequence =
+      atomic_load_explicit(&out->sequence, memory_order_relaxed);
+  atomic_store_explicit(&out->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  out->frames = instance->gb.bus->ppu.frames;
+  memcpy(out->pixels, instance->gb.renderer->framebuffer,
+         sizeof(out->pixels));
+  CowMemoryCopy(&instance->gb.bus->wram, out->wram);
+  memcpy(out->hram, instance->gb.bus->hram, sizeof(instance->gb.bus->hram));
+  atomic_store_explicit(&out->sequence, sequence + 2, memory_order_release);
+  atomic_store_explicit(&shared->latest, slot, memory_order_release);
+}
+
+
+static int Create(Table* const table, const char* const path,
+                  ProtocolResponse* const response) {
+  Instance* instance = (Instance*)calloc(1, sizeof(Instance));
+  if (instance == NULL) {
+    response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+    response->error = MEMORY_ALLOCATION_FAILURE;
+    return -1;
+  }
+  pthread_mutex_init(&instance->lock, NULL);
+  instance->shared_fd = CreateSharedMemory(sizeof(ProtocolShared));
+  if (instance->shared_fd >= 0) {
+    void* map = mmap(NULL, sizeof(ProtocolShared), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, instance->shared_fd, 0);
+    instance->shared = map != MAP_FAILED ? (ProtocolShared*)map : NULL;
+  }
+  if (instance->shared == NULL) {
+    response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+    response->error = MEMORY_ALLOCATION_FAILURE;
+    FreeInstance(instance);
+    return -1;
+  }
+  instance->shared->magic = PROTOCOL_MAGIC;
+  instance->shared->version = PROTOCOL_VERSION;
+  instance->shared->slot_count = PROTOCOL_SLOTS;
+  atomic_init(&instance->shared->latest, 0);
+  for (int i = 0; i < PROTOCOL_SLOTS; ++i) {
+    atomic_init(&instance->shared->slots[i].sequence, 0);
+  }
+
+  if (LoadRom(instance, path) == RESULT_NOTOK) {
+    response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+    response->error = instance->global_ctx.error;
+    FreeInstance(instance);
+    return -1;
+  }
+  Publish(instance);
+
+  pthread_mutex_lock(&table->lock);
+  int full = table->free_count == 0 && table->used_count == _MAX_INSTANCES;
+  uint32_t id = 0;
+  if (!full) {
+    uint32_t index = table->free_count > 0
+                         ? table->free_indices[--table->free_count]
+                         : table->used_count++;
+    table->instances[index] = instance;
+    id = table->generations[index] << _INDEX_BITS | index;
+  }
+  pthread_mutex_unlock(&table->lock);
+  if (full) {
+    response->status = PROTOCOL_STATUS_BAD_REQUEST;
+    FreeInstance(instance);
+    return -1;
+  }
+  response->instance = id;
+  response->frames = instance->gb.bus->ppu.frames;
+  return instance->shared_fd;
+}
+
+
+static void Destroy(Table* const table, uint32_t id,
+                    ProtocolResponse* const response) {
+  Instance* instance = NULL;
+  pthread_mutex_lock(&table->lock);
+  Instance** entry = Lookup(table, id);
+  if (entry != NULL) {
+    instance = *entry;
+    *entry = NULL;
+    instance->dead = 1;
+    ++instance->refs;
+    uint32_t index = id & (_MAX_INSTANCES - 1);
+    // Wraps after as many generations as the id has bits for.
+    table->generations[index] =
+        (table->generations[index] + 1) & (UINT32_MAX >> _INDEX_BITS);
+    table->free_indices[table->free_count++] = index;
+  }
+  pthread_mutex_unlock(&table->lock);
+  if (instance == NULL) {
+    response->status = PROTOCOL_STATUS_NO_INSTANCE;
+    return;
+  }
+  Release(table, instance);
+}
+
+
+// Runs one request against an existing instance.
+static void Execute(Instance* const instance, const ProtocolRequest* const
+                    request, const char* const payload,
+                    ProtocolResponse* const response) {
+  Gameboy* gb = &instance->gb;
+  switch (request->op) {
+    case PROTOCOL_OP_LOAD_ROM:
+      if (LoadRom(instance, payload) == RESULT_NOTOK) {
+        // The old cartridge is still in and keeps running.
+        response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+        response->error = instance->global_ctx.error;
+        instance->global_ctx.error = NO_ERROR;
+        return;
+      }
+      Publish(instance);
+      break;
+    case PROTOCOL_OP_STEP:
+      BusSetButtons(gb->bus, (uint8_t)request->buttons);
+      for (uint32_t i = 0; i < request->arg; ++i) {
+        if (GameboyRunFrame(gb) == RESULT_NOTOK) {
+          response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+          response->error = instance->global_ctx.error;
+          return;
+        }
+      }
+      Publish(instance);
+      response->value = (instance->next_slot + PROTOCOL_SLOTS - 1) %
+                        PROTOCOL_SLOTS;
+      break;
+    case PROTOCOL_OP_SNAPSHOT: {
+      uint32_t id = 0;
+      while (id < _MAX_SNAPSHOTS && instance->snapshots[id] != NULL) {
+        ++id;
+      }
+      size_t size = StateSize(gb);
+      uint8_t* state = id < _MAX_SNAPSHOTS ? (uint8_t*)malloc(size) : NULL;
+      if (state == NULL) {
+        response->status = PROTOCOL_STATUS_NO_SNAPSHOT;
+        return;
+      }
+      if (StateSave(gb, state, size) == RESULT_NOTOK) {
+        free(state);
+        response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+        response->error = instance->global_ctx.error;
+        instance->global_ctx.error = NO_ERROR;
+        return;
+      }
+      instance->snapshots[id] = state;
+      instance->snapshot_sizes[id] = size;
+      response->value = id;
+      break;
+    }
+    case PROTOCOL_OP_RESTORE:
+      if (request->arg >= _MAX_SNAPSHOTS ||
+          instance->snapshots[request->arg] == NULL) {
+        response->status = PROTOCOL_STATUS_NO_SNAPSHOT;
+        return;
+      }
+      if (StateLoad(gb, instance->snapshots[request->arg],
+                    instance->snapshot_sizes[request->arg]) == RESULT_NOTOK) {
+        // Rejected states leave the machine as it was.
+        response->status = PROTOCOL_STATUS_MACHINE_ERROR;
+        response->error = instance->global_ctx.error;
+        instance->global_ctx.error = NO_ERROR;
+        return;
+      }
+      Publish(instance);
+      break;
+    case PROTOCOL_OP_RELEASE_SNAPSHOT:
+      if (request->arg >= _MAX_SNAPSHOTS ||
+          instance->snapshots[request->arg] == NULL) {
+        response->status = PROTOCOL_STATUS_NO_SNAPSHOT;
+        return;
+      }
+      free(instance->snapshots[request->arg]);
+      instance->snapshots[request->arg] = NULL;
+      break;
+    default:
+      response->status = PROTOCOL_STATUS_BAD_REQUEST;
+      return;
+  }
+  response->frames = gb->bus->ppu.frames;
+}
+
+
+static int ReadFully(int fd, void* const data, size_t size) {
+  uint8_t* pos = (uint8_t*)data;
+  while (size > 0) {
+    ssize_t count = read(fd, pos, size);
+    if (count <= 0) {
+      return -1;
+    }
+    pos += count;
+    size -= count;
+  }
+  return 0;
+}
+
+
+// Sends the response, with shared_fd attached when it isn't negative.
+static int SendResponse(int fd, const ProtocolResponse* const response,
+                        int shared_fd) {
+  struct iovec iov = {
+    .iov_base = (void*)response,
+    .iov_len = sizeof(ProtocolResponse)
+  };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int))];
+  } control;
+  if (shared_fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &shared_fd, sizeof(int));
+  }
+  return sendmsg(fd, &message, 0) == (ssize_t)sizeof(ProtocolResponse) ? 0
+                                                                       : -1;
+}
+
+
+typedef struct ClientDef {
+  int fd;
+  Table* table;
+} Client;
+
+
+static void* ServeClient(void* const client_arg) {
+  Client client = *(Client*)client_arg;
+  free(client_arg);
+  ProtocolRequest request;
+  char payload[PROTOCOL_MAX_PAYLOAD + 1];
+
+  while (ReadFully(client.fd, &request, sizeof(request)) == 0) {
+    if (request.size > PROTOCOL_MAX_PAYLOAD ||
+        ReadFully(client.fd, payload, request.size) != 0) {
+      break;
+    }
+    payload[request.size] = '\0';
+    ProtocolResponse response = {
+      .status = PROTOCOL_STATUS_OK,
+      .error = NO_ERROR,
+      .instance = request.instance,
+      .value = 0,
+      .frames = 0
+    };
+    int shared_fd = -1;
+
+    if (request.op == PROTOCOL_OP_CREATE) {
+      shared_fd = Create(client.table, payload, &response);
+    }
+    else if (request.op == PROTOCOL_OP_DESTROY) {
+      Destroy(client.table, request.instance, &response);
+    }
+    else {
+      Instance* instance = Acquire(client.table, request.instance);
+      if (instance == NULL) {
+        response.status = PROTOCOL_STATUS_NO_INSTANCE;
+      }
+      else {
+        pthread_mutex_lock(&instance->lock);
+        if (instance->dead || !instance->initialized) {
+          response.status = PROTOCOL_STATUS_NO_INSTANCE;
+        }
+        else {
+          Execute(instance, &request, payload, &response);
+        }
+        pthread_mutex_unlock(&instance->lock);
+        Release(client.table, instance);
+      }
+    }
+    if (SendResponse(client.fd, &response, shared_fd) != 0) {
+      break;
+    }
+  }
+  close(client.fd);
+  return NULL;
+}
+
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    PrintUsage();
+    return 1;
+  }
+  const char* path = argv[1];
+  // Clients that hang up mid response must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, 64) != 0) {
+    perror("gbemu-server");
+    return 1;
+  }
+
+  static Table table;
+  pthread_mutex_init(&table.lock, NULL);
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    Client* client = (Client*)malloc(sizeof(Client));
+    pthread_t thread;
+    if (client == NULL) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->table = &table;
+    if (pthread_create(&thread, NULL, ServeClient, client) != 0) {
+      free(client);
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
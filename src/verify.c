@@ -0,0 +1,203 @@
+#include "gb.h"
+#include "global.h"
+#include "movie.h"
+#include "pool.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+static const unsigned long _DEFAULT_SEGMENT_KEYFRAMES = 1;
+
+
+typedef struct VerifyDef {
+  const Movie* movie;
+  // One machine per worker, each with the ROM in.
+  Gameboy* machines;
+  GlobalCtx* contexts;
+  // Frames per segment, a multiple of the keyframe interval.
+  unsigned long segment;
+  // First frame known to diverge, MOVIE_NO_DESYNC while none has. Segments
+  // starting after it are skipped.
+  atomic_ulong desync;
+} Verify;
+
+
+static void PrintUsage(void) {
+  printf("Usage: gbemu-verify [options] <romfile> <movie>\n"
+         "  --threads <n>           worker threads, default one per core\n"
+         "  --pin                   bind each worker thread to a core\n"
+         "  --segment <n>           keyframes per segment (default 1)\n"
+         "\n"
+         "Replays a movie in segments from its keyframes, in parallel, and\n"
+         "checks every digest and the keyframe ending each segment. Prints\n"
+         "the first frame that diverged and exits with 1 if any did.\n");
+}
+
+
+static double Seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// Lowers the first divergent frame to frame if it is earlier.
+static void Diverged(Verify* const verify, unsigned long frame) {
+  unsigned long known = atomic_load(&verify->desync);
+  while (frame < known &&
+         !atomic_compare_exchange_weak(&verify->desync, &known, frame)) {
+  }
+}
+
+
+static void VerifyTask(void* const ctx, size_t index, int worker) {
+  Verify* const verify = (Verify*)ctx;
+  const Movie* const movie = verify->movie;
+  Gameboy* const gb = &verify->machines[worker];
+  unsigned long start = index * verify->segment;
+  unsigned long end = start + verify->segment;
+  if (end > movie->frame_count) {
+    end = movie->frame_count;
+  }
+  if (start > atomic_load(&verify->desync)) {
+    return;
+  }
+
+  // Failing to reach a keyframe is put down to its segment's first frame.
+  gb->global_ctx->error = NO_ERROR;
+  if (MovieSeek(movie, gb, start) == RESULT_NOTOK) {
+    Diverged(verify, start);
+    return;
+  }
+  for (unsigned long frame = start; frame < end; ++frame) {
+    if (MoviePlayFrame(movie, gb, frame) == RESULT_NOTOK ||
+        !MovieDigestMatches(movie, gb, frame) ||
+        !MovieKeyframeMatches(movie, gb, frame)) {
+      Diverged(verify, frame);
+      return;
+    }
+    // Nothing after an earlier divergence is reported.
+    if (frame > atomic_load_explicit(&verify->desync,
+                                     memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+
+int main(int argc, char** argv) {
+  const char* romfile = NULL;
+  const char* moviefile = NULL;
+  int threads = 0;
+  int pin = 0;
+  unsigned long segment_keyframes = _DEFAULT_SEGMENT_KEYFRAMES;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--pin") == 0) {
+      pin = 1;
+    }
+    else if (strcmp(argv[i], "--segment") == 0 && i + 1 < argc) {
+      segment_keyframes = strtoul(argv[++i], NULL, 10);
+    }
+    else if (romfile == NULL) {
+      romfile = argv[i];
+    }
+    else {
+      moviefile = argv[i];
+    }
+  }
+  if (romfile == NULL || moviefile == NULL || segment_keyframes == 0) {
+    PrintUsage();
+    return 1;
+  }
+
+  GlobalCtx global_ctx = {.error = NO_ERROR};
+  Movie* movie = MovieCreate(&global_ctx);
+  if (movie == NULL || MovieRead(movie, moviefile) == RESULT_NOTOK) {
+    printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[global_ctx.error]);
+    MovieDestroy(movie);
+    return 1;
+  }
+  ThreadPool* pool = ThreadPoolCreate(&global_ctx, threads, pin);
+  if (pool == NULL) {
+    printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[global_ctx.error]);
+    MovieDestroy(movie);
+    return 1;
+  }
+
+  Verify verify = {
+    .movie = movie,
+    .machines = (Gameboy*)calloc(pool->size, sizeof(Gameboy)),
+    .contexts = (GlobalCtx*)calloc(pool->size, sizeof(GlobalCtx)),
+    // Without keyframes the movie is a single segment.
+    .segment = movie->keyframe_interval > 0
+                   ? movie->keyframe_interval * segment_keyframes
+                   : movie->frame_count + 1,
+    .desync = MOVIE_NO_DESYNC
+  };
+  Result result = verify.machines != NULL && verify.contexts != NULL
+                      ? RESULT_OK
+                      : RESULT_NOTOK;
+  int initialized = 0;
+  for (; result == RESULT_OK && initialized < pool->size; ++initialized) {
+    Gameboy* gb = &verify.machines[initialized];
+    gb->options = (GameboyOptions){
+      .color_profile = COLOR_PROFILE_LCD,
+      .apu_mode = APU_MODE_ELIDED,
+      .render_mode = RENDER_MODE_NONE
+    };
+    gb->global_ctx = &verify.contexts[initialized];
+    result = GameboyInit(gb, romfile);
+    if (result == RESULT_NOTOK) {
+      global_ctx.error = gb->global_ctx->error;
+    }
+    else if (MovieStart(movie, gb) == RESULT_NOTOK) {
+      // Checked once up front rather than reported as a desync.
+      global_ctx.error = gb->global_ctx->error;
+      result = RESULT_NOTOK;
+    }
+  }
+
+  if (result == RESULT_OK) {
+    double start = Seconds();
+    size_t segments =
+        (movie->frame_count + verify.segment - 1) / verify.segment;
+    ThreadPoolRun(pool, VerifyTask, &verify, segments);
+    double seconds = Seconds() - start;
+    unsigned long desync = atomic_load(&verify.desync);
+    printf("frames=%zu keyframes=%zu segments=%zu threads=%d ",
+           movie->frame_count, movie->keyframe_count, segments, pool->size);
+    if (desync == MOVIE_NO_DESYNC) {
+      printf("desync=none");
+    }
+    else {
+      printf("desync=%lu", desync);
+    }
+    printf(" wall_s=%.3f fps=%.0f\n", seconds,
+           seconds > 0 ? movie->frame_count / seconds : 0.0);
+    if (desync != MOVIE_NO_DESYNC) {
+      global_ctx.error = MOVIE_DESYNC;
+      result = RESULT_NOTOK;
+    }
+  }
+  else {
+    printf("Fatal Error: %s\n", _ERROR_CODE_STRINGS[global_ctx.error]);
+  }
+
+  for (int i = 0; i < initialized; ++i) {
+    GameboyDestroy(&verify.machines[i]);
+  }
+  free(verify.machines);
+  free(verify.contexts);
+  ThreadPoolDestroy(pool);
+  MovieDestroy(movie);
+  return result == RESULT_OK ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#include "bus.h"
+#include "gb.h"
+#include "global.h"
+#include "state.h"
+
+#include "test_rom.h"
+#include "testing.h"
+
+#include "stdint.h"
+
+static void TestForkIsolation(void);
+
+
+void TestFork(void) {
+  tmodbegin_
+
+  TestForkIsolation();
+
+  tmodend_
+}
+
+static void TestForkIsolation(void) {
+  tbegin_
+
+  GlobalCtx parent_ctx;
+  Gameboy parent;
+  tassert_(TestMachineInit(&parent, &parent_ctx) == RESULT_OK);
+  tassert_(GameboyRunFrame(&parent) == RESULT_OK);
+  BusWrite(parent.bus, 0xC100, 0x11);
+  BusWrite(parent.bus, 0x8100, 0x22);
+
+  GlobalCtx child_ctx;
+  Gameboy child = {.options = parent.options, .global_ctx = &child_ctx};
+  tassert_(GameboyFork(&child, &parent) == RESULT_OK);
+  tassert_(StateHash(&child) == StateHash(&parent));
+  uint64_t parent_hash = StateHash(&parent);
+
+  // Writes to shared pages, of WRAM and VRAM, stay on the side making them.
+  BusWrite(child.bus, 0xC100, 0xAB);
+  BusWrite(child.bus, 0x8100, 0xCD);
+  tassert_(BusRead(child.bus, 0xC100) == 0xAB);
+  tassert_(BusRead(child.bus, 0x8100) == 0xCD);
+  tassert_(BusRead(parent.bus, 0xC100) == 0x11);
+  tassert_(BusRead(parent.bus, 0x8100) == 0x22);
+  tassert_(StateHash(&parent) == parent_hash);
+
+  BusWrite(parent.bus, 0xC200, 0x33);
+  tassert_(BusRead(child.bus, 0xC200) == 0x00);
+
+  // The child running on leaves the parent where it was.
+  for (int i = 0; i < 5; ++i) {
+    tassert_(GameboyRunFrame(&child) == RESULT_OK);
+  }
+  tassert_(BusRead(parent.bus, 0xC200) == 0x33);
+  BusWrite(parent.bus, 0xC200, 0x00);
+  tassert_(StateHash(&parent) == parent_hash);
+
+  GameboyDestroy(&child);
+  // Dropping the child leaves the parent's pages in place.
+  tassert_(BusRead(parent.bus, 0xC100) == 0x11);
+  tassert_(GameboyRunFrame(&parent) == RESULT_OK);
+  GameboyDestroy(&parent);
+  tend_
+}
@@ -0,0 +1,57 @@
+#include "bus.h"
+#include "gb.h"
+#include "global.h"
+#include "link.h"
+
+#include "test_rom.h"
+#include "testing.h"
+
+#include "stdint.h"
+
+static void TestLinkExchange(void);
+
+
+void TestLink(void) {
+  tmodbegin_
+
+  TestLinkExchange();
+
+  tmodend_
+}
+
+static void TestLinkExchange(void) {
+  tbegin_
+
+  GlobalCtx contexts[2];
+  Gameboy machines[2];
+  tassert_(TestMachineInit(&machines[0], &contexts[0]) == RESULT_OK);
+  tassert_(TestMachineInit(&machines[1], &contexts[1]) == RESULT_OK);
+  GlobalCtx global_ctx = {.error = NO_ERROR};
+  Link* link = LinkCreate(&global_ctx, machines, 2);
+  tassert_(link != NULL);
+
+  // The second machine waits on the external clock, then the first drives
+  // the transfer with its own.
+  Bus* const driver = machines[0].bus;
+  Bus* const follower = machines[1].bus;
+  BusWrite(driver, 0xFF01, 0x42);
+  BusWrite(follower, 0xFF01, 0x99);
+  BusWrite(follower, 0xFF02, 0x80);
+  BusWrite(driver, 0xFF02, 0x81);
+  driver->interrupts_flag = 0;
+  follower->interrupts_flag = 0;
+
+  // 8 bits at 512 cycles each, with room for the quanta between turns.
+  tassert_(LinkRunCycles(link, 8 * 512 + 4 * LINK_QUANTUM) == RESULT_OK);
+  tassert_(BusRead(driver, 0xFF01) == 0x99);
+  tassert_(BusRead(follower, 0xFF01) == 0x42);
+  tassert_((BusRead(driver, 0xFF02) & 0x80) == 0);
+  tassert_((BusRead(follower, 0xFF02) & 0x80) == 0);
+  tassert_(driver->interrupts_flag & (1 << INTERRUPT_SERIAL));
+  tassert_(follower->interrupts_flag & (1 << INTERRUPT_SERIAL));
+
+  LinkDestroy(link);
+  GameboyDestroy(&machines[0]);
+  GameboyDestroy(&machines[1]);
+  tend_
+}
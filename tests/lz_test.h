@@ -0,0 +1,71 @@
+#include "lz.h"
+
+#include "testing.h"
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+static void TestLzRoundTrip(void);
+static void TestLzSmallCapacity(void);
+
+
+void TestLz(void) {
+  tmodbegin_
+
+  TestLzRoundTrip();
+  TestLzSmallCapacity();
+
+  tmodend_
+}
+
+static void TestLzRoundTrip(void) {
+  tbegin_
+
+  // Zeroes, a repeated tile and noise, which exercise long copies, short
+  // copies and literal runs.
+  const size_t size = 3 * 0x4000;
+  uint8_t* in = (uint8_t*)malloc(size);
+  uint8_t* packed = (uint8_t*)malloc(LzBound(size));
+  uint8_t* out = (uint8_t*)malloc(size);
+  tassert_(in != NULL && packed != NULL && out != NULL);
+  memset(in, 0, 0x4000);
+  for (size_t i = 0x4000; i < 0x8000; ++i) {
+    in[i] = (uint8_t)(i % 16 * 7);
+  }
+  uint32_t seed = 1;
+  for (size_t i = 0x8000; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    in[i] = (uint8_t)(seed >> 16);
+  }
+
+  size_t packed_size = LzCompress(in, size, packed, LzBound(size));
+  tassert_(packed_size > 0 && packed_size < size);
+  tassert_(LzDecompress(packed, packed_size, out, size) == size);
+  tassert_(memcmp(in, out, size) == 0);
+  // Cut short, the input doesn't make it out whole.
+  tassert_(LzDecompress(packed, packed_size - 1, out, size) != size);
+
+  free(in);
+  free(packed);
+  free(out);
+  tend_
+}
+
+static void TestLzSmallCapacity(void) {
+  tbegin_
+
+  uint8_t in[256];
+  uint8_t packed[2 * sizeof(in)];
+  uint8_t out[sizeof(in)];
+  for (size_t i = 0; i < sizeof(in); ++i) {
+    in[i] = (uint8_t)(i * 31);
+  }
+  tassert_(sizeof(packed) >= LzBound(sizeof(in)));
+  size_t packed_size = LzCompress(in, sizeof(in), packed, sizeof(packed));
+  tassert_(packed_size > 0);
+  tassert_(LzCompress(in, sizeof(in), packed, 8) == 0);
+  tassert_(LzDecompress(packed, packed_size, out, sizeof(out) - 1) == 0);
+
+  tend_
+}
@@ -0,0 +1,95 @@
+#include "global.h"
+#include "netplay.h"
+
+#include "test_rom.h"
+#include "testing.h"
+
+#include "stdint.h"
+#include "stdio.h"
+#include "time.h"
+#include "unistd.h"
+
+#define _NETPLAY_TEST_FRAMES 240
+#define _NETPLAY_TEST_PORT 47613
+
+static void TestNetplayRollback(void);
+
+
+void TestNetplay(void) {
+  tmodbegin_
+
+  TestNetplayRollback();
+
+  tmodend_
+}
+
+// Buttons player gives on frame, changing every few frames and differently
+// for each, so predictions keep missing.
+static uint8_t NetplayTestButtons(int player, unsigned long frame) {
+  return player == 0 ? (uint8_t)(frame / 3 * 37) : (uint8_t)(frame / 5 * 91);
+}
+
+static void TestNetplayRollback(void) {
+  tbegin_
+
+  // Netplay loads machines from a file.
+  char path[] = "/tmp/gbemu-test-XXXXXX";
+  int fd = mkstemp(path);
+  tassert_(fd >= 0);
+  static uint8_t rom[TEST_ROM_SIZE];
+  TestRomBuild(rom);
+  tassert_(write(fd, rom, sizeof(rom)) == (ssize_t)sizeof(rom));
+  close(fd);
+
+  // Two peers in one thread over loopback, with enough send delay that
+  // the remote buttons arrive frames late.
+  GlobalCtx contexts[NETPLAY_PLAYERS];
+  Netplay* peers[NETPLAY_PLAYERS];
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    contexts[i].error = NO_ERROR;
+    NetplayOptions options = {
+      .roms = {path, path},
+      .player = i,
+      .port = (uint16_t)(_NETPLAY_TEST_PORT + i),
+      .peer_host = "127.0.0.1",
+      .peer_port = (uint16_t)(_NETPLAY_TEST_PORT + 1 - i),
+      .input_delay = 1,
+      .send_delay_ms = 40,
+      .render = 0
+    };
+    peers[i] = NetplayCreate(&contexts[i], &options);
+    tassert_(peers[i] != NULL);
+  }
+
+  while (peers[0]->frame < _NETPLAY_TEST_FRAMES ||
+         peers[1]->frame < _NETPLAY_TEST_FRAMES) {
+    int any = 0;
+    for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+      int advanced = 0;
+      if (peers[i]->frame < _NETPLAY_TEST_FRAMES) {
+        tassert_(NetplayAdvance(peers[i],
+                                NetplayTestButtons(i, peers[i]->frame),
+                                &advanced) == RESULT_OK);
+      }
+      any |= advanced;
+    }
+    if (!any) {
+      struct timespec sleep = {.tv_sec = 0, .tv_nsec = 1000000};
+      nanosleep(&sleep, NULL);
+    }
+  }
+
+  for (int i = 0; i < NETPLAY_PLAYERS; ++i) {
+    const NetplayStats* const stats = &peers[i]->stats;
+    tassert_(stats->rollbacks > 0);
+    // States were hashed for the peers to compare, and agreed.
+    tassert_(peers[i]->hashed > 0);
+    tassert_(stats->desync == NETPLAY_NO_DESYNC);
+    tassert_(stats->max_resimulated > 0);
+    tassert_(stats->max_resimulated <= NETPLAY_MAX_ROLLBACK);
+  }
+  NetplayDestroy(peers[0]);
+  NetplayDestroy(peers[1]);
+  unlink(path);
+  tend_
+}
@@ -0,0 +1,71 @@
+#include "gb.h"
+#include "global.h"
+#include "rewind.h"
+#include "state.h"
+
+#include "test_rom.h"
+#include "testing.h"
+
+#include "stdint.h"
+
+#define _REWIND_TEST_FRAMES 40
+
+static void TestRewindSeek(void);
+
+
+void TestRewind(void) {
+  tmodbegin_
+
+  TestRewindSeek();
+
+  tmodend_
+}
+
+// Buttons held during frame, so the replay has input to get right.
+static uint8_t RewindTestButtons(unsigned long frame) {
+  return (uint8_t)(frame * 37 % 256);
+}
+
+static void TestRewindSeek(void) {
+  tbegin_
+
+  // A straight run gives what every frame should look like.
+  GlobalCtx straight_ctx;
+  Gameboy straight;
+  uint64_t hashes[_REWIND_TEST_FRAMES + 1];
+  tassert_(TestMachineInit(&straight, &straight_ctx) == RESULT_OK);
+  hashes[0] = StateHash(&straight);
+  for (unsigned long i = 0; i < _REWIND_TEST_FRAMES; ++i) {
+    BusSetButtons(straight.bus, RewindTestButtons(i));
+    tassert_(GameboyRunFrame(&straight) == RESULT_OK);
+    hashes[i + 1] = StateHash(&straight);
+  }
+  GameboyDestroy(&straight);
+
+  GlobalCtx global_ctx;
+  Gameboy gb;
+  tassert_(TestMachineInit(&gb, &global_ctx) == RESULT_OK);
+  RewindOptions options = {.interval = 4, .capacity = 1 << 20};
+  Rewind* rewind = RewindCreate(&gb, &options);
+  tassert_(rewind != NULL);
+  for (unsigned long i = 0; i < _REWIND_TEST_FRAMES; ++i) {
+    BusSetButtons(gb.bus, RewindTestButtons(i));
+    tassert_(GameboyRunFrame(&gb) == RESULT_OK);
+    RewindFrame(rewind);
+  }
+  tassert_(StateHash(&gb) == hashes[_REWIND_TEST_FRAMES]);
+
+  // Between snapshots, on one, back again and forward to the end.
+  unsigned long frames[] = {13, 8, 0, 27, _REWIND_TEST_FRAMES};
+  for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); ++i) {
+    tassert_(RewindSeek(rewind, frames[i]) == frames[i]);
+    tassert_(StateHash(&gb) == hashes[frames[i]]);
+  }
+  tassert_(RewindSeek(rewind, 21) == 21);
+  tassert_(RewindStepBack(rewind) == 20);
+  tassert_(StateHash(&gb) == hashes[20]);
+
+  RewindDestroy(rewind);
+  GameboyDestroy(&gb);
+  tend_
+}
@@ -0,0 +1,81 @@
+#include "gb.h"
+#include "global.h"
+#include "state.h"
+#include "store.h"
+
+#include "test_rom.h"
+#include "testing.h"
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+static void TestStoreDedup(void);
+
+
+void TestStore(void) {
+  tmodbegin_
+
+  TestStoreDedup();
+
+  tmodend_
+}
+
+static void TestStoreDedup(void) {
+  tbegin_
+
+  GlobalCtx global_ctx;
+  Gameboy gb;
+  tassert_(TestMachineInit(&gb, &global_ctx) == RESULT_OK);
+  StoreOptions options = {.path = NULL, .capacity = 16 << 20};
+  Store* store = StoreCreate(&global_ctx, &options);
+  tassert_(store != NULL);
+
+  size_t size = StateSize(&gb);
+  uint8_t* state = (uint8_t*)malloc(size);
+  uint8_t* out = (uint8_t*)malloc(size);
+  tassert_(state != NULL && out != NULL);
+  tassert_(GameboyRunFrame(&gb) == RESULT_OK);
+  tassert_(StateSave(&gb, state, size) == RESULT_OK);
+
+  uint64_t first;
+  uint64_t again;
+  tassert_(StoreAdd(store, state, size, &first) == RESULT_OK);
+  size_t pieces = store->piece_count;
+  size_t end = store->end;
+  tassert_(pieces > 1);
+
+  // The same state adds no pieces, only its list of them.
+  tassert_(StoreAdd(store, state, size, &again) == RESULT_OK);
+  tassert_(again == first + 1);
+  tassert_(store->piece_count == pieces);
+  tassert_(store->end - end < size / 4);
+
+  // A frame later only a few pieces differ.
+  tassert_(GameboyRunFrame(&gb) == RESULT_OK);
+  uint64_t later;
+  tassert_(StoreSave(store, &gb, &later) == RESULT_OK);
+  tassert_(store->piece_count > pieces);
+  tassert_(store->piece_count - pieces < pieces);
+
+  tassert_(StoreStateSize(store, first) == size);
+  tassert_(StoreGet(store, first, out, size) == RESULT_OK);
+  tassert_(memcmp(out, state, size) == 0);
+  tassert_(StoreGet(store, again, out, size) == RESULT_OK);
+  tassert_(memcmp(out, state, size) == 0);
+  tassert_(StoreStateSize(store, later + 1) == 0);
+
+  // Loading the first state back gives the machine it was saved from.
+  uint64_t later_hash = StateHash(&gb);
+  tassert_(StoreLoad(store, &gb, first) == RESULT_OK);
+  tassert_(StateSave(&gb, out, size) == RESULT_OK);
+  tassert_(memcmp(out, state, size) == 0);
+  tassert_(StoreLoad(store, &gb, later) == RESULT_OK);
+  tassert_(StateHash(&gb) == later_hash);
+
+  free(state);
+  free(out);
+  StoreDestroy(store);
+  GameboyDestroy(&gb);
+  tend_
+}
@@ -1,8 +1,22 @@
 #include "cpu_test.h"
+#include "fork_test.h"
+#include "link_test.h"
+#include "lz_test.h"
+#include "netplay_test.h"
+#include "rewind_test.h"
+#include "store_test.h"
+
+#include "testing.h"
 
 #include "stdio.h"
 
 int main(void) {
   //TestCpu();
-  return 0;
+  TestLz();
+  TestRewind();
+  TestFork();
+  TestStore();
+  TestLink();
+  TestNetplay();
+  return _TESTS_PASSED == _TESTS_RUN ? 0 : 1;
 }
@@ -0,0 +1,50 @@
+#ifndef TEST_ROM_H
+#define TEST_ROM_H
+
+#include "gb.h"
+#include "global.h"
+
+#include "stdint.h"
+#include "string.h"
+
+
+#define TEST_ROM_SIZE 0x8000
+
+// ld hl, 0xC000; loop: inc (hl); jr loop. Memory changes every frame, and
+// nothing else is touched, so tests can drive the rest through the bus.
+static const uint8_t _TEST_PROGRAM[] = {0x21, 0x00, 0xC0, 0x34, 0x18, 0xFD};
+
+
+// Fills TEST_ROM_SIZE bytes with a cartridge without an MBC running
+// _TEST_PROGRAM.
+static void TestRomBuild(uint8_t* const rom) {
+  memset(rom, 0, TEST_ROM_SIZE);
+  // jp 0x150, past the header.
+  rom[0x100] = 0xC3;
+  rom[0x101] = 0x50;
+  rom[0x102] = 0x01;
+  uint8_t checksum = 0;
+  for (uint16_t i = 0x0134; i < 0x014D; ++i) {
+    checksum = checksum - rom[i] - 1;
+  }
+  rom[0x14D] = checksum;
+  memcpy(rom + 0x150, _TEST_PROGRAM, sizeof(_TEST_PROGRAM));
+}
+
+
+// Starts gb on the test ROM.
+static Result TestMachineInit(Gameboy* const gb, GlobalCtx* const global_ctx) {
+  static uint8_t rom[TEST_ROM_SIZE];
+  TestRomBuild(rom);
+
+  memset(gb, 0, sizeof(Gameboy));
+  gb->options = (GameboyOptions){
+    .color_profile = COLOR_PROFILE_LCD,
+    .apu_mode = APU_MODE_ELIDED,
+    .render_mode = RENDER_MODE_NONE
+  };
+  gb->global_ctx = global_ctx;
+  return GameboyInitFromBuffer(gb, rom, sizeof(rom));
+}
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef TESTING_H
+#define TESTING_H
+
 #include "stdio.h"
 
 
@@ -39,3 +42,5 @@ if (!(x)) {\
 void __tassert(const char* message, const char* file, const char* function, int line) {
   printf("Assertion failed: %s (%s:%s:%d)\n\n", message, file, function, line);
 }
+
+#endif